@@ -0,0 +1,109 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+#ifndef BENCH_HEADER_BENCH_H_INCLUDED
+#define BENCH_HEADER_BENCH_H_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+namespace bench
+{
+    using clock = std::chrono::steady_clock;
+
+    inline constexpr std::chrono::milliseconds default_duration{300};
+
+    //Thread counts to measure: powers of 2 up to the number of hardware threads and the number itself
+    inline std::vector<unsigned> thread_counts()
+    {
+        unsigned max_count = std::max(std::thread::hardware_concurrency(), 1u);
+        std::vector<unsigned> ret;
+        for (unsigned count = 1; count < max_count; count *= 2)
+            ret.push_back(count);
+        ret.push_back(max_count);
+        return ret;
+    }
+
+    //Runs body(thread_index, stop) on thread_count threads for the given duration.
+    //body must loop until stop becomes true and return the number of operations it performed.
+    //Returns the total number of operations per second.
+    template<class Body>
+    double run_threads(unsigned thread_count, std::chrono::milliseconds duration, Body body)
+    {
+        std::atomic<unsigned> ready{0};
+        std::atomic<bool> start{false};
+        std::atomic<bool> stop{false};
+        std::vector<uint64_t> ops(thread_count);
+        std::vector<std::thread> threads;
+        threads.reserve(thread_count);
+        for (unsigned i = 0; i < thread_count; ++i)
+        {
+            threads.emplace_back([&, i]() {
+                ready.fetch_add(1);
+                while (!start.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+                ops[i] = body(i, stop);
+            });
+        }
+        while (ready.load() != thread_count)
+            std::this_thread::yield();
+        auto begin = clock::now();
+        start.store(true, std::memory_order_release);
+        std::this_thread::sleep_for(duration);
+        stop.store(true, std::memory_order_relaxed);
+        for (auto & thread: threads)
+            thread.join();
+        std::chrono::duration<double> elapsed = clock::now() - begin;
+
+        uint64_t total = 0;
+        for (auto count: ops)
+            total += count;
+        return double(total) / elapsed.count();
+    }
+
+    //Latency percentiles in nanoseconds
+    struct latency_summary
+    {
+        double p50 = 0;
+        double p99 = 0;
+        double p999 = 0;
+        double max = 0;
+    };
+
+    //Sorts the samples in place
+    inline latency_summary summarize(std::vector<uint64_t> & samples)
+    {
+        latency_summary ret;
+        if (samples.empty())
+            return ret;
+        std::sort(samples.begin(), samples.end());
+        auto at = [&](double fraction) {
+            return double(samples[std::min(samples.size() - 1, size_t(fraction * double(samples.size())))]);
+        };
+        ret.p50 = at(0.5);
+        ret.p99 = at(0.99);
+        ret.p999 = at(0.999);
+        ret.max = double(samples.back());
+        return ret;
+    }
+
+    inline void print_header(const char * title)
+    {
+        std::printf("\n%s\n", title);
+    #ifndef NDEBUG
+        std::printf("warning: assertions are enabled, results are not representative\n");
+    #endif
+    }
+}
+
+#endif
@@ -0,0 +1,272 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+//Throughput and latency of std::atomic<intrusive_shared_ptr> under read/write mixes of 100/0, 99/1 and 50/50
+//compared to std::atomic<std::shared_ptr> and a mutex guarded refcnt_ptr. All threads access the same slot.
+//
+//Usage: bench-atomic_mix [--json <file>|-] [--duration <ms>]
+
+#include <intrusive_shared_ptr/ref_counted.h>
+#include <intrusive_shared_ptr/refcnt_ptr.h>
+
+#include "bench.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+
+using namespace isptr;
+
+namespace
+{
+    struct item : ref_counted<item>
+    {
+        int value = 1;
+    };
+
+    struct plain_item
+    {
+        int value = 1;
+    };
+
+    constexpr unsigned pool_size = 4;
+
+    //Each slot type provides read() and write(index) with write storing one of a few preallocated values
+    //so that allocation does not dominate the measurements
+
+    class isptr_slot
+    {
+    public:
+        static constexpr const char * name = "std::atomic<refcnt_ptr>";
+
+        isptr_slot()
+        {
+            for (auto & value: m_pool)
+                value = make_refcnt<item>();
+            m_slot.store(m_pool[0]);
+        }
+
+        int read() const
+            { return m_slot.load()->value; }
+        void write(unsigned index)
+            { m_slot.store(m_pool[index % pool_size]); }
+    private:
+        refcnt_ptr<item> m_pool[pool_size];
+        std::atomic<refcnt_ptr<item>> m_slot;
+    };
+
+    class shared_ptr_slot
+    {
+    public:
+        static constexpr const char * name = "std::atomic<shared_ptr>";
+
+        shared_ptr_slot()
+        {
+            for (auto & value: m_pool)
+                value = std::make_shared<plain_item>();
+            this->store(m_pool[0]);
+        }
+
+        int read() const
+        {
+        #if __cpp_lib_atomic_shared_ptr >= 201711L
+            return m_slot.load()->value;
+        #else
+            return std::atomic_load(&m_slot)->value;
+        #endif
+        }
+        void write(unsigned index)
+            { this->store(m_pool[index % pool_size]); }
+    private:
+        void store(const std::shared_ptr<plain_item> & value)
+        {
+        #if __cpp_lib_atomic_shared_ptr >= 201711L
+            m_slot.store(value);
+        #else
+            std::atomic_store(&m_slot, value);
+        #endif
+        }
+
+        std::shared_ptr<plain_item> m_pool[pool_size];
+    #if __cpp_lib_atomic_shared_ptr >= 201711L
+        std::atomic<std::shared_ptr<plain_item>> m_slot;
+    #else
+        std::shared_ptr<plain_item> m_slot;
+    #endif
+    };
+
+    class mutex_slot
+    {
+    public:
+        static constexpr const char * name = "mutex+refcnt_ptr";
+
+        mutex_slot()
+        {
+            for (auto & value: m_pool)
+                value = make_refcnt<item>();
+            m_slot = m_pool[0];
+        }
+
+        int read() const
+        {
+            refcnt_ptr<item> value;
+            {
+                std::lock_guard<std::mutex> guard(m_mutex);
+                value = m_slot;
+            }
+            return value->value;
+        }
+        void write(unsigned index)
+        {
+            refcnt_ptr<item> old = m_pool[index % pool_size];
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_slot.swap(old);
+        }
+    private:
+        refcnt_ptr<item> m_pool[pool_size];
+        mutable std::mutex m_mutex;
+        refcnt_ptr<item> m_slot;
+    };
+
+    struct result
+    {
+        const char * impl;
+        unsigned write_percent;
+        unsigned threads;
+        double ops_per_sec;
+        bench::latency_summary latency;
+    };
+
+    //Every 8th operation is timed to limit the effect of reading the clock on throughput
+    constexpr uint64_t sample_mask = 7;
+    constexpr size_t max_samples_per_thread = 1 << 20;
+
+    template<class Slot>
+    result measure(unsigned write_percent, unsigned threads, std::chrono::milliseconds duration)
+    {
+        Slot slot;
+        std::vector<std::vector<uint64_t>> samples(threads);
+
+        double ops = bench::run_threads(threads, duration, [&](unsigned idx, const std::atomic<bool> & stop) {
+            auto & mine = samples[idx];
+            mine.reserve(max_samples_per_thread);
+            uint64_t count = 0;
+            int sum = 0;
+            //offset threads so that writes do not happen in lockstep
+            for (unsigned op = idx * 37; !stop.load(std::memory_order_relaxed); ++op, ++count)
+            {
+                bool is_write = (op % 100) < write_percent;
+                if ((count & sample_mask) == 0 && mine.size() < max_samples_per_thread)
+                {
+                    auto start = bench::clock::now();
+                    if (is_write)
+                        slot.write(op);
+                    else
+                        sum += slot.read();
+                    auto end = bench::clock::now();
+                    mine.push_back(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+                }
+                else
+                {
+                    if (is_write)
+                        slot.write(op);
+                    else
+                        sum += slot.read();
+                }
+            }
+            return count + (sum == 0);
+        });
+
+        std::vector<uint64_t> all;
+        for (auto & mine: samples)
+            all.insert(all.end(), mine.begin(), mine.end());
+        return {Slot::name, write_percent, threads, ops, bench::summarize(all)};
+    }
+
+    void print(const result & res)
+    {
+        std::printf("%-26s %3u/%-3u %8u %10.2f %8.0f %8.0f %8.0f\n", res.impl, 100 - res.write_percent, res.write_percent,
+                    res.threads, res.ops_per_sec / 1e6, res.latency.p50, res.latency.p99, res.latency.p999);
+    }
+
+    void write_json(FILE * out, const std::vector<result> & results)
+    {
+        std::fprintf(out, "{\n  \"benchmark\": \"atomic_mix\",\n  \"unit\": {\"throughput\": \"ops/s\", \"latency\": \"ns\"},\n");
+        std::fprintf(out, "  \"results\": [\n");
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            auto & res = results[i];
+            std::fprintf(out, "    {\"impl\": \"%s\", \"reads\": %u, \"writes\": %u, \"threads\": %u, \"ops_per_sec\": %.0f, "
+                              "\"p50\": %.0f, \"p99\": %.0f, \"p999\": %.0f}%s\n",
+                         res.impl, 100 - res.write_percent, res.write_percent, res.threads, res.ops_per_sec,
+                         res.latency.p50, res.latency.p99, res.latency.p999, i + 1 < results.size() ? "," : "");
+        }
+        std::fprintf(out, "  ]\n}\n");
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    const char * json_path = nullptr;
+    auto duration = bench::default_duration;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+        {
+            json_path = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--duration") == 0 && i + 1 < argc)
+        {
+            duration = std::chrono::milliseconds(std::atoi(argv[++i]));
+        }
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--json <file>|-] [--duration <ms>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    //keep stdout clean for JSON
+    bool quiet = json_path && std::strcmp(json_path, "-") == 0;
+
+    if (!quiet)
+    {
+        bench::print_header("single slot read/write mixes (Mops/s, latency ns)");
+        std::printf("%-26s %7s %8s %10s %8s %8s %8s\n", "impl", "r/w", "threads", "Mops/s", "p50", "p99", "p999");
+    }
+
+    std::vector<result> results;
+    for (unsigned write_percent: {0u, 1u, 50u})
+    {
+        for (unsigned threads: bench::thread_counts())
+        {
+            for (auto & res: {measure<isptr_slot>(write_percent, threads, duration),
+                              measure<shared_ptr_slot>(write_percent, threads, duration),
+                              measure<mutex_slot>(write_percent, threads, duration)})
+            {
+                if (!quiet)
+                    print(res);
+                results.push_back(res);
+            }
+        }
+    }
+
+    if (json_path)
+    {
+        FILE * out = quiet ? stdout : std::fopen(json_path, "w");
+        if (!out)
+        {
+            std::fprintf(stderr, "cannot open %s\n", json_path);
+            return EXIT_FAILURE;
+        }
+        write_json(out, results);
+        if (out != stdout)
+            std::fclose(out);
+    }
+}
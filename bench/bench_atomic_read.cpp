@@ -0,0 +1,76 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+//Contention benchmark for atomic_intrusive_shared_ptr loads of a read-mostly value.
+//Every thread loads the same slot. Optionally one extra thread replaces the value periodically.
+
+#include <intrusive_shared_ptr/ref_counted.h>
+#include <intrusive_shared_ptr/refcnt_ptr.h>
+
+#include "bench.h"
+
+#include <cstring>
+
+using namespace isptr;
+
+namespace
+{
+    struct config : ref_counted<config>
+    {
+        int value = 0;
+    };
+
+    template<class Policy>
+    double measure(unsigned readers, bool with_writer)
+    {
+        atomic_intrusive_shared_ptr<config, config::refcnt_ptr_traits, Policy> slot(make_refcnt<config>());
+        unsigned thread_count = readers + (with_writer ? 1 : 0);
+        return bench::run_threads(thread_count, bench::default_duration, [&](unsigned idx, const std::atomic<bool> & stop) {
+            uint64_t count = 0;
+            if (idx == readers) 
+            {
+                while (!stop.load(std::memory_order_relaxed)) 
+                {
+                    slot.store(make_refcnt<config>());
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+                return count;
+            }
+            int sum = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                auto ptr = slot.load();
+                sum += ptr->value;
+                ++count;
+            }
+            return count + (sum != 0);
+        });
+    }
+
+    void run(bool with_writer)
+    {
+        bench::print_header(with_writer ? "atomic load, 1 writer every 100us (Mops/s)" : "atomic load, no writers (Mops/s)");
+        std::printf("%8s %14s %14s %14s\n", "threads", "locked", "read_mostly", "lock_free");
+        for (unsigned threads: bench::thread_counts())
+        {
+            std::printf("%8u %14.2f %14.2f", threads, 
+                        measure<locked_atomic_policy<>>(threads, with_writer) / 1e6, 
+                        measure<read_mostly_atomic_policy<>>(threads, with_writer) / 1e6);
+            if constexpr (std::is_same_v<default_atomic_policy, lock_free_atomic_policy>)
+                std::printf(" %14.2f\n", measure<lock_free_atomic_policy>(threads, with_writer) / 1e6);
+            else
+                std::printf(" %14s\n", "n/a");
+        }
+    }
+}
+
+int main()
+{
+    run(false);
+    run(true);
+}
@@ -0,0 +1,100 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+//Memory and throughput of large arrays of atomic_intrusive_shared_ptr slots, such as hash buckets,
+//with an embedded lock per slot versus the striped lock table.
+//Every thread accesses random slots: 90% loads and 10% stores.
+
+#include <intrusive_shared_ptr/ref_counted.h>
+#include <intrusive_shared_ptr/refcnt_ptr.h>
+
+#include "bench.h"
+
+#include <memory>
+
+using namespace isptr;
+
+namespace
+{
+    struct item : ref_counted<item>
+    {
+        int value = 0;
+    };
+
+    constexpr size_t slot_count = 1 << 20;
+
+    //xorshift, good enough to pick slots
+    struct random_index
+    {
+        uint32_t state;
+
+        size_t operator()() noexcept
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state & (slot_count - 1);
+        }
+    };
+
+    template<class Policy>
+    double measure(unsigned threads)
+    {
+        using slot = atomic_intrusive_shared_ptr<item, item::refcnt_ptr_traits, Policy>;
+        auto slots = std::make_unique<slot[]>(slot_count);
+        for (size_t i = 0; i < slot_count; ++i)
+            slots[i].store(make_refcnt<item>());
+
+        return bench::run_threads(threads, bench::default_duration, [&](unsigned idx, const std::atomic<bool> & stop) {
+            random_index next{2463534242u + idx};
+            uint64_t count = 0;
+            int sum = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                auto & target = slots[next()];
+                if (count % 10 == 9)
+                    target.store(slots[next()].load());
+                else
+                    sum += target.load()->value;
+                ++count;
+            }
+            return count + (sum != 0);
+        });
+    }
+
+    template<class Policy>
+    double slots_megabytes()
+    {
+        using slot = atomic_intrusive_shared_ptr<item, item::refcnt_ptr_traits, Policy>;
+        return double(sizeof(slot) * slot_count) / (1024 * 1024);
+    }
+}
+
+int main()
+{
+    bench::print_header("memory of 1M slots (MiB)");
+    std::printf("%14s %14s %14s\n", "locked", "striped", "lock_free");
+    std::printf("%14.2f %14.2f", slots_megabytes<locked_atomic_policy<>>(), slots_megabytes<striped_atomic_policy<>>());
+    if constexpr (std::is_same_v<default_atomic_policy, lock_free_atomic_policy>)
+        std::printf(" %14.2f\n", slots_megabytes<lock_free_atomic_policy>());
+    else
+        std::printf(" %14s\n", "n/a");
+
+    bench::print_header("random slot access, 90% loads (Mops/s)");
+    std::printf("%8s %14s %14s %14s\n", "threads", "locked", "striped", "lock_free");
+    for (unsigned threads: bench::thread_counts())
+    {
+        std::printf("%8u %14.2f %14.2f", threads,
+                    measure<locked_atomic_policy<>>(threads) / 1e6,
+                    measure<striped_atomic_policy<>>(threads) / 1e6);
+        if constexpr (std::is_same_v<default_atomic_policy, lock_free_atomic_policy>)
+            std::printf(" %14.2f\n", measure<lock_free_atomic_policy>(threads) / 1e6);
+        else
+            std::printf(" %14s\n", "n/a");
+    }
+}
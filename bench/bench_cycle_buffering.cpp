@@ -0,0 +1,130 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+//Overhead of buffering cycle candidates on acyclic workloads. Single threaded objects without cycle
+//collection are the baseline. Collectable objects are measured without collecting and with
+//collect_cycles() called after every batch of operations which finds nothing to collect.
+
+#include <intrusive_shared_ptr/ref_counted.h>
+#include <intrusive_shared_ptr/refcnt_ptr.h>
+#include <intrusive_shared_ptr/cycle_collector.h>
+
+#include "bench.h"
+
+#include <vector>
+
+using namespace isptr;
+
+namespace
+{
+    struct plain_item : ref_counted<plain_item, ref_counted_flags::single_threaded>
+    {
+        std::vector<refcnt_ptr<plain_item>> children;
+        int value = 1;
+    };
+
+    struct collectable_item : ref_counted<collectable_item, ref_counted_flags::single_threaded |
+                                                            ref_counted_flags::cycle_collectable>
+    {
+        void traverse(cycle_visitor & visitor) noexcept
+        {
+            for (auto & child: children)
+                visitor(child);
+        }
+
+        std::vector<refcnt_ptr<collectable_item>> children;
+        int value = 1;
+    };
+
+    constexpr int batch_size = 1024;
+    constexpr size_t object_count = 4096;
+    constexpr size_t child_count = 4;
+
+    template<class Item>
+    std::vector<refcnt_ptr<Item>> make_objects()
+    {
+        std::vector<refcnt_ptr<Item>> ret;
+        ret.reserve(object_count);
+        for (size_t i = 0; i < object_count; ++i)
+        {
+            auto item = make_refcnt<Item>();
+            for (size_t j = 0; j < child_count; ++j)
+                item->children.push_back(make_refcnt<Item>());
+            ret.push_back(std::move(item));
+        }
+        return ret;
+    }
+
+    //Copies and releases pointers to long lived objects
+    template<class Item>
+    double measure_copy(bool collect)
+    {
+        auto objects = make_objects<Item>();
+        return bench::run_threads(1, bench::default_duration, [&](unsigned, const std::atomic<bool> & stop) {
+            uint64_t count = 0;
+            size_t idx = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                for (int i = 0; i < batch_size; ++i)
+                {
+                    refcnt_ptr<Item> copy = objects[idx];
+                    count += copy->value;
+                    idx = (idx + 1) % object_count;
+                }
+                if constexpr (Item::collects_cycles)
+                {
+                    if (collect)
+                        collect_cycles();
+                }
+            }
+            return count;
+        });
+    }
+
+    //Creates small trees and releases them
+    template<class Item>
+    double measure_churn(bool collect)
+    {
+        return bench::run_threads(1, bench::default_duration, [&](unsigned, const std::atomic<bool> & stop) {
+            uint64_t count = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                for (int i = 0; i < batch_size / 8; ++i)
+                {
+                    auto root = make_refcnt<Item>();
+                    for (size_t j = 0; j < child_count; ++j)
+                    {
+                        auto child = make_refcnt<Item>();
+                        root->children.push_back(child);
+                    }
+                    count += root->value;
+                }
+                if constexpr (Item::collects_cycles)
+                {
+                    if (collect)
+                        collect_cycles();
+                }
+            }
+            return count;
+        });
+    }
+}
+
+int main()
+{
+    bench::print_header("single threaded acyclic workloads with and without cycle collection (Mops/s)");
+    std::printf("%12s %14s %14s %14s\n", "workload", "plain", "collectable", "+ collect");
+    std::printf("%12s %14.2f %14.2f %14.2f\n", "copy",
+                measure_copy<plain_item>(false) / 1e6,
+                measure_copy<collectable_item>(false) / 1e6,
+                measure_copy<collectable_item>(true) / 1e6);
+    std::printf("%12s %14.2f %14.2f %14.2f\n", "tree churn",
+                measure_churn<plain_item>(false) / 1e6,
+                measure_churn<collectable_item>(false) / 1e6,
+                measure_churn<collectable_item>(true) / 1e6);
+}
@@ -0,0 +1,107 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+//Tail latency of locked atomic_intrusive_shared_ptr operations when there are more threads than cores.
+//Compares the previous lock that spins forever with spin_lock that parks waiters after its spin budget.
+//Every thread alternates loads and stores of the same slot and times each operation.
+
+#include <intrusive_shared_ptr/ref_counted.h>
+#include <intrusive_shared_ptr/refcnt_ptr.h>
+
+#include "bench.h"
+
+using namespace isptr;
+
+namespace
+{
+    struct item : ref_counted<item>
+    {
+        int value = 0;
+    };
+
+    //The lock used before spin_lock: spins with a pause instruction until the lock is free
+    class pure_spin_lock 
+    {
+    public:
+        void lock() noexcept 
+        {
+            for ( ; ; ) 
+            {
+                while (m_value.load(std::memory_order_relaxed)) 
+                    pause();
+                unsigned current = 0;
+                if (m_value.compare_exchange_strong(current, 1, std::memory_order_acquire, std::memory_order_relaxed))
+                    return;
+                pause();
+            }
+        }
+
+        void unlock() noexcept 
+            { m_value.store(0, std::memory_order_release); }
+
+    private:
+        static void pause() noexcept
+        {
+        #ifdef ISPTR_THREAD_YIELD
+            ISPTR_THREAD_YIELD;
+        #endif
+        }
+
+        std::atomic<unsigned> m_value{0};
+    };
+
+    constexpr size_t max_samples_per_thread = 1 << 20;
+
+    template<class Lock>
+    void measure(const char * name, unsigned threads)
+    {
+        atomic_intrusive_shared_ptr<item, item::refcnt_ptr_traits, locked_atomic_policy<Lock>> slot(make_refcnt<item>());
+        auto replacement = make_refcnt<item>();
+        std::vector<std::vector<uint64_t>> samples(threads);
+        
+        double ops = bench::run_threads(threads, bench::default_duration, [&](unsigned idx, const std::atomic<bool> & stop) {
+            auto & mine = samples[idx];
+            mine.reserve(max_samples_per_thread);
+            uint64_t count = 0;
+            int sum = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                auto start = bench::clock::now();
+                if (count & 1)
+                    slot.store(replacement);
+                else
+                    sum += slot.load()->value;
+                auto end = bench::clock::now();
+                if (mine.size() < max_samples_per_thread)
+                    mine.push_back(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+                ++count;
+            }
+            return count + (sum != 0);
+        });
+
+        std::vector<uint64_t> all;
+        for (auto & mine: samples)
+            all.insert(all.end(), mine.begin(), mine.end());
+        auto summary = bench::summarize(all);
+        std::printf("%8u %-12s %10.2f %10.0f %10.0f %10.0f %12.0f\n", threads, name, ops / 1e6, 
+                    summary.p50, summary.p99, summary.p999, summary.max);
+    }
+}
+
+int main()
+{
+    bench::print_header("locked atomic load/store with oversubscribed threads (Mops/s, latency ns)");
+    std::printf("%8s %-12s %10s %10s %10s %10s %12s\n", "threads", "lock", "Mops/s", "p50", "p99", "p999", "max");
+    unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+    for (unsigned threads: {cores, 2 * cores, 4 * cores, 8 * cores})
+    {
+        measure<pure_spin_lock>("spin", threads);
+        measure<spin_lock<>>("spin_lock<>", threads);
+        measure<spin_lock<0>>("spin_lock<0>", threads);
+    }
+}
@@ -0,0 +1,140 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+//Allocation churn of weak reference control blocks: heap allocated (default) vs pooled.
+//Every operation creates an object, obtains a weak pointer to it and releases both.
+//In the cross-thread scenario weak pointers are created on one thread and released on another.
+
+#include <intrusive_shared_ptr/ref_counted.h>
+#include <intrusive_shared_ptr/refcnt_ptr.h>
+
+#include "bench.h"
+
+#include <mutex>
+
+using namespace isptr;
+
+namespace
+{
+    struct heap_item : weak_ref_counted<heap_item>
+    {
+        int value = 1;
+    };
+
+    struct pooled_item : ref_counted<pooled_item, ref_counted_flags::provide_weak_references |
+                                                  ref_counted_flags::pool_weak_references>
+    {
+        int value = 1;
+    };
+
+    template<class Item>
+    double measure_local(unsigned threads)
+    {
+        return bench::run_threads(threads, bench::default_duration, [&](unsigned, const std::atomic<bool> & stop) {
+            uint64_t count = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                auto weak = make_refcnt<Item>()->get_weak_ptr();
+                count += bool(weak);
+            }
+            return count;
+        });
+    }
+
+    constexpr size_t batch_size = 256;
+    constexpr size_t max_pending = 8;
+
+    //Hands batches of weak pointers from a producer thread to a consumer thread
+    template<class Item>
+    class mailbox
+    {
+    public:
+        using batch = std::vector<typename Item::weak_ptr>;
+
+        bool put(batch & value)
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            if (m_pending.size() >= max_pending)
+                return false;
+            m_pending.push_back(std::move(value));
+            return true;
+        }
+
+        bool take(batch & value)
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            if (m_pending.empty())
+                return false;
+            value = std::move(m_pending.back());
+            m_pending.pop_back();
+            return true;
+        }
+    private:
+        std::mutex m_mutex;
+        std::vector<batch> m_pending;
+    };
+
+    template<class Item>
+    double measure_cross(unsigned pairs)
+    {
+        std::vector<mailbox<Item>> boxes(pairs);
+        return bench::run_threads(2 * pairs, bench::default_duration, [&](unsigned idx, const std::atomic<bool> & stop) {
+            auto & box = boxes[idx / 2];
+            uint64_t count = 0;
+            typename mailbox<Item>::batch current;
+            if (idx % 2 == 0)
+            {
+                while (!stop.load(std::memory_order_relaxed))
+                {
+                    if (current.empty())
+                    {
+                        current.reserve(batch_size);
+                        for (size_t i = 0; i < batch_size; ++i)
+                            current.push_back(make_refcnt<Item>()->get_weak_ptr());
+                    }
+                    if (!box.put(current))
+                        std::this_thread::yield();
+                    else
+                        current = {};
+                }
+                return count;
+            }
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                if (!box.take(current))
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                count += current.size();
+                current.clear();
+            }
+            return count;
+        });
+    }
+}
+
+int main()
+{
+    bench::print_header("create + get_weak_ptr + release on the same thread (Mops/s)");
+    std::printf("%8s %14s %14s\n", "threads", "heap", "pooled");
+    for (unsigned threads: bench::thread_counts())
+        std::printf("%8u %14.2f %14.2f\n", threads, measure_local<heap_item>(threads) / 1e6, measure_local<pooled_item>(threads) / 1e6);
+
+    bench::print_header("weak pointers released on another thread (Mops/s)");
+    std::printf("%8s %14s %14s\n", "pairs", "heap", "pooled");
+    unsigned last_pairs = 0;
+    for (unsigned threads: bench::thread_counts())
+    {
+        unsigned pairs = std::max(threads / 2, 1u);
+        if (pairs == last_pairs)
+            continue;
+        last_pairs = pairs;
+        std::printf("%8u %14.2f %14.2f\n", pairs, measure_cross<heap_item>(pairs) / 1e6, measure_cross<pooled_item>(pairs) / 1e6);
+    }
+}
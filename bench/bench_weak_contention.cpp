@@ -0,0 +1,69 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+//Reference count updates of weak-capable objects under contention. All threads copy and release pointers
+//to the same object. Objects without weak support are shown as the baseline.
+//This file is built twice: as bench-weak_contention with the default fetch_add based counts and as
+//bench-weak_contention_cas with ISPTR_USE_FETCH_ADD_WEAK_COUNT=0 that uses compare-and-swap loops.
+
+#include <intrusive_shared_ptr/ref_counted.h>
+#include <intrusive_shared_ptr/refcnt_ptr.h>
+
+#include "bench.h"
+
+using namespace isptr;
+
+namespace
+{
+    struct plain_item : ref_counted<plain_item>
+    {
+        int value = 1;
+    };
+
+    struct weak_item : weak_ref_counted<weak_item>
+    {
+        int value = 1;
+    };
+
+    template<class Item>
+    double measure(unsigned threads, const refcnt_ptr<Item> & shared)
+    {
+        return bench::run_threads(threads, bench::default_duration, [&](unsigned, const std::atomic<bool> & stop) {
+            uint64_t count = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                for (int i = 0; i < 64; ++i)
+                {
+                    refcnt_ptr<Item> copy = shared;
+                    count += copy->value;
+                }
+            }
+            return count;
+        });
+    }
+}
+
+int main()
+{
+    auto plain = make_refcnt<plain_item>();
+    auto no_weak = make_refcnt<weak_item>();
+    auto with_weak = make_refcnt<weak_item>();
+    auto weak = with_weak->get_weak_ptr();
+
+    bench::print_header(ISPTR_USE_FETCH_ADD_WEAK_COUNT ?
+                            "copy + release of a shared pointer, weak-capable counts use fetch_add (Mops/s)" :
+                            "copy + release of a shared pointer, weak-capable counts use compare-and-swap (Mops/s)");
+    std::printf("%8s %14s %14s %14s\n", "threads", "plain", "weak-capable", "has weak");
+    for (unsigned threads: bench::thread_counts())
+    {
+        std::printf("%8u %14.2f %14.2f %14.2f\n", threads,
+                    measure(threads, plain) / 1e6,
+                    measure(threads, no_weak) / 1e6,
+                    measure(threads, with_weak) / 1e6);
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+//Throughput of weak_reference::lock() when all threads lock the same weak pointer and release the result.
+//This file is built twice: as bench-weak_lock with the default wait-free lock and as bench-weak_lock_cas 
+//with ISPTR_USE_WAIT_FREE_WEAK_LOCK=0 that uses a compare-and-swap loop.
+
+#include <intrusive_shared_ptr/ref_counted.h>
+#include <intrusive_shared_ptr/refcnt_ptr.h>
+
+#include "bench.h"
+
+using namespace isptr;
+
+namespace
+{
+    struct item : weak_ref_counted<item>
+    {
+        int value = 1;
+    };
+
+    double measure(unsigned threads, const item::weak_ptr & weak)
+    {
+        return bench::run_threads(threads, bench::default_duration, [&](unsigned, const std::atomic<bool> & stop) {
+            uint64_t count = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                for (int i = 0; i < 64; ++i)
+                {
+                    auto strong = weak->lock();
+                    count += strong->value;
+                }
+            }
+            return count;
+        });
+    }
+}
+
+int main()
+{
+    auto strong = make_refcnt<item>();
+    auto weak = strong->get_weak_ptr();
+
+    bench::print_header(ISPTR_USE_WAIT_FREE_WEAK_LOCK ?
+                            "lock + release of a shared weak pointer, wait-free lock (Mops/s)" :
+                            "lock + release of a shared weak pointer, compare-and-swap lock (Mops/s)");
+    std::printf("%8s %14s\n", "threads", "lock");
+    for (unsigned threads: bench::thread_counts())
+        std::printf("%8u %14.2f\n", threads, measure(threads, weak) / 1e6);
+}
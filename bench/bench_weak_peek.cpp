@@ -0,0 +1,83 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+//Reading a field of the owner of a weak pointer shared by all threads: weak_reference::lock() that increments
+//and decrements the owner's count vs with_locked() and peek() that resolve it inside an RCU read section
+//without writing to shared memory. The peek() column enters one read section per batch of 64 reads.
+
+#include <intrusive_shared_ptr/ref_counted.h>
+#include <intrusive_shared_ptr/refcnt_ptr.h>
+#include <intrusive_shared_ptr/rcu_ptr.h>
+
+#include "bench.h"
+
+using namespace isptr;
+
+namespace
+{
+    struct item : ref_counted<item, ref_counted_flags::provide_weak_references | ref_counted_flags::rcu_destroy>
+    {
+        int value = 1;
+    };
+
+    constexpr int batch_size = 64;
+
+    //read_batch performs batch_size reads
+    template<class ReadBatch>
+    double measure(unsigned threads, ReadBatch read_batch)
+    {
+        return bench::run_threads(threads, bench::default_duration, [&](unsigned, const std::atomic<bool> & stop) {
+            uint64_t count = 0;
+            while (!stop.load(std::memory_order_relaxed))
+                count += read_batch();
+            return count;
+        });
+    }
+}
+
+int main()
+{
+    auto strong = make_refcnt<item>();
+    auto weak = strong->get_weak_ptr();
+
+    auto lock = [&]() {
+        uint64_t count = 0;
+        for (int i = 0; i < batch_size; ++i)
+        {
+            auto locked = weak->lock();
+            count += locked ? locked->value : 0;
+        }
+        return count;
+    };
+    auto with_locked = [&]() {
+        uint64_t count = 0;
+        for (int i = 0; i < batch_size; ++i)
+            count += weak->with_locked([](const item * p) { return p ? p->value : 0; });
+        return count;
+    };
+    auto peek = [&]() {
+        uint64_t count = 0;
+        rcu_read_guard guard;
+        for (int i = 0; i < batch_size; ++i)
+        {
+            auto p = weak->peek(guard);
+            count += p ? p->value : 0;
+        }
+        return count;
+    };
+
+    bench::print_header("reading the owner of a shared weak pointer (Mops/s)");
+    std::printf("%8s %14s %14s %14s\n", "threads", "lock", "with_locked", "peek");
+    for (unsigned threads: bench::thread_counts())
+    {
+        std::printf("%8u %14.2f %14.2f %14.2f\n", threads,
+                    measure(threads, lock) / 1e6,
+                    measure(threads, with_locked) / 1e6,
+                    measure(threads, peek) / 1e6);
+    }
+}
@@ -0,0 +1,202 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+#ifndef HEADER_BLOCK_POOL_H_INCLUDED
+#define HEADER_BLOCK_POOL_H_INCLUDED
+
+#include <intrusive_shared_ptr/common.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <new>
+
+namespace isptr
+{
+    //MARK:- thread_block_pool
+
+    //Pool of fixed size memory blocks. Each thread allocates from its own cache which is refilled
+    //from slabs of BlocksPerSlab blocks. Blocks freed by the allocating thread go straight back to
+    //its cache. Blocks freed by other threads are pushed to a lock-free list of the cache that
+    //allocated them and picked up when its local list runs out.
+    //Memory is never returned to the system. Caches of exited threads, together with their free
+    //blocks, are reused by new threads. Blocks allocated by a thread after its cache was released,
+    //e.g. from destructors of thread_local objects, come from the heap and go back there when freed.
+    ISPTR_EXPORTED
+    template<size_t BlockSize, size_t BlockAlign = alignof(std::max_align_t), size_t BlocksPerSlab = 64>
+    class thread_block_pool
+    {
+    private:
+        struct cache;
+
+        struct free_block
+        {
+            free_block * next;
+        };
+
+        //Every block is preceded by a pointer to the cache that allocated it
+        static constexpr size_t header_size = (sizeof(cache *) + BlockAlign - 1) / BlockAlign * BlockAlign;
+        static constexpr size_t payload_size = BlockSize < sizeof(free_block) ? sizeof(free_block) : BlockSize;
+        static constexpr size_t stride = (header_size + payload_size + BlockAlign - 1) / BlockAlign * BlockAlign;
+
+        static_assert(BlockAlign >= alignof(free_block) && (BlockAlign & (BlockAlign - 1)) == 0,
+                      "BlockAlign must be a power of 2 no smaller than pointer alignment");
+        static_assert(BlockAlign <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "over-aligned blocks are not supported");
+        static_assert(BlocksPerSlab > 0, "BlocksPerSlab must be positive");
+
+        struct cache
+        {
+            free_block * local = nullptr;
+            std::atomic<free_block *> remote{nullptr};
+            std::atomic<bool> in_use{true};
+            cache * next = nullptr;
+        };
+
+        struct thread_holder
+        {
+            ~thread_holder() noexcept
+            {
+                if (this->owned)
+                {
+                    //blocks allocated from now on, including by later thread_local destructors,
+                    //do not come from the cache
+                    thread_block_pool::exited() = true;
+                    thread_block_pool::current_slot() = nullptr;
+                    this->owned->in_use.store(false, std::memory_order_release);
+                }
+            }
+
+            cache * owned = nullptr;
+        };
+
+    public:
+        static constexpr size_t block_size = BlockSize;
+        static constexpr size_t block_align = BlockAlign;
+
+        //Returns a block of block_size bytes aligned to block_align. Throws std::bad_alloc on failure.
+        static void * allocate()
+        {
+            auto owner = thread_block_pool::current_slot();
+            if (!owner)
+            {
+                if (thread_block_pool::exited())
+                    return thread_block_pool::allocate_unpooled();
+                owner = thread_block_pool::acquire_current();
+            }
+
+            auto block = owner->local;
+            if (!block)
+            {
+                block = owner->remote.exchange(nullptr, std::memory_order_acquire);
+                if (!block)
+                    block = thread_block_pool::allocate_slab(owner);
+            }
+            owner->local = block->next;
+            return block;
+        }
+
+        //Returns a block obtained from allocate(). Can be called from any thread.
+        static void deallocate(void * ptr) noexcept
+        {
+            if (!ptr)
+                return;
+            auto block = static_cast<free_block *>(ptr);
+            auto start = static_cast<char *>(ptr) - header_size;
+            auto owner = *reinterpret_cast<cache **>(start);
+            if (!owner)
+            {
+                ::operator delete(start);
+                return;
+            }
+            if (owner == thread_block_pool::current_slot())
+            {
+                block->next = owner->local;
+                owner->local = block;
+                return;
+            }
+            block->next = owner->remote.load(std::memory_order_relaxed);
+            while (!owner->remote.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed))
+            {}
+        }
+
+    private:
+        static cache *& current_slot() noexcept
+        {
+            static thread_local cache * instance = nullptr;
+            return instance;
+        }
+
+        static bool & exited() noexcept
+        {
+            static thread_local bool instance = false;
+            return instance;
+        }
+
+        static std::atomic<cache *> & head() noexcept
+        {
+            static std::atomic<cache *> instance{nullptr};
+            return instance;
+        }
+
+        static cache * acquire_current()
+        {
+            static thread_local thread_holder holder;
+
+            auto & list = thread_block_pool::head();
+            cache * ret = nullptr;
+            for (auto entry = list.load(std::memory_order_acquire); entry; entry = entry->next)
+            {
+                if (!entry->in_use.load(std::memory_order_relaxed) && !entry->in_use.exchange(true, std::memory_order_acquire))
+                {
+                    ret = entry;
+                    break;
+                }
+            }
+            if (!ret)
+            {
+                ret = new cache;
+                ret->next = list.load(std::memory_order_relaxed);
+                while (!list.compare_exchange_weak(ret->next, ret, std::memory_order_release, std::memory_order_relaxed))
+                {}
+            }
+            holder.owned = thread_block_pool::current_slot() = ret;
+            return ret;
+        }
+
+        //Returns a block that belongs to no cache
+        static void * allocate_unpooled()
+        {
+            auto start = static_cast<char *>(::operator new(stride));
+            *reinterpret_cast<cache **>(start) = nullptr;
+            return start + header_size;
+        }
+
+        //Returns a list of blocks of a new slab
+        static free_block * allocate_slab(cache * owner)
+        {
+            auto slab = static_cast<char *>(::operator new(stride * BlocksPerSlab));
+            free_block * ret = nullptr;
+            for (size_t i = BlocksPerSlab; i-- > 0; )
+            {
+                char * start = slab + i * stride;
+                *reinterpret_cast<cache **>(start) = owner;
+                auto block = reinterpret_cast<free_block *>(start + header_size);
+                block->next = ret;
+                ret = block;
+            }
+            return ret;
+        }
+    };
+
+    //Default allocator for pooled weak reference control blocks
+    ISPTR_EXPORTED
+    template<class WeakValue>
+    using weak_reference_pool = thread_block_pool<sizeof(WeakValue), alignof(WeakValue)>;
+}
+
+#endif
@@ -13,6 +13,8 @@
     #include <version>
 #endif
 
+#include <type_traits>
+
 
 #if __cpp_constexpr >= 201907L
 
@@ -81,21 +83,102 @@
 #endif
 
 
+//Size used to keep independently modified data on separate cache lines. 
+//std::hardware_destructive_interference_size is not reliably usable in headers.
+#ifndef ISPTR_CACHE_LINE_SIZE
+
+    #if defined(__APPLE__) && defined(__aarch64__)
+        #define ISPTR_CACHE_LINE_SIZE 128
+    #else
+        #define ISPTR_CACHE_LINE_SIZE 64
+    #endif
+
+#endif
+
+//Lock-free std::atomic<intrusive_shared_ptr> and fetch_add weak counts store data in the upper 16 bits of
+//a pointer. This requires 64-bit pointers with no more than 48 significant bits which is not the case when
+//the top byte of a pointer can carry a tag (Android, ARM memory tagging or hardware-assisted AddressSanitizer).
+#if (defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__) || defined(_M_ARM64)) && !defined(__ANDROID__) \
+    && !defined(__ARM_FEATURE_MEMORY_TAGGING) && !defined(__SANITIZE_HWADDRESS__)
+
+    #define ISPTR_POINTER_HAS_FREE_TOP_BITS 1
+
+#else
+
+    #define ISPTR_POINTER_HAS_FREE_TOP_BITS 0
+
+#endif
+
+#if defined(__has_feature)
+    #if __has_feature(hwaddress_sanitizer)
+        #undef ISPTR_POINTER_HAS_FREE_TOP_BITS
+        #define ISPTR_POINTER_HAS_FREE_TOP_BITS 0
+    #endif
+#endif
+
+//Lock-free std::atomic<intrusive_shared_ptr> packs a count into the upper bits of a pointer. Define 
+//ISPTR_USE_LOCK_FREE_ATOMIC to 0 to use a spin lock based implementation instead.
+#ifndef ISPTR_USE_LOCK_FREE_ATOMIC
+    #define ISPTR_USE_LOCK_FREE_ATOMIC ISPTR_POINTER_HAS_FREE_TOP_BITS
+#endif
+
+//Weak-capable ref_counted objects update their count with plain fetch_add/fetch_sub. Once a weak reference is
+//created its pointer is stored in the count above a field that absorbs updates racing with the creation.
+//Define ISPTR_USE_FETCH_ADD_WEAK_COUNT to 0 to use compare-and-swap loops instead.
+#ifndef ISPTR_USE_FETCH_ADD_WEAK_COUNT
+    #define ISPTR_USE_FETCH_ADD_WEAK_COUNT ISPTR_POINTER_HAS_FREE_TOP_BITS
+#endif
+
+//weak_reference::lock() increments the strong count with a single fetch_add. The count of a destroyed owner
+//has a sticky sign bit so that the increment fails it without a retry loop. Define ISPTR_USE_WAIT_FREE_WEAK_LOCK
+//to 0 to use a compare-and-swap loop that never increments a zero count instead.
+#ifndef ISPTR_USE_WAIT_FREE_WEAK_LOCK
+    #define ISPTR_USE_WAIT_FREE_WEAK_LOCK 1
+#endif
+
+//Locks park waiting threads via std::atomic::wait when it is available and atomic pointers provide
+//wait/notify_one/notify_all. Define ISPTR_USE_ATOMIC_WAIT to 0 to make locks yield to the scheduler
+//instead and to omit waiting on atomic pointers.
+#ifndef ISPTR_USE_ATOMIC_WAIT
+
+    #if __cpp_lib_atomic_wait >= 201907L
+        #define ISPTR_USE_ATOMIC_WAIT 1
+    #else
+        #define ISPTR_USE_ATOMIC_WAIT 0
+    #endif
+
+#endif
+
+//ref_counted objects with promote_on_share flag assert that they are not used by another thread before
+//they are published. It changes object layout so it must have the same value in all translation units
+//and, unlike assert(), does not follow NDEBUG.
+#ifndef ISPTR_CHECK_UNPUBLISHED_USE
+    #define ISPTR_CHECK_UNPUBLISHED_USE 0
+#endif
+
+
 #if defined(_MSC_VER) && !defined(__clang__)
 
     #define ISPTR_ALWAYS_INLINE __forceinline
     #define ISPTR_TRIVIAL_ABI
+    #define ISPTR_UNLIKELY(x) (x)
 
 #elif defined(__clang__) 
 
     #define ISPTR_ALWAYS_INLINE [[gnu::always_inline]] inline
     #define ISPTR_TRIVIAL_ABI [[clang::trivial_abi]]
+    #define ISPTR_UNLIKELY(x) __builtin_expect(!!(x), 0)
 
 #elif defined (__GNUC__)
 
     #define ISPTR_ALWAYS_INLINE [[gnu::always_inline]] inline
     #define ISPTR_TRIVIAL_ABI
+    #define ISPTR_UNLIKELY(x) __builtin_expect(!!(x), 0)
+
+#endif
 
+#ifndef ISPTR_UNLIKELY
+    #define ISPTR_UNLIKELY(x) (x)
 #endif
 
 #ifndef ISPTR_EXPORTED
@@ -107,6 +190,31 @@ namespace isptr::internal
 {
     template<bool Val, class... Args>
     constexpr bool dependent_bool = Val;
+
+    //T made dependent on X so that a possibly incomplete T is only looked at when X is known
+    template<class T, class X>
+    struct dependent_type
+    {
+        using type = T;
+    };
+    template<class T, class X>
+    using dependent_t = typename dependent_type<T, X>::type;
+
+    template<class T, class = void>
+    struct has_refcnt_allocator : std::false_type {};
+
+    template<class T>
+    struct has_refcnt_allocator<T, std::void_t<typename T::refcnt_allocator>> : std::true_type {};
+
+    //T preceded by a cache line of padding so that it never shares a line with the data laid out 
+    //before it. Explicit padding is used rather than alignas since over-aligned structs trigger padding
+    //warnings (C4324 under MSVC).
+    template<class T>
+    struct cache_line_padded
+    {
+        char padding[ISPTR_CACHE_LINE_SIZE] = {};
+        T value{};
+    };
 }
 
 
@@ -0,0 +1,381 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+#ifndef HEADER_CYCLE_COLLECTOR_H_INCLUDED
+#define HEADER_CYCLE_COLLECTOR_H_INCLUDED
+
+#include <intrusive_shared_ptr/intrusive_shared_ptr.h>
+
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace isptr
+{
+    ISPTR_EXPORTED
+    class cycle_visitor;
+
+    namespace internal
+    {
+        class cycle_collector;
+
+        //Colors of synchronous trial deletion (Bacon and Rajan, "Concurrent Cycle Collection in
+        //Reference Counted Systems", 2001)
+        enum class cycle_color : unsigned char
+        {
+            black,      //in use
+            gray,       //possible member of a cycle
+            white,      //member of a garbage cycle
+            purple,     //possible root of a cycle
+            collecting  //garbage being destroyed
+        };
+
+        struct cycle_node;
+
+        //Type-specific operations of a cycle collectable class
+        struct cycle_ops
+        {
+            void (*traverse)(cycle_node * node, cycle_visitor & visitor) noexcept;
+            void (*release)(cycle_node * node) noexcept;
+        };
+
+        //Count of a cycle collectable object. Objects whose count drops to a non-zero value are linked
+        //into the candidate list of the releasing thread. The list is not synchronized so releasing a
+        //buffered object on another thread must not race with the buffering thread using its list.
+        struct cycle_node
+        {
+            explicit cycle_node(const cycle_ops * ops_) noexcept:
+                ops(ops_)
+            {}
+
+            void add_ref() noexcept
+            {
+                assert(this->count > 0);
+                ++this->count;
+                this->color = cycle_color::black;
+            }
+
+            //Returns whether the object needs to be destroyed
+            bool sub_ref() noexcept;
+
+            bool buffered() const noexcept
+                { return this->next != nullptr; }
+
+            void unlink() noexcept
+            {
+                this->prev->next = this->next;
+                this->next->prev = this->prev;
+                this->prev = this->next = nullptr;
+            }
+
+            cycle_node * prev = nullptr;
+            cycle_node * next = nullptr;
+            const cycle_ops * ops;
+            int count = 1;
+            cycle_color color = cycle_color::black;
+        };
+
+        template<class T, class = void>
+        struct is_cycle_collectable : std::false_type
+        {};
+
+        template<class T>
+        struct is_cycle_collectable<T, std::void_t<decltype(T::collects_cycles)>> : std::bool_constant<T::collects_cycles>
+        {};
+    }
+
+    //MARK:- cycle_visitor
+
+    //Passed to traverse() of cycle collectable classes which must call it for every pointer to
+    //a cycle collectable object they hold. Pointers to other objects are ignored.
+    ISPTR_EXPORTED
+    class cycle_visitor
+    {
+    friend internal::cycle_collector;
+    public:
+        cycle_visitor(const cycle_visitor &) = delete;
+        cycle_visitor & operator=(const cycle_visitor &) = delete;
+
+        template<class T, class Traits>
+        void operator()(intrusive_shared_ptr<T, Traits> & ptr) noexcept
+        {
+            using object_type = std::remove_const_t<T>;
+            if constexpr (internal::is_cycle_collectable<object_type>::value)
+            {
+                if (!ptr)
+                    return;
+                if (this->m_action == action::clear)
+                    ptr.reset();
+                else
+                    this->visit(object_type::ref_counted_base::cycle_node_of(ptr.get()));
+            }
+        }
+
+    private:
+        enum class action
+        {
+            mark_gray,
+            scan,
+            scan_black,
+            collect_white,
+            restore,
+            clear
+        };
+
+        cycle_visitor(internal::cycle_collector & collector, action act) noexcept:
+            m_collector(collector),
+            m_action(act)
+        {}
+
+        void visit(internal::cycle_node * node) noexcept;
+
+    private:
+        internal::cycle_collector & m_collector;
+        action m_action;
+    };
+
+    namespace internal
+    {
+        //Candidate roots of garbage cycles buffered by a thread. The list is circular with the
+        //collector as the sentinel.
+        class cycle_collector
+        {
+        friend cycle_visitor;
+        public:
+            static cycle_collector & current() noexcept
+            {
+                static thread_local cycle_collector instance;
+                return instance;
+            }
+
+            cycle_collector(const cycle_collector &) = delete;
+            cycle_collector & operator=(const cycle_collector &) = delete;
+
+            //Collects garbage left by the exiting thread
+            ~cycle_collector() noexcept
+            {
+                while (this->m_roots.next != &this->m_roots)
+                    this->collect();
+            }
+
+            void buffer(cycle_node * node) noexcept
+            {
+                node->prev = this->m_roots.prev;
+                node->next = &this->m_roots;
+                this->m_roots.prev->next = node;
+                this->m_roots.prev = node;
+            }
+
+            size_t collect() noexcept;
+
+        private:
+            cycle_collector() noexcept
+                { this->m_roots.prev = this->m_roots.next = &this->m_roots; }
+
+            void mark_gray(cycle_node * root) noexcept;
+            void scan(cycle_node * root) noexcept;
+            void scan_black(cycle_node * node) noexcept;
+            void collect_white(cycle_node * root) noexcept;
+            void drain(std::vector<cycle_node *> & stack, cycle_visitor::action act) noexcept;
+
+        private:
+            cycle_node m_roots{nullptr};
+            bool m_collecting = false;
+            //kept between collections to avoid reallocation
+            std::vector<cycle_node *> m_candidates;
+            std::vector<cycle_node *> m_stack;
+            std::vector<cycle_node *> m_black_stack;
+            std::vector<cycle_node *> m_garbage;
+        };
+
+        inline bool cycle_node::sub_ref() noexcept
+        {
+            assert(this->count > 0);
+            if (--this->count == 0)
+            {
+                if (this->buffered())
+                    this->unlink();
+                this->color = cycle_color::black;
+                return true;
+            }
+            if (this->color != cycle_color::purple && this->color != cycle_color::collecting)
+            {
+                this->color = cycle_color::purple;
+                if (!this->buffered())
+                    cycle_collector::current().buffer(this);
+            }
+            return false;
+        }
+
+        inline size_t cycle_collector::collect() noexcept
+        {
+            //destructors run by the collection can call us again
+            if (this->m_collecting)
+                return 0;
+            this->m_collecting = true;
+
+            auto & candidates = this->m_candidates;
+            for (auto node = this->m_roots.next; node != &this->m_roots; )
+            {
+                auto next = node->next;
+                node->unlink();
+                //objects used again since they were buffered are not roots anymore
+                if (node->color == cycle_color::purple)
+                    candidates.push_back(node);
+                node = next;
+            }
+
+            //trial deletion of the references inside the subgraphs reachable from the candidates
+            for (auto node: candidates)
+                this->mark_gray(node);
+            for (auto node: candidates)
+                this->scan(node);
+            for (auto node: candidates)
+                this->collect_white(node);
+            candidates.clear();
+
+            auto & garbage = this->m_garbage;
+            //undo the trial deletion of references held by garbage and add one of our own so that
+            //clearing the references does not destroy anything
+            for (auto node: garbage)
+            {
+                cycle_visitor visitor(*this, cycle_visitor::action::restore);
+                node->ops->traverse(node, visitor);
+            }
+            for (auto node: garbage)
+                ++node->count;
+            for (auto node: garbage)
+            {
+                cycle_visitor visitor(*this, cycle_visitor::action::clear);
+                node->ops->traverse(node, visitor);
+            }
+            size_t ret = garbage.size();
+            for (auto node: garbage)
+                node->ops->release(node);
+            garbage.clear();
+
+            this->m_collecting = false;
+            return ret;
+        }
+
+        inline void cycle_collector::mark_gray(cycle_node * root) noexcept
+        {
+            if (root->color == cycle_color::gray)
+                return;
+            root->color = cycle_color::gray;
+            this->m_stack.push_back(root);
+            this->drain(this->m_stack, cycle_visitor::action::mark_gray);
+        }
+
+        inline void cycle_collector::scan(cycle_node * root) noexcept
+        {
+            cycle_visitor visitor(*this, cycle_visitor::action::scan);
+            auto & stack = this->m_stack;
+            stack.push_back(root);
+            while (!stack.empty())
+            {
+                auto node = stack.back();
+                stack.pop_back();
+                if (node->color != cycle_color::gray)
+                    continue;
+                if (node->count > 0)
+                {
+                    //referenced from outside so it and everything it references is alive
+                    this->scan_black(node);
+                }
+                else
+                {
+                    node->color = cycle_color::white;
+                    node->ops->traverse(node, visitor);
+                }
+            }
+        }
+
+        inline void cycle_collector::scan_black(cycle_node * node) noexcept
+        {
+            node->color = cycle_color::black;
+            this->m_black_stack.push_back(node);
+            this->drain(this->m_black_stack, cycle_visitor::action::scan_black);
+        }
+
+        inline void cycle_collector::collect_white(cycle_node * root) noexcept
+        {
+            if (root->color != cycle_color::white)
+                return;
+            root->color = cycle_color::collecting;
+            this->m_garbage.push_back(root);
+            this->m_stack.push_back(root);
+            this->drain(this->m_stack, cycle_visitor::action::collect_white);
+        }
+
+        inline void cycle_collector::drain(std::vector<cycle_node *> & stack, cycle_visitor::action act) noexcept
+        {
+            cycle_visitor visitor(*this, act);
+            while (!stack.empty())
+            {
+                auto node = stack.back();
+                stack.pop_back();
+                node->ops->traverse(node, visitor);
+            }
+        }
+    }
+
+    inline void cycle_visitor::visit(internal::cycle_node * node) noexcept
+    {
+        using internal::cycle_color;
+
+        auto & collector = this->m_collector;
+        switch (this->m_action)
+        {
+        case action::mark_gray:
+            --node->count;
+            if (node->color != cycle_color::gray)
+            {
+                node->color = cycle_color::gray;
+                collector.m_stack.push_back(node);
+            }
+            break;
+        case action::scan:
+            collector.m_stack.push_back(node);
+            break;
+        case action::scan_black:
+            ++node->count;
+            if (node->color != cycle_color::black)
+            {
+                node->color = cycle_color::black;
+                collector.m_black_stack.push_back(node);
+            }
+            break;
+        case action::collect_white:
+            if (node->color == cycle_color::white)
+            {
+                node->color = cycle_color::collecting;
+                collector.m_garbage.push_back(node);
+                collector.m_stack.push_back(node);
+            }
+            break;
+        case action::restore:
+            ++node->count;
+            break;
+        case action::clear:
+            break;
+        }
+    }
+
+    //MARK:- collect_cycles
+
+    //Destroys garbage cycles of objects with ref_counted_flags::cycle_collectable whose count the calling
+    //thread decremented to a non-zero value since the previous collection. Returns the number of
+    //destroyed objects.
+    ISPTR_EXPORTED
+    inline size_t collect_cycles() noexcept
+        { return internal::cycle_collector::current().collect(); }
+}
+
+#endif
@@ -0,0 +1,354 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+#ifndef HEADER_DEFERRED_DESTROY_H_INCLUDED
+#define HEADER_DEFERRED_DESTROY_H_INCLUDED
+
+#include <intrusive_shared_ptr/common.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <new>
+
+namespace isptr
+{
+    //MARK:- deferred_destroy_snapshot
+
+    ISPTR_EXPORTED
+    struct deferred_destroy_snapshot
+    {
+        uint64_t deferred = 0;
+        uint64_t destroyed = 0;
+        uint64_t pending = 0;
+        uint64_t max_pending = 0;
+        uint64_t drains = 0;
+        std::chrono::nanoseconds total_drain_time{0};
+        std::chrono::nanoseconds max_drain_time{0};
+    };
+
+    namespace internal
+    {
+        struct deferred_node
+        {
+            void (*destroy)(const void *) noexcept;
+            const void * object;
+            uint64_t seq;
+            deferred_node * next;
+        };
+
+        //Objects whose destruction was deferred by one thread. Only the owning thread pushes but any
+        //thread can drain. Drained nodes are returned to the queue they came from for reuse.
+        //Queues link themselves into a global list, are never freed and are reused by new threads 
+        //once their owners exit.
+        class deferred_queue
+        {
+        public:
+            //Queues destruction of object on the calling thread's queue. Destroys it immediately if
+            //that is not possible.
+            static void push(const void * object, void (*destroy)(const void *) noexcept) noexcept
+            {
+                auto queue = deferred_queue::acquire_current();
+                auto node = queue ? queue->allocate_node() : nullptr;
+                if (!node)
+                {
+                    destroy(object);
+                    return;
+                }
+                auto pushed = queue->m_pushed.load(std::memory_order_relaxed) + 1;
+                node->destroy = destroy;
+                node->object = object;
+                node->seq = pushed;
+                queue->splice(node, node);
+
+                queue->m_pushed.store(pushed, std::memory_order_relaxed);
+                auto depth = pushed - queue->m_destroyed.load(std::memory_order_relaxed);
+                if (depth > queue->m_max_depth.load(std::memory_order_relaxed))
+                    queue->m_max_depth.store(depth, std::memory_order_relaxed);
+            }
+
+            static size_t drain_current(size_t max_count) noexcept
+            {
+                auto queue = deferred_queue::current_slot();
+                if (!queue)
+                    return 0;
+                auto start = std::chrono::steady_clock::now();
+                size_t ret = 0;
+                while (ret < max_count)
+                {
+                    size_t count = queue->drain(max_count - ret);
+                    if (!count)
+                        break;
+                    ret += count;
+                }
+                deferred_queue::record_drain(start, ret);
+                return ret;
+            }
+
+            static size_t drain_all() noexcept
+            {
+                auto & list = deferred_queue::head();
+                auto start = std::chrono::steady_clock::now();
+                size_t ret = 0;
+                for (auto queue = list.load(std::memory_order_acquire); queue; queue = queue->m_next)
+                    ret += queue->drain(std::numeric_limits<size_t>::max());
+                //destructors run above could have queued more objects on this thread
+                if (auto queue = deferred_queue::current_slot())
+                {
+                    while (size_t count = queue->drain(std::numeric_limits<size_t>::max()))
+                        ret += count;
+                }
+                deferred_queue::record_drain(start, ret);
+                return ret;
+            }
+
+            static deferred_destroy_snapshot snapshot() noexcept
+            {
+                deferred_destroy_snapshot ret;
+                auto & list = deferred_queue::head();
+                for (auto queue = list.load(std::memory_order_acquire); queue; queue = queue->m_next)
+                {
+                    auto pushed = queue->m_pushed.load(std::memory_order_relaxed);
+                    auto destroyed = queue->m_destroyed.load(std::memory_order_relaxed);
+                    auto max_depth = queue->m_max_depth.load(std::memory_order_relaxed);
+                    ret.deferred += pushed;
+                    ret.destroyed += destroyed;
+                    ret.pending += pushed > destroyed ? pushed - destroyed : 0;
+                    if (max_depth > ret.max_pending)
+                        ret.max_pending = max_depth;
+                }
+                auto & stats = deferred_queue::drain_stats();
+                ret.drains = stats.drains.load(std::memory_order_relaxed);
+                ret.total_drain_time = std::chrono::nanoseconds(stats.total_time.load(std::memory_order_relaxed));
+                ret.max_drain_time = std::chrono::nanoseconds(stats.max_time.load(std::memory_order_relaxed));
+                return ret;
+            }
+
+        private:
+            struct thread_holder
+            {
+                ~thread_holder() noexcept
+                {
+                    if (this->rec)
+                    {
+                        //objects released from now on, including by the destructors run below, 
+                        //are destroyed immediately
+                        deferred_queue::exited() = true;
+                        deferred_queue::current_slot() = nullptr;
+                        this->rec->drain(std::numeric_limits<size_t>::max());
+                        this->rec->m_in_use.store(false, std::memory_order_release);
+                    }
+                }
+
+                deferred_queue * rec = nullptr;
+            };
+
+            struct drain_counters
+            {
+                std::atomic<uint64_t> drains{0};
+                std::atomic<int64_t> total_time{0};
+                std::atomic<int64_t> max_time{0};
+            };
+
+            static deferred_queue *& current_slot() noexcept
+            {
+                static thread_local deferred_queue * instance = nullptr;
+                return instance;
+            }
+
+            static bool & exited() noexcept
+            {
+                static thread_local bool instance = false;
+                return instance;
+            }
+
+            static std::atomic<deferred_queue *> & head() noexcept
+            {
+                static std::atomic<deferred_queue *> instance{nullptr};
+                return instance;
+            }
+
+            static drain_counters & drain_stats() noexcept
+            {
+                static drain_counters instance;
+                return instance;
+            }
+
+            static deferred_queue * acquire_current() noexcept
+            {
+                auto & slot = deferred_queue::current_slot();
+                if (!slot && !deferred_queue::exited())
+                {
+                    static thread_local thread_holder holder;
+                    holder.rec = slot = deferred_queue::acquire();
+                }
+                return slot;
+            }
+
+            static deferred_queue * acquire() noexcept
+            {
+                auto & list = deferred_queue::head();
+                for (auto rec = list.load(std::memory_order_acquire); rec; rec = rec->m_next)
+                {
+                    if (!rec->m_in_use.load(std::memory_order_relaxed) && !rec->m_in_use.exchange(true, std::memory_order_acquire))
+                        return rec;
+                }
+
+                auto rec = new (std::nothrow) deferred_queue;
+                if (!rec)
+                    return nullptr;
+                rec->m_next = list.load(std::memory_order_relaxed);
+                while (!list.compare_exchange_weak(rec->m_next, rec, std::memory_order_release, std::memory_order_relaxed))
+                {}
+                return rec;
+            }
+
+            //Records duration of a drain that started at start if it destroyed anything
+            static void record_drain(std::chrono::steady_clock::time_point start, size_t count) noexcept
+            {
+                if (count)
+                {
+                    int64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                    auto & stats = deferred_queue::drain_stats();
+                    stats.drains.fetch_add(1, std::memory_order_relaxed);
+                    stats.total_time.fetch_add(time, std::memory_order_relaxed);
+                    for (int64_t current = stats.max_time.load(std::memory_order_relaxed); current < time; )
+                    {
+                        if (stats.max_time.compare_exchange_weak(current, time, std::memory_order_relaxed, std::memory_order_relaxed))
+                            break;
+                    }
+                }
+            }
+
+            //Called by the owning thread
+            deferred_node * allocate_node() noexcept
+            {
+                if (!this->m_spare)
+                    this->m_spare = this->m_returned.exchange(nullptr, std::memory_order_acquire);
+                if (auto ret = this->m_spare)
+                {
+                    this->m_spare = ret->next;
+                    return ret;
+                }
+                return new (std::nothrow) deferred_node;
+            }
+
+            //Pushes a list of nodes from first to last. The list is popped in reverse order.
+            void splice(deferred_node * first, deferred_node * last) noexcept
+            {
+                last->next = this->m_head.load(std::memory_order_relaxed);
+                while (!this->m_head.compare_exchange_weak(last->next, first, std::memory_order_release, std::memory_order_relaxed))
+                {}
+            }
+
+            //Merges two lists ordered from oldest to newest
+            static deferred_node * merge(deferred_node * first, deferred_node * second) noexcept
+            {
+                deferred_node * ret = nullptr;
+                deferred_node ** tail = &ret;
+                while (first && second)
+                {
+                    auto & older = first->seq < second->seq ? first : second;
+                    *tail = older;
+                    tail = &older->next;
+                    older = older->next;
+                }
+                *tail = first ? first : second;
+                return ret;
+            }
+
+            //Keeps nodes that a drain did not get to so that the next drain destroys them before
+            //anything queued later
+            void put_back(deferred_node * oldest) noexcept
+            {
+                for ( ; ; )
+                {
+                    //another drain could have put back its own leftovers meanwhile
+                    oldest = merge(oldest, this->m_leftover.exchange(nullptr, std::memory_order_acquire));
+                    deferred_node * expected = nullptr;
+                    if (this->m_leftover.compare_exchange_strong(expected, oldest, std::memory_order_release, std::memory_order_relaxed))
+                        return;
+                }
+            }
+
+            //Destroys up to max_count objects queued so far in the order they were queued.
+            //Returns the number of destroyed objects.
+            size_t drain(size_t max_count) noexcept
+            {
+                if (!max_count || (!this->m_leftover.load(std::memory_order_relaxed) && !this->m_head.load(std::memory_order_relaxed)))
+                    return 0;
+                deferred_node * list = this->m_head.exchange(nullptr, std::memory_order_acquire);
+                deferred_node * oldest = nullptr;
+                while (list)
+                {
+                    auto next = list->next;
+                    list->next = oldest;
+                    oldest = list;
+                    list = next;
+                }
+                oldest = merge(this->m_leftover.exchange(nullptr, std::memory_order_acquire), oldest);
+
+                size_t ret = 0;
+                deferred_node * first_done = oldest;
+                deferred_node * last_done = nullptr;
+                for ( ; oldest && ret < max_count; ++ret)
+                {
+                    last_done = oldest;
+                    oldest = oldest->next;
+                    last_done->destroy(last_done->object);
+                }
+                this->m_destroyed.fetch_add(ret, std::memory_order_relaxed);
+                if (last_done)
+                {
+                    last_done->next = this->m_returned.load(std::memory_order_relaxed);
+                    while (!this->m_returned.compare_exchange_weak(last_done->next, first_done, std::memory_order_release, std::memory_order_relaxed))
+                    {}
+                }
+
+                if (oldest)
+                    this->put_back(oldest);
+                return ret;
+            }
+
+        private:
+            std::atomic<deferred_node *> m_head{nullptr};
+            //oldest first
+            std::atomic<deferred_node *> m_leftover{nullptr};
+            std::atomic<deferred_node *> m_returned{nullptr};
+            deferred_node * m_spare = nullptr;
+            std::atomic<uint64_t> m_pushed{0};
+            std::atomic<uint64_t> m_destroyed{0};
+            std::atomic<uint64_t> m_max_depth{0};
+            std::atomic<bool> m_in_use{true};
+            deferred_queue * m_next = nullptr;
+        };
+    }
+
+    //MARK:- Draining
+
+    //Destroys up to max_count objects whose destruction was deferred by the calling thread, including
+    //objects released by the destructors it runs. Suitable for idle hooks of event loops.
+    //Returns the number of destroyed objects.
+    ISPTR_EXPORTED
+    inline size_t drain_deferred_destroy(size_t max_count = std::numeric_limits<size_t>::max()) noexcept
+        { return internal::deferred_queue::drain_current(max_count); }
+
+    //Destroys all objects whose destruction was deferred by any thread.
+    //Returns the number of destroyed objects.
+    ISPTR_EXPORTED
+    inline size_t drain_all_deferred_destroy() noexcept
+        { return internal::deferred_queue::drain_all(); }
+
+    //Statistics of all deferred destruction queues
+    ISPTR_EXPORTED
+    inline deferred_destroy_snapshot deferred_destroy_stats() noexcept
+        { return internal::deferred_queue::snapshot(); }
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+#ifndef HEADER_DEFERRED_DESTROY_RECLAIMER_H_INCLUDED
+#define HEADER_DEFERRED_DESTROY_RECLAIMER_H_INCLUDED
+
+#include <intrusive_shared_ptr/deferred_destroy.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace isptr
+{
+    //MARK:- deferred_destroy_reclaimer
+
+    //Background thread that periodically drains all deferred destruction queues.
+    //The destructor stops the thread and drains the queues once more.
+    ISPTR_EXPORTED
+    class deferred_destroy_reclaimer
+    {
+    public:
+        explicit deferred_destroy_reclaimer(std::chrono::milliseconds interval = std::chrono::milliseconds(10)):
+            m_interval(interval),
+            m_thread(&deferred_destroy_reclaimer::run, this)
+        {}
+
+        ~deferred_destroy_reclaimer() noexcept
+        {
+            {
+                std::lock_guard<std::mutex> guard(this->m_mutex);
+                this->m_stop = true;
+            }
+            this->m_cond.notify_one();
+            this->m_thread.join();
+            //the thread could have been stopped in the middle of a drain
+            drain_all_deferred_destroy();
+        }
+
+        deferred_destroy_reclaimer(const deferred_destroy_reclaimer &) = delete;
+        deferred_destroy_reclaimer & operator=(const deferred_destroy_reclaimer &) = delete;
+
+        //Makes the reclaimer drain the queues without waiting for the interval to pass
+        void wake() noexcept
+        {
+            {
+                std::lock_guard<std::mutex> guard(this->m_mutex);
+                this->m_woken = true;
+            }
+            this->m_cond.notify_one();
+        }
+
+    private:
+        void run() noexcept
+        {
+            std::unique_lock<std::mutex> lock(this->m_mutex);
+            while (!this->m_stop)
+            {
+                if (!this->m_woken)
+                    this->m_cond.wait_for(lock, this->m_interval);
+                this->m_woken = false;
+                lock.unlock();
+                drain_all_deferred_destroy();
+                lock.lock();
+            }
+        }
+
+    private:
+        const std::chrono::milliseconds m_interval;
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+        bool m_stop = false;
+        bool m_woken = false;
+        std::thread m_thread;
+    };
+}
+
+#endif
@@ -0,0 +1,431 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+#ifndef HEADER_HAZARD_POINTER_H_INCLUDED
+#define HEADER_HAZARD_POINTER_H_INCLUDED
+
+#include <intrusive_shared_ptr/intrusive_shared_ptr.h>
+
+#include <atomic>
+#include <cassert>
+#include <new>
+
+namespace isptr
+{
+    ISPTR_EXPORTED
+    template<class T>
+    class hazard_guard;
+
+    //MARK:- hazard_domain
+
+    ISPTR_EXPORTED
+    class hazard_domain
+    {
+    template<class T> friend class hazard_guard;
+    public:
+        using reclaimer = void (*)(void *) noexcept;
+
+        static constexpr size_t default_reclaim_threshold = 16;
+
+    private:
+        struct record
+        {
+            std::atomic<const void *> hazard{nullptr};
+            std::atomic<bool> active{true};
+            record * next = nullptr;
+        };
+
+        struct retired
+        {
+            void * ptr;
+            reclaimer reclaim;
+            retired * next;
+        };
+
+        //Free records of the global domain cached by each thread. Other domains can be
+        //destroyed while threads still run so their records are not cached.
+        struct thread_cache
+        {
+            static constexpr unsigned capacity = 4;
+
+            ~thread_cache() noexcept
+            {
+                for (unsigned i = 0; i < this->count; ++i)
+                    this->records[i]->active.store(false, std::memory_order_release);
+            }
+
+            record * records[capacity];
+            unsigned count = 0;
+        };
+
+    public:
+        explicit hazard_domain(size_t reclaim_threshold = default_reclaim_threshold) noexcept:
+            m_reclaim_threshold(reclaim_threshold)
+        {}
+        hazard_domain(const hazard_domain &) = delete;
+        hazard_domain & operator=(const hazard_domain &) = delete;
+        ~hazard_domain() noexcept;
+
+        //The default domain. It is never destroyed.
+        static hazard_domain & global() noexcept
+        {
+            static hazard_domain * instance = new hazard_domain();
+            return *instance;
+        }
+
+        //Calls reclaim(ptr) once no hazard guard protects ptr
+        void retire(void * ptr, reclaimer reclaim) noexcept;
+
+        //Calls Traits::sub_ref(ptr) once no hazard guard protects ptr
+        template<class Traits, class T>
+        void retire_ref(T * ptr) noexcept
+        {
+            using mutable_type = std::remove_cv_t<T>;
+            this->retire(const_cast<mutable_type *>(ptr), [](void * p) noexcept {
+                Traits::sub_ref(static_cast<T *>(static_cast<mutable_type *>(p)));
+            });
+        }
+
+        //Reclaims all retired pointers that are not currently protected
+        void reclaim() noexcept;
+
+    private:
+        record * acquire_record();
+        void release_record(record * rec) noexcept;
+        bool is_protected(const void * ptr) const noexcept;
+
+        static thread_cache & this_thread_cache() noexcept
+        {
+            static thread_local thread_cache cache;
+            return cache;
+        }
+
+    private:
+        std::atomic<record *> m_records{nullptr};
+        std::atomic<retired *> m_retired{nullptr};
+        std::atomic<size_t> m_retired_count{0};
+        const size_t m_reclaim_threshold;
+    };
+
+    //MARK:- hazard_guard
+
+    ISPTR_EXPORTED
+    template<class T>
+    class hazard_guard
+    {
+    template<class X, class Traits> friend class hazard_atomic_ptr;
+    public:
+        constexpr hazard_guard() noexcept = default;
+        hazard_guard(hazard_guard && src) noexcept:
+            m_domain(src.m_domain),
+            m_record(src.m_record),
+            m_p(src.m_p)
+        {
+            src.m_record = nullptr;
+            src.m_p = nullptr;
+        }
+        hazard_guard & operator=(hazard_guard && src) noexcept
+        {
+            if (this != &src)
+            {
+                this->reset();
+                this->m_domain = src.m_domain;
+                this->m_record = src.m_record;
+                this->m_p = src.m_p;
+                src.m_record = nullptr;
+                src.m_p = nullptr;
+            }
+            return *this;
+        }
+        ~hazard_guard() noexcept
+            { this->reset(); }
+
+        T * get() const noexcept
+            { return this->m_p; }
+        T * operator->() const noexcept
+            { return this->m_p; }
+        template<class X=T>
+        std::enable_if_t<std::is_same_v<X, T>,
+        X &> operator*() const noexcept
+            { return *this->m_p; }
+        explicit operator bool() const noexcept
+            { return this->m_p; }
+
+        void reset() noexcept
+        {
+            if (this->m_record)
+            {
+                this->m_record->hazard.store(nullptr, std::memory_order_release);
+                this->m_domain->release_record(this->m_record);
+                this->m_record = nullptr;
+            }
+            this->m_p = nullptr;
+        }
+
+    private:
+        //Publishes the value of source in a hazard record, retrying until it is stable
+        hazard_guard(hazard_domain & domain, const std::atomic<T *> & source):
+            m_domain(&domain),
+            m_record(domain.acquire_record())
+        {
+            T * p = source.load(std::memory_order_relaxed);
+            for ( ; ; )
+            {
+                this->m_record->hazard.store(p, std::memory_order_seq_cst);
+                T * current = source.load(std::memory_order_seq_cst);
+                if (current == p)
+                    break;
+                p = current;
+            }
+            this->m_p = p;
+        }
+
+    private:
+        hazard_domain * m_domain = nullptr;
+        hazard_domain::record * m_record = nullptr;
+        T * m_p = nullptr;
+    };
+
+    //MARK:- hazard_atomic_ptr
+
+    ISPTR_EXPORTED
+    template<class T, class Traits>
+    class hazard_atomic_ptr
+    {
+    public:
+        using value_type = intrusive_shared_ptr<T, Traits>;
+        using guard_type = hazard_guard<T>;
+
+    public:
+        hazard_atomic_ptr() noexcept:
+            m_domain(&hazard_domain::global())
+        {}
+        explicit hazard_atomic_ptr(hazard_domain & domain) noexcept:
+            m_domain(&domain)
+        {}
+        hazard_atomic_ptr(value_type desired, hazard_domain & domain = hazard_domain::global()) noexcept:
+            m_p(publish(desired)),
+            m_domain(&domain)
+        {}
+
+        hazard_atomic_ptr(const hazard_atomic_ptr &) = delete;
+        hazard_atomic_ptr & operator=(const hazard_atomic_ptr &) = delete;
+
+        ~hazard_atomic_ptr() noexcept
+        {
+            if (T * p = this->m_p.load(std::memory_order_relaxed))
+                this->m_domain->template retire_ref<Traits>(p);
+        }
+
+        value_type operator=(value_type desired) noexcept
+        {
+            this->store(desired);
+            return desired;
+        }
+
+        //Borrows the current value without changing its reference count.
+        //The value stays alive at least until the guard is destroyed or reset.
+        guard_type protect() const
+            { return guard_type(*this->m_domain, this->m_p); }
+
+        value_type load() const
+        {
+            auto guard = this->protect();
+            return value_type::ref(guard.get());
+        }
+
+        operator value_type() const
+            { return this->load(); }
+
+        void store(value_type desired) noexcept
+        {
+            T * old = this->m_p.exchange(publish(desired), std::memory_order_acq_rel);
+            if (old)
+                this->m_domain->template retire_ref<Traits>(old);
+        }
+
+        value_type exchange(value_type desired) noexcept
+        {
+            T * old = this->m_p.exchange(publish(desired), std::memory_order_acq_rel);
+            //readers may still use the old value so our reference is retired and the caller gets a new one
+            auto ret = value_type::ref(old);
+            if (old)
+                this->m_domain->template retire_ref<Traits>(old);
+            return ret;
+        }
+
+        bool compare_exchange_strong(value_type & expected, value_type desired)
+        {
+            internal::publish<Traits>(desired.get());
+            for ( ; ; )
+            {
+                T * current = expected.get();
+                if (this->m_p.compare_exchange_strong(current, desired.get(), std::memory_order_acq_rel, std::memory_order_relaxed))
+                {
+                    desired.release();
+                    if (current)
+                        this->m_domain->template retire_ref<Traits>(current);
+                    return true;
+                }
+                //current cannot be dereferenced so reload safely. If the value changed back to
+                //expected meanwhile, failing would be spurious.
+                auto loaded = this->load();
+                if (loaded != expected)
+                {
+                    expected = std::move(loaded);
+                    return false;
+                }
+            }
+        }
+
+        hazard_domain & domain() const noexcept
+            { return *this->m_domain; }
+
+    private:
+        //Objects stored here become reachable from other threads
+        static T * publish(value_type & desired) noexcept
+        {
+            internal::publish<Traits>(desired.get());
+            return desired.release();
+        }
+
+    private:
+        std::atomic<T *> m_p{nullptr};
+        hazard_domain * m_domain;
+    };
+
+    //MARK:- Implementation
+
+    inline hazard_domain::~hazard_domain() noexcept
+    {
+        //reclaimers can retire more pointers which looks at the records so those are freed last
+        while (auto node = this->m_retired.exchange(nullptr, std::memory_order_acquire))
+        {
+            while (node)
+            {
+                auto next = node->next;
+                node->reclaim(node->ptr);
+                delete node;
+                node = next;
+            }
+        }
+        for (auto rec = this->m_records.exchange(nullptr, std::memory_order_acquire); rec; )
+        {
+            assert(!rec->active.load(std::memory_order_relaxed) || rec->hazard.load(std::memory_order_relaxed) == nullptr);
+            auto next = rec->next;
+            delete rec;
+            rec = next;
+        }
+    }
+
+    inline auto hazard_domain::acquire_record() -> record *
+    {
+        if (this == &hazard_domain::global())
+        {
+            auto & cache = hazard_domain::this_thread_cache();
+            if (cache.count)
+                return cache.records[--cache.count];
+        }
+
+        for (auto rec = this->m_records.load(std::memory_order_acquire); rec; rec = rec->next)
+        {
+            if (!rec->active.load(std::memory_order_relaxed) && !rec->active.exchange(true, std::memory_order_acquire))
+                return rec;
+        }
+
+        auto rec = new record;
+        rec->next = this->m_records.load(std::memory_order_relaxed);
+        while (!this->m_records.compare_exchange_weak(rec->next, rec, std::memory_order_release, std::memory_order_relaxed))
+        {}
+        return rec;
+    }
+
+    inline void hazard_domain::release_record(record * rec) noexcept
+    {
+        if (this == &hazard_domain::global())
+        {
+            auto & cache = hazard_domain::this_thread_cache();
+            if (cache.count < thread_cache::capacity)
+            {
+                cache.records[cache.count++] = rec;
+                return;
+            }
+        }
+        rec->active.store(false, std::memory_order_release);
+    }
+
+    inline bool hazard_domain::is_protected(const void * ptr) const noexcept
+    {
+        for (auto rec = this->m_records.load(std::memory_order_acquire); rec; rec = rec->next)
+        {
+            if (rec->hazard.load(std::memory_order_seq_cst) == ptr)
+                return true;
+        }
+        return false;
+    }
+
+    inline void hazard_domain::retire(void * ptr, reclaimer reclaim) noexcept
+    {
+        auto node = new (std::nothrow) retired{ptr, reclaim, nullptr};
+        if (!node)
+        {
+            //out of memory: wait for the readers instead
+            for (internal::spin_backoff backoff; this->is_protected(ptr); )
+                backoff();
+            reclaim(ptr);
+            return;
+        }
+        node->next = this->m_retired.load(std::memory_order_relaxed);
+        while (!this->m_retired.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+        {}
+        if (this->m_retired_count.fetch_add(1, std::memory_order_relaxed) + 1 >= this->m_reclaim_threshold)
+            this->reclaim();
+    }
+
+    inline void hazard_domain::reclaim() noexcept
+    {
+        //Take the whole list so reclaimers can safely retire more pointers
+        auto node = this->m_retired.exchange(nullptr, std::memory_order_acquire);
+        if (!node)
+            return;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        retired * keep = nullptr;
+        retired * keep_tail = nullptr;
+        size_t kept = 0;
+        size_t taken = 0;
+        while (node)
+        {
+            auto next = node->next;
+            ++taken;
+            if (this->is_protected(node->ptr))
+            {
+                node->next = keep;
+                keep = node;
+                if (!keep_tail)
+                    keep_tail = node;
+                ++kept;
+            }
+            else
+            {
+                node->reclaim(node->ptr);
+                delete node;
+            }
+            node = next;
+        }
+        this->m_retired_count.fetch_sub(taken - kept, std::memory_order_relaxed);
+        if (keep)
+        {
+            keep_tail->next = this->m_retired.load(std::memory_order_relaxed);
+            while (!this->m_retired.compare_exchange_weak(keep_tail->next, keep, std::memory_order_release, std::memory_order_relaxed))
+            {}
+        }
+    }
+}
+
+#endif
@@ -15,6 +15,10 @@
 #include <ostream>
 #include <atomic>
 #include <memory>
+#include <thread>
+#include <cassert>
+#include <cstdint>
+#include <iterator>
 
 
 namespace isptr
@@ -35,6 +39,30 @@ namespace isptr
             auto operator()(Traits *, T * p) noexcept(noexcept(Traits::sub_ref(p))) -> decltype(Traits::sub_ref(p));
         };
 
+        struct add_ref_n_detector
+        {
+            template<class Traits, class T>
+            auto operator()(Traits * , T * p) noexcept(noexcept(Traits::add_ref_n(p, size_t(1)))) -> decltype(Traits::add_ref_n(p, size_t(1)));
+        };
+
+        struct sub_ref_n_detector
+        {
+            template<class Traits, class T>
+            auto operator()(Traits *, T * p) noexcept(noexcept(Traits::sub_ref_n(p, size_t(1)))) -> decltype(Traits::sub_ref_n(p, size_t(1)));
+        };
+
+        struct publish_detector
+        {
+            template<class Traits, class T>
+            auto operator()(Traits *, T * p) noexcept(noexcept(Traits::publish(p))) -> decltype(Traits::publish(p));
+        };
+
+        struct is_referenced_detector
+        {
+            template<class Traits, class T>
+            auto operator()(Traits *, T * p) noexcept(noexcept(Traits::is_referenced(p))) -> decltype(Traits::is_referenced(p));
+        };
+
     }
 
     template<class Traits, class T>
@@ -48,8 +76,6 @@ namespace isptr
     {
         static_assert(are_intrusive_shared_traits<Traits, T>, "Invalid Traits for type T");
         
-        friend std::atomic<intrusive_shared_ptr<T, Traits>>;
-
     #if ISPTR_SUPPORT_OUT_PTR
         friend std::out_ptr_t<intrusive_shared_ptr<T, Traits>, T *>;
         friend std::inout_ptr_t<intrusive_shared_ptr<T, Traits>, T *>;
@@ -398,63 +424,941 @@ namespace isptr
     std::enable_if_t<is_intrusive_shared_ptr_v<Dest> && std::is_same_v<typename Dest::traits_type, Traits>,
     Dest> intrusive_static_cast(intrusive_shared_ptr<Src, Traits> p) noexcept
         { return Dest::noref(static_cast<typename Dest::pointer>(p.release())); }
+
+    //MARK:- Batched operations
+
+    namespace internal
+    {
+        //Adds n references to p via Traits::add_ref_n if available or one by one otherwise
+        template<class Traits, class T>
+        void add_refs(T * p, size_t n) noexcept
+        {
+            if constexpr (std::is_nothrow_invocable_v<add_ref_n_detector, Traits *, T *>)
+                Traits::add_ref_n(p, n);
+            else
+                for ( ; n; --n)
+                    Traits::add_ref(p);
+        }
+
+        //Removes n references from p via Traits::sub_ref_n if available or one by one otherwise
+        template<class Traits, class T>
+        void sub_refs(T * p, size_t n) noexcept
+        {
+            if constexpr (std::is_nothrow_invocable_v<sub_ref_n_detector, Traits *, T *>)
+                Traits::sub_ref_n(p, n);
+            else
+                for ( ; n; --n)
+                    Traits::sub_ref(p);
+        }
+
+        //Tells p that it is about to become reachable from other threads via Traits::publish if available
+        template<class Traits, class T>
+        void publish(T * p) noexcept
+        {
+            if constexpr (std::is_nothrow_invocable_v<publish_detector, Traits *, T *>)
+            {
+                if (p)
+                    Traits::publish(p);
+            }
+        }
+    }
+
+    //MARK:- borrowed_ptr
+
+    namespace internal
+    {
+        //Whether p still has references according to Traits::is_referenced. True if Traits cannot tell.
+        template<class Traits, class T>
+        bool is_referenced(T * p) noexcept
+        {
+            if constexpr (std::is_nothrow_invocable_v<is_referenced_detector, Traits *, T *>)
+                return Traits::is_referenced(p);
+            else
+                return true;
+        }
+    }
+
+    //A non-owning pointer to an object kept alive by an intrusive_shared_ptr elsewhere. It is trivially copyable 
+    //and creating, copying or destroying it does not change the reference count, which makes it a cheap parameter 
+    //type. The caller must keep an owning pointer alive while it is used. Debug builds assert on every access 
+    //that the object still has references if Traits provides is_referenced(p).
+    ISPTR_EXPORTED
+    template<class T, class Traits>
+    class borrowed_ptr
+    {
+        static_assert(are_intrusive_shared_traits<Traits, T>, "Invalid Traits for type T");
+
+    public:
+        using pointer = T *;
+        using element_type = T;
+        using traits_type = Traits;
+        using owning_ptr = intrusive_shared_ptr<T, Traits>;
+
+    public:
+        constexpr borrowed_ptr() noexcept = default;
+        constexpr borrowed_ptr(std::nullptr_t) noexcept
+            {}
+        template<class Y, class = std::enable_if_t<std::is_convertible_v<Y *, T *>, void>>
+        constexpr borrowed_ptr(const intrusive_shared_ptr<Y, Traits> & src) noexcept : m_p(src.get())
+            {}
+        //A temporary would be destroyed while still borrowed
+        template<class Y, class = std::enable_if_t<std::is_convertible_v<Y *, T *>, void>>
+        borrowed_ptr(intrusive_shared_ptr<Y, Traits> && src) = delete;
+        template<class Y, class = std::enable_if_t<std::is_convertible_v<Y *, T *> && !std::is_same_v<Y, T>, void>>
+        constexpr borrowed_ptr(borrowed_ptr<Y, Traits> src) noexcept : m_p(src.get())
+            {}
+
+        constexpr T * get() const noexcept
+        { 
+            this->check();
+            return this->m_p; 
+        }
+
+        constexpr T * operator->() const noexcept
+            { return this->get(); }
+
+        template<class X=T>
+        constexpr
+        std::enable_if_t<std::is_same_v<X, T>,
+        X &> operator*() const noexcept
+            { return *this->get(); }
+
+        constexpr explicit operator bool() const noexcept
+            { return this->m_p; }
+
+        //Promotes to an owning pointer
+        constexpr owning_ptr ref() const noexcept
+            { return owning_ptr::ref(this->get()); }
+
+        template<class Y>
+        friend constexpr bool operator==(borrowed_ptr lhs, borrowed_ptr<Y, Traits> rhs) noexcept
+            { return lhs.m_p == rhs.m_p; }
+
+        template<class Y, class YTraits>
+        friend constexpr bool operator==(borrowed_ptr lhs, const intrusive_shared_ptr<Y, YTraits> & rhs) noexcept
+            { return lhs.m_p == rhs.get(); }
+
+        template<class Y, class YTraits>
+        friend constexpr bool operator==(const intrusive_shared_ptr<Y, YTraits> & lhs, borrowed_ptr rhs) noexcept
+            { return lhs.get() == rhs.m_p; }
+
+        friend constexpr bool operator==(borrowed_ptr lhs, std::nullptr_t) noexcept
+            { return lhs.m_p == nullptr; }
+
+        friend constexpr bool operator==(std::nullptr_t, borrowed_ptr rhs) noexcept
+            { return nullptr == rhs.m_p; }
+
+        template<class Y>
+        friend constexpr bool operator!=(borrowed_ptr lhs, borrowed_ptr<Y, Traits> rhs) noexcept
+            { return !(lhs == rhs); }
+
+        template<class Y, class YTraits>
+        friend constexpr bool operator!=(borrowed_ptr lhs, const intrusive_shared_ptr<Y, YTraits> & rhs) noexcept
+            { return !(lhs == rhs); }
+
+        template<class Y, class YTraits>
+        friend constexpr bool operator!=(const intrusive_shared_ptr<Y, YTraits> & lhs, borrowed_ptr rhs) noexcept
+            { return !(lhs == rhs); }
+
+        friend constexpr bool operator!=(borrowed_ptr lhs, std::nullptr_t) noexcept
+            { return !(lhs == nullptr); }
+
+        friend constexpr bool operator!=(std::nullptr_t, borrowed_ptr rhs) noexcept
+            { return !(nullptr == rhs); }
+
+    private:
+        template<class Y, class YTraits> friend class borrowed_ptr;
+
+        constexpr void check() const noexcept
+            { assert(!this->m_p || internal::is_referenced<Traits>(this->m_p)); }
+
+    private:
+        T * m_p = nullptr;
+    };
+
+    //Resets count pointers starting at ptrs. Adjacent pointers to the same object are released 
+    //with a single Traits::sub_ref_n(p, n) call if Traits provides it.
+    ISPTR_EXPORTED
+    template<class T, class Traits>
+    void release_all(intrusive_shared_ptr<T, Traits> * ptrs, size_t count) noexcept
+    {
+        for (size_t i = 0; i < count; )
+        {
+            T * p = ptrs[i].release();
+            size_t run = 1;
+            for ( ; i + run < count && ptrs[i + run].get() == p; ++run)
+                ptrs[i + run].release();
+            i += run;
+            if (p)
+                internal::sub_refs<Traits>(p, run);
+        }
+    }
+
+    //Same as above for a contiguous range such as std::vector, std::array or std::span
+    ISPTR_EXPORTED
+    template<class Range>
+    auto release_all(Range && ptrs) noexcept -> decltype(release_all(std::data(ptrs), std::size(ptrs)))
+        { release_all(std::data(ptrs), std::size(ptrs)); }
+
+    //Assigns count pointers starting at src to the ones starting at dest. Adjacent pointers in src 
+    //to the same object are counted with a single Traits::add_ref_n(p, n) call if Traits provides it.
+    //Previous values of dest are released as if by release_all. The ranges must not overlap.
+    ISPTR_EXPORTED
+    template<class T, class Traits>
+    void ref_all(const intrusive_shared_ptr<T, Traits> * src, intrusive_shared_ptr<T, Traits> * dest, size_t count) noexcept
+    {
+        release_all(dest, count);
+        for (size_t i = 0; i < count; )
+        {
+            T * p = src[i].get();
+            size_t run = 1;
+            for ( ; i + run < count && src[i + run].get() == p; ++run)
+            {}
+            if (p)
+                internal::add_refs<Traits>(p, run);
+            for (size_t end = i + run; i < end; ++i)
+                dest[i] = intrusive_shared_ptr<T, Traits>::noref(p);
+        }
+    }
+
+    //Same as above for contiguous ranges of equal size such as std::vector, std::array or std::span
+    ISPTR_EXPORTED
+    template<class SrcRange, class DestRange>
+    auto ref_all(const SrcRange & src, DestRange && dest) noexcept -> decltype(ref_all(std::data(src), std::data(dest), std::size(src)))
+    {
+        assert(std::size(src) == std::size(dest));
+        ref_all(std::data(src), std::data(dest), std::size(src));
+    }
 }
 
 namespace isptr 
 {
     namespace internal
     {
-        class simple_lock {
+        inline void spin_yield() noexcept 
+        {
+            #ifdef ISPTR_THREAD_YIELD
+                ISPTR_THREAD_YIELD;
+            #endif
+        }
+
+        //Spins for a while and then starts yielding the thread to the OS scheduler
+        class spin_backoff
+        {
         public:
-            void lock() noexcept 
+            void operator()() noexcept
+            {
+                if (this->m_count < spin_backoff::max_spins) 
+                {
+                    ++this->m_count;
+                    spin_yield();
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+        private:
+            static constexpr unsigned max_spins = 64;
+            unsigned m_count = 0;
+        };
+
+        //A small per-thread number used to spread threads over per-object slots
+        inline unsigned this_thread_slot() noexcept
+        {
+            static std::atomic<unsigned> next{0};
+            static thread_local unsigned slot = next.fetch_add(1, std::memory_order_relaxed);
+            return slot;
+        }
+    }
+
+    //MARK:- spin_lock
+
+    //SpinBudget of a spin_lock that never parks
+    ISPTR_EXPORTED
+    inline constexpr unsigned unlimited_spin_budget = ~0u;
+
+    //Spins with exponential backoff for up to SpinBudget pauses and then parks the thread 
+    //until the owner unlocks. The state is 0 when unlocked, 1 when locked and 2 when locked 
+    //with (possibly) parked waiters so that uncontended unlock never needs to wake anyone.
+    //With unlimited_spin_budget it spins until the lock is free, as atomic operations 
+    //did before parking was introduced, and the state is never 2.
+    //If Stats is not void its static members are called to record acquisitions and contention
+    //(see lock_contention.h). Otherwise no extra code is generated.
+    ISPTR_EXPORTED
+    template<unsigned SpinBudget = 128, class Stats = void>
+    class spin_lock 
+    {
+    public:
+        static constexpr unsigned spin_budget = SpinBudget;
+        using stats_type = Stats;
+
+        void lock() noexcept 
+        {
+            unsigned current = 0;
+            if (this->m_value.compare_exchange_strong(current, 1, std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                if constexpr (!std::is_void_v<Stats>)
+                    Stats::record_acquisition();
+                return;
+            }
+
+            if constexpr (std::is_void_v<Stats>)
+            {
+                this->lock_contended();
+            }
+            else
+            {
+                auto token = Stats::begin_contention();
+                auto result = this->lock_contended();
+                Stats::end_contention(token, result.spins, result.parks);
+            }
+        }
+
+        bool try_lock() noexcept 
+        {
+            unsigned current = 0;
+            bool ret = this->m_value.compare_exchange_strong(current, 1, std::memory_order_acquire, std::memory_order_relaxed);
+            if constexpr (!std::is_void_v<Stats>)
+            {
+                if (ret)
+                    Stats::record_acquisition();
+            }
+            return ret;
+        }
+
+        void unlock() noexcept 
+        { 
+            if constexpr (SpinBudget == unlimited_spin_budget)
             {
-                for ( ; ; ) {
-                    
-                    while (m_value.load(std::memory_order_relaxed)) 
-                        yield();
-                    
+                this->m_value.store(0, std::memory_order_release);
+            }
+            else if (this->m_value.exchange(0, std::memory_order_release) == 2)
+            {
+            #if ISPTR_USE_ATOMIC_WAIT
+                this->m_value.notify_one();
+            #endif
+            }
+        }
+
+    private:
+        struct contention
+        {
+            unsigned spins;
+            unsigned parks;
+        };
+
+        contention lock_contended() noexcept
+        {
+            contention ret = {0, 0};
+            if constexpr (SpinBudget == unlimited_spin_budget)
+            {
+                for ( ; ; )
+                {
+                    while (this->m_value.load(std::memory_order_relaxed))
+                    {
+                        internal::spin_yield();
+                        ++ret.spins;
+                    }
                     unsigned current = 0;
-                    if (m_value.compare_exchange_strong(current, 1, std::memory_order_acquire, std::memory_order_relaxed))
-                        return;
+                    if (this->m_value.compare_exchange_weak(current, 1, std::memory_order_acquire, std::memory_order_relaxed))
+                        return ret;
+                }
+            }
+            else
+            {
+                for (unsigned delay = 1; ret.spins < SpinBudget; ) 
+                {
+                    for (unsigned i = 0; i < delay; ++i)
+                        internal::spin_yield();
+                    ret.spins += delay;
+                    if (delay < spin_lock::max_delay)
+                        delay *= 2;
                 
-                    yield();
+                    unsigned current = this->m_value.load(std::memory_order_relaxed);
+                    if (current == 0 && this->m_value.compare_exchange_weak(current, 1, std::memory_order_acquire, std::memory_order_relaxed))
+                        return ret;
                 }
+
+                //Taking the lock in state 2 is conservative: unlock() may do a spurious notify
+                while (this->m_value.exchange(2, std::memory_order_acquire) != 0)
+                {
+                    ++ret.parks;
+                #if ISPTR_USE_ATOMIC_WAIT
+                    this->m_value.wait(2, std::memory_order_relaxed);
+                #else
+                    std::this_thread::yield();
+                #endif
+                }
+                return ret;
             }
+        }
 
-            void unlock() noexcept 
-                { m_value.store(0, std::memory_order_release); }
+    private:
+        static constexpr unsigned max_delay = 32;
 
+        std::atomic<unsigned> m_value{0};
+    };
+
+    //Lock that only spins. Unlike spin_lock<> it never parks waiting threads.
+    ISPTR_EXPORTED
+    using pure_spin_lock = spin_lock<unlimited_spin_budget>;
+
+    //MARK:- Atomic policies
+
+    ISPTR_EXPORTED
+    template<class Lock = spin_lock<>>
+    struct locked_atomic_policy 
+    {};
+
+    ISPTR_EXPORTED
+    struct lock_free_atomic_policy 
+    {};
+
+    ISPTR_EXPORTED
+    template<unsigned ReaderSlots = 16, class Lock = spin_lock<>>
+    struct read_mostly_atomic_policy
+    {};
+
+    ISPTR_EXPORTED
+    template<unsigned Stripes = 64, class Lock = spin_lock<>>
+    struct striped_atomic_policy
+    {};
+
+    ISPTR_EXPORTED
+    using default_atomic_policy = std::conditional_t<ISPTR_USE_LOCK_FREE_ATOMIC, lock_free_atomic_policy, locked_atomic_policy<>>;
+
+    namespace internal 
+    {
+        //Raw storage for atomic_intrusive_shared_ptr. All operations transfer
+        //references via raw pointers: load() returns a pointer with a reference added,
+        //exchange() consumes the reference of its argument and returns the previous one
+        template<class T, class Traits, class Policy>
+        class atomic_storage;
+
+        template<class T, class Traits, class Lock>
+        class atomic_storage<T, Traits, locked_atomic_policy<Lock>>
+        {
+        public:
+            static constexpr bool is_always_lock_free = false;
+
+            constexpr atomic_storage() noexcept = default;
+            constexpr atomic_storage(T * p) noexcept : m_p(p)
+                {}
+            atomic_storage(const atomic_storage &) = delete;
+            atomic_storage & operator=(const atomic_storage &) = delete;
+            ~atomic_storage() noexcept
+            { 
+                if (T * p = this->m_p.load(std::memory_order_relaxed)) 
+                    Traits::sub_ref(p); 
+            }
+
+            bool is_lock_free() const noexcept
+                { return false; }
+
+            T * load() const noexcept
+            {
+                this->m_lock.lock();
+                T * ret = this->m_p.load(std::memory_order_relaxed);
+                if (ret) Traits::add_ref(ret);
+                this->m_lock.unlock();
+                return ret;
+            }
+
+            T * exchange(T * desired) noexcept
+            {
+                this->m_lock.lock();
+                T * ret = this->m_p.load(std::memory_order_relaxed);
+                this->m_p.store(desired, std::memory_order_relaxed);
+                this->m_lock.unlock();
+                return ret;
+            }
+
+            //On success the storage takes over the reference held by desired and releases the previous value.
+            //On failure actual receives the current value with a reference added.
+            bool compare_exchange(T * expected, T * desired, T *& actual) noexcept
+            {
+                this->m_lock.lock();
+                T * current = this->m_p.load(std::memory_order_relaxed);
+                if (current == expected) {
+                    this->m_p.store(desired, std::memory_order_relaxed);
+                    this->m_lock.unlock();
+                    if (current) Traits::sub_ref(current);
+                    return true;
+                } 
+                if (current) Traits::add_ref(current);
+                this->m_lock.unlock();
+                actual = current;
+                return false;
+            }
+
+            //Calls func with the current value kept alive but without adding a reference.
+            //func must be short and must not access this storage.
+            template<class Func>
+            auto borrow(Func && func) const noexcept
+            {
+                static_assert(std::is_nothrow_invocable_v<Func, T *>, "func must be noexcept");
+                auto & lock = this->m_lock;
+                lock.lock();
+                auto ret = std::forward<Func>(func)(this->m_p.load(std::memory_order_relaxed));
+                lock.unlock();
+                return ret;
+            }
+
+        #if ISPTR_USE_ATOMIC_WAIT
+            void wait(T * old) const noexcept
+                { this->m_p.wait(old, std::memory_order_acquire); }
+            void notify_one() noexcept
+                { this->m_p.notify_one(); }
+            void notify_all() noexcept
+                { this->m_p.notify_all(); }
+        #endif
         private:
-            static void yield() noexcept {
-                #ifdef ISPTR_THREAD_YIELD
-                    ISPTR_THREAD_YIELD;
-                #endif
+            mutable Lock m_lock;
+            //Only modified under the lock. It is atomic so that waiting can be done without it.
+            std::atomic<T *> m_p{nullptr};
+        };
+
+        //A fixed table of Items, each on its own cache line, shared by all storages with the same
+        //Stripes and Item. Storage addresses are hashed to pick an item.
+        template<unsigned Stripes, class Item>
+        class striped_table
+        {
+            static_assert(Stripes > 0 && (Stripes & (Stripes - 1)) == 0, "number of stripes must be a power of 2");
+        public:
+            static Item & item_for(const void * address) noexcept
+            {
+                if constexpr (Stripes == 1)
+                {
+                    return s_items[0].value;
+                }
+                else
+                {
+                    //Fibonacci hashing spreads adjacent addresses over distant stripes
+                    uint64_t hash = uint64_t(reinterpret_cast<uintptr_t>(address) / alignof(void *)) * 0x9E3779B97F4A7C15u;
+                    return s_items[hash >> (64 - striped_table::stripe_bits)].value;
+                }
+            }
+        private:
+            static constexpr unsigned log2(unsigned value) noexcept
+                { return value > 1 ? 1 + log2(value / 2) : 0; }
+
+            static constexpr unsigned stripe_bits = log2(Stripes);
+
+            //each item on its own line so that contention on one stripe does not slow down the others
+            static inline cache_line_padded<Item> s_items[Stripes];
+        };
+
+        //Storage that keeps only the pointer. Operations lock one of the Stripes locks shared by all 
+        //such storages, chosen by the storage address.
+        template<class T, class Traits, unsigned Stripes, class Lock>
+        class atomic_storage<T, Traits, striped_atomic_policy<Stripes, Lock>>
+        {
+            using lock_table = striped_table<Stripes, Lock>;
+        public:
+            static constexpr bool is_always_lock_free = false;
+
+            constexpr atomic_storage() noexcept = default;
+            constexpr atomic_storage(T * p) noexcept : m_p(p)
+                {}
+            atomic_storage(const atomic_storage &) = delete;
+            atomic_storage & operator=(const atomic_storage &) = delete;
+            ~atomic_storage() noexcept
+            { 
+                if (T * p = this->m_p.load(std::memory_order_relaxed)) 
+                    Traits::sub_ref(p); 
             }
+
+            bool is_lock_free() const noexcept
+                { return false; }
+
+            T * load() const noexcept
+            {
+                auto & lock = lock_table::item_for(this);
+                lock.lock();
+                T * ret = this->m_p.load(std::memory_order_relaxed);
+                if (ret) Traits::add_ref(ret);
+                lock.unlock();
+                return ret;
+            }
+
+            T * exchange(T * desired) noexcept
+            {
+                auto & lock = lock_table::item_for(this);
+                lock.lock();
+                T * ret = this->m_p.load(std::memory_order_relaxed);
+                this->m_p.store(desired, std::memory_order_relaxed);
+                lock.unlock();
+                return ret;
+            }
+
+            //The previous value is released after unlocking since its destruction may
+            //access another storage that maps to the same lock
+            bool compare_exchange(T * expected, T * desired, T *& actual) noexcept
+            {
+                auto & lock = lock_table::item_for(this);
+                lock.lock();
+                T * current = this->m_p.load(std::memory_order_relaxed);
+                if (current == expected) {
+                    this->m_p.store(desired, std::memory_order_relaxed);
+                    lock.unlock();
+                    if (current) Traits::sub_ref(current);
+                    return true;
+                } 
+                if (current) Traits::add_ref(current);
+                lock.unlock();
+                actual = current;
+                return false;
+            }
+
+            //Calls func with the current value kept alive but without adding a reference.
+            //func must be short and must not access this storage.
+            template<class Func>
+            auto borrow(Func && func) const noexcept
+            {
+                static_assert(std::is_nothrow_invocable_v<Func, T *>, "func must be noexcept");
+                auto & lock = lock_table::item_for(this);
+                lock.lock();
+                auto ret = std::forward<Func>(func)(this->m_p.load(std::memory_order_relaxed));
+                lock.unlock();
+                return ret;
+            }
+
+        #if ISPTR_USE_ATOMIC_WAIT
+            void wait(T * old) const noexcept
+                { this->m_p.wait(old, std::memory_order_acquire); }
+            void notify_one() noexcept
+                { this->m_p.notify_one(); }
+            void notify_all() noexcept
+                { this->m_p.notify_all(); }
+        #endif
         private:
-            std::atomic<unsigned> m_value{0};
+            //Only modified under the lock. It is atomic so that waiting can be done without it.
+            std::atomic<T *> m_p{nullptr};
+        };
+
+        //Lock-free storage using split reference counts. The upper bits of the stored word hold
+        //a "local" count of loads in progress. A load first increments the local count, which keeps 
+        //the pointee alive, then adds a real reference and finally tries to undo its local increment. 
+        //A writer that replaces the pointer transfers the outstanding local count to the pointee 
+        //via Traits::add_ref, so loaders that find the pointer gone release that transferred
+        //reference instead.
+        template<class T, class Traits>
+        class atomic_storage<T, Traits, lock_free_atomic_policy>
+        {
+            static_assert(internal::dependent_bool<ISPTR_POINTER_HAS_FREE_TOP_BITS, T>, "lock_free_atomic_policy is not supported on this platform");
+            static_assert(sizeof(T *) == sizeof(uintptr_t) && sizeof(uintptr_t) == 8, "pointers must be 64-bit");
+
+        private:
+            static constexpr unsigned pointer_bits = 48;
+            static constexpr uintptr_t pointer_mask = (uintptr_t(1) << pointer_bits) - 1;
+            static constexpr uintptr_t local_ref = uintptr_t(1) << pointer_bits;
+        public:
+            static constexpr bool is_always_lock_free = std::atomic<uintptr_t>::is_always_lock_free;
+
+            constexpr atomic_storage() noexcept = default;
+            atomic_storage(T * p) noexcept : m_value(atomic_storage::pack(p))
+                {}
+            atomic_storage(const atomic_storage &) = delete;
+            atomic_storage & operator=(const atomic_storage &) = delete;
+            ~atomic_storage() noexcept
+            { 
+                uintptr_t value = this->m_value.load(std::memory_order_relaxed);
+                assert(atomic_storage::local_count(value) == 0);
+                if (T * p = atomic_storage::unpack(value)) 
+                    Traits::sub_ref(p); 
+            }
+
+            bool is_lock_free() const noexcept
+                { return this->m_value.is_lock_free(); }
+
+            T * load() const noexcept
+            {
+                uintptr_t value = this->m_value.fetch_add(atomic_storage::local_ref, std::memory_order_acquire);
+                assert(atomic_storage::local_count(value) < atomic_storage::local_count(~uintptr_t(0)));
+                T * ret = atomic_storage::unpack(value);
+                if (ret) Traits::add_ref(ret);
+                this->drop_local_ref(ret);
+                return ret;
+            }
+
+            T * exchange(T * desired) noexcept
+            {
+                uintptr_t old = this->m_value.exchange(atomic_storage::pack(desired), std::memory_order_acq_rel);
+                T * ret = atomic_storage::unpack(old);
+                atomic_storage::add_refs(ret, atomic_storage::local_count(old));
+                return ret;
+            }
+
+            bool compare_exchange(T * expected, T * desired, T *& actual) noexcept
+            {
+                for (uintptr_t value = this->m_value.load(std::memory_order_relaxed); ; ) 
+                {
+                    if (atomic_storage::unpack(value) == expected) 
+                    {
+                        if (!this->m_value.compare_exchange_weak(value, atomic_storage::pack(desired), 
+                                                                 std::memory_order_acq_rel, std::memory_order_relaxed))
+                            continue;
+                        
+                        //expected holds its own reference so the previous value cannot be destroyed here 
+                        //and we can fold our release into the transfer
+                        if (expected)
+                        {
+                            if (auto count = atomic_storage::local_count(value))
+                                atomic_storage::add_refs(expected, count - 1);
+                            else
+                                Traits::sub_ref(expected);
+                        }
+                        return true;
+                    }
+
+                    T * current = this->load();
+                    if (current != expected) 
+                    {
+                        actual = current;
+                        return false;
+                    }
+                    //the value changed back to expected in the meantime, retry
+                    if (current) Traits::sub_ref(current);
+                    value = this->m_value.load(std::memory_order_relaxed);
+                }
+            }
+
+            //Calls func with the current value kept alive by the local count but without adding a reference
+            template<class Func>
+            auto borrow(Func && func) const noexcept
+            {
+                static_assert(std::is_nothrow_invocable_v<Func, T *>, "func must be noexcept");
+                uintptr_t value = this->m_value.fetch_add(atomic_storage::local_ref, std::memory_order_acquire);
+                assert(atomic_storage::local_count(value) < atomic_storage::local_count(~uintptr_t(0)));
+                T * p = atomic_storage::unpack(value);
+                auto ret = std::forward<Func>(func)(p);
+                this->drop_local_ref(p);
+                return ret;
+            }
+
+        #if ISPTR_USE_ATOMIC_WAIT
+            //Every load changes the local count so waiting on the stored word would keep waking up 
+            //while readers are busy. Instead waiters sleep on a counter that only notifications change.
+            void wait(T * old) const noexcept
+            {
+                auto & notifications = atomic_storage::notifications_for(this);
+                for ( ; ; )
+                {
+                    unsigned seen = notifications.load(std::memory_order_acquire);
+                    if (atomic_storage::unpack(this->m_value.load(std::memory_order_acquire)) != old)
+                        return;
+                    notifications.wait(seen, std::memory_order_acquire);
+                }
+            }
+            //The counter is shared with other storages so waking a single waiter could wake one of theirs
+            void notify_one() noexcept
+                { this->notify_all(); }
+            void notify_all() noexcept
+            {
+                auto & notifications = atomic_storage::notifications_for(this);
+                notifications.fetch_add(1, std::memory_order_release);
+                notifications.notify_all();
+            }
+        #endif
+
+        private:
+        #if ISPTR_USE_ATOMIC_WAIT
+            static std::atomic<unsigned> & notifications_for(const atomic_storage * storage) noexcept
+                { return striped_table<64, std::atomic<unsigned>>::item_for(storage); }
+        #endif
+
+            void drop_local_ref(T * p) const noexcept
+            {
+                uintptr_t value = this->m_value.load(std::memory_order_relaxed);
+                while (atomic_storage::unpack(value) == p && atomic_storage::local_count(value) != 0) 
+                {
+                    if (this->m_value.compare_exchange_weak(value, value - atomic_storage::local_ref, 
+                                                            std::memory_order_release, std::memory_order_relaxed))
+                        return;
+                }
+                //a writer replaced the value and transferred our local reference to the object
+                if (p) Traits::sub_ref(p);
+            }
+
+            static void add_refs(T * p, uintptr_t count) noexcept
+            {
+                if (p) 
+                {
+                    for ( ; count; --count)
+                        Traits::add_ref(p);
+                }
+            }
+
+            static uintptr_t pack(T * p) noexcept
+            {
+                auto ret = reinterpret_cast<uintptr_t>(p);
+                assert((ret & ~atomic_storage::pointer_mask) == 0);
+                return ret;
+            }
+
+            static T * unpack(uintptr_t value) noexcept
+                { return reinterpret_cast<T *>(value & atomic_storage::pointer_mask); }
+            
+            static constexpr uintptr_t local_count(uintptr_t value) noexcept
+                { return value >> atomic_storage::pointer_bits; }
+
+        private:
+            mutable std::atomic<uintptr_t> m_value{0};
+        };
+
+        //Storage optimized for rarely changing values. Writers are serialized by a lock and bump 
+        //a sequence counter to odd while they modify the value. Readers announce themselves in one of 
+        //ReaderSlots per-thread counters, each on its own cache line, and validate that no writer is active.
+        //A writer waits for all announced readers to leave before releasing the previous value,
+        //so readers can safely add a reference after the validated read. Readers never write 
+        //to a cache line shared by all of them.
+        template<class T, class Traits, unsigned ReaderSlots, class Lock>
+        class atomic_storage<T, Traits, read_mostly_atomic_policy<ReaderSlots, Lock>>
+        {
+            static_assert(ReaderSlots > 0, "at least one reader slot is required");
+        public:
+            static constexpr bool is_always_lock_free = false;
+
+            constexpr atomic_storage() noexcept = default;
+            constexpr atomic_storage(T * p) noexcept : m_p(p)
+                {}
+            atomic_storage(const atomic_storage &) = delete;
+            atomic_storage & operator=(const atomic_storage &) = delete;
+            ~atomic_storage() noexcept
+            { 
+                if (T * p = this->m_p.load(std::memory_order_relaxed)) 
+                    Traits::sub_ref(p); 
+            }
+
+            bool is_lock_free() const noexcept
+                { return false; }
+
+            T * load() const noexcept
+            {
+                auto & readers = this->m_readers[internal::this_thread_slot() % ReaderSlots].value;
+                for ( ; ; )
+                {
+                    readers.fetch_add(1, std::memory_order_seq_cst);
+                    unsigned sequence = this->m_sequence.load(std::memory_order_seq_cst);
+                    if ((sequence & 1) == 0)
+                    {
+                        T * ret = this->m_p.load(std::memory_order_acquire);
+                        if (ret) Traits::add_ref(ret);
+                        readers.fetch_sub(1, std::memory_order_release);
+                        return ret;
+                    }
+                    readers.fetch_sub(1, std::memory_order_relaxed);
+                    for (internal::spin_backoff backoff; this->m_sequence.load(std::memory_order_relaxed) == sequence; )
+                        backoff();
+                }
+            }
+
+            T * exchange(T * desired) noexcept
+            {
+                this->begin_write();
+                T * ret = this->m_p.load(std::memory_order_relaxed);
+                this->m_p.store(desired, std::memory_order_relaxed);
+                this->end_write();
+                return ret;
+            }
+
+            bool compare_exchange(T * expected, T * desired, T *& actual) noexcept
+            {
+                this->begin_write();
+                T * current = this->m_p.load(std::memory_order_relaxed);
+                if (current == expected) 
+                {
+                    this->m_p.store(desired, std::memory_order_relaxed);
+                    this->end_write();
+                    if (current) Traits::sub_ref(current);
+                    return true;
+                }
+                if (current) Traits::add_ref(current);
+                this->end_write();
+                actual = current;
+                return false;
+            }
+            //Calls func with the current value kept alive by the reader slot but without adding a reference.
+            //func must be short since writers wait for it.
+            template<class Func>
+            auto borrow(Func && func) const noexcept
+            {
+                static_assert(std::is_nothrow_invocable_v<Func, T *>, "func must be noexcept");
+                auto & readers = this->m_readers[internal::this_thread_slot() % ReaderSlots].value;
+                for ( ; ; )
+                {
+                    readers.fetch_add(1, std::memory_order_seq_cst);
+                    unsigned sequence = this->m_sequence.load(std::memory_order_seq_cst);
+                    if ((sequence & 1) == 0)
+                    {
+                        auto ret = std::forward<Func>(func)(this->m_p.load(std::memory_order_acquire));
+                        readers.fetch_sub(1, std::memory_order_release);
+                        return ret;
+                    }
+                    readers.fetch_sub(1, std::memory_order_relaxed);
+                    for (internal::spin_backoff backoff; this->m_sequence.load(std::memory_order_relaxed) == sequence; )
+                        backoff();
+                }
+            }
+
+        #if ISPTR_USE_ATOMIC_WAIT
+            void wait(T * old) const noexcept
+                { this->m_p.wait(old, std::memory_order_acquire); }
+            void notify_one() noexcept
+                { this->m_p.notify_one(); }
+            void notify_all() noexcept
+                { this->m_p.notify_all(); }
+        #endif
+
+        private:
+            void begin_write() noexcept
+            {
+                this->m_lock.lock();
+                this->m_sequence.fetch_add(1, std::memory_order_seq_cst);
+                for (auto & slot: this->m_readers)
+                {
+                    for (internal::spin_backoff backoff; slot.value.load(std::memory_order_seq_cst) != 0; )
+                        backoff();
+                }
+            }
+
+            void end_write() noexcept
+            {
+                this->m_sequence.fetch_add(1, std::memory_order_release);
+                this->m_lock.unlock();
+            }
+        private:
+            std::atomic<unsigned> m_sequence{0};
+            std::atomic<T *> m_p{nullptr};
+            Lock m_lock;
+            //readers on different slots do not write to the same line
+            mutable internal::cache_line_padded<std::atomic<unsigned>> m_readers[ReaderSlots];
         };
     }
-}
 
-namespace std
-{
-    template<class Traits, class T>
-    class atomic<::isptr::intrusive_shared_ptr<T, Traits>>
+    //MARK:- atomic_intrusive_shared_ptr
+
+    ISPTR_EXPORTED
+    template<class T, class Traits, class Policy = default_atomic_policy>
+    class atomic_intrusive_shared_ptr
     {
     public:
-        using value_type = ::isptr::intrusive_shared_ptr<T, Traits>;
+        using value_type = intrusive_shared_ptr<T, Traits>;
+        using policy_type = Policy;
+    private:
+        using storage_type = internal::atomic_storage<T, Traits, Policy>;
     public:
-        static constexpr bool is_always_lock_free = false;
+        static constexpr bool is_always_lock_free = storage_type::is_always_lock_free;
 
-        constexpr atomic() noexcept = default;
-        atomic(value_type desired) noexcept : m_p(desired.m_p)
-            { desired.m_p = nullptr; }
+        constexpr atomic_intrusive_shared_ptr() noexcept = default;
+        atomic_intrusive_shared_ptr(value_type desired) noexcept : m_storage(publish(desired))
+            {}
         
-        atomic(const atomic&) = delete;
-        atomic & operator=(const atomic&) = delete;
+        atomic_intrusive_shared_ptr(const atomic_intrusive_shared_ptr &) = delete;
+        atomic_intrusive_shared_ptr & operator=(const atomic_intrusive_shared_ptr &) = delete;
         
-        ~atomic() noexcept
-            { value_type::do_sub_ref(this->m_p); }
+        ~atomic_intrusive_shared_ptr() noexcept = default;
 
         value_type operator=(value_type desired) noexcept
         { 
@@ -465,61 +1369,92 @@ namespace std
         operator value_type() const noexcept
             { return this->load(); }
 
-        value_type load(memory_order /*order*/ = memory_order_seq_cst) const noexcept
-        {
-            this->m_lock.lock();
-            auto ret = value_type::ref(this->m_p);
-            this->m_lock.unlock();
-            return ret;
-        }
+        value_type load(std::memory_order /*order*/ = std::memory_order_seq_cst) const noexcept
+            { return value_type::noref(this->m_storage.load()); }
 
-        void store(value_type desired, memory_order /*order*/ = memory_order_seq_cst) noexcept
-        { 
-            this->m_lock.lock();
-            std::swap(this->m_p, desired.m_p);
-            this->m_lock.unlock();
-        }
+        void store(value_type desired, std::memory_order /*order*/ = std::memory_order_seq_cst) noexcept
+            { value_type::noref(this->m_storage.exchange(publish(desired))); }
         
-        value_type exchange(value_type desired, memory_order /*order*/ = memory_order_seq_cst) noexcept
-        {
-            this->m_lock.lock();
-            std::swap(this->m_p, desired.m_p);
-            this->m_lock.unlock();
-            return desired;
-        }
+        value_type exchange(value_type desired, std::memory_order /*order*/ = std::memory_order_seq_cst) noexcept
+            { return value_type::noref(this->m_storage.exchange(publish(desired))); }
 
-        bool compare_exchange_strong(value_type & expected, value_type desired, memory_order /*success*/, memory_order /*failure*/) noexcept
+        bool compare_exchange_strong(value_type & expected, value_type desired, std::memory_order /*success*/, std::memory_order /*failure*/) noexcept
             { return this->do_compare_exchange(expected, std::move(desired)); }
 
-        bool compare_exchange_strong(value_type & expected, value_type desired, memory_order /*order*/ = memory_order_seq_cst) noexcept
+        bool compare_exchange_strong(value_type & expected, value_type desired, std::memory_order /*order*/ = std::memory_order_seq_cst) noexcept
             { return this->do_compare_exchange(expected, std::move(desired)); }
 
-        bool compare_exchange_weak(value_type & expected, value_type desired, memory_order /*success*/, memory_order /*failure*/) noexcept
+        bool compare_exchange_weak(value_type & expected, value_type desired, std::memory_order /*success*/, std::memory_order /*failure*/) noexcept
             { return this->do_compare_exchange(expected, std::move(desired)); }
-        bool compare_exchange_weak(value_type & expected, value_type desired, memory_order /*order*/ = memory_order_seq_cst) noexcept
+        bool compare_exchange_weak(value_type & expected, value_type desired, std::memory_order /*order*/ = std::memory_order_seq_cst) noexcept
             { return this->do_compare_exchange(expected, std::move(desired)); }
 
 
         bool is_lock_free() const noexcept
-            { return false; }
+            { return this->m_storage.is_lock_free(); }
+
+    #if ISPTR_USE_ATOMIC_WAIT
+        //Blocks until the stored pointer differs from old and the object is notified.
+        //Like std::atomic these do not notify automatically: call notify_one() or notify_all() after modifying.
+        void wait(value_type old, std::memory_order /*order*/ = std::memory_order_seq_cst) const noexcept
+            { this->m_storage.wait(old.get()); }
+
+        void notify_one() noexcept
+            { this->m_storage.notify_one(); }
+
+        void notify_all() noexcept
+            { this->m_storage.notify_all(); }
+    #endif
         
+    protected:
+        //Calls func(T *) with the current value kept alive but without changing its reference count.
+        //This is meant for derived classes that need to access the pointee in place.
+        template<class Func>
+        auto borrow(Func && func) const noexcept
+            { return this->m_storage.borrow(std::forward<Func>(func)); }
+
     private:
+        //Objects stored here become reachable from other threads
+        static T * publish(value_type & desired) noexcept
+        {
+            internal::publish<Traits>(desired.get());
+            return desired.release();
+        }
+
         bool do_compare_exchange(value_type & expected, value_type && desired) noexcept
         {
-            this->m_lock.lock();
-            if (this->m_p == expected.m_p) {
-                std::swap(this->m_p, desired.m_p);
-                this->m_lock.unlock();
+            internal::publish<Traits>(desired.get());
+            T * actual;
+            if (this->m_storage.compare_exchange(expected.get(), desired.get(), actual)) {
+                desired.release();
                 return true;
-            } else {
-                expected = value_type::ref(this->m_p);
-                this->m_lock.unlock();
-                return false;
             }
+            expected = value_type::noref(actual);
+            return false;
         }
     private:
-        mutable isptr::internal::simple_lock m_lock;
-        T * m_p = nullptr;
+        storage_type m_storage;
+    };
+}
+
+namespace std
+{
+    template<class Traits, class T>
+    class atomic<::isptr::intrusive_shared_ptr<T, Traits>> : public ::isptr::atomic_intrusive_shared_ptr<T, Traits>
+    {
+    private:
+        using base = ::isptr::atomic_intrusive_shared_ptr<T, Traits>;
+    public:
+        using typename base::value_type;
+    public:
+        constexpr atomic() noexcept = default;
+        atomic(value_type desired) noexcept : base(std::move(desired))
+            {}
+        
+        atomic(const atomic&) = delete;
+        atomic & operator=(const atomic&) = delete;
+
+        using base::operator=;
     };
 
 #if ISPTR_SUPPORT_OUT_PTR
@@ -0,0 +1,167 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+#ifndef HEADER_LOCK_CONTENTION_H_INCLUDED
+#define HEADER_LOCK_CONTENTION_H_INCLUDED
+
+#include <intrusive_shared_ptr/intrusive_shared_ptr.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace isptr
+{
+    //MARK:- lock_contention_snapshot
+
+    ISPTR_EXPORTED
+    struct lock_contention_snapshot
+    {
+        const char * name = nullptr;
+        uint64_t acquisitions = 0;
+        uint64_t contended = 0;
+        uint64_t spins = 0;
+        uint64_t parks = 0;
+        std::chrono::nanoseconds total_wait{0};
+        std::chrono::nanoseconds max_wait{0};
+    };
+
+    namespace internal
+    {
+        //Counters shared by all locks with the same tag. Entries link themselves into a global
+        //list on first use and are never removed.
+        struct lock_contention_entry
+        {
+            const char * const name;
+            std::atomic<uint64_t> acquisitions{0};
+            std::atomic<uint64_t> contended{0};
+            std::atomic<uint64_t> spins{0};
+            std::atomic<uint64_t> parks{0};
+            std::atomic<int64_t> total_wait{0};
+            std::atomic<int64_t> max_wait{0};
+            std::atomic<bool> registered{false};
+            lock_contention_entry * next = nullptr;
+
+            static std::atomic<lock_contention_entry *> & head() noexcept
+            {
+                static std::atomic<lock_contention_entry *> instance{nullptr};
+                return instance;
+            }
+
+            void ensure_registered() noexcept
+            {
+                if (this->registered.load(std::memory_order_acquire) || this->registered.exchange(true, std::memory_order_acq_rel))
+                    return;
+                auto & list = lock_contention_entry::head();
+                this->next = list.load(std::memory_order_relaxed);
+                while (!list.compare_exchange_weak(this->next, this, std::memory_order_release, std::memory_order_relaxed))
+                {}
+            }
+
+            lock_contention_snapshot snapshot() const noexcept
+            {
+                lock_contention_snapshot ret;
+                ret.name = this->name;
+                ret.acquisitions = this->acquisitions.load(std::memory_order_relaxed);
+                ret.contended = this->contended.load(std::memory_order_relaxed);
+                ret.spins = this->spins.load(std::memory_order_relaxed);
+                ret.parks = this->parks.load(std::memory_order_relaxed);
+                ret.total_wait = std::chrono::nanoseconds(this->total_wait.load(std::memory_order_relaxed));
+                ret.max_wait = std::chrono::nanoseconds(this->max_wait.load(std::memory_order_relaxed));
+                return ret;
+            }
+
+            void reset() noexcept
+            {
+                this->acquisitions.store(0, std::memory_order_relaxed);
+                this->contended.store(0, std::memory_order_relaxed);
+                this->spins.store(0, std::memory_order_relaxed);
+                this->parks.store(0, std::memory_order_relaxed);
+                this->total_wait.store(0, std::memory_order_relaxed);
+                this->max_wait.store(0, std::memory_order_relaxed);
+            }
+        };
+
+        template<class Tag, class = void>
+        struct lock_tag_name
+        {
+            static constexpr const char * value = nullptr;
+        };
+
+        template<class Tag>
+        struct lock_tag_name<Tag, std::void_t<decltype(Tag::name)>>
+        {
+            static constexpr const char * value = Tag::name;
+        };
+    }
+
+    //MARK:- lock_contention_counter
+
+    //Stats hook for spin_lock that aggregates contention of all locks using the same Tag.
+    //If Tag has a static `name` member convertible to const char * it is reported in snapshots.
+    ISPTR_EXPORTED
+    template<class Tag>
+    class lock_contention_counter
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        static void record_acquisition() noexcept
+        {
+            auto & entry = lock_contention_counter::s_entry;
+            entry.ensure_registered();
+            entry.acquisitions.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        static clock::time_point begin_contention() noexcept
+            { return clock::now(); }
+
+        static void end_contention(clock::time_point start, unsigned spins, unsigned parks) noexcept
+        {
+            int64_t wait = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+            auto & entry = lock_contention_counter::s_entry;
+            entry.ensure_registered();
+            entry.acquisitions.fetch_add(1, std::memory_order_relaxed);
+            entry.contended.fetch_add(1, std::memory_order_relaxed);
+            entry.spins.fetch_add(spins, std::memory_order_relaxed);
+            entry.parks.fetch_add(parks, std::memory_order_relaxed);
+            entry.total_wait.fetch_add(wait, std::memory_order_relaxed);
+            for (int64_t current = entry.max_wait.load(std::memory_order_relaxed); current < wait; )
+            {
+                if (entry.max_wait.compare_exchange_weak(current, wait, std::memory_order_relaxed, std::memory_order_relaxed))
+                    break;
+            }
+        }
+
+        static lock_contention_snapshot snapshot() noexcept
+            { return lock_contention_counter::s_entry.snapshot(); }
+
+        static void reset() noexcept
+            { lock_contention_counter::s_entry.reset(); }
+
+    private:
+        static inline internal::lock_contention_entry s_entry{internal::lock_tag_name<Tag>::value};
+    };
+
+    //Convenience lock type: spin_lock with default spin budget that records contention under Tag
+    ISPTR_EXPORTED
+    template<class Tag>
+    using counted_spin_lock = spin_lock<spin_lock<>::spin_budget, lock_contention_counter<Tag>>;
+
+    //Calls func(const lock_contention_snapshot &) for every tag whose locks were acquired at least once
+    ISPTR_EXPORTED
+    template<class Func>
+    void for_each_lock_contention(Func && func)
+    {
+        auto & list = internal::lock_contention_entry::head();
+        for (auto entry = list.load(std::memory_order_acquire); entry; entry = entry->next)
+            func(entry->snapshot());
+    }
+}
+
+#endif
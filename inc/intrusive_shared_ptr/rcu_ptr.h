@@ -0,0 +1,435 @@
+/*
+ Copyright 2026 Eugene Gershnik
+
+ Use of this source code is governed by the MIT
+ license that can be found in the LICENSE file or at
+ https://github.com/gershnik/intrusive_shared_ptr/blob/master/LICENSE.txt
+*/
+
+#ifndef HEADER_RCU_PTR_H_INCLUDED
+#define HEADER_RCU_PTR_H_INCLUDED
+
+#include <intrusive_shared_ptr/intrusive_shared_ptr.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <new>
+
+namespace isptr
+{
+    ISPTR_EXPORTED
+    class rcu_read_guard;
+
+    //MARK:- rcu_domain
+
+    ISPTR_EXPORTED
+    class rcu_domain
+    {
+    friend rcu_read_guard;
+    public:
+        using callback = void (*)(void *) noexcept;
+
+        static constexpr size_t default_poll_interval = 1;
+
+    private:
+        //Epoch of the read section the owning thread is in or 0 if none
+        struct record
+        {
+            std::atomic<uint64_t> epoch{0};
+            std::atomic<bool> active{true};
+            record * next = nullptr;
+        };
+
+        struct pending
+        {
+            void * arg;
+            callback func;
+            uint64_t epoch;
+            pending * next;
+        };
+
+        //Each thread keeps its record of the global domain. Other domains can be destroyed
+        //while threads still run so their records are acquired by each guard.
+        struct thread_cache
+        {
+            ~thread_cache() noexcept
+            {
+                if (this->rec)
+                    this->rec->active.store(false, std::memory_order_release);
+            }
+
+            record * rec = nullptr;
+            unsigned nesting = 0;
+        };
+
+    public:
+        explicit rcu_domain(size_t poll_interval = default_poll_interval) noexcept:
+            m_poll_interval(poll_interval),
+            m_next_poll(poll_interval)
+        {}
+        rcu_domain(const rcu_domain &) = delete;
+        rcu_domain & operator=(const rcu_domain &) = delete;
+        ~rcu_domain() noexcept;
+
+        //The default domain. It is never destroyed.
+        static rcu_domain & global() noexcept
+        {
+            static rcu_domain * instance = new rcu_domain();
+            return *instance;
+        }
+
+        //Waits until all read sections that started before the call have finished.
+        //Must not be called from within a read section of this domain.
+        void synchronize() noexcept;
+
+        //Calls func(arg) once all read sections that started before the call have finished.
+        //Never waits. Callbacks run from within later call_rcu(), poll() or barrier() calls.
+        void call_rcu(void * arg, callback func) noexcept;
+
+        //Calls Traits::sub_ref(ptr) once all current read sections have finished
+        template<class Traits, class T>
+        void retire_ref(T * ptr) noexcept
+        {
+            using mutable_type = std::remove_cv_t<T>;
+            this->call_rcu(const_cast<mutable_type *>(ptr), [](void * p) noexcept {
+                Traits::sub_ref(static_cast<T *>(static_cast<mutable_type *>(p)));
+            });
+        }
+
+        //Deletes ptr once all current read sections have finished. Suitable for use in
+        //an overridden ref_counted::destroy()
+        template<class T>
+        void defer_delete(const T * ptr) noexcept
+        {
+            this->call_rcu(const_cast<T *>(ptr), [](void * p) noexcept {
+                delete static_cast<const T *>(p);
+            });
+        }
+
+        //Runs the callbacks whose grace period has already elapsed without waiting
+        void poll() noexcept;
+
+        //Waits for a grace period and runs all callbacks scheduled before the call
+        void barrier() noexcept;
+
+    private:
+        record * acquire_record();
+        void release_record(record * rec) noexcept;
+        uint64_t oldest_reader() const noexcept;
+        void run_callbacks(uint64_t before) noexcept;
+
+        static thread_cache & this_thread_cache() noexcept
+        {
+            static thread_local thread_cache cache;
+            return cache;
+        }
+
+    private:
+        std::atomic<uint64_t> m_epoch{1};
+        std::atomic<record *> m_records{nullptr};
+        std::atomic<pending *> m_pending{nullptr};
+        std::atomic<size_t> m_pending_count{0};
+        const size_t m_poll_interval;
+        std::atomic<size_t> m_next_poll;
+    };
+
+    //MARK:- rcu_read_guard
+
+    ISPTR_EXPORTED
+    class rcu_read_guard
+    {
+    public:
+        //Enters a read section. For the global domain this stores the current epoch into a thread-local 
+        //record (allocated on the first use by a thread) followed by a full fence so that writers 
+        //see it before the reader loads any pointer. Nested sections do neither.
+        explicit rcu_read_guard(rcu_domain & domain = rcu_domain::global());
+        rcu_read_guard(const rcu_read_guard &) = delete;
+        rcu_read_guard & operator=(const rcu_read_guard &) = delete;
+        ~rcu_read_guard() noexcept;
+
+        rcu_domain & domain() const noexcept
+            { return *this->m_domain; }
+
+    private:
+        rcu_domain * m_domain;
+        rcu_domain::record * m_record;
+    };
+
+    //MARK:- rcu_ptr
+
+    ISPTR_EXPORTED
+    template<class T, class Traits>
+    class rcu_ptr
+    {
+    public:
+        using value_type = intrusive_shared_ptr<T, Traits>;
+
+    public:
+        rcu_ptr() noexcept:
+            m_domain(&rcu_domain::global())
+        {}
+        explicit rcu_ptr(rcu_domain & domain) noexcept:
+            m_domain(&domain)
+        {}
+        rcu_ptr(value_type desired, rcu_domain & domain = rcu_domain::global()) noexcept:
+            m_p(publish(desired)),
+            m_domain(&domain)
+        {}
+
+        rcu_ptr(const rcu_ptr &) = delete;
+        rcu_ptr & operator=(const rcu_ptr &) = delete;
+
+        ~rcu_ptr() noexcept
+        {
+            if (T * p = this->m_p.load(std::memory_order_relaxed))
+                this->m_domain->template retire_ref<Traits>(p);
+        }
+
+        value_type operator=(value_type desired) noexcept
+        {
+            this->store(desired);
+            return desired;
+        }
+
+        //Reads the current value without changing its reference count.
+        //The result is valid until the guard is destroyed.
+        T * read([[maybe_unused]] const rcu_read_guard & guard) const noexcept
+        {
+            assert(&guard.domain() == this->m_domain);
+            return this->m_p.load(std::memory_order_acquire);
+        }
+
+        value_type load() const
+        {
+            rcu_read_guard guard(*this->m_domain);
+            return value_type::ref(this->read(guard));
+        }
+
+        operator value_type() const
+            { return this->load(); }
+
+        void store(value_type desired) noexcept
+        {
+            T * old = this->m_p.exchange(publish(desired), std::memory_order_seq_cst);
+            if (old)
+                this->m_domain->template retire_ref<Traits>(old);
+        }
+
+        value_type exchange(value_type desired) noexcept
+        {
+            T * old = this->m_p.exchange(publish(desired), std::memory_order_seq_cst);
+            //readers may still use the old value so our reference is retired and the caller gets a new one
+            auto ret = value_type::ref(old);
+            if (old)
+                this->m_domain->template retire_ref<Traits>(old);
+            return ret;
+        }
+
+        bool compare_exchange_strong(value_type & expected, value_type desired)
+        {
+            internal::publish<Traits>(desired.get());
+            for ( ; ; )
+            {
+                T * current = expected.get();
+                if (this->m_p.compare_exchange_strong(current, desired.get(), std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    desired.release();
+                    if (current)
+                        this->m_domain->template retire_ref<Traits>(current);
+                    return true;
+                }
+                //current cannot be dereferenced so reload safely. If the value changed back to
+                //expected meanwhile, failing would be spurious.
+                auto loaded = this->load();
+                if (loaded != expected)
+                {
+                    expected = std::move(loaded);
+                    return false;
+                }
+            }
+        }
+
+        rcu_domain & domain() const noexcept
+            { return *this->m_domain; }
+
+    private:
+        //Objects stored here become reachable from other threads
+        static T * publish(value_type & desired) noexcept
+        {
+            internal::publish<Traits>(desired.get());
+            return desired.release();
+        }
+
+    private:
+        std::atomic<T *> m_p{nullptr};
+        rcu_domain * m_domain;
+    };
+
+    //MARK:- Implementation
+
+    inline rcu_read_guard::rcu_read_guard(rcu_domain & domain):
+        m_domain(&domain)
+    {
+        if (&domain == &rcu_domain::global())
+        {
+            auto & cache = rcu_domain::this_thread_cache();
+            if (!cache.rec)
+                cache.rec = domain.acquire_record();
+            this->m_record = cache.rec;
+            if (cache.nesting++ != 0)
+                return;
+        }
+        else
+        {
+            this->m_record = domain.acquire_record();
+        }
+        this->m_record->epoch.store(domain.m_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    inline rcu_read_guard::~rcu_read_guard() noexcept
+    {
+        if (this->m_domain == &rcu_domain::global())
+        {
+            auto & cache = rcu_domain::this_thread_cache();
+            if (--cache.nesting != 0)
+                return;
+            this->m_record->epoch.store(0, std::memory_order_release);
+        }
+        else
+        {
+            this->m_record->epoch.store(0, std::memory_order_release);
+            this->m_domain->release_record(this->m_record);
+        }
+    }
+
+    inline rcu_domain::~rcu_domain() noexcept
+    {
+        //callbacks can schedule more callbacks which look at the records so those are freed last
+        while (auto node = this->m_pending.exchange(nullptr, std::memory_order_acquire))
+        {
+            while (node)
+            {
+                auto next = node->next;
+                node->func(node->arg);
+                delete node;
+                node = next;
+            }
+        }
+        for (auto rec = this->m_records.exchange(nullptr, std::memory_order_acquire); rec; )
+        {
+            assert(rec->epoch.load(std::memory_order_relaxed) == 0);
+            auto next = rec->next;
+            delete rec;
+            rec = next;
+        }
+    }
+
+    inline auto rcu_domain::acquire_record() -> record *
+    {
+        for (auto rec = this->m_records.load(std::memory_order_acquire); rec; rec = rec->next)
+        {
+            if (!rec->active.load(std::memory_order_relaxed) && !rec->active.exchange(true, std::memory_order_acquire))
+                return rec;
+        }
+
+        auto rec = new record;
+        rec->next = this->m_records.load(std::memory_order_relaxed);
+        while (!this->m_records.compare_exchange_weak(rec->next, rec, std::memory_order_release, std::memory_order_relaxed))
+        {}
+        return rec;
+    }
+
+    inline void rcu_domain::release_record(record * rec) noexcept
+    {
+        rec->active.store(false, std::memory_order_release);
+    }
+
+    inline uint64_t rcu_domain::oldest_reader() const noexcept
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t ret = UINT64_MAX;
+        for (auto rec = this->m_records.load(std::memory_order_acquire); rec; rec = rec->next)
+        {
+            uint64_t epoch = rec->epoch.load(std::memory_order_acquire);
+            if (epoch != 0 && epoch < ret)
+                ret = epoch;
+        }
+        return ret;
+    }
+
+    inline void rcu_domain::synchronize() noexcept
+    {
+        uint64_t epoch = this->m_epoch.fetch_add(1, std::memory_order_seq_cst);
+        for (internal::spin_backoff backoff; this->oldest_reader() <= epoch; )
+            backoff();
+    }
+
+    inline void rcu_domain::call_rcu(void * arg, callback func) noexcept
+    {
+        uint64_t epoch = this->m_epoch.fetch_add(1, std::memory_order_seq_cst);
+        //There is nowhere to keep the callback if allocation fails and waiting for the readers
+        //instead could deadlock, so running out of memory terminates
+        auto node = new pending{arg, func, epoch, nullptr};
+        node->next = this->m_pending.load(std::memory_order_relaxed);
+        while (!this->m_pending.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+        {}
+
+        if (this->m_pending_count.fetch_add(1, std::memory_order_relaxed) + 1 >= this->m_next_poll.load(std::memory_order_relaxed))
+            this->poll();
+    }
+
+    inline void rcu_domain::poll() noexcept
+    {
+        this->run_callbacks(this->oldest_reader());
+    }
+
+    inline void rcu_domain::barrier() noexcept
+    {
+        uint64_t epoch = this->m_epoch.load(std::memory_order_seq_cst);
+        this->synchronize();
+        this->run_callbacks(epoch + 1);
+    }
+
+    inline void rcu_domain::run_callbacks(uint64_t before) noexcept
+    {
+        //Take the whole list so callbacks can safely schedule more
+        auto node = this->m_pending.exchange(nullptr, std::memory_order_acquire);
+        if (!node)
+            return;
+
+        pending * keep = nullptr;
+        pending * keep_tail = nullptr;
+        size_t ran = 0;
+        while (node)
+        {
+            auto next = node->next;
+            if (node->epoch < before)
+            {
+                node->func(node->arg);
+                delete node;
+                ++ran;
+            }
+            else
+            {
+                node->next = keep;
+                keep = node;
+                if (!keep_tail)
+                    keep_tail = node;
+            }
+            node = next;
+        }
+        //callbacks kept for long read sections make each poll longer so poll less often as they accumulate
+        size_t left = this->m_pending_count.fetch_sub(ran, std::memory_order_relaxed) - ran;
+        this->m_next_poll.store(left + (left > this->m_poll_interval ? left : this->m_poll_interval), std::memory_order_relaxed);
+        if (keep)
+        {
+            keep_tail->next = this->m_pending.load(std::memory_order_relaxed);
+            while (!this->m_pending.compare_exchange_weak(keep_tail->next, keep, std::memory_order_release, std::memory_order_relaxed))
+            {}
+        }
+    }
+}
+
+#endif
@@ -10,13 +10,26 @@
 #define HEADER_REF_COUNTED_H_INCLUDED
 
 #include <intrusive_shared_ptr/intrusive_shared_ptr.h>
+#include <intrusive_shared_ptr/block_pool.h>
+#include <intrusive_shared_ptr/deferred_destroy.h>
+#include <intrusive_shared_ptr/cycle_collector.h>
 
 #include <atomic>
 #include <cassert>
 #include <limits>
+#include <memory>
+#include <new>
+#if ISPTR_CHECK_UNPUBLISHED_USE
+    #include <thread>
+#endif
 
 namespace isptr
 {
+    //Defined in rcu_ptr.h which classes with ref_counted_flags::rcu_destroy need to include
+    ISPTR_EXPORTED
+    class rcu_domain;
+    ISPTR_EXPORTED
+    class rcu_read_guard;
 
     //MARK:- ref_counted_flags
 
@@ -25,7 +38,17 @@ namespace isptr
     {
         none = 0,
         provide_weak_references = 1,
-        single_threaded = 2
+        single_threaded = 2,
+        biased = 4,
+        allow_immortal = 8,
+        co_allocate_weak_reference = 16,
+        pool_weak_references = 32,
+        deferred_destroy = 64,
+        isolate_count = 128,
+        promote_on_share = 256,
+        weak_side_table = 512,
+        cycle_collectable = 1024,
+        rcu_destroy = 2048
     };
 
     ISPTR_EXPORTED constexpr ref_counted_flags operator|(ref_counted_flags lhs, ref_counted_flags rhs) noexcept
@@ -40,11 +63,508 @@ namespace isptr
     ISPTR_EXPORTED constexpr bool contains(ref_counted_flags val, ref_counted_flags flag) noexcept
         { return (val & flag) == flag;   }
 
+    //MARK:- Weak reference allocation
+
+    namespace internal
+    {
+        //Derived::weak_reference_allocator if present, otherwise the default pool
+        template<class Derived, class WeakValue, class = void>
+        struct weak_reference_allocator_of
+        {
+            using type = weak_reference_pool<WeakValue>;
+        };
+
+        template<class Derived, class WeakValue>
+        struct weak_reference_allocator_of<Derived, WeakValue, std::void_t<typename Derived::weak_reference_allocator>>
+        {
+            using type = typename Derived::weak_reference_allocator;
+        };
+    }
+
+    //MARK:- Allocator support
+
+    namespace internal
+    {
+        //Layout of an object allocated via an allocator. The object is at the start of the block. 
+        //Allocators that cannot be recreated on demand are stored after it.
+        template<class T, class Allocator>
+        struct allocated_layout
+        {
+            static constexpr size_t align = alignof(T) > alignof(Allocator) ? alignof(T) : alignof(Allocator);
+
+            struct alignas(align) unit
+            {
+                unsigned char bytes[align];
+            };
+
+            using allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<unit>;
+            using traits = std::allocator_traits<allocator_type>;
+
+            static_assert(std::is_same_v<typename traits::pointer, unit *>, "fancy pointers are not supported");
+            static_assert(alignof(allocator_type) <= align, "rebound allocator alignment is unexpected");
+
+            static constexpr bool stores_allocator = !(traits::is_always_equal::value && 
+                                                       std::is_default_constructible_v<allocator_type>);
+            static constexpr size_t allocator_offset = (sizeof(T) + alignof(allocator_type) - 1) / alignof(allocator_type) * alignof(allocator_type);
+            static constexpr size_t size = stores_allocator ? allocator_offset + sizeof(allocator_type) : sizeof(T);
+            static constexpr size_t units = (size + align - 1) / align;
+
+            static void * allocator_address(unit * storage) noexcept
+                { return reinterpret_cast<unsigned char *>(storage) + allocator_offset; }
+            static allocator_type * stored_allocator(unit * storage) noexcept
+                { return std::launder(static_cast<allocator_type *>(allocator_address(storage))); }
+        };
+    }
+
+    //MARK:- Biased counting support
+
+    namespace internal
+    {
+        //Link of an object whose shared count went negative and which waits for its owning
+        //thread to merge the biased count into the shared one
+        struct biased_queue_node
+        {
+            void (* const merge)(biased_queue_node *) noexcept;
+            biased_queue_node * next = nullptr;
+        };
+
+        //Record of a thread that owns biased counts. Records are never freed. When a thread exits
+        //its record is released and the next thread that acquires it takes over the biased counts
+        //of all objects created under it. Queued objects of a released record are merged by the
+        //thread that queues them.
+        class biased_owner
+        {
+        public:
+            //Record of the calling thread or nullptr if it never created a biased object
+            static biased_owner * current() noexcept
+                { return biased_owner::current_slot(); }
+
+            //Record of the calling thread, acquiring one if necessary. Returns nullptr if a new
+            //record cannot be allocated
+            static biased_owner * acquire_current() noexcept
+            {
+                auto & slot = biased_owner::current_slot();
+                if (!slot)
+                {
+                    static thread_local thread_holder holder;
+                    holder.rec = slot = biased_owner::acquire();
+                }
+                return slot;
+            }
+
+            bool has_queued() const noexcept
+                { return this->m_queue.load(std::memory_order_relaxed) != nullptr; }
+
+            //Called by a non-owning thread
+            void enqueue(biased_queue_node * node) noexcept
+            {
+                node->next = this->m_queue.load(std::memory_order_relaxed);
+                while (!this->m_queue.compare_exchange_weak(node->next, node, std::memory_order_seq_cst, std::memory_order_relaxed))
+                {}
+                this->drain_if_released();
+            }
+
+            //Called by the owning thread
+            void drain() noexcept
+            {
+                for (auto node = this->m_queue.exchange(nullptr, std::memory_order_acquire); node; )
+                {
+                    auto next = node->next; //merge can destroy the object
+                    node->merge(node);
+                    node = next;
+                }
+            }
+
+        private:
+            struct thread_holder
+            {
+                ~thread_holder() noexcept
+                {
+                    if (this->rec)
+                    {
+                        biased_owner::current_slot() = nullptr;
+                        this->rec->drain();
+                        this->rec->m_in_use.store(false, std::memory_order_seq_cst);
+                        this->rec->drain_if_released();
+                    }
+                }
+
+                biased_owner * rec = nullptr;
+            };
+
+            static biased_owner *& current_slot() noexcept
+            {
+                static thread_local biased_owner * instance = nullptr;
+                return instance;
+            }
+
+            static std::atomic<biased_owner *> & head() noexcept
+            {
+                static std::atomic<biased_owner *> instance{nullptr};
+                return instance;
+            }
+
+            static biased_owner * acquire() noexcept
+            {
+                auto & list = biased_owner::head();
+                for (auto rec = list.load(std::memory_order_acquire); rec; rec = rec->m_next)
+                {
+                    if (!rec->m_in_use.load(std::memory_order_relaxed) && !rec->m_in_use.exchange(true, std::memory_order_acquire))
+                    {
+                        rec->drain();
+                        return rec;
+                    }
+                }
+
+                auto rec = new (std::nothrow) biased_owner;
+                if (!rec)
+                    return nullptr;
+                rec->m_next = list.load(std::memory_order_relaxed);
+                while (!list.compare_exchange_weak(rec->m_next, rec, std::memory_order_release, std::memory_order_relaxed))
+                {}
+                return rec;
+            }
+
+            //Nodes queued after the owner released the record would never be merged so whoever
+            //observes such nodes temporarily takes the record over and merges them
+            void drain_if_released() noexcept
+            {
+                while (this->m_queue.load(std::memory_order_seq_cst) && 
+                       !this->m_in_use.load(std::memory_order_seq_cst) &&
+                       !this->m_in_use.exchange(true, std::memory_order_seq_cst))
+                {
+                    this->drain();
+                    this->m_in_use.store(false, std::memory_order_seq_cst);
+                }
+            }
+
+        private:
+            std::atomic<biased_queue_node *> m_queue{nullptr};
+            std::atomic<bool> m_in_use{true};
+            biased_owner * m_next = nullptr;
+        };
+
+        //Count of a biased object. The owning thread updates biased without atomics. Other threads
+        //update shared which holds the count shifted left by 2 and the merged and queued flags.
+        //The node must be the first member so that ref_counted can be recovered from it.
+        template<class CountType>
+        struct biased_count
+        {
+            static constexpr CountType merged = 1;
+            static constexpr CountType queued = 2;
+            static constexpr CountType one = 4;
+
+            biased_count(CountType initial, void (*merge)(biased_queue_node *) noexcept) noexcept:
+                node{merge},
+                owner(biased_owner::acquire_current()),
+                biased(this->owner ? initial : 0),
+                shared(this->owner ? CountType(0) : CountType(initial * one | merged))
+            {}
+
+            static CountType refs(CountType value) noexcept
+                { return CountType((value - (value & (one - 1))) / one); }
+
+            biased_queue_node node;
+            biased_owner * const owner;
+            CountType biased;
+            std::atomic<CountType> shared;
+        };
+    }
+
+    //Merges the biased counts of objects owned by the calling thread that other threads have 
+    //released below zero. This happens automatically on the owning thread's sub_ref() and when 
+    //it exits. Threads that rarely release their objects can call it periodically.
+    ISPTR_EXPORTED
+    inline void merge_biased_refs() noexcept
+    {
+        if (auto owner = internal::biased_owner::current())
+            owner->drain();
+    }
+
+    //MARK:- Count storage
+
+    namespace internal
+    {
+        //Count of an object whose counts live in its co-allocated weak reference
+        struct no_count
+        {
+            constexpr explicit no_count(int) noexcept
+            {}
+        };
+
+        //Count of an object that is counted without atomic read-modify-write operations until it is
+        //published. value holds the count shifted left by 1 and the published flag.
+        template<class CountType>
+        struct promotable_count
+        {
+            static constexpr CountType published = 1;
+            static constexpr CountType one = 2;
+
+            explicit promotable_count(CountType initial) noexcept:
+                value(CountType(initial * one))
+            {}
+
+            static CountType refs(CountType value) noexcept
+                { return CountType(value / one); }
+
+            //Unpublished objects can only be used by the thread that created them
+            void check_owner() const noexcept
+            {
+            #if ISPTR_CHECK_UNPUBLISHED_USE
+                assert(this->owner == std::this_thread::get_id() && "object used by another thread before publish()");
+            #endif
+            }
+
+            std::atomic<CountType> value;
+        #if ISPTR_CHECK_UNPUBLISHED_USE
+            const std::thread::id owner = std::this_thread::get_id();
+        #endif
+        };
+
+        //Type of the count stored in ref_counted
+        template<ref_counted_flags Flags, class CountType>
+        using ref_counted_count = std::conditional_t<contains(Flags, ref_counted_flags::co_allocate_weak_reference), no_count,
+                                      std::conditional_t<contains(Flags, ref_counted_flags::cycle_collectable), cycle_node,
+                                          std::conditional_t<contains(Flags, ref_counted_flags::single_threaded), CountType, 
+                                              std::conditional_t<contains(Flags, ref_counted_flags::biased), biased_count<CountType>, 
+                                                  std::conditional_t<contains(Flags, ref_counted_flags::promote_on_share), promotable_count<CountType>,
+                                                                     std::atomic<CountType>>>>>>;
+
+        //Storage of the count of ref_counted. It is a private base so that the count stays the first member
+        //of ref_counted while optional padding follows it.
+        template<class Count, bool Isolated>
+        struct count_storage
+        {
+            explicit count_storage(Count (* make)() noexcept) noexcept:
+                m_count(make())
+            {}
+
+            mutable Count m_count;
+        };
+
+        //The padding keeps members of the derived class at least a cache line away from the count
+        template<class Count>
+        struct count_storage<Count, true>
+        {
+            static_assert(sizeof(Count) < ISPTR_CACHE_LINE_SIZE);
+
+            explicit count_storage(Count (* make)() noexcept) noexcept:
+                m_count(make())
+            {}
+
+            mutable Count m_count;
+            char m_padding[ISPTR_CACHE_LINE_SIZE - sizeof(Count)] = {};
+        };
+    }
+
+    //MARK:- Weak side table
+
+    namespace internal
+    {
+        //Weak references of objects with weak_side_table flag keyed by object address. Objects are spread 
+        //over shards with their own locks so that unrelated objects rarely contend. An object has an entry
+        //from the moment its first weak reference is created until it is destroyed.
+        class weak_side_table
+        {
+        public:
+            static void * find(const void * obj) noexcept
+            {
+                auto hash = weak_side_table::hash_of(obj);
+                auto & entry = weak_side_table::shard_for(hash);
+                entry.lock.lock();
+                auto slot = entry.find(obj, hash);
+                void * ret = slot ? slot->weak : nullptr;
+                entry.lock.unlock();
+                return ret;
+            }
+
+            //Returns the weak reference of obj. If there is none creates it via make() which is called 
+            //with the shard locked. created tells which case happened.
+            template<class Make>
+            static void * find_or_insert(const void * obj, Make && make, bool & created)
+            {
+                auto hash = weak_side_table::hash_of(obj);
+                auto & entry = weak_side_table::shard_for(hash);
+                entry.lock.lock();
+                try
+                {
+                    void * ret;
+                    if (auto slot = entry.find(obj, hash))
+                    {
+                        ret = slot->weak;
+                        created = false;
+                    }
+                    else
+                    {
+                        entry.reserve();
+                        ret = std::forward<Make>(make)();
+                        entry.insert(obj, ret, hash);
+                        created = true;
+                    }
+                    entry.lock.unlock();
+                    return ret;
+                }
+                catch(...)
+                {
+                    entry.lock.unlock();
+                    throw;
+                }
+            }
+
+            //Removes the entry of obj and returns its weak reference
+            static void * erase(const void * obj) noexcept
+            {
+                auto hash = weak_side_table::hash_of(obj);
+                auto & entry = weak_side_table::shard_for(hash);
+                entry.lock.lock();
+                void * ret = entry.erase(obj, hash);
+                entry.lock.unlock();
+                return ret;
+            }
+
+        private:
+            static constexpr unsigned shard_bits = 6;
+
+            struct slot
+            {
+                const void * obj;
+                void * weak;
+            };
+
+            //Open addressing hash table with linear probing. Top bits of the hash select the shard and 
+            //the following ones the slot.
+            struct shard
+            {
+                spin_lock<> lock;
+                slot * slots = nullptr;
+                unsigned capacity_bits = 0;
+                size_t size = 0;
+
+                size_t index_of(uint64_t hash) const noexcept
+                    { return size_t((hash << weak_side_table::shard_bits) >> (64 - this->capacity_bits)); }
+                size_t mask() const noexcept
+                    { return (size_t(1) << this->capacity_bits) - 1; }
+
+                slot * find(const void * obj, uint64_t hash) const noexcept
+                {
+                    if (!this->slots)
+                        return nullptr;
+                    for (size_t i = this->index_of(hash); this->slots[i].obj; i = (i + 1) & this->mask())
+                    {
+                        if (this->slots[i].obj == obj)
+                            return &this->slots[i];
+                    }
+                    return nullptr;
+                }
+
+                //Makes sure the next insert() does not need to allocate. Keeps the table at most half full.
+                void reserve()
+                {
+                    if (this->slots && (this->size + 1) * 2 <= this->mask() + 1)
+                        return;
+                    unsigned new_bits = this->slots ? this->capacity_bits + 1 : 4;
+                    auto old_slots = this->slots;
+                    auto old_capacity = this->slots ? this->mask() + 1 : 0;
+                    this->slots = new slot[size_t(1) << new_bits]();
+                    this->capacity_bits = new_bits;
+                    for (size_t i = 0; i < old_capacity; ++i)
+                    {
+                        if (old_slots[i].obj)
+                            this->place(old_slots[i], weak_side_table::hash_of(old_slots[i].obj));
+                    }
+                    delete[] old_slots;
+                }
+
+                void insert(const void * obj, void * weak, uint64_t hash) noexcept
+                {
+                    this->place(slot{obj, weak}, hash);
+                    ++this->size;
+                }
+
+                void * erase(const void * obj, uint64_t hash) noexcept
+                {
+                    auto found = this->find(obj, hash);
+                    if (!found)
+                        return nullptr;
+                    void * ret = found->weak;
+                    //move back following entries that would not be found across the hole otherwise
+                    size_t hole = size_t(found - this->slots);
+                    for (size_t i = (hole + 1) & this->mask(); this->slots[i].obj; i = (i + 1) & this->mask())
+                    {
+                        size_t home = this->index_of(weak_side_table::hash_of(this->slots[i].obj));
+                        if (((i - home) & this->mask()) >= ((i - hole) & this->mask()))
+                        {
+                            this->slots[hole] = this->slots[i];
+                            hole = i;
+                        }
+                    }
+                    this->slots[hole] = slot{nullptr, nullptr};
+                    --this->size;
+                    return ret;
+                }
+
+                void place(const slot & value, uint64_t hash) noexcept
+                {
+                    size_t i = this->index_of(hash);
+                    while (this->slots[i].obj)
+                        i = (i + 1) & this->mask();
+                    this->slots[i] = value;
+                }
+            };
+
+            static uint64_t hash_of(const void * obj) noexcept
+            {
+                //Fibonacci hashing spreads adjacent addresses over distant shards and slots
+                return uint64_t(reinterpret_cast<uintptr_t>(obj) / alignof(void *)) * 0x9E3779B97F4A7C15u;
+            }
+
+            static shard & shard_for(uint64_t hash) noexcept
+            {
+                //never destroyed so that objects released during static destruction can still use it
+                //each shard on its own line so that locking one does not slow down the others
+                static cache_line_padded<shard> * const shards = new cache_line_padded<shard>[size_t(1) << weak_side_table::shard_bits];
+                return shards[hash >> (64 - weak_side_table::shard_bits)].value;
+            }
+        };
+    }
+
+    //MARK:- ref_counted_layout
+
+    //Where the count of a ref_counted object is relative to the rest of it. Offsets are from the start
+    //of the object. Cache lines are counted from the one the object starts on.
+    ISPTR_EXPORTED
+    struct ref_counted_layout
+    {
+        size_t object_size = 0;
+        size_t count_offset = 0;
+        size_t count_size = 0;
+        size_t count_padding = 0;
+        size_t payload_offset = 0;
+        size_t count_line = 0;
+        size_t payload_line = 0;
+
+        //Whether the count is on the same cache line as data that follows ref_counted in the object
+        bool shares_line() const noexcept
+            { return this->payload_offset < this->object_size && this->count_line == this->payload_line; }
+    };
+
+    ISPTR_EXPORTED
+    template<class Char>
+    std::basic_ostream<Char> & operator<<(std::basic_ostream<Char> & str, const ref_counted_layout & layout)
+    {
+        str << "size: " << layout.object_size 
+            << ", count: " << layout.count_offset << '+' << layout.count_size 
+            << " (padding " << layout.count_padding << ", line " << layout.count_line << ')'
+            << ", payload: " << layout.payload_offset << " (line " << layout.payload_line << ')';
+        return str;
+    }
+
     //MARK:- Forward Declarations
 
     ISPTR_EXPORTED
     template<ref_counted_flags Flags>
-    using default_count_type = std::conditional_t<contains(Flags, ref_counted_flags::provide_weak_references), intptr_t, int>;
+    using default_count_type = std::conditional_t<contains(Flags, ref_counted_flags::provide_weak_references) && 
+                                                  !contains(Flags, ref_counted_flags::weak_side_table), intptr_t, int>;
 
     ISPTR_EXPORTED
     template<class Derived, ref_counted_flags Flags = ref_counted_flags::none, class CountType = default_count_type<Flags>>
@@ -70,6 +590,18 @@ namespace isptr
     template<class Derived>
     using weak_ref_counted_wrapper = ref_counted_wrapper<Derived, ref_counted_flags::provide_weak_references>;
 
+    ISPTR_EXPORTED
+    template<class Derived>
+    using biased_ref_counted = ref_counted<Derived, ref_counted_flags::biased>;
+
+    ISPTR_EXPORTED
+    template<class Derived>
+    using biased_ref_counted_adapter = ref_counted_adapter<Derived, ref_counted_flags::biased>;
+
+    ISPTR_EXPORTED
+    template<class Derived>
+    using biased_ref_counted_wrapper = ref_counted_wrapper<Derived, ref_counted_flags::biased>;
+
     ISPTR_EXPORTED
     template<class Derived, class CountType = default_count_type<ref_counted_flags::single_threaded>>
     using ref_counted_st = ref_counted<Derived, ref_counted_flags::single_threaded, CountType>;
@@ -101,6 +633,10 @@ namespace isptr
     template<class Owner>
     class weak_reference;
 
+    ISPTR_EXPORTED
+    template<class T>
+    ref_counted_layout layout_of_ref_counted(const T & obj) noexcept;
+
 
     //MARK:-
 
@@ -113,21 +649,50 @@ namespace isptr
         template<class T>
         static void sub_ref(const T * obj) noexcept
             { obj->call_sub_ref(); }
+
+        template<class T>
+        static auto add_ref_n(const T * obj, size_t n) noexcept -> decltype(obj->call_add_ref_n(n))
+            { obj->call_add_ref_n(n); }
+
+        template<class T>
+        static auto sub_ref_n(const T * obj, size_t n) noexcept -> decltype(obj->call_sub_ref_n(n))
+            { obj->call_sub_ref_n(n); }
+
+        template<class T>
+        static auto publish(const T * obj) noexcept -> decltype(obj->publish())
+            { obj->publish(); }
+
+        template<class T>
+        static auto is_referenced(const T * obj) noexcept -> decltype(obj->is_referenced())
+            { return obj->is_referenced(); }
     };
 
     //MARK:-
 
     template<class Derived, ref_counted_flags Flags, class CountType>
-    class ref_counted
+    class ref_counted : private internal::count_storage<internal::ref_counted_count<Flags, CountType>,
+                                                        contains(Flags, ref_counted_flags::isolate_count)>
     {
     template<class Owner> friend class weak_reference;
+    template<class T> friend ref_counted_layout layout_of_ref_counted(const T & obj) noexcept;
     friend ref_counted_traits;
+    friend cycle_visitor;
     public:
         using refcnt_ptr_traits = ref_counted_traits;
         using ref_counted_base = ref_counted;
         
         static constexpr bool provides_weak_references = contains(Flags, ref_counted_flags::provide_weak_references);
         static constexpr bool single_threaded = contains(Flags, ref_counted_flags::single_threaded);
+        static constexpr bool biased = contains(Flags, ref_counted_flags::biased);
+        static constexpr bool allows_immortal = contains(Flags, ref_counted_flags::allow_immortal);
+        static constexpr bool co_allocates_weak_reference = contains(Flags, ref_counted_flags::co_allocate_weak_reference);
+        static constexpr bool pools_weak_references = contains(Flags, ref_counted_flags::pool_weak_references);
+        static constexpr bool defers_destroy = contains(Flags, ref_counted_flags::deferred_destroy);
+        static constexpr bool isolates_count = contains(Flags, ref_counted_flags::isolate_count);
+        static constexpr bool promotes_on_share = contains(Flags, ref_counted_flags::promote_on_share);
+        static constexpr bool uses_weak_side_table = contains(Flags, ref_counted_flags::weak_side_table);
+        static constexpr bool collects_cycles = contains(Flags, ref_counted_flags::cycle_collectable);
+        static constexpr bool destroys_after_rcu = contains(Flags, ref_counted_flags::rcu_destroy);
         
     public:
         using weak_value_type   = std::conditional_t<ref_counted::provides_weak_references, weak_reference<Derived>, void>;
@@ -135,13 +700,44 @@ namespace isptr
         using const_weak_ptr    = std::conditional_t<ref_counted::provides_weak_references, intrusive_shared_ptr<const weak_value_type, ref_counted_traits>, void>;
         
     private:
-        static_assert(!ref_counted::provides_weak_references || (ref_counted::provides_weak_references && std::is_same_v<CountType, intptr_t>),
-                      "CountType must be intptr_t (the default) when providing weak references");
+        static_assert(!ref_counted::provides_weak_references || ref_counted::uses_weak_side_table || std::is_same_v<CountType, intptr_t>,
+                      "CountType must be intptr_t (the default) when providing weak references without weak_side_table");
         static_assert(std::is_integral_v<CountType>, "CountType must be an integral type");
         static_assert(ref_counted::single_threaded || std::atomic<CountType>::is_always_lock_free,
                       "CountType must be such that std::atomic<CountType> is alwayd lock free");
+        static_assert(!ref_counted::biased || (!ref_counted::single_threaded && !ref_counted::provides_weak_references),
+                      "biased counting cannot be combined with other flags");
+        static_assert(!ref_counted::biased || std::is_signed_v<CountType>, "CountType must be signed for biased counting");
+        static_assert(!ref_counted::allows_immortal || (!ref_counted::provides_weak_references && !ref_counted::biased),
+                      "immortal objects cannot be combined with weak references or biased counting");
+        static_assert(!ref_counted::co_allocates_weak_reference || ref_counted::provides_weak_references,
+                      "co_allocate_weak_reference requires provide_weak_references");
+        static_assert(!ref_counted::pools_weak_references || 
+                      (ref_counted::provides_weak_references && !ref_counted::co_allocates_weak_reference),
+                      "pool_weak_references requires provide_weak_references and cannot be combined with co_allocate_weak_reference");
+        static_assert(!ref_counted::defers_destroy || !ref_counted::co_allocates_weak_reference,
+                      "deferred_destroy cannot be combined with co_allocate_weak_reference");
+        static_assert(!ref_counted::isolates_count || !ref_counted::co_allocates_weak_reference,
+                      "isolate_count cannot be combined with co_allocate_weak_reference");
+        static_assert(!ref_counted::promotes_on_share || 
+                      (!ref_counted::provides_weak_references && !ref_counted::single_threaded && !ref_counted::biased && 
+                       !ref_counted::allows_immortal),
+                      "promote_on_share cannot be combined with weak references, single threaded, biased or immortal objects");
+        static_assert(!ref_counted::uses_weak_side_table || 
+                      (ref_counted::provides_weak_references && !ref_counted::co_allocates_weak_reference),
+                      "weak_side_table requires provide_weak_references and cannot be combined with co_allocate_weak_reference");
+        static_assert(!ref_counted::uses_weak_side_table || std::is_signed_v<CountType>, 
+                      "CountType must be signed for weak_side_table");
+        static_assert(!ref_counted::collects_cycles || 
+                      (ref_counted::single_threaded && !ref_counted::provides_weak_references && !ref_counted::allows_immortal),
+                      "cycle_collectable requires single_threaded and cannot be combined with weak references or immortal objects");
+        static_assert(!ref_counted::collects_cycles || std::is_same_v<CountType, int>,
+                      "CountType must be int (the default) for cycle_collectable");
+        static_assert(!ref_counted::destroys_after_rcu || (!ref_counted::co_allocates_weak_reference && !ref_counted::defers_destroy),
+                      "rcu_destroy cannot be combined with co_allocate_weak_reference or deferred_destroy");
         
-        using count_type = std::conditional_t<ref_counted::single_threaded, CountType, std::atomic<CountType>>;
+        using count_type = internal::ref_counted_count<Flags, CountType>;
+        using count_storage = internal::count_storage<count_type, ref_counted::isolates_count>;
 
     public:
         ref_counted(const ref_counted &) noexcept = delete;
@@ -151,7 +747,113 @@ namespace isptr
         
         void add_ref() const noexcept;
         void sub_ref() const noexcept;
+
+        //Same as calling add_ref() or sub_ref() n times but with a single atomic operation where possible
+        void add_ref_n(size_t n) const noexcept;
+        void sub_ref_n(size_t n) const noexcept;
+
+        //Makes add_ref() and sub_ref() no-ops so the object is never destroyed by releasing references.
+        //Suitable for long-lived shared objects and objects with static storage.
+        template<class X = Derived, class = std::enable_if_t<internal::dependent_bool<ref_counted::allows_immortal, X>> >
+        void make_immortal() const noexcept
+        {
+            if constexpr (!ref_counted::single_threaded)
+                this->m_count.store(ref_counted::immortal_count, std::memory_order_relaxed);
+            else
+                this->m_count = ref_counted::immortal_count;
+        }
+
+        template<class X = Derived, class = std::enable_if_t<internal::dependent_bool<ref_counted::allows_immortal, X>> >
+        bool is_immortal() const noexcept
+        {
+            if constexpr (!ref_counted::single_threaded)
+                return ref_counted::is_immortal_count(this->m_count.load(std::memory_order_relaxed));
+            else
+                return ref_counted::is_immortal_count(this->m_count);
+        }
+
+        //Switches counting to atomic operations so that the object can be used by other threads. Must be
+        //called by the creating thread before the object becomes reachable from another thread. 
+        //Storing the object in std::atomic<intrusive_shared_ptr>, hazard_atomic_ptr or rcu_ptr calls it.
+        template<class X = Derived, class = std::enable_if_t<internal::dependent_bool<ref_counted::promotes_on_share, X>> >
+        void publish() const noexcept
+        {
+            auto value = this->m_count.value.load(std::memory_order_relaxed);
+            if (!(value & count_type::published))
+            {
+                this->m_count.check_owner();
+                this->m_count.value.store(value | count_type::published, std::memory_order_release);
+            }
+        }
+
+        template<class X = Derived, class = std::enable_if_t<internal::dependent_bool<ref_counted::promotes_on_share, X>> >
+        bool is_published() const noexcept
+            { return this->m_count.value.load(std::memory_order_relaxed) & count_type::published; }
         
+        //Allocates T together with its weak reference in a single block which is freed once both the
+        //object is destroyed and all weak pointers are released. Objects of classes that co-allocate
+        //their weak references must be created via this function (make_refcnt calls it).
+        template<class T, class... Args, class X = Derived, 
+                 class = std::enable_if_t<internal::dependent_bool<ref_counted::co_allocates_weak_reference, X>> >
+        static T * co_allocate(Args &&... args)
+        {
+            static_assert(std::is_base_of_v<Derived, T>, "T must derive from Derived");
+            static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "over-aligned types cannot co-allocate weak references");
+
+            void * storage = ::operator new(ref_counted::weak_block_offset() + sizeof(T));
+            void * object_storage = static_cast<char *>(storage) + ref_counted::weak_block_offset();
+            //set before constructing T so that weak_block() can check it, including from T's constructor
+            auto block = ::new (storage) weak_value_type(1, static_cast<Derived *>(object_storage));
+            //the only weak reference is the one held by the object
+            if constexpr (!ref_counted::single_threaded)
+                block->m_count.store(1, std::memory_order_relaxed);
+            else
+                block->m_count = 1;
+            T * ret;
+            try
+            {
+                ret = ::new (object_storage) T(std::forward<Args>(args)...);
+            }
+            catch(...)
+            {
+                block->~weak_value_type();
+                ::operator delete(storage);
+                throw;
+            }
+            [[maybe_unused]] Derived * owner = ret;
+            assert(owner == block->m_owner && "Derived must be at the start of T");
+            return ret;
+        }
+
+        //Allocates T using a copy of Derived::refcnt_allocator constructed from alloc. The memory is returned
+        //through the same allocator when the object is destroyed. Only available if Derived declares a 
+        //refcnt_allocator type and T is Derived since destroy() only knows the size of Derived. Objects of 
+        //such classes must be created via this function (make_refcnt and allocate_refcnt call it).
+        template<class T, class Alloc, class... Args, class X = Derived, 
+                 class = std::enable_if_t<internal::has_refcnt_allocator<X>::value && std::is_same_v<T, X>> >
+        static T * allocate(const Alloc & alloc, Args &&... args)
+        {
+            static_assert(!ref_counted::co_allocates_weak_reference, 
+                          "refcnt_allocator cannot be combined with co_allocate_weak_reference");
+            using layout = internal::allocated_layout<T, typename X::refcnt_allocator>;
+
+            typename layout::allocator_type allocator(alloc);
+            auto storage = layout::traits::allocate(allocator, layout::units);
+            T * ret;
+            try
+            {
+                ret = ::new (static_cast<void *>(storage)) T(std::forward<Args>(args)...);
+            }
+            catch(...)
+            {
+                layout::traits::deallocate(allocator, storage, layout::units);
+                throw;
+            }
+            if constexpr (layout::stores_allocator)
+                ::new (layout::allocator_address(storage)) typename layout::allocator_type(std::move(allocator));
+            return ret;
+        }
+
         template<class X = Derived, class = std::enable_if_t<internal::dependent_bool<ref_counted::provides_weak_references, X>> >
         weak_ptr get_weak_ptr()
             { return weak_ptr::noref(const_cast<weak_reference<X> *>(const_cast<const ref_counted *>(this)->call_get_weak_value())); }
@@ -161,18 +863,37 @@ namespace isptr
             { return const_weak_ptr::noref(this->call_get_weak_value()); }
         
     protected:
-        ref_counted() noexcept = default;
+        ref_counted() noexcept:
+            count_storage(&ref_counted::initial_count)
+        {}
         ~ref_counted() noexcept;
         
         void destroy() const noexcept
-            { delete static_cast<const Derived *>(this); }
+        { 
+            //co-allocated storage is freed when the weak reference is
+            if constexpr (ref_counted::co_allocates_weak_reference)
+                static_cast<const Derived *>(this)->~Derived();
+            else if constexpr (internal::has_refcnt_allocator<Derived>::value)
+                ref_counted::deallocate(static_cast<const Derived *>(this));
+            else
+                delete static_cast<const Derived *>(this); 
+        }
         
         const weak_value_type * get_weak_value() const;
         
         weak_value_type * make_weak_reference(intptr_t count) const
         {
             auto non_const_derived = static_cast<Derived *>(const_cast<ref_counted *>(this));
-            return new weak_value_type(count, non_const_derived);
+            if constexpr (ref_counted::pools_weak_references)
+            {
+                using allocator = typename ref_counted::weak_allocator_type<>;
+                void * storage = allocator::allocate();
+                return ::new (storage) weak_value_type(count, non_const_derived);
+            }
+            else
+            {
+                return new weak_value_type(count, non_const_derived);
+            }
         }
 
     private:
@@ -181,9 +902,45 @@ namespace isptr
             { static_cast<const Derived *>(this)->add_ref(); }
         void call_sub_ref() const noexcept
             { static_cast<const Derived *>(this)->sub_ref(); }
+        void call_traverse(cycle_visitor & visitor) noexcept
+            { static_cast<Derived *>(this)->traverse(visitor); }
+
+        //Whether the count is not 0. Only meant for debug checks.
+        bool is_referenced() const noexcept;
+
+        //Classes that override add_ref() or sub_ref() see every reference individually
+        void call_add_ref_n(size_t n) const noexcept
+        {
+            if constexpr (std::is_same_v<decltype(&Derived::add_ref), void (ref_counted::*)() const noexcept>)
+                static_cast<const Derived *>(this)->add_ref_n(n);
+            else
+                for ( ; n; --n)
+                    this->call_add_ref();
+        }
+        void call_sub_ref_n(size_t n) const noexcept
+        {
+            if constexpr (std::is_same_v<decltype(&Derived::sub_ref), void (ref_counted::*)() const noexcept>)
+                static_cast<const Derived *>(this)->sub_ref_n(n);
+            else
+                for ( ; n; --n)
+                    this->call_sub_ref();
+        }
         
         void call_destroy() const noexcept
-            { static_cast<const Derived *>(this)->destroy(); }
+        {
+            if constexpr (ref_counted::defers_destroy)
+                internal::deferred_queue::push(static_cast<const Derived *>(this), &ref_counted::destroy_deferred);
+            else if constexpr (ref_counted::destroys_after_rcu)
+                internal::dependent_t<rcu_domain, Derived>::global().call_rcu(const_cast<Derived *>(static_cast<const Derived *>(this)), 
+                                                                              &ref_counted::destroy_after_rcu);
+            else
+                static_cast<const Derived *>(this)->destroy();
+        }
+
+        static void destroy_deferred(const void * obj) noexcept
+            { static_cast<const Derived *>(obj)->destroy(); }
+        static void destroy_after_rcu(void * obj) noexcept
+            { static_cast<const Derived *>(obj)->destroy(); }
 
         auto call_make_weak_reference(intptr_t count) const
         {
@@ -195,6 +952,28 @@ namespace isptr
             { return static_cast<const Derived *>(this)->get_weak_value(); }
         
         //Weak reference pointer decoding and encoding
+    #if ISPTR_USE_FETCH_ADD_WEAK_COUNT
+        //The pointer is stored above a field that starts in the middle of its range. Updates that were meant
+        //for the count but landed on the encoded pointer change only this field and are undone afterwards.
+        static constexpr unsigned straggler_bits = 15;
+        static constexpr uintptr_t straggler_base = uintptr_t(1) << (straggler_bits - 1);
+        //Largest batched update applied at once. Leaves room in the field for 256 threads updating 
+        //the count at the same time.
+        static constexpr size_t max_straggler_update = straggler_base / 256;
+        static constexpr uintptr_t weak_pointer_mask = (uintptr_t(1) << 48) - 1;
+
+        template<class X>
+        static X * decode_pointer(intptr_t count) noexcept
+            { return (X *)((uintptr_t(count) >> ref_counted::straggler_bits) & ref_counted::weak_pointer_mask); }
+
+        template<class X>
+        static intptr_t encode_pointer(X * ptr) noexcept
+        {
+            assert((uintptr_t(ptr) & ~ref_counted::weak_pointer_mask) == 0);
+            return intptr_t((uintptr_t(ptr) << ref_counted::straggler_bits) | ref_counted::straggler_base |
+                            uintptr_t(std::numeric_limits<intptr_t>::min()));
+        }
+    #else
         template<class X>
         static X * decode_pointer(intptr_t count) noexcept
             { return (X *)(uintptr_t(count) << 1); }
@@ -202,17 +981,118 @@ namespace isptr
         template<class X>
         static intptr_t encode_pointer(X * ptr) noexcept
             { return (uintptr_t(ptr) >> 1) | uintptr_t(std::numeric_limits<intptr_t>::min()); }
+    #endif
 
         static bool is_encoded_pointer(intptr_t count) noexcept
             { return count < 0; }
-    private:
-        mutable count_type m_count = 1;
-    };
 
-    template<class Owner>
-    class weak_reference
-    {
-    template<class T, ref_counted_flags Flags, class CountType> friend class ref_counted;
+        //With weak_side_table the count is replaced by this marker and the weak reference is looked up by 
+        //object address. The marker is in the middle of the negative range so that updates racing with 
+        //the replacement keep it negative.
+        static constexpr CountType side_table_marker = CountType(std::numeric_limits<CountType>::min() / 2);
+
+        weak_value_type * side_table_weak() const noexcept
+            { return static_cast<weak_value_type *>(internal::weak_side_table::find(this)); }
+
+        weak_value_type * make_side_table_weak() const;
+
+        //Destroys an object created by allocate() and returns its memory to the allocator
+        static void deallocate(const Derived * obj) noexcept
+        {
+            using layout = internal::allocated_layout<Derived, typename Derived::refcnt_allocator>;
+            using allocator_type = typename layout::allocator_type;
+
+            auto storage = reinterpret_cast<typename layout::unit *>(const_cast<Derived *>(obj));
+            obj->~Derived();
+            if constexpr (layout::stores_allocator)
+            {
+                auto stored = layout::stored_allocator(storage);
+                allocator_type allocator(std::move(*stored));
+                stored->~allocator_type();
+                layout::traits::deallocate(allocator, storage, layout::units);
+            }
+            else
+            {
+                allocator_type allocator;
+                layout::traits::deallocate(allocator, storage, layout::units);
+            }
+        }
+
+        //Allocator of pooled weak references
+        template<class X = Derived>
+        using weak_allocator_type = typename internal::weak_reference_allocator_of<X, weak_value_type>::type;
+
+        //Weak reference co-allocated in front of the object
+        static constexpr size_t weak_block_offset() noexcept
+        {
+            constexpr size_t align = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+            return (sizeof(weak_value_type) + align - 1) / align * align;
+        }
+
+        weak_value_type * weak_block() const noexcept
+        {
+            auto derived = reinterpret_cast<const char *>(static_cast<const Derived *>(this));
+            auto ret = reinterpret_cast<weak_value_type *>(const_cast<char *>(derived - ref_counted::weak_block_offset()));
+            //the block of a co-allocated object always points back to it
+            assert(ret->m_owner == static_cast<const Derived *>(this) && "object was not created via co_allocate()");
+            return ret;
+        }
+
+        //Immortal objects. Counts above the threshold are immortal. The sentinel is in the middle of that
+        //range so that updates racing with make_immortal() cannot bring the count back
+        static constexpr CountType immortal_threshold = std::numeric_limits<CountType>::max() / 2 + 1;
+        static constexpr CountType immortal_count = immortal_threshold + immortal_threshold / 2;
+
+        //Counts of weak_side_table objects saturate there
+        static constexpr bool saturates_count = ref_counted::allows_immortal || ref_counted::uses_weak_side_table;
+
+        static bool is_immortal_count(CountType count) noexcept
+            { return ref_counted::saturates_count && ISPTR_UNLIKELY(count >= ref_counted::immortal_threshold); }
+
+        void saturate() const noexcept
+        {
+            //move to the middle of the immortal range unless the count has been replaced meanwhile
+            CountType value = ref_counted::immortal_threshold;
+            while (!ref_counted::is_encoded_pointer(value) && 
+                   !this->m_count.compare_exchange_weak(value, ref_counted::immortal_count, std::memory_order_relaxed))
+            {}
+        }
+
+        //Biased counting
+        bool is_biased_owner() const noexcept
+            { return this->m_count.owner == internal::biased_owner::current() && this->m_count.biased != 0; }
+        void release_shared() const noexcept;
+        void merge_biased(bool from_queue) const noexcept;
+        static void merge_queued(internal::biased_queue_node * node) noexcept;
+
+        //Cycle collection
+        static void cycle_traverse(internal::cycle_node * node, cycle_visitor & visitor) noexcept;
+        static void cycle_release(internal::cycle_node * node) noexcept;
+        static internal::cycle_node * cycle_node_of(const ref_counted * obj) noexcept
+            { return &obj->m_count; }
+
+        static count_type initial_count() noexcept
+        {
+            if constexpr (ref_counted::biased)
+            {
+                return count_type(1, &ref_counted::merge_queued);
+            }
+            else if constexpr (ref_counted::collects_cycles)
+            {
+                static constexpr internal::cycle_ops ops{&ref_counted::cycle_traverse, &ref_counted::cycle_release};
+                return count_type(&ops);
+            }
+            else
+            {
+                return count_type(1);
+            }
+        }
+    };
+
+    template<class Owner>
+    class weak_reference
+    {
+    template<class T, ref_counted_flags Flags, class CountType> friend class ref_counted;
     friend ref_counted_traits;
     public:
         using refcnt_ptr_traits = ref_counted_traits;
@@ -224,6 +1104,13 @@ namespace isptr
 
     private:
         using count_type = std::conditional_t<weak_reference::single_threaded, intptr_t, std::atomic<intptr_t>>;
+
+        //Strong count of a destroyed owner. With wait-free lock() failed attempts keep incrementing it 
+        //but cannot clear the sign bit.
+        static constexpr intptr_t dead_owner = (!weak_reference::single_threaded && ISPTR_USE_WAIT_FREE_WEAK_LOCK) ? 
+                                                    std::numeric_limits<intptr_t>::min() : 0;
+        static intptr_t owner_refs(intptr_t value) noexcept
+            { return value < 0 ? 0 : value; }
         
     public:
         weak_reference(const weak_reference &) noexcept = delete;
@@ -242,6 +1129,39 @@ namespace isptr
         strong_ptr lock() noexcept
             { return strong_ptr::noref(this->call_lock_owner()); }
 
+        //Owners with rcu_destroy can be resolved without changing their count. The returned pointer is
+        //valid until the read section ends.
+        template<class X = Owner, class = std::enable_if_t<internal::dependent_bool<X::destroys_after_rcu, X>>>
+        const strong_value_type * peek(const internal::dependent_t<rcu_read_guard, X> & guard) const noexcept
+        {
+            assert((&guard.domain() == &internal::dependent_t<rcu_domain, X>::global()));
+            (void)guard;
+            return this->call_peek_owner();
+        }
+
+        template<class X = Owner, class = std::enable_if_t<internal::dependent_bool<X::destroys_after_rcu, X>>>
+        strong_value_type * peek(const internal::dependent_t<rcu_read_guard, X> & guard) noexcept
+        {
+            assert((&guard.domain() == &internal::dependent_t<rcu_domain, X>::global()));
+            (void)guard;
+            return this->call_peek_owner();
+        }
+
+        //Calls fn with the owner or nullptr from within a read section
+        template<class Func, class X = Owner, class = std::enable_if_t<internal::dependent_bool<X::destroys_after_rcu, X>>>
+        decltype(auto) with_locked(Func && fn) const
+        {
+            internal::dependent_t<rcu_read_guard, X> guard;
+            return std::forward<Func>(fn)(this->peek(guard));
+        }
+
+        template<class Func, class X = Owner, class = std::enable_if_t<internal::dependent_bool<X::destroys_after_rcu, X>>>
+        decltype(auto) with_locked(Func && fn)
+        {
+            internal::dependent_t<rcu_read_guard, X> guard;
+            return std::forward<Func>(fn)(this->peek(guard));
+        }
+
     protected:
         constexpr weak_reference(intptr_t initial_strong, Owner * owner) noexcept:
             m_strong(initial_strong),
@@ -251,12 +1171,32 @@ namespace isptr
         ~weak_reference() noexcept = default;
         
         void destroy() const
-            { delete static_cast<const derived_type<> *>(this); }
+        { 
+            if constexpr (Owner::co_allocates_weak_reference)
+            {
+                //we are at the start of the block that also held the owner
+                auto storage = const_cast<void *>(static_cast<const void *>(this));
+                this->~weak_reference();
+                ::operator delete(storage);
+            }
+            else if constexpr (Owner::pools_weak_references && std::is_same_v<derived_type<>, weak_reference>)
+            {
+                using allocator = typename Owner::ref_counted_base::template weak_allocator_type<Owner>;
+                auto storage = const_cast<void *>(static_cast<const void *>(this));
+                this->~weak_reference();
+                allocator::deallocate(storage);
+            }
+            else
+            {
+                delete static_cast<const derived_type<> *>(this); 
+            }
+        }
         
         void add_owner_ref() noexcept;
         void sub_owner_ref() noexcept;
         
         strong_value_type * lock_owner() const noexcept;
+        strong_value_type * peek_owner() const noexcept;
         
         void on_owner_destruction() const noexcept
         {}
@@ -275,10 +1215,46 @@ namespace isptr
             { static_cast<derived_type<> *>(this)->sub_owner_ref(); }
         void call_destroy() const
             { static_cast<const derived_type<> *>(this)->destroy(); }
+
+        //Classes that override add_owner_ref() or sub_owner_ref() see every reference individually
+        void call_add_owner_ref_n(size_t n) noexcept
+        {
+            if constexpr (std::is_same_v<decltype(&derived_type<>::add_owner_ref), void (weak_reference::*)() noexcept>)
+                this->add_owner_ref_n(n);
+            else
+                for ( ; n; --n)
+                    this->call_add_owner_ref();
+        }
+        void call_sub_owner_ref_n(size_t n) noexcept
+        {
+            if constexpr (std::is_same_v<decltype(&derived_type<>::sub_owner_ref), void (weak_reference::*)() noexcept>)
+                this->sub_owner_ref_n(n);
+            else
+                for ( ; n; --n)
+                    this->call_sub_owner_ref();
+        }
+
+        void add_owner_ref_n(size_t n) noexcept;
+        void sub_owner_ref_n(size_t n) noexcept;
+        //Called once the owner count drops to 0
+        void release_owner() noexcept;
         strong_value_type * call_lock_owner() const noexcept
             { return static_cast<const derived_type<> *>(this)->lock_owner(); }
+        strong_value_type * call_peek_owner() const noexcept
+            { return static_cast<const derived_type<> *>(this)->peek_owner(); }
         void call_on_owner_destruction() const noexcept
             { static_cast<const derived_type<> *>(this)->on_owner_destruction(); }
+
+        //A co-allocated owner cannot release its reference to us from its destructor since that could 
+        //free its memory while it is still being destroyed, so we do it here once destruction is complete
+        void release_co_allocated_owner() noexcept
+        {
+            if constexpr (Owner::co_allocates_weak_reference)
+            {
+                this->call_on_owner_destruction();
+                this->call_sub_ref(); //this can delete ourselves
+            }
+        }
         
     private:
         mutable count_type m_count = 2;
@@ -382,31 +1358,90 @@ namespace isptr
             auto oldcount = this->m_strong.fetch_sub(1, std::memory_order_release);
             assert(oldcount > 0);
             if (oldcount == 1)
-            {
-                std::atomic_thread_fence(std::memory_order_acquire);
-                auto owner = this->m_owner;
-                this->m_owner = nullptr;
-                owner->call_destroy(); //this can cascade to deleting ourselves so must be the last thing
-            }
+                this->release_owner();
         } 
         else 
         {
             assert(this->m_strong > 0);
             if (--this->m_strong == 0) 
-            {
-                auto owner = this->m_owner;
-                this->m_owner = nullptr;
-                owner->call_destroy(); //this can cascade to deleting ourselves so must be the last thing
-            }
+                this->release_owner();
+        }
+    }
+
+    template<class Owner>
+    inline void weak_reference<Owner>::add_owner_ref_n(size_t n) noexcept
+    {
+        auto delta = intptr_t(n);
+        if constexpr (!weak_reference::single_threaded) 
+        {
+            [[maybe_unused]] auto oldcount = this->m_strong.fetch_add(delta, std::memory_order_relaxed);
+            assert(oldcount > 0);
+            assert(oldcount <= std::numeric_limits<decltype(oldcount)>::max() - delta);
+        }
+        else
+        {
+            assert(this->m_strong > 0);
+            assert(this->m_strong <= std::numeric_limits<decltype(this->m_strong)>::max() - delta);
+            this->m_strong += delta;
+        }
+    }
+
+    template<class Owner>
+    inline void weak_reference<Owner>::sub_owner_ref_n(size_t n) noexcept
+    {
+        auto delta = intptr_t(n);
+        if constexpr (!weak_reference::single_threaded) 
+        {
+            auto oldcount = this->m_strong.fetch_sub(delta, std::memory_order_release);
+            assert(oldcount >= delta);
+            if (oldcount == delta)
+                this->release_owner();
+        }
+        else
+        {
+            assert(this->m_strong >= delta);
+            this->m_strong -= delta;
+            if (this->m_strong == 0)
+                this->release_owner();
         }
     }
 
+    template<class Owner>
+    inline void weak_reference<Owner>::release_owner() noexcept
+    {
+        if constexpr (!weak_reference::single_threaded) 
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+        #if ISPTR_USE_WAIT_FREE_WEAK_LOCK
+            //lock() can revive the owner until the count is marked dead. Whoever releases the revived 
+            //reference tries again.
+            intptr_t expected = 0;
+            if (!this->m_strong.compare_exchange_strong(expected, weak_reference::dead_owner, 
+                                                        std::memory_order_acquire, std::memory_order_relaxed))
+                return;
+        #endif
+        }
+        auto owner = this->m_owner;
+        //peek_owner() can still read it and co-allocated owners check it on destruction
+        if constexpr (!Owner::co_allocates_weak_reference && (weak_reference::single_threaded || !Owner::destroys_after_rcu))
+            this->m_owner = nullptr;
+        owner->call_destroy(); //this can cascade to deleting ourselves so must be the last thing
+        this->release_co_allocated_owner();
+    }
+
     template<class Owner>
     inline
     auto weak_reference<Owner>::lock_owner() const noexcept -> strong_value_type *
     {
         if constexpr (!weak_reference::single_threaded) 
         {
+        #if ISPTR_USE_WAIT_FREE_WEAK_LOCK
+            //a zero count that is not yet marked dead is revived, see sub_owner_ref()
+            intptr_t value = this->m_strong.fetch_add(1, std::memory_order_acquire);
+            if (value < 0)
+                return nullptr;
+            return this->m_owner;
+        #else
             for (intptr_t value = this->m_strong.load(std::memory_order_relaxed); ; )
             {
                 assert(value >= 0);
@@ -417,6 +1452,7 @@ namespace isptr
                 if (this->m_strong.compare_exchange_strong(value, value + 1, std::memory_order_release, std::memory_order_relaxed))
                     return this->m_owner;
             }
+        #endif
         } 
         else
         {
@@ -427,19 +1463,113 @@ namespace isptr
         }
     }
 
+    template<class Owner>
+    inline
+    auto weak_reference<Owner>::peek_owner() const noexcept -> strong_value_type *
+    {
+        //a live owner seen inside a read section is destroyed after the section ends
+        intptr_t value;
+        if constexpr (!weak_reference::single_threaded) 
+            value = this->m_strong.load(std::memory_order_acquire);
+        else
+            value = this->m_strong;
+        if (weak_reference::owner_refs(value) == 0)
+            return nullptr;
+        return this->m_owner;
+    }
+
     template<class Derived, ref_counted_flags Flags, class CountType>
     inline void ref_counted<Derived, Flags, CountType>::add_ref() const noexcept
     {
-        if constexpr(!ref_counted::provides_weak_references)
+        if constexpr(ref_counted::co_allocates_weak_reference)
+        {
+            this->weak_block()->call_add_owner_ref();
+        }
+        else if constexpr(ref_counted::promotes_on_share)
+        {
+            auto value = this->m_count.value.load(std::memory_order_relaxed);
+            assert(count_type::refs(value) > 0);
+            assert(count_type::refs(value) < std::numeric_limits<CountType>::max() / count_type::one);
+            if (value & count_type::published)
+            {
+                this->m_count.value.fetch_add(count_type::one, std::memory_order_relaxed);
+            }
+            else
+            {
+                this->m_count.check_owner();
+                this->m_count.value.store(CountType(value + count_type::one), std::memory_order_relaxed);
+            }
+        }
+        else if constexpr(ref_counted::biased)
+        {
+            if (this->is_biased_owner())
+            {
+                assert(this->m_count.biased < std::numeric_limits<CountType>::max());
+                ++this->m_count.biased;
+            }
+            else
+            {
+                [[maybe_unused]] auto oldvalue = this->m_count.shared.fetch_add(count_type::one, std::memory_order_relaxed);
+                assert(count_type::refs(oldvalue) < std::numeric_limits<CountType>::max() / count_type::one);
+            }
+        }
+        else if constexpr(ref_counted::uses_weak_side_table)
         {
             if constexpr(!ref_counted::single_threaded)
             {
+                CountType value = this->m_count.load(std::memory_order_acquire);
+                if (!ref_counted::is_encoded_pointer(value))
+                {
+                    if (ref_counted::is_immortal_count(value))
+                        return;
+                    value = this->m_count.fetch_add(1, std::memory_order_relaxed);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value > 0);
+                        if (ISPTR_UNLIKELY(value == ref_counted::immortal_threshold - 1))
+                            this->saturate();
+                        return;
+                    }
+                    //the weak reference has been created since we looked so undo and go there
+                    this->m_count.fetch_sub(1, std::memory_order_acquire);
+                }
+                this->side_table_weak()->call_add_owner_ref();
+            }
+            else
+            {
+                assert(this->m_count != 0);
+                if (!ref_counted::is_encoded_pointer(this->m_count))
+                {
+                    if (!ref_counted::is_immortal_count(this->m_count))
+                        ++this->m_count;
+                }
+                else
+                {
+                    this->side_table_weak()->call_add_owner_ref();
+                }
+            }
+        }
+        else if constexpr(ref_counted::collects_cycles)
+        {
+            this->m_count.add_ref();
+        }
+        else if constexpr(!ref_counted::provides_weak_references)
+        {
+            if constexpr(!ref_counted::single_threaded)
+            {
+                if constexpr (ref_counted::allows_immortal)
+                {
+                    if (ref_counted::is_immortal_count(this->m_count.load(std::memory_order_relaxed)))
+                        return;
+                }
                 [[maybe_unused]] auto oldcount = this->m_count.fetch_add(1, std::memory_order_relaxed);
                 assert(oldcount > 0);
                 assert(oldcount < std::numeric_limits<decltype(oldcount)>::max());
             }
             else
             {
+                if (ref_counted::is_immortal_count(this->m_count))
+                    return;
                 assert(this->m_count > 0);
                 assert(this->m_count < std::numeric_limits<decltype(this->m_count)>::max());
                 ++this->m_count;
@@ -449,7 +1579,24 @@ namespace isptr
         {
             if constexpr(!ref_counted::single_threaded)
             {
-                for(intptr_t value = this->m_count.load(std::memory_order_relaxed); ; )
+            #if ISPTR_USE_FETCH_ADD_WEAK_COUNT
+                intptr_t value = this->m_count.load(std::memory_order_acquire);
+                if (!ref_counted::is_encoded_pointer(value))
+                {
+                    value = this->m_count.fetch_add(1, std::memory_order_relaxed);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value > 0);
+                        assert(value < std::numeric_limits<decltype(value)>::max());
+                        return;
+                    }
+                    //the weak reference has been created since we looked so undo and go there
+                    this->m_count.fetch_sub(1, std::memory_order_acquire);
+                }
+                auto ptr = ref_counted::decode_pointer<weak_value_type>(value);
+                ptr->call_add_owner_ref();
+            #else
+                for(intptr_t value = this->m_count.load(std::memory_order_acquire); ; )
                 {
                     assert(value != 0);
                     if (!ref_counted::is_encoded_pointer(value))
@@ -465,6 +1612,7 @@ namespace isptr
                         return;
                     }
                 }
+            #endif
             }
             else 
             {
@@ -486,10 +1634,100 @@ namespace isptr
     template<class Derived, ref_counted_flags Flags, class CountType>
     inline void ref_counted<Derived, Flags, CountType>::sub_ref() const noexcept
     {
-        if constexpr(!ref_counted::provides_weak_references)
+        if constexpr(ref_counted::co_allocates_weak_reference)
+        {
+            this->weak_block()->call_sub_owner_ref();
+        }
+        else if constexpr(ref_counted::promotes_on_share)
+        {
+            auto value = this->m_count.value.load(std::memory_order_relaxed);
+            assert(count_type::refs(value) > 0);
+            if (value & count_type::published)
+            {
+                value = this->m_count.value.fetch_sub(count_type::one, std::memory_order_release);
+                if (value == (count_type::one | count_type::published))
+                {
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    this->call_destroy();
+                }
+            }
+            else
+            {
+                this->m_count.check_owner();
+                value = CountType(value - count_type::one);
+                this->m_count.value.store(value, std::memory_order_relaxed);
+                if (value == 0)
+                    this->call_destroy();
+            }
+        }
+        else if constexpr(ref_counted::biased)
+        {
+            if (this->is_biased_owner())
+            {
+                auto owner = this->m_count.owner;
+                if (--this->m_count.biased == 0)
+                    this->merge_biased(false);
+                if (owner->has_queued())
+                    owner->drain();
+            }
+            else
+            {
+                this->release_shared();
+            }
+        }
+        else if constexpr(ref_counted::uses_weak_side_table)
+        {
+            if constexpr(!ref_counted::single_threaded)
+            {
+                CountType value = this->m_count.load(std::memory_order_acquire);
+                if (!ref_counted::is_encoded_pointer(value))
+                {
+                    if (ref_counted::is_immortal_count(value))
+                        return;
+                    value = this->m_count.fetch_sub(1, std::memory_order_release);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value > 0);
+                        if (value == 1)
+                        {
+                            std::atomic_thread_fence(std::memory_order_acquire);
+                            this->call_destroy();
+                        }
+                        return;
+                    }
+                    //the weak reference has been created since we looked so undo and go there
+                    this->m_count.fetch_add(1, std::memory_order_acquire);
+                }
+                this->side_table_weak()->call_sub_owner_ref();
+            }
+            else
+            {
+                assert(this->m_count != 0);
+                if (!ref_counted::is_encoded_pointer(this->m_count))
+                {
+                    if (!ref_counted::is_immortal_count(this->m_count) && --this->m_count == 0)
+                        this->call_destroy();
+                }
+                else
+                {
+                    this->side_table_weak()->call_sub_owner_ref();
+                }
+            }
+        }
+        else if constexpr(ref_counted::collects_cycles)
+        {
+            if (this->m_count.sub_ref())
+                this->call_destroy();
+        }
+        else if constexpr(!ref_counted::provides_weak_references)
         {
             if constexpr(!ref_counted::single_threaded)
             {
+                if constexpr (ref_counted::allows_immortal)
+                {
+                    if (ref_counted::is_immortal_count(this->m_count.load(std::memory_order_relaxed)))
+                        return;
+                }
                 auto oldcount = this->m_count.fetch_sub(1, std::memory_order_release);
                 assert(oldcount > 0);
                 if (oldcount == 1)
@@ -500,6 +1738,8 @@ namespace isptr
             }
             else
             {
+                if (ref_counted::is_immortal_count(this->m_count))
+                    return;
                 assert(this->m_count > 0);
                 if (--this->m_count == 0)
                     this->call_destroy();
@@ -509,7 +1749,28 @@ namespace isptr
         {
             if constexpr(!ref_counted::single_threaded)
             {
-                for (intptr_t value = this->m_count.load(std::memory_order_relaxed); ; )
+            #if ISPTR_USE_FETCH_ADD_WEAK_COUNT
+                intptr_t value = this->m_count.load(std::memory_order_acquire);
+                if (!ref_counted::is_encoded_pointer(value))
+                {
+                    value = this->m_count.fetch_sub(1, std::memory_order_release);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value > 0);
+                        if (value == 1)
+                        {
+                            std::atomic_thread_fence(std::memory_order_acquire);
+                            this->call_destroy();
+                        }
+                        return;
+                    }
+                    //the weak reference has been created since we looked so undo and go there
+                    this->m_count.fetch_add(1, std::memory_order_acquire);
+                }
+                auto ptr = ref_counted::decode_pointer<weak_value_type>(value);
+                ptr->call_sub_owner_ref();
+            #else
+                for (intptr_t value = this->m_count.load(std::memory_order_acquire); ; )
                 {
                     assert(value != 0);
                     if (!ref_counted::is_encoded_pointer(value))
@@ -531,6 +1792,7 @@ namespace isptr
                         return;
                     }
                 }
+            #endif
             }
             else
             {
@@ -550,26 +1812,381 @@ namespace isptr
     }
 
 
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::add_ref_n(size_t n) const noexcept
+    {
+        if constexpr(!ref_counted::provides_weak_references && !ref_counted::biased && !ref_counted::promotes_on_share &&
+                     !ref_counted::collects_cycles)
+        {
+            auto delta = CountType(n);
+            assert(size_t(delta) == n);
+            if constexpr(!ref_counted::single_threaded)
+            {
+                if constexpr (ref_counted::allows_immortal)
+                {
+                    if (ref_counted::is_immortal_count(this->m_count.load(std::memory_order_relaxed)))
+                        return;
+                }
+                [[maybe_unused]] auto oldcount = this->m_count.fetch_add(delta, std::memory_order_relaxed);
+                assert(oldcount > 0);
+                assert(oldcount <= std::numeric_limits<decltype(oldcount)>::max() - delta);
+            }
+            else
+            {
+                if (ref_counted::is_immortal_count(this->m_count))
+                    return;
+                assert(this->m_count > 0);
+                assert(this->m_count <= std::numeric_limits<decltype(this->m_count)>::max() - delta);
+                this->m_count = CountType(this->m_count + delta);
+            }
+        }
+        else if constexpr(ref_counted::co_allocates_weak_reference)
+        {
+            this->weak_block()->call_add_owner_ref_n(n);
+        }
+        else if constexpr(ref_counted::provides_weak_references && !ref_counted::uses_weak_side_table)
+        {
+            auto delta = intptr_t(n);
+            if constexpr(!ref_counted::single_threaded)
+            {
+            #if ISPTR_USE_FETCH_ADD_WEAK_COUNT
+                intptr_t value = this->m_count.load(std::memory_order_acquire);
+                while (n && !ref_counted::is_encoded_pointer(value))
+                {
+                    delta = intptr_t(n < ref_counted::max_straggler_update ? n : ref_counted::max_straggler_update);
+                    value = this->m_count.fetch_add(delta, std::memory_order_relaxed);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value > 0);
+                        assert(value <= std::numeric_limits<decltype(value)>::max() - delta);
+                        n -= size_t(delta);
+                        continue;
+                    }
+                    //the weak reference has been created since we looked so undo and go there
+                    this->m_count.fetch_sub(delta, std::memory_order_acquire);
+                }
+                if (n)
+                    ref_counted::decode_pointer<weak_value_type>(value)->call_add_owner_ref_n(n);
+            #else
+                for(intptr_t value = this->m_count.load(std::memory_order_acquire); ; )
+                {
+                    assert(value != 0);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value <= std::numeric_limits<decltype(value)>::max() - delta);
+                        if (this->m_count.compare_exchange_strong(value, value + delta, std::memory_order_release, std::memory_order_relaxed))
+                            return;
+                    }
+                    else
+                    {
+                        ref_counted::decode_pointer<weak_value_type>(value)->call_add_owner_ref_n(n);
+                        return;
+                    }
+                }
+            #endif
+            }
+            else 
+            {
+                assert(this->m_count != 0);
+                if (!ref_counted::is_encoded_pointer(this->m_count))
+                {
+                    assert(this->m_count <= std::numeric_limits<decltype(this->m_count)>::max() - delta);
+                    this->m_count += delta;
+                }
+                else 
+                {
+                    ref_counted::decode_pointer<weak_value_type>(this->m_count)->call_add_owner_ref_n(n);
+                }
+            }
+        }
+        else
+        {
+            for ( ; n; --n)
+                this->add_ref();
+        }
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::sub_ref_n(size_t n) const noexcept
+    {
+        if (n == 0)
+            return;
+        if constexpr(!ref_counted::provides_weak_references && !ref_counted::biased && !ref_counted::promotes_on_share &&
+                     !ref_counted::collects_cycles)
+        {
+            auto delta = CountType(n);
+            assert(size_t(delta) == n);
+            if constexpr(!ref_counted::single_threaded)
+            {
+                if constexpr (ref_counted::allows_immortal)
+                {
+                    if (ref_counted::is_immortal_count(this->m_count.load(std::memory_order_relaxed)))
+                        return;
+                }
+                auto oldcount = this->m_count.fetch_sub(delta, std::memory_order_release);
+                assert(oldcount >= delta);
+                if (oldcount == delta)
+                {
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    this->call_destroy();
+                }
+            }
+            else
+            {
+                if (ref_counted::is_immortal_count(this->m_count))
+                    return;
+                assert(this->m_count >= delta);
+                this->m_count = CountType(this->m_count - delta);
+                if (this->m_count == 0)
+                    this->call_destroy();
+            }
+        }
+        else if constexpr(ref_counted::co_allocates_weak_reference)
+        {
+            this->weak_block()->call_sub_owner_ref_n(n);
+        }
+        else if constexpr(ref_counted::provides_weak_references && !ref_counted::uses_weak_side_table)
+        {
+            auto delta = intptr_t(n);
+            if constexpr(!ref_counted::single_threaded)
+            {
+            #if ISPTR_USE_FETCH_ADD_WEAK_COUNT
+                intptr_t value = this->m_count.load(std::memory_order_acquire);
+                while (n && !ref_counted::is_encoded_pointer(value))
+                {
+                    delta = intptr_t(n < ref_counted::max_straggler_update ? n : ref_counted::max_straggler_update);
+                    value = this->m_count.fetch_sub(delta, std::memory_order_release);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value >= delta);
+                        n -= size_t(delta);
+                        if (value == delta)
+                        {
+                            assert(n == 0);
+                            std::atomic_thread_fence(std::memory_order_acquire);
+                            this->call_destroy();
+                        }
+                        continue;
+                    }
+                    //the weak reference has been created since we looked so undo and go there
+                    this->m_count.fetch_add(delta, std::memory_order_acquire);
+                }
+                if (n)
+                    ref_counted::decode_pointer<weak_value_type>(value)->call_sub_owner_ref_n(n);
+            #else
+                for (intptr_t value = this->m_count.load(std::memory_order_acquire); ; )
+                {
+                    assert(value != 0);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value >= delta);
+                        if (this->m_count.compare_exchange_strong(value, value - delta, std::memory_order_release, std::memory_order_relaxed))
+                        {
+                            if (value == delta)
+                            {
+                                std::atomic_thread_fence(std::memory_order_acquire);
+                                this->call_destroy();
+                            }
+                            return;
+                        }
+                    }
+                    else
+                    {
+                        ref_counted::decode_pointer<weak_value_type>(value)->call_sub_owner_ref_n(n);
+                        return;
+                    }
+                }
+            #endif
+            }
+            else
+            {
+                assert(this->m_count != 0);
+                if (!ref_counted::is_encoded_pointer(this->m_count))
+                {
+                    assert(this->m_count >= delta);
+                    this->m_count -= delta;
+                    if (this->m_count == 0)
+                        this->call_destroy();
+                }
+                else
+                {
+                    ref_counted::decode_pointer<weak_value_type>(this->m_count)->call_sub_owner_ref_n(n);
+                }
+            }
+        }
+        else
+        {
+            for ( ; n; --n)
+                this->sub_ref();
+        }
+    }
+
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::release_shared() const noexcept
+    {
+        auto & count = this->m_count;
+        for (CountType value = count.shared.load(std::memory_order_relaxed); ; )
+        {
+            CountType desired = CountType(value - count_type::one);
+            //Before merging the owner holds a biased reference so the object cannot die here. If the 
+            //shared count goes negative we might have released the owner's last reference and it needs 
+            //to merge the counts to find out.
+            bool enqueue = !(value & count_type::merged) && !(value & count_type::queued) && count_type::refs(desired) < 0;
+            if (enqueue)
+                desired = CountType(desired | count_type::queued);
+            if (count.shared.compare_exchange_weak(value, desired, std::memory_order_release, std::memory_order_relaxed))
+            {
+                if (enqueue)
+                {
+                    count.owner->enqueue(&count.node);
+                }
+                else if ((desired & (count_type::merged | count_type::queued)) == count_type::merged && 
+                         count_type::refs(desired) == 0)
+                {
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    this->call_destroy();
+                }
+                return;
+            }
+        }
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::merge_biased(bool from_queue) const noexcept
+    {
+        auto & count = this->m_count;
+        if (!from_queue)
+        {
+            //An object still queued is destroyed when its node is merged
+            auto oldvalue = count.shared.fetch_or(count_type::merged, std::memory_order_acq_rel);
+            if (!(oldvalue & count_type::queued) && count_type::refs(oldvalue) == 0)
+                this->call_destroy();
+            return;
+        }
+
+        CountType biased = count.biased;
+        count.biased = 0;
+        for (CountType value = count.shared.load(std::memory_order_relaxed); ; )
+        {
+            CountType desired = CountType(((value + biased * count_type::one) | count_type::merged) & ~count_type::queued);
+            if (count.shared.compare_exchange_weak(value, desired, std::memory_order_acq_rel, std::memory_order_relaxed))
+            {
+                assert(count_type::refs(desired) >= 0);
+                if (count_type::refs(desired) == 0)
+                    this->call_destroy();
+                return;
+            }
+        }
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::merge_queued(internal::biased_queue_node * node) noexcept
+    {
+        //the node is the first member of m_count which is the only member of a standard layout class
+        static_assert(std::is_standard_layout_v<ref_counted> && std::is_standard_layout_v<count_type>);
+        reinterpret_cast<const ref_counted *>(node)->merge_biased(true);
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline bool ref_counted<Derived, Flags, CountType>::is_referenced() const noexcept
+    {
+        auto value_of = [](const auto & count) {
+            if constexpr (ref_counted::single_threaded)
+                return count;
+            else
+                return count.load(std::memory_order_relaxed);
+        };
+
+        if constexpr (ref_counted::co_allocates_weak_reference)
+        {
+            return weak_value_type::owner_refs(value_of(this->weak_block()->m_strong)) > 0;
+        }
+        else if constexpr (ref_counted::provides_weak_references)
+        {
+            auto value = value_of(this->m_count);
+            if (!ref_counted::is_encoded_pointer(value))
+                return value > 0;
+            const weak_value_type * weak;
+            if constexpr (ref_counted::uses_weak_side_table)
+                weak = this->side_table_weak();
+            else
+                weak = ref_counted::decode_pointer<const weak_value_type>(value);
+            return weak_value_type::owner_refs(value_of(weak->m_strong)) > 0;
+        }
+        else if constexpr (ref_counted::biased)
+        {
+            //the owner's part of the count cannot be read from other threads
+            return true;
+        }
+        else if constexpr (ref_counted::promotes_on_share)
+        {
+            return count_type::refs(this->m_count.value.load(std::memory_order_relaxed)) > 0;
+        }
+        else if constexpr (ref_counted::collects_cycles)
+        {
+            return this->m_count.count > 0;
+        }
+        else
+        {
+            return value_of(this->m_count) > 0;
+        }
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::cycle_traverse(internal::cycle_node * node, cycle_visitor & visitor) noexcept
+    {
+        //the node is m_count which is the only member of a standard layout class
+        static_assert(std::is_standard_layout_v<ref_counted>);
+        reinterpret_cast<ref_counted *>(node)->call_traverse(visitor);
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::cycle_release(internal::cycle_node * node) noexcept
+    {
+        reinterpret_cast<const ref_counted *>(node)->call_sub_ref();
+    }
+
     template<class Derived, ref_counted_flags Flags, class CountType>
     inline auto ref_counted<Derived, Flags, CountType>::get_weak_value() const -> const weak_value_type *
     {
         static_assert(ref_counted::provides_weak_references, "class doesn't provide weak references");
         
-        if constexpr(!ref_counted::single_threaded)
+        if constexpr(ref_counted::co_allocates_weak_reference)
+        {
+            auto ptr = this->weak_block();
+            ptr->call_add_ref();
+            return ptr;
+        }
+        else if constexpr(ref_counted::uses_weak_side_table)
+        {
+            bool created;
+            auto ptr = static_cast<weak_value_type *>(
+                internal::weak_side_table::find_or_insert(this, [this]() -> void * { return this->make_side_table_weak(); }, created));
+            if (!created)
+                ptr->call_add_ref();
+            return ptr;
+        }
+        else if constexpr(!ref_counted::single_threaded)
         {
+            weak_reference<Derived> * ret = nullptr;
             for (intptr_t value = this->m_count.load(std::memory_order_acquire); ; )
             {
                 if (!ref_counted::is_encoded_pointer(value))
                 {
-                    weak_reference<Derived> * ret = this->call_make_weak_reference(value);
+                    //the count keeps changing until we publish so retries only refresh the unpublished copy
+                    if (!ret)
+                        ret = this->call_make_weak_reference(value);
+                    else
+                        ret->m_strong.store(value, std::memory_order_relaxed);
                     uintptr_t desired = ref_counted::encode_pointer(ret);
-                    if (this->m_count.compare_exchange_strong(value, desired, std::memory_order_release, std::memory_order_relaxed))
+                    if (this->m_count.compare_exchange_strong(value, desired, std::memory_order_acq_rel, std::memory_order_acquire))
                         return ret;
-
-                    ret->call_destroy();
                 }
                 else
                 {
+                    if (ret)
+                        ret->call_destroy();
                     auto ptr = ref_counted::decode_pointer<weak_value_type>(value);
                     ptr->call_add_ref();
                     return ptr;
@@ -593,12 +2210,83 @@ namespace isptr
         }
     }
 
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline auto ref_counted<Derived, Flags, CountType>::make_side_table_weak() const -> weak_value_type *
+    {
+        //a saturated count stays saturated in the weak reference
+        auto strong = [](CountType value) {
+            return ref_counted::is_immortal_count(value) ? std::numeric_limits<intptr_t>::max() / 2 : intptr_t(value);
+        };
+
+        weak_value_type * ret = this->call_make_weak_reference(0);
+        if constexpr(!ref_counted::single_threaded)
+        {
+            //only add_ref() and sub_ref() can change the count while we hold the side table lock
+            for (CountType value = this->m_count.load(std::memory_order_relaxed); ; )
+            {
+                assert(value > 0);
+                ret->m_strong.store(strong(value), std::memory_order_relaxed);
+                if (this->m_count.compare_exchange_weak(value, ref_counted::side_table_marker, std::memory_order_acq_rel, std::memory_order_relaxed))
+                    return ret;
+            }
+        }
+        else
+        {
+            assert(this->m_count > 0);
+            ret->m_strong = strong(this->m_count);
+            this->m_count = ref_counted::side_table_marker;
+            return ret;
+        }
+    }
+
     template<class Derived, ref_counted_flags Flags, class CountType>
     inline ref_counted<Derived, Flags, CountType>::~ref_counted() noexcept
     {
-        [[maybe_unused]] auto valid_count = [](auto val) { return val == 0 || val == 1;};
+        [[maybe_unused]] auto valid_count = [](auto val) { 
+            return val == 0 || val == 1 || (ref_counted::saturates_count && val >= ref_counted::immortal_threshold); 
+        };
         
-        if constexpr (ref_counted::provides_weak_references)
+        if constexpr (ref_counted::co_allocates_weak_reference)
+        {
+            //the weak reference is released by weak_reference::sub_owner_ref() after destruction completes
+            if constexpr(!ref_counted::single_threaded)
+                assert(valid_count(weak_value_type::owner_refs(this->weak_block()->m_strong.load(std::memory_order_relaxed))));
+            else
+                assert(valid_count(this->weak_block()->m_strong));
+        }
+        else if constexpr (ref_counted::uses_weak_side_table)
+        {
+            CountType value;
+            if constexpr(!ref_counted::single_threaded)
+                value = this->m_count.load(std::memory_order_relaxed);
+            else
+                value = this->m_count;
+            if (ref_counted::is_encoded_pointer(value))
+            {
+                auto ptr = static_cast<const weak_value_type *>(internal::weak_side_table::erase(this));
+                assert(ptr);
+                //a saturated object can only be destroyed directly and must not be locked after that
+                if constexpr(!ref_counted::single_threaded)
+                {
+                    assert(valid_count(weak_value_type::owner_refs(ptr->m_strong.load(std::memory_order_relaxed))));
+                    if (ptr->m_strong.load(std::memory_order_relaxed) > 1)
+                        ptr->m_strong.store(weak_value_type::dead_owner, std::memory_order_relaxed);
+                }
+                else
+                {
+                    assert(valid_count(ptr->m_strong));
+                    if (ptr->m_strong > 1)
+                        ptr->m_strong = 0;
+                }
+                ptr->call_on_owner_destruction();
+                ptr->call_sub_ref();
+            }
+            else
+            {
+                assert(valid_count(value));
+            }
+        }
+        else if constexpr (ref_counted::provides_weak_references)
         {
             if constexpr(!ref_counted::single_threaded)
             {
@@ -606,7 +2294,7 @@ namespace isptr
                 if (ref_counted::is_encoded_pointer(value))
                 {
                     auto ptr = ref_counted::decode_pointer<const weak_value_type>(value);
-                    assert(valid_count(ptr->m_strong.load(std::memory_order_relaxed)));
+                    assert(valid_count(weak_value_type::owner_refs(ptr->m_strong.load(std::memory_order_relaxed))));
                     ptr->call_on_owner_destruction();
                     ptr->call_sub_ref();
                 }
@@ -630,6 +2318,21 @@ namespace isptr
                 }
             }
         }
+        else if constexpr (ref_counted::biased)
+        {
+            assert(valid_count(this->m_count.biased + count_type::refs(this->m_count.shared.load(std::memory_order_relaxed))));
+        }
+        else if constexpr (ref_counted::promotes_on_share)
+        {
+            assert(valid_count(count_type::refs(this->m_count.value.load(std::memory_order_relaxed))));
+        }
+        else if constexpr (ref_counted::collects_cycles)
+        {
+            //objects can be destroyed directly while buffered
+            assert(valid_count(this->m_count.count));
+            if (this->m_count.buffered())
+                this->m_count.unlink();
+        }
         else
         {
             if constexpr(!ref_counted::single_threaded)
@@ -638,6 +2341,104 @@ namespace isptr
                 assert(valid_count(this->m_count));
         }
     }
+
+    //MARK:- Layout report
+
+    //Reports where the count of obj landed. The payload is whatever follows the ref_counted base of obj, 
+    //normally the first members of T.
+    template<class T>
+    ref_counted_layout layout_of_ref_counted(const T & obj) noexcept
+    {
+        using base_type = typename T::ref_counted_base;
+
+        const base_type & base = obj;
+        auto address = [](const void * ptr) { return reinterpret_cast<uintptr_t>(ptr); };
+        auto start = address(std::addressof(obj));
+        auto count = address(std::addressof(base.m_count));
+        auto payload = address(std::addressof(base)) + sizeof(base_type);
+
+        ref_counted_layout ret;
+        ret.object_size = sizeof(T);
+        ret.count_offset = count - start;
+        ret.count_size = sizeof(base.m_count);
+        ret.count_padding = sizeof(typename base_type::count_storage) - sizeof(base.m_count);
+        ret.payload_offset = payload - start;
+        ret.count_line = count / ISPTR_CACHE_LINE_SIZE - start / ISPTR_CACHE_LINE_SIZE;
+        ret.payload_line = payload / ISPTR_CACHE_LINE_SIZE - start / ISPTR_CACHE_LINE_SIZE;
+        return ret;
+    }
+
+    //MARK:- atomic_weak_ptr
+
+    ISPTR_EXPORTED
+    template<class WeakValue, class Policy = default_atomic_policy>
+    class atomic_weak_ptr : public atomic_intrusive_shared_ptr<WeakValue, ref_counted_traits, Policy>
+    {
+    private:
+        using base = atomic_intrusive_shared_ptr<WeakValue, ref_counted_traits, Policy>;
+    public:
+        using typename base::value_type;
+        using strong_ptr = decltype(std::declval<WeakValue &>().lock());
+
+    public:
+        constexpr atomic_weak_ptr() noexcept = default;
+        atomic_weak_ptr(value_type desired) noexcept : base(std::move(desired))
+            {}
+
+        atomic_weak_ptr(const atomic_weak_ptr &) = delete;
+        atomic_weak_ptr & operator=(const atomic_weak_ptr &) = delete;
+
+        using base::operator=;
+
+        //Equivalent to load()->lock() but does not add and release a reference to the weak reference itself
+        strong_ptr lock_strong() const noexcept
+        {
+            return this->borrow([](WeakValue * weak) noexcept {
+                return weak ? weak->lock() : strong_ptr();
+            });
+        }
+    };
+}
+
+namespace std
+{
+    template<class Owner>
+    class atomic<::isptr::intrusive_shared_ptr<::isptr::weak_reference<Owner>, ::isptr::ref_counted_traits>> : 
+        public ::isptr::atomic_weak_ptr<::isptr::weak_reference<Owner>>
+    {
+    private:
+        using base = ::isptr::atomic_weak_ptr<::isptr::weak_reference<Owner>>;
+    public:
+        using typename base::value_type;
+    public:
+        constexpr atomic() noexcept = default;
+        atomic(value_type desired) noexcept : base(std::move(desired))
+            {}
+        
+        atomic(const atomic&) = delete;
+        atomic & operator=(const atomic&) = delete;
+
+        using base::operator=;
+    };
+
+    template<class Owner>
+    class atomic<::isptr::intrusive_shared_ptr<const ::isptr::weak_reference<Owner>, ::isptr::ref_counted_traits>> : 
+        public ::isptr::atomic_weak_ptr<const ::isptr::weak_reference<Owner>>
+    {
+    private:
+        using base = ::isptr::atomic_weak_ptr<const ::isptr::weak_reference<Owner>>;
+    public:
+        using typename base::value_type;
+    public:
+        constexpr atomic() noexcept = default;
+        atomic(value_type desired) noexcept : base(std::move(desired))
+            {}
+        
+        atomic(const atomic&) = delete;
+        atomic & operator=(const atomic&) = delete;
+
+        using base::operator=;
+    };
 }
 
 #endif
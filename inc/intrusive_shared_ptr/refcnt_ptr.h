@@ -18,6 +18,10 @@ namespace isptr
     template<class T>
     using refcnt_ptr = intrusive_shared_ptr<T, typename T::refcnt_ptr_traits>;
 
+    ISPTR_EXPORTED
+    template<class T>
+    using borrowed_refcnt_ptr = borrowed_ptr<T, typename T::refcnt_ptr_traits>;
+
     ISPTR_EXPORTED
     template<class T>
     constexpr refcnt_ptr<T> refcnt_retain(T * ptr) noexcept {
@@ -30,10 +34,45 @@ namespace isptr
         return refcnt_ptr<T>::noref(ptr);
     }
 
+    namespace internal
+    {
+        template<class Void, class T, class... Args>
+        struct has_co_allocate : std::false_type {};
+
+        template<class T, class... Args>
+        struct has_co_allocate<std::void_t<decltype(T::template co_allocate<T>(std::declval<Args>()...))>, T, Args...> : std::true_type {};
+
+        template<class Void, class T, class... Args>
+        struct has_allocate : std::false_type {};
+
+        template<class T, class... Args>
+        struct has_allocate<std::void_t<decltype(T::template allocate<T>(std::declval<const typename T::refcnt_allocator &>(), 
+                                                                          std::declval<Args>()...))>, T, Args...> : std::true_type {};
+    }
+
     ISPTR_EXPORTED
     template<class T, class... Args>
     inline refcnt_ptr<T> make_refcnt(Args &&... args) {
-        return refcnt_ptr<T>::noref(new T( std::forward<Args>(args)... ));
+        //classes that co-allocate their weak references need to allocate themselves
+        if constexpr (internal::has_co_allocate<void, T, Args &&...>::value)
+            return refcnt_ptr<T>::noref(T::template co_allocate<T>(std::forward<Args>(args)...));
+        //and so do classes that use an allocator
+        else if constexpr (internal::has_allocate<void, T, Args &&...>::value)
+            return refcnt_ptr<T>::noref(T::template allocate<T>(typename T::refcnt_allocator(), std::forward<Args>(args)...));
+        else if constexpr (internal::has_refcnt_allocator<T>::value)
+            static_assert(internal::dependent_bool<false, T>, 
+                          "classes with refcnt_allocator can only be created as the Derived type of their ref_counted base");
+        else
+            return refcnt_ptr<T>::noref(new T( std::forward<Args>(args)... ));
+    }
+
+    //Creates T using an allocator. T must declare a refcnt_allocator type constructible from alloc.
+    ISPTR_EXPORTED
+    template<class T, class Alloc, class... Args>
+    inline refcnt_ptr<T> allocate_refcnt(const Alloc & alloc, Args &&... args) {
+        static_assert(internal::has_allocate<void, T, Args &&...>::value, 
+                      "T must declare refcnt_allocator and be the Derived type of its ref_counted base");
+        return refcnt_ptr<T>::noref(T::template allocate<T>(alloc, std::forward<Args>(args)...));
     }
 
     ISPTR_EXPORTED
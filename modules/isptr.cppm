@@ -23,7 +23,11 @@ module;
 
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <compare>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #if defined(_MSC_VER) && !defined(__clang__) && (defined(_M_X64) || defined(_M_IX86))
     #include <emmintrin.h>
 #endif
@@ -35,10 +39,15 @@ module;
     #include <intrin.h>
 #endif
 
+#include <iterator>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <ostream>
+#include <thread>
 #include <type_traits>
+#include <vector>
 
 
 export module isptr;
@@ -57,6 +66,7 @@ export module isptr;
 #endif
 
 
+
 #if __cpp_constexpr >= 201907L
 
     #define ISPTR_CONSTEXPR_SINCE_CPP20 constexpr
@@ -120,23 +130,104 @@ export module isptr;
 #endif
 
 
+//Size used to keep independently modified data on separate cache lines. 
+//std::hardware_destructive_interference_size is not reliably usable in headers.
+#ifndef ISPTR_CACHE_LINE_SIZE
+
+    #if defined(__APPLE__) && defined(__aarch64__)
+        #define ISPTR_CACHE_LINE_SIZE 128
+    #else
+        #define ISPTR_CACHE_LINE_SIZE 64
+    #endif
+
+#endif
+
+//Lock-free std::atomic<intrusive_shared_ptr> and fetch_add weak counts store data in the upper 16 bits of
+//a pointer. This requires 64-bit pointers with no more than 48 significant bits which is not the case when
+//the top byte of a pointer can carry a tag (Android, ARM memory tagging or hardware-assisted AddressSanitizer).
+#if (defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__) || defined(_M_ARM64)) && !defined(__ANDROID__) \
+    && !defined(__ARM_FEATURE_MEMORY_TAGGING) && !defined(__SANITIZE_HWADDRESS__)
+
+    #define ISPTR_POINTER_HAS_FREE_TOP_BITS 1
+
+#else
+
+    #define ISPTR_POINTER_HAS_FREE_TOP_BITS 0
+
+#endif
+
+#if defined(__has_feature)
+    #if __has_feature(hwaddress_sanitizer)
+        #undef ISPTR_POINTER_HAS_FREE_TOP_BITS
+        #define ISPTR_POINTER_HAS_FREE_TOP_BITS 0
+    #endif
+#endif
+
+//Lock-free std::atomic<intrusive_shared_ptr> packs a count into the upper bits of a pointer. Define 
+//ISPTR_USE_LOCK_FREE_ATOMIC to 0 to use a spin lock based implementation instead.
+#ifndef ISPTR_USE_LOCK_FREE_ATOMIC
+    #define ISPTR_USE_LOCK_FREE_ATOMIC ISPTR_POINTER_HAS_FREE_TOP_BITS
+#endif
+
+//Weak-capable ref_counted objects update their count with plain fetch_add/fetch_sub. Once a weak reference is
+//created its pointer is stored in the count above a field that absorbs updates racing with the creation.
+//Define ISPTR_USE_FETCH_ADD_WEAK_COUNT to 0 to use compare-and-swap loops instead.
+#ifndef ISPTR_USE_FETCH_ADD_WEAK_COUNT
+    #define ISPTR_USE_FETCH_ADD_WEAK_COUNT ISPTR_POINTER_HAS_FREE_TOP_BITS
+#endif
+
+//weak_reference::lock() increments the strong count with a single fetch_add. The count of a destroyed owner
+//has a sticky sign bit so that the increment fails it without a retry loop. Define ISPTR_USE_WAIT_FREE_WEAK_LOCK
+//to 0 to use a compare-and-swap loop that never increments a zero count instead.
+#ifndef ISPTR_USE_WAIT_FREE_WEAK_LOCK
+    #define ISPTR_USE_WAIT_FREE_WEAK_LOCK 1
+#endif
+
+//Locks park waiting threads via std::atomic::wait when it is available and atomic pointers provide
+//wait/notify_one/notify_all. Define ISPTR_USE_ATOMIC_WAIT to 0 to make locks yield to the scheduler
+//instead and to omit waiting on atomic pointers.
+#ifndef ISPTR_USE_ATOMIC_WAIT
+
+    #if __cpp_lib_atomic_wait >= 201907L
+        #define ISPTR_USE_ATOMIC_WAIT 1
+    #else
+        #define ISPTR_USE_ATOMIC_WAIT 0
+    #endif
+
+#endif
+
+//ref_counted objects with promote_on_share flag assert that they are not used by another thread before
+//they are published. It changes object layout so it must have the same value in all translation units
+//and, unlike assert(), does not follow NDEBUG.
+#ifndef ISPTR_CHECK_UNPUBLISHED_USE
+    #define ISPTR_CHECK_UNPUBLISHED_USE 0
+#endif
+
+
 #if defined(_MSC_VER) && !defined(__clang__)
 
     #define ISPTR_ALWAYS_INLINE __forceinline
     #define ISPTR_TRIVIAL_ABI
+    #define ISPTR_UNLIKELY(x) (x)
 
 #elif defined(__clang__) 
 
     #define ISPTR_ALWAYS_INLINE [[gnu::always_inline]] inline
     #define ISPTR_TRIVIAL_ABI [[clang::trivial_abi]]
+    #define ISPTR_UNLIKELY(x) __builtin_expect(!!(x), 0)
 
 #elif defined (__GNUC__)
 
     #define ISPTR_ALWAYS_INLINE [[gnu::always_inline]] inline
     #define ISPTR_TRIVIAL_ABI
+    #define ISPTR_UNLIKELY(x) __builtin_expect(!!(x), 0)
 
 #endif
 
+#ifndef ISPTR_UNLIKELY
+    #define ISPTR_UNLIKELY(x) (x)
+#endif
+
 #ifndef ISPTR_EXPORTED
     #define ISPTR_EXPORTED
 #endif
@@ -146,6 +237,31 @@ namespace isptr::internal
 {
     template<bool Val, class... Args>
     constexpr bool dependent_bool = Val;
+
+    //T made dependent on X so that a possibly incomplete T is only looked at when X is known
+    template<class T, class X>
+    struct dependent_type
+    {
+        using type = T;
+    };
+    template<class T, class X>
+    using dependent_t = typename dependent_type<T, X>::type;
+
+    template<class T, class = void>
+    struct has_refcnt_allocator : std::false_type {};
+
+    template<class T>
+    struct has_refcnt_allocator<T, std::void_t<typename T::refcnt_allocator>> : std::true_type {};
+
+    //T preceded by a cache line of padding so that it never shares a line with the data laid out 
+    //before it. Explicit padding is used rather than alignas since over-aligned structs trigger padding
+    //warnings (C4324 under MSVC).
+    template<class T>
+    struct cache_line_padded
+    {
+        char padding[ISPTR_CACHE_LINE_SIZE] = {};
+        T value{};
+    };
 }
 
 
@@ -172,6 +288,30 @@ namespace isptr
             auto operator()(Traits *, T * p) noexcept(noexcept(Traits::sub_ref(p))) -> decltype(Traits::sub_ref(p));
         };
 
+        struct add_ref_n_detector
+        {
+            template<class Traits, class T>
+            auto operator()(Traits * , T * p) noexcept(noexcept(Traits::add_ref_n(p, size_t(1)))) -> decltype(Traits::add_ref_n(p, size_t(1)));
+        };
+
+        struct sub_ref_n_detector
+        {
+            template<class Traits, class T>
+            auto operator()(Traits *, T * p) noexcept(noexcept(Traits::sub_ref_n(p, size_t(1)))) -> decltype(Traits::sub_ref_n(p, size_t(1)));
+        };
+
+        struct publish_detector
+        {
+            template<class Traits, class T>
+            auto operator()(Traits *, T * p) noexcept(noexcept(Traits::publish(p))) -> decltype(Traits::publish(p));
+        };
+
+        struct is_referenced_detector
+        {
+            template<class Traits, class T>
+            auto operator()(Traits *, T * p) noexcept(noexcept(Traits::is_referenced(p))) -> decltype(Traits::is_referenced(p));
+        };
+
     }
 
     template<class Traits, class T>
@@ -185,8 +325,6 @@ namespace isptr
     {
         static_assert(are_intrusive_shared_traits<Traits, T>, "Invalid Traits for type T");
         
-        friend std::atomic<intrusive_shared_ptr<T, Traits>>;
-
     #if ISPTR_SUPPORT_OUT_PTR
         friend std::out_ptr_t<intrusive_shared_ptr<T, Traits>, T *>;
         friend std::inout_ptr_t<intrusive_shared_ptr<T, Traits>, T *>;
@@ -535,1008 +673,5722 @@ namespace isptr
     std::enable_if_t<is_intrusive_shared_ptr_v<Dest> && std::is_same_v<typename Dest::traits_type, Traits>,
     Dest> intrusive_static_cast(intrusive_shared_ptr<Src, Traits> p) noexcept
         { return Dest::noref(static_cast<typename Dest::pointer>(p.release())); }
-}
 
-namespace isptr 
-{
+    //MARK:- Batched operations
+
     namespace internal
     {
-        class simple_lock {
-        public:
-            void lock() noexcept 
+        //Adds n references to p via Traits::add_ref_n if available or one by one otherwise
+        template<class Traits, class T>
+        void add_refs(T * p, size_t n) noexcept
+        {
+            if constexpr (std::is_nothrow_invocable_v<add_ref_n_detector, Traits *, T *>)
+                Traits::add_ref_n(p, n);
+            else
+                for ( ; n; --n)
+                    Traits::add_ref(p);
+        }
+
+        //Removes n references from p via Traits::sub_ref_n if available or one by one otherwise
+        template<class Traits, class T>
+        void sub_refs(T * p, size_t n) noexcept
+        {
+            if constexpr (std::is_nothrow_invocable_v<sub_ref_n_detector, Traits *, T *>)
+                Traits::sub_ref_n(p, n);
+            else
+                for ( ; n; --n)
+                    Traits::sub_ref(p);
+        }
+
+        //Tells p that it is about to become reachable from other threads via Traits::publish if available
+        template<class Traits, class T>
+        void publish(T * p) noexcept
+        {
+            if constexpr (std::is_nothrow_invocable_v<publish_detector, Traits *, T *>)
             {
-                for ( ; ; ) {
-                    
-                    while (m_value.load(std::memory_order_relaxed)) 
-                        yield();
-                    
-                    unsigned current = 0;
-                    if (m_value.compare_exchange_strong(current, 1, std::memory_order_acquire, std::memory_order_relaxed))
-                        return;
-                
-                    yield();
-                }
+                if (p)
+                    Traits::publish(p);
             }
+        }
+    }
 
-            void unlock() noexcept 
-                { m_value.store(0, std::memory_order_release); }
+    //MARK:- borrowed_ptr
 
-        private:
-            static void yield() noexcept {
-                #ifdef ISPTR_THREAD_YIELD
-                    ISPTR_THREAD_YIELD;
-                #endif
-            }
-        private:
-            std::atomic<unsigned> m_value{0};
-        };
+    namespace internal
+    {
+        //Whether p still has references according to Traits::is_referenced. True if Traits cannot tell.
+        template<class Traits, class T>
+        bool is_referenced(T * p) noexcept
+        {
+            if constexpr (std::is_nothrow_invocable_v<is_referenced_detector, Traits *, T *>)
+                return Traits::is_referenced(p);
+            else
+                return true;
+        }
     }
-}
 
-namespace std
-{
-    template<class Traits, class T>
-    class atomic<::isptr::intrusive_shared_ptr<T, Traits>>
+    //A non-owning pointer to an object kept alive by an intrusive_shared_ptr elsewhere. It is trivially copyable 
+    //and creating, copying or destroying it does not change the reference count, which makes it a cheap parameter 
+    //type. The caller must keep an owning pointer alive while it is used. Debug builds assert on every access 
+    //that the object still has references if Traits provides is_referenced(p).
+    ISPTR_EXPORTED
+    template<class T, class Traits>
+    class borrowed_ptr
     {
+        static_assert(are_intrusive_shared_traits<Traits, T>, "Invalid Traits for type T");
+
     public:
-        using value_type = ::isptr::intrusive_shared_ptr<T, Traits>;
-    public:
-        static constexpr bool is_always_lock_free = false;
+        using pointer = T *;
+        using element_type = T;
+        using traits_type = Traits;
+        using owning_ptr = intrusive_shared_ptr<T, Traits>;
 
-        constexpr atomic() noexcept = default;
-        atomic(value_type desired) noexcept : m_p(desired.m_p)
-            { desired.m_p = nullptr; }
-        
-        atomic(const atomic&) = delete;
-        atomic & operator=(const atomic&) = delete;
-        
-        ~atomic() noexcept
-            { value_type::do_sub_ref(this->m_p); }
+    public:
+        constexpr borrowed_ptr() noexcept = default;
+        constexpr borrowed_ptr(std::nullptr_t) noexcept
+            {}
+        template<class Y, class = std::enable_if_t<std::is_convertible_v<Y *, T *>, void>>
+        constexpr borrowed_ptr(const intrusive_shared_ptr<Y, Traits> & src) noexcept : m_p(src.get())
+            {}
+        //A temporary would be destroyed while still borrowed
+        template<class Y, class = std::enable_if_t<std::is_convertible_v<Y *, T *>, void>>
+        borrowed_ptr(intrusive_shared_ptr<Y, Traits> && src) = delete;
+        template<class Y, class = std::enable_if_t<std::is_convertible_v<Y *, T *> && !std::is_same_v<Y, T>, void>>
+        constexpr borrowed_ptr(borrowed_ptr<Y, Traits> src) noexcept : m_p(src.get())
+            {}
 
-        value_type operator=(value_type desired) noexcept
+        constexpr T * get() const noexcept
         { 
-            this->store(desired);
-            return desired; 
+            this->check();
+            return this->m_p; 
         }
 
-        operator value_type() const noexcept
-            { return this->load(); }
+        constexpr T * operator->() const noexcept
+            { return this->get(); }
 
-        value_type load(memory_order /*order*/ = memory_order_seq_cst) const noexcept
-        {
-            this->m_lock.lock();
-            auto ret = value_type::ref(this->m_p);
-            this->m_lock.unlock();
-            return ret;
-        }
+        template<class X=T>
+        constexpr
+        std::enable_if_t<std::is_same_v<X, T>,
+        X &> operator*() const noexcept
+            { return *this->get(); }
 
-        void store(value_type desired, memory_order /*order*/ = memory_order_seq_cst) noexcept
-        { 
-            this->m_lock.lock();
-            std::swap(this->m_p, desired.m_p);
-            this->m_lock.unlock();
-        }
-        
-        value_type exchange(value_type desired, memory_order /*order*/ = memory_order_seq_cst) noexcept
-        {
-            this->m_lock.lock();
-            std::swap(this->m_p, desired.m_p);
-            this->m_lock.unlock();
-            return desired;
-        }
+        constexpr explicit operator bool() const noexcept
+            { return this->m_p; }
 
-        bool compare_exchange_strong(value_type & expected, value_type desired, memory_order /*success*/, memory_order /*failure*/) noexcept
-            { return this->do_compare_exchange(expected, std::move(desired)); }
+        //Promotes to an owning pointer
+        constexpr owning_ptr ref() const noexcept
+            { return owning_ptr::ref(this->get()); }
 
-        bool compare_exchange_strong(value_type & expected, value_type desired, memory_order /*order*/ = memory_order_seq_cst) noexcept
-            { return this->do_compare_exchange(expected, std::move(desired)); }
+        template<class Y>
+        friend constexpr bool operator==(borrowed_ptr lhs, borrowed_ptr<Y, Traits> rhs) noexcept
+            { return lhs.m_p == rhs.m_p; }
 
-        bool compare_exchange_weak(value_type & expected, value_type desired, memory_order /*success*/, memory_order /*failure*/) noexcept
-            { return this->do_compare_exchange(expected, std::move(desired)); }
-        bool compare_exchange_weak(value_type & expected, value_type desired, memory_order /*order*/ = memory_order_seq_cst) noexcept
-            { return this->do_compare_exchange(expected, std::move(desired)); }
+        template<class Y, class YTraits>
+        friend constexpr bool operator==(borrowed_ptr lhs, const intrusive_shared_ptr<Y, YTraits> & rhs) noexcept
+            { return lhs.m_p == rhs.get(); }
 
+        template<class Y, class YTraits>
+        friend constexpr bool operator==(const intrusive_shared_ptr<Y, YTraits> & lhs, borrowed_ptr rhs) noexcept
+            { return lhs.get() == rhs.m_p; }
 
-        bool is_lock_free() const noexcept
-            { return false; }
-        
-    private:
-        bool do_compare_exchange(value_type & expected, value_type && desired) noexcept
-        {
-            this->m_lock.lock();
-            if (this->m_p == expected.m_p) {
-                std::swap(this->m_p, desired.m_p);
-                this->m_lock.unlock();
-                return true;
-            } else {
-                expected = value_type::ref(this->m_p);
-                this->m_lock.unlock();
-                return false;
-            }
-        }
-    private:
-        mutable isptr::internal::simple_lock m_lock;
-        T * m_p = nullptr;
-    };
+        friend constexpr bool operator==(borrowed_ptr lhs, std::nullptr_t) noexcept
+            { return lhs.m_p == nullptr; }
 
-#if ISPTR_SUPPORT_OUT_PTR
+        friend constexpr bool operator==(std::nullptr_t, borrowed_ptr rhs) noexcept
+            { return nullptr == rhs.m_p; }
 
-    template<class T, class Traits>
-    class out_ptr_t<::isptr::intrusive_shared_ptr<T, Traits>, T *>
-    {
-    public:
-        constexpr out_ptr_t(::isptr::intrusive_shared_ptr<T, Traits> & owner) noexcept:
-            m_p(&owner.m_p)
-        {
-            owner.reset();
-        }
-        constexpr out_ptr_t(out_ptr_t && src) noexcept = default;
-        out_ptr_t(const out_ptr_t &) = delete;
+        template<class Y>
+        friend constexpr bool operator!=(borrowed_ptr lhs, borrowed_ptr<Y, Traits> rhs) noexcept
+            { return !(lhs == rhs); }
 
-        void operator=(const out_ptr_t &) = delete;
-        void operator=(out_ptr_t &&) = delete;
+        template<class Y, class YTraits>
+        friend constexpr bool operator!=(borrowed_ptr lhs, const intrusive_shared_ptr<Y, YTraits> & rhs) noexcept
+            { return !(lhs == rhs); }
 
-        constexpr operator T**() const noexcept
-            { return m_p; }
+        template<class Y, class YTraits>
+        friend constexpr bool operator!=(const intrusive_shared_ptr<Y, YTraits> & lhs, borrowed_ptr rhs) noexcept
+            { return !(lhs == rhs); }
 
-        constexpr operator void**() const noexcept requires(!std::is_same_v<T *, void *>)
-            { return reinterpret_cast<void**>(m_p); }
-    private:
-        T ** m_p;
-    };
+        friend constexpr bool operator!=(borrowed_ptr lhs, std::nullptr_t) noexcept
+            { return !(lhs == nullptr); }
 
-    template<class T, class Traits>
-    class inout_ptr_t<::isptr::intrusive_shared_ptr<T, Traits>, T *>
-    {
-    public:
-        constexpr inout_ptr_t(::isptr::intrusive_shared_ptr<T, Traits> & owner) noexcept :
-            m_p(&owner.m_p)
-        {}
-        constexpr inout_ptr_t(inout_ptr_t && src) noexcept = default;
-        inout_ptr_t(const inout_ptr_t &) = delete;
+        friend constexpr bool operator!=(std::nullptr_t, borrowed_ptr rhs) noexcept
+            { return !(nullptr == rhs); }
 
-        void operator=(const inout_ptr_t &) = delete;
-        void operator=(inout_ptr_t &&) = delete;
+    private:
+        template<class Y, class YTraits> friend class borrowed_ptr;
 
-        constexpr operator T**() const noexcept
-            { return m_p; }
+        constexpr void check() const noexcept
+            { assert(!this->m_p || internal::is_referenced<Traits>(this->m_p)); }
 
-        constexpr operator void**() const noexcept requires(!std::is_same_v<T *, void *>)
-            { return reinterpret_cast<void**>(m_p); }
     private:
-        T ** m_p;
+        T * m_p = nullptr;
     };
 
-#endif
+    //Resets count pointers starting at ptrs. Adjacent pointers to the same object are released 
+    //with a single Traits::sub_ref_n(p, n) call if Traits provides it.
+    ISPTR_EXPORTED
+    template<class T, class Traits>
+    void release_all(intrusive_shared_ptr<T, Traits> * ptrs, size_t count) noexcept
+    {
+        for (size_t i = 0; i < count; )
+        {
+            T * p = ptrs[i].release();
+            size_t run = 1;
+            for ( ; i + run < count && ptrs[i + run].get() == p; ++run)
+                ptrs[i + run].release();
+            i += run;
+            if (p)
+                internal::sub_refs<Traits>(p, run);
+        }
+    }
 
-#if ISPTR_SUPPORT_STD_FORMAT
+    //Same as above for a contiguous range such as std::vector, std::array or std::span
+    ISPTR_EXPORTED
+    template<class Range>
+    auto release_all(Range && ptrs) noexcept -> decltype(release_all(std::data(ptrs), std::size(ptrs)))
+        { release_all(std::data(ptrs), std::size(ptrs)); }
 
-    template<class T, class Traits, class CharT>
-    struct formatter<::isptr::intrusive_shared_ptr<T, Traits>, CharT> : public formatter<void *, CharT>
+    //Assigns count pointers starting at src to the ones starting at dest. Adjacent pointers in src 
+    //to the same object are counted with a single Traits::add_ref_n(p, n) call if Traits provides it.
+    //Previous values of dest are released as if by release_all. The ranges must not overlap.
+    ISPTR_EXPORTED
+    template<class T, class Traits>
+    void ref_all(const intrusive_shared_ptr<T, Traits> * src, intrusive_shared_ptr<T, Traits> * dest, size_t count) noexcept
     {
-        template <typename FormatContext>
-        auto format(const ::isptr::intrusive_shared_ptr<T, Traits> & ptr, FormatContext & ctx) const -> decltype(ctx.out()) 
-            { return formatter<void *, CharT>::format(ptr.get(), ctx); }
-    };
-#endif
+        release_all(dest, count);
+        for (size_t i = 0; i < count; )
+        {
+            T * p = src[i].get();
+            size_t run = 1;
+            for ( ; i + run < count && src[i + run].get() == p; ++run)
+            {}
+            if (p)
+                internal::add_refs<Traits>(p, run);
+            for (size_t end = i + run; i < end; ++i)
+                dest[i] = intrusive_shared_ptr<T, Traits>::noref(p);
+        }
+    }
 
-    template<class T, class Traits>
-    struct hash<::isptr::intrusive_shared_ptr<T, Traits>> 
+    //Same as above for contiguous ranges of equal size such as std::vector, std::array or std::span
+    ISPTR_EXPORTED
+    template<class SrcRange, class DestRange>
+    auto ref_all(const SrcRange & src, DestRange && dest) noexcept -> decltype(ref_all(std::data(src), std::data(dest), std::size(src)))
     {
-        constexpr size_t operator()(const ::isptr::intrusive_shared_ptr<T, Traits> & ptr) const noexcept 
-            { return hash_value(ptr); }
-    };
+        assert(std::size(src) == std::size(dest));
+        ref_all(std::data(src), std::data(dest), std::size(src));
+    }
 }
 
-#undef ISPTR_TRIVIAL_ABI
-#undef ISPTR_CONSTEXPR_SINCE_CPP20
-#undef ISPTR_USE_SPACESHIP_OPERATOR
-#undef ISPTR_SUPPORT_OUT_PTR
-
-#endif
-
-
-#ifndef HEADER_REF_COUNTED_H_INCLUDED
-#define HEADER_REF_COUNTED_H_INCLUDED
-
-
-
-namespace isptr
+namespace isptr 
 {
+    namespace internal
+    {
+        inline void spin_yield() noexcept 
+        {
+            #ifdef ISPTR_THREAD_YIELD
+                ISPTR_THREAD_YIELD;
+            #endif
+        }
+
+        //Spins for a while and then starts yielding the thread to the OS scheduler
+        class spin_backoff
+        {
+        public:
+            void operator()() noexcept
+            {
+                if (this->m_count < spin_backoff::max_spins) 
+                {
+                    ++this->m_count;
+                    spin_yield();
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+        private:
+            static constexpr unsigned max_spins = 64;
+            unsigned m_count = 0;
+        };
+
+        //A small per-thread number used to spread threads over per-object slots
+        inline unsigned this_thread_slot() noexcept
+        {
+            static std::atomic<unsigned> next{0};
+            static thread_local unsigned slot = next.fetch_add(1, std::memory_order_relaxed);
+            return slot;
+        }
+    }
+
+    //MARK:- spin_lock
+
+    //SpinBudget of a spin_lock that never parks
+    ISPTR_EXPORTED
+    inline constexpr unsigned unlimited_spin_budget = ~0u;
+
+    //Spins with exponential backoff for up to SpinBudget pauses and then parks the thread 
+    //until the owner unlocks. The state is 0 when unlocked, 1 when locked and 2 when locked 
+    //with (possibly) parked waiters so that uncontended unlock never needs to wake anyone.
+    //With unlimited_spin_budget it spins until the lock is free, as atomic operations 
+    //did before parking was introduced, and the state is never 2.
+    //If Stats is not void its static members are called to record acquisitions and contention
+    //(see lock_contention.h). Otherwise no extra code is generated.
+    ISPTR_EXPORTED
+    template<unsigned SpinBudget = 128, class Stats = void>
+    class spin_lock 
+    {
+    public:
+        static constexpr unsigned spin_budget = SpinBudget;
+        using stats_type = Stats;
+
+        void lock() noexcept 
+        {
+            unsigned current = 0;
+            if (this->m_value.compare_exchange_strong(current, 1, std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                if constexpr (!std::is_void_v<Stats>)
+                    Stats::record_acquisition();
+                return;
+            }
+
+            if constexpr (std::is_void_v<Stats>)
+            {
+                this->lock_contended();
+            }
+            else
+            {
+                auto token = Stats::begin_contention();
+                auto result = this->lock_contended();
+                Stats::end_contention(token, result.spins, result.parks);
+            }
+        }
+
+        bool try_lock() noexcept 
+        {
+            unsigned current = 0;
+            bool ret = this->m_value.compare_exchange_strong(current, 1, std::memory_order_acquire, std::memory_order_relaxed);
+            if constexpr (!std::is_void_v<Stats>)
+            {
+                if (ret)
+                    Stats::record_acquisition();
+            }
+            return ret;
+        }
+
+        void unlock() noexcept 
+        { 
+            if constexpr (SpinBudget == unlimited_spin_budget)
+            {
+                this->m_value.store(0, std::memory_order_release);
+            }
+            else if (this->m_value.exchange(0, std::memory_order_release) == 2)
+            {
+            #if ISPTR_USE_ATOMIC_WAIT
+                this->m_value.notify_one();
+            #endif
+            }
+        }
+
+    private:
+        struct contention
+        {
+            unsigned spins;
+            unsigned parks;
+        };
+
+        contention lock_contended() noexcept
+        {
+            contention ret = {0, 0};
+            if constexpr (SpinBudget == unlimited_spin_budget)
+            {
+                for ( ; ; )
+                {
+                    while (this->m_value.load(std::memory_order_relaxed))
+                    {
+                        internal::spin_yield();
+                        ++ret.spins;
+                    }
+                    unsigned current = 0;
+                    if (this->m_value.compare_exchange_weak(current, 1, std::memory_order_acquire, std::memory_order_relaxed))
+                        return ret;
+                }
+            }
+            else
+            {
+                for (unsigned delay = 1; ret.spins < SpinBudget; ) 
+                {
+                    for (unsigned i = 0; i < delay; ++i)
+                        internal::spin_yield();
+                    ret.spins += delay;
+                    if (delay < spin_lock::max_delay)
+                        delay *= 2;
+                
+                    unsigned current = this->m_value.load(std::memory_order_relaxed);
+                    if (current == 0 && this->m_value.compare_exchange_weak(current, 1, std::memory_order_acquire, std::memory_order_relaxed))
+                        return ret;
+                }
+
+                //Taking the lock in state 2 is conservative: unlock() may do a spurious notify
+                while (this->m_value.exchange(2, std::memory_order_acquire) != 0)
+                {
+                    ++ret.parks;
+                #if ISPTR_USE_ATOMIC_WAIT
+                    this->m_value.wait(2, std::memory_order_relaxed);
+                #else
+                    std::this_thread::yield();
+                #endif
+                }
+                return ret;
+            }
+        }
+
+    private:
+        static constexpr unsigned max_delay = 32;
+
+        std::atomic<unsigned> m_value{0};
+    };
+
+    //Lock that only spins. Unlike spin_lock<> it never parks waiting threads.
+    ISPTR_EXPORTED
+    using pure_spin_lock = spin_lock<unlimited_spin_budget>;
+
+    //MARK:- Atomic policies
+
+    ISPTR_EXPORTED
+    template<class Lock = spin_lock<>>
+    struct locked_atomic_policy 
+    {};
+
+    ISPTR_EXPORTED
+    struct lock_free_atomic_policy 
+    {};
+
+    ISPTR_EXPORTED
+    template<unsigned ReaderSlots = 16, class Lock = spin_lock<>>
+    struct read_mostly_atomic_policy
+    {};
+
+    ISPTR_EXPORTED
+    template<unsigned Stripes = 64, class Lock = spin_lock<>>
+    struct striped_atomic_policy
+    {};
+
+    ISPTR_EXPORTED
+    using default_atomic_policy = std::conditional_t<ISPTR_USE_LOCK_FREE_ATOMIC, lock_free_atomic_policy, locked_atomic_policy<>>;
+
+    namespace internal 
+    {
+        //Raw storage for atomic_intrusive_shared_ptr. All operations transfer
+        //references via raw pointers: load() returns a pointer with a reference added,
+        //exchange() consumes the reference of its argument and returns the previous one
+        template<class T, class Traits, class Policy>
+        class atomic_storage;
+
+        template<class T, class Traits, class Lock>
+        class atomic_storage<T, Traits, locked_atomic_policy<Lock>>
+        {
+        public:
+            static constexpr bool is_always_lock_free = false;
+
+            constexpr atomic_storage() noexcept = default;
+            constexpr atomic_storage(T * p) noexcept : m_p(p)
+                {}
+            atomic_storage(const atomic_storage &) = delete;
+            atomic_storage & operator=(const atomic_storage &) = delete;
+            ~atomic_storage() noexcept
+            { 
+                if (T * p = this->m_p.load(std::memory_order_relaxed)) 
+                    Traits::sub_ref(p); 
+            }
+
+            bool is_lock_free() const noexcept
+                { return false; }
+
+            T * load() const noexcept
+            {
+                this->m_lock.lock();
+                T * ret = this->m_p.load(std::memory_order_relaxed);
+                if (ret) Traits::add_ref(ret);
+                this->m_lock.unlock();
+                return ret;
+            }
+
+            T * exchange(T * desired) noexcept
+            {
+                this->m_lock.lock();
+                T * ret = this->m_p.load(std::memory_order_relaxed);
+                this->m_p.store(desired, std::memory_order_relaxed);
+                this->m_lock.unlock();
+                return ret;
+            }
+
+            //On success the storage takes over the reference held by desired and releases the previous value.
+            //On failure actual receives the current value with a reference added.
+            bool compare_exchange(T * expected, T * desired, T *& actual) noexcept
+            {
+                this->m_lock.lock();
+                T * current = this->m_p.load(std::memory_order_relaxed);
+                if (current == expected) {
+                    this->m_p.store(desired, std::memory_order_relaxed);
+                    this->m_lock.unlock();
+                    if (current) Traits::sub_ref(current);
+                    return true;
+                } 
+                if (current) Traits::add_ref(current);
+                this->m_lock.unlock();
+                actual = current;
+                return false;
+            }
+
+            //Calls func with the current value kept alive but without adding a reference.
+            //func must be short and must not access this storage.
+            template<class Func>
+            auto borrow(Func && func) const noexcept
+            {
+                static_assert(std::is_nothrow_invocable_v<Func, T *>, "func must be noexcept");
+                auto & lock = this->m_lock;
+                lock.lock();
+                auto ret = std::forward<Func>(func)(this->m_p.load(std::memory_order_relaxed));
+                lock.unlock();
+                return ret;
+            }
+
+        #if ISPTR_USE_ATOMIC_WAIT
+            void wait(T * old) const noexcept
+                { this->m_p.wait(old, std::memory_order_acquire); }
+            void notify_one() noexcept
+                { this->m_p.notify_one(); }
+            void notify_all() noexcept
+                { this->m_p.notify_all(); }
+        #endif
+        private:
+            mutable Lock m_lock;
+            //Only modified under the lock. It is atomic so that waiting can be done without it.
+            std::atomic<T *> m_p{nullptr};
+        };
+
+        //A fixed table of Items, each on its own cache line, shared by all storages with the same
+        //Stripes and Item. Storage addresses are hashed to pick an item.
+        template<unsigned Stripes, class Item>
+        class striped_table
+        {
+            static_assert(Stripes > 0 && (Stripes & (Stripes - 1)) == 0, "number of stripes must be a power of 2");
+        public:
+            static Item & item_for(const void * address) noexcept
+            {
+                if constexpr (Stripes == 1)
+                {
+                    return s_items[0].value;
+                }
+                else
+                {
+                    //Fibonacci hashing spreads adjacent addresses over distant stripes
+                    uint64_t hash = uint64_t(reinterpret_cast<uintptr_t>(address) / alignof(void *)) * 0x9E3779B97F4A7C15u;
+                    return s_items[hash >> (64 - striped_table::stripe_bits)].value;
+                }
+            }
+        private:
+            static constexpr unsigned log2(unsigned value) noexcept
+                { return value > 1 ? 1 + log2(value / 2) : 0; }
+
+            static constexpr unsigned stripe_bits = log2(Stripes);
+
+            //each item on its own line so that contention on one stripe does not slow down the others
+            static inline cache_line_padded<Item> s_items[Stripes];
+        };
+
+        //Storage that keeps only the pointer. Operations lock one of the Stripes locks shared by all 
+        //such storages, chosen by the storage address.
+        template<class T, class Traits, unsigned Stripes, class Lock>
+        class atomic_storage<T, Traits, striped_atomic_policy<Stripes, Lock>>
+        {
+            using lock_table = striped_table<Stripes, Lock>;
+        public:
+            static constexpr bool is_always_lock_free = false;
+
+            constexpr atomic_storage() noexcept = default;
+            constexpr atomic_storage(T * p) noexcept : m_p(p)
+                {}
+            atomic_storage(const atomic_storage &) = delete;
+            atomic_storage & operator=(const atomic_storage &) = delete;
+            ~atomic_storage() noexcept
+            { 
+                if (T * p = this->m_p.load(std::memory_order_relaxed)) 
+                    Traits::sub_ref(p); 
+            }
+
+            bool is_lock_free() const noexcept
+                { return false; }
+
+            T * load() const noexcept
+            {
+                auto & lock = lock_table::item_for(this);
+                lock.lock();
+                T * ret = this->m_p.load(std::memory_order_relaxed);
+                if (ret) Traits::add_ref(ret);
+                lock.unlock();
+                return ret;
+            }
+
+            T * exchange(T * desired) noexcept
+            {
+                auto & lock = lock_table::item_for(this);
+                lock.lock();
+                T * ret = this->m_p.load(std::memory_order_relaxed);
+                this->m_p.store(desired, std::memory_order_relaxed);
+                lock.unlock();
+                return ret;
+            }
+
+            //The previous value is released after unlocking since its destruction may
+            //access another storage that maps to the same lock
+            bool compare_exchange(T * expected, T * desired, T *& actual) noexcept
+            {
+                auto & lock = lock_table::item_for(this);
+                lock.lock();
+                T * current = this->m_p.load(std::memory_order_relaxed);
+                if (current == expected) {
+                    this->m_p.store(desired, std::memory_order_relaxed);
+                    lock.unlock();
+                    if (current) Traits::sub_ref(current);
+                    return true;
+                } 
+                if (current) Traits::add_ref(current);
+                lock.unlock();
+                actual = current;
+                return false;
+            }
+
+            //Calls func with the current value kept alive but without adding a reference.
+            //func must be short and must not access this storage.
+            template<class Func>
+            auto borrow(Func && func) const noexcept
+            {
+                static_assert(std::is_nothrow_invocable_v<Func, T *>, "func must be noexcept");
+                auto & lock = lock_table::item_for(this);
+                lock.lock();
+                auto ret = std::forward<Func>(func)(this->m_p.load(std::memory_order_relaxed));
+                lock.unlock();
+                return ret;
+            }
+
+        #if ISPTR_USE_ATOMIC_WAIT
+            void wait(T * old) const noexcept
+                { this->m_p.wait(old, std::memory_order_acquire); }
+            void notify_one() noexcept
+                { this->m_p.notify_one(); }
+            void notify_all() noexcept
+                { this->m_p.notify_all(); }
+        #endif
+        private:
+            //Only modified under the lock. It is atomic so that waiting can be done without it.
+            std::atomic<T *> m_p{nullptr};
+        };
+
+        //Lock-free storage using split reference counts. The upper bits of the stored word hold
+        //a "local" count of loads in progress. A load first increments the local count, which keeps 
+        //the pointee alive, then adds a real reference and finally tries to undo its local increment. 
+        //A writer that replaces the pointer transfers the outstanding local count to the pointee 
+        //via Traits::add_ref, so loaders that find the pointer gone release that transferred
+        //reference instead.
+        template<class T, class Traits>
+        class atomic_storage<T, Traits, lock_free_atomic_policy>
+        {
+            static_assert(internal::dependent_bool<ISPTR_POINTER_HAS_FREE_TOP_BITS, T>, "lock_free_atomic_policy is not supported on this platform");
+            static_assert(sizeof(T *) == sizeof(uintptr_t) && sizeof(uintptr_t) == 8, "pointers must be 64-bit");
+
+        private:
+            static constexpr unsigned pointer_bits = 48;
+            static constexpr uintptr_t pointer_mask = (uintptr_t(1) << pointer_bits) - 1;
+            static constexpr uintptr_t local_ref = uintptr_t(1) << pointer_bits;
+        public:
+            static constexpr bool is_always_lock_free = std::atomic<uintptr_t>::is_always_lock_free;
+
+            constexpr atomic_storage() noexcept = default;
+            atomic_storage(T * p) noexcept : m_value(atomic_storage::pack(p))
+                {}
+            atomic_storage(const atomic_storage &) = delete;
+            atomic_storage & operator=(const atomic_storage &) = delete;
+            ~atomic_storage() noexcept
+            { 
+                uintptr_t value = this->m_value.load(std::memory_order_relaxed);
+                assert(atomic_storage::local_count(value) == 0);
+                if (T * p = atomic_storage::unpack(value)) 
+                    Traits::sub_ref(p); 
+            }
+
+            bool is_lock_free() const noexcept
+                { return this->m_value.is_lock_free(); }
+
+            T * load() const noexcept
+            {
+                uintptr_t value = this->m_value.fetch_add(atomic_storage::local_ref, std::memory_order_acquire);
+                assert(atomic_storage::local_count(value) < atomic_storage::local_count(~uintptr_t(0)));
+                T * ret = atomic_storage::unpack(value);
+                if (ret) Traits::add_ref(ret);
+                this->drop_local_ref(ret);
+                return ret;
+            }
+
+            T * exchange(T * desired) noexcept
+            {
+                uintptr_t old = this->m_value.exchange(atomic_storage::pack(desired), std::memory_order_acq_rel);
+                T * ret = atomic_storage::unpack(old);
+                atomic_storage::add_refs(ret, atomic_storage::local_count(old));
+                return ret;
+            }
+
+            bool compare_exchange(T * expected, T * desired, T *& actual) noexcept
+            {
+                for (uintptr_t value = this->m_value.load(std::memory_order_relaxed); ; ) 
+                {
+                    if (atomic_storage::unpack(value) == expected) 
+                    {
+                        if (!this->m_value.compare_exchange_weak(value, atomic_storage::pack(desired), 
+                                                                 std::memory_order_acq_rel, std::memory_order_relaxed))
+                            continue;
+                        
+                        //expected holds its own reference so the previous value cannot be destroyed here 
+                        //and we can fold our release into the transfer
+                        if (expected)
+                        {
+                            if (auto count = atomic_storage::local_count(value))
+                                atomic_storage::add_refs(expected, count - 1);
+                            else
+                                Traits::sub_ref(expected);
+                        }
+                        return true;
+                    }
+
+                    T * current = this->load();
+                    if (current != expected) 
+                    {
+                        actual = current;
+                        return false;
+                    }
+                    //the value changed back to expected in the meantime, retry
+                    if (current) Traits::sub_ref(current);
+                    value = this->m_value.load(std::memory_order_relaxed);
+                }
+            }
+
+            //Calls func with the current value kept alive by the local count but without adding a reference
+            template<class Func>
+            auto borrow(Func && func) const noexcept
+            {
+                static_assert(std::is_nothrow_invocable_v<Func, T *>, "func must be noexcept");
+                uintptr_t value = this->m_value.fetch_add(atomic_storage::local_ref, std::memory_order_acquire);
+                assert(atomic_storage::local_count(value) < atomic_storage::local_count(~uintptr_t(0)));
+                T * p = atomic_storage::unpack(value);
+                auto ret = std::forward<Func>(func)(p);
+                this->drop_local_ref(p);
+                return ret;
+            }
+
+        #if ISPTR_USE_ATOMIC_WAIT
+            //Every load changes the local count so waiting on the stored word would keep waking up 
+            //while readers are busy. Instead waiters sleep on a counter that only notifications change.
+            void wait(T * old) const noexcept
+            {
+                auto & notifications = atomic_storage::notifications_for(this);
+                for ( ; ; )
+                {
+                    unsigned seen = notifications.load(std::memory_order_acquire);
+                    if (atomic_storage::unpack(this->m_value.load(std::memory_order_acquire)) != old)
+                        return;
+                    notifications.wait(seen, std::memory_order_acquire);
+                }
+            }
+            //The counter is shared with other storages so waking a single waiter could wake one of theirs
+            void notify_one() noexcept
+                { this->notify_all(); }
+            void notify_all() noexcept
+            {
+                auto & notifications = atomic_storage::notifications_for(this);
+                notifications.fetch_add(1, std::memory_order_release);
+                notifications.notify_all();
+            }
+        #endif
+
+        private:
+        #if ISPTR_USE_ATOMIC_WAIT
+            static std::atomic<unsigned> & notifications_for(const atomic_storage * storage) noexcept
+                { return striped_table<64, std::atomic<unsigned>>::item_for(storage); }
+        #endif
+
+            void drop_local_ref(T * p) const noexcept
+            {
+                uintptr_t value = this->m_value.load(std::memory_order_relaxed);
+                while (atomic_storage::unpack(value) == p && atomic_storage::local_count(value) != 0) 
+                {
+                    if (this->m_value.compare_exchange_weak(value, value - atomic_storage::local_ref, 
+                                                            std::memory_order_release, std::memory_order_relaxed))
+                        return;
+                }
+                //a writer replaced the value and transferred our local reference to the object
+                if (p) Traits::sub_ref(p);
+            }
+
+            static void add_refs(T * p, uintptr_t count) noexcept
+            {
+                if (p) 
+                {
+                    for ( ; count; --count)
+                        Traits::add_ref(p);
+                }
+            }
+
+            static uintptr_t pack(T * p) noexcept
+            {
+                auto ret = reinterpret_cast<uintptr_t>(p);
+                assert((ret & ~atomic_storage::pointer_mask) == 0);
+                return ret;
+            }
+
+            static T * unpack(uintptr_t value) noexcept
+                { return reinterpret_cast<T *>(value & atomic_storage::pointer_mask); }
+            
+            static constexpr uintptr_t local_count(uintptr_t value) noexcept
+                { return value >> atomic_storage::pointer_bits; }
+
+        private:
+            mutable std::atomic<uintptr_t> m_value{0};
+        };
+
+        //Storage optimized for rarely changing values. Writers are serialized by a lock and bump 
+        //a sequence counter to odd while they modify the value. Readers announce themselves in one of 
+        //ReaderSlots per-thread counters, each on its own cache line, and validate that no writer is active.
+        //A writer waits for all announced readers to leave before releasing the previous value,
+        //so readers can safely add a reference after the validated read. Readers never write 
+        //to a cache line shared by all of them.
+        template<class T, class Traits, unsigned ReaderSlots, class Lock>
+        class atomic_storage<T, Traits, read_mostly_atomic_policy<ReaderSlots, Lock>>
+        {
+            static_assert(ReaderSlots > 0, "at least one reader slot is required");
+        public:
+            static constexpr bool is_always_lock_free = false;
+
+            constexpr atomic_storage() noexcept = default;
+            constexpr atomic_storage(T * p) noexcept : m_p(p)
+                {}
+            atomic_storage(const atomic_storage &) = delete;
+            atomic_storage & operator=(const atomic_storage &) = delete;
+            ~atomic_storage() noexcept
+            { 
+                if (T * p = this->m_p.load(std::memory_order_relaxed)) 
+                    Traits::sub_ref(p); 
+            }
+
+            bool is_lock_free() const noexcept
+                { return false; }
+
+            T * load() const noexcept
+            {
+                auto & readers = this->m_readers[internal::this_thread_slot() % ReaderSlots].value;
+                for ( ; ; )
+                {
+                    readers.fetch_add(1, std::memory_order_seq_cst);
+                    unsigned sequence = this->m_sequence.load(std::memory_order_seq_cst);
+                    if ((sequence & 1) == 0)
+                    {
+                        T * ret = this->m_p.load(std::memory_order_acquire);
+                        if (ret) Traits::add_ref(ret);
+                        readers.fetch_sub(1, std::memory_order_release);
+                        return ret;
+                    }
+                    readers.fetch_sub(1, std::memory_order_relaxed);
+                    for (internal::spin_backoff backoff; this->m_sequence.load(std::memory_order_relaxed) == sequence; )
+                        backoff();
+                }
+            }
+
+            T * exchange(T * desired) noexcept
+            {
+                this->begin_write();
+                T * ret = this->m_p.load(std::memory_order_relaxed);
+                this->m_p.store(desired, std::memory_order_relaxed);
+                this->end_write();
+                return ret;
+            }
+
+            bool compare_exchange(T * expected, T * desired, T *& actual) noexcept
+            {
+                this->begin_write();
+                T * current = this->m_p.load(std::memory_order_relaxed);
+                if (current == expected) 
+                {
+                    this->m_p.store(desired, std::memory_order_relaxed);
+                    this->end_write();
+                    if (current) Traits::sub_ref(current);
+                    return true;
+                }
+                if (current) Traits::add_ref(current);
+                this->end_write();
+                actual = current;
+                return false;
+            }
+            //Calls func with the current value kept alive by the reader slot but without adding a reference.
+            //func must be short since writers wait for it.
+            template<class Func>
+            auto borrow(Func && func) const noexcept
+            {
+                static_assert(std::is_nothrow_invocable_v<Func, T *>, "func must be noexcept");
+                auto & readers = this->m_readers[internal::this_thread_slot() % ReaderSlots].value;
+                for ( ; ; )
+                {
+                    readers.fetch_add(1, std::memory_order_seq_cst);
+                    unsigned sequence = this->m_sequence.load(std::memory_order_seq_cst);
+                    if ((sequence & 1) == 0)
+                    {
+                        auto ret = std::forward<Func>(func)(this->m_p.load(std::memory_order_acquire));
+                        readers.fetch_sub(1, std::memory_order_release);
+                        return ret;
+                    }
+                    readers.fetch_sub(1, std::memory_order_relaxed);
+                    for (internal::spin_backoff backoff; this->m_sequence.load(std::memory_order_relaxed) == sequence; )
+                        backoff();
+                }
+            }
+
+        #if ISPTR_USE_ATOMIC_WAIT
+            void wait(T * old) const noexcept
+                { this->m_p.wait(old, std::memory_order_acquire); }
+            void notify_one() noexcept
+                { this->m_p.notify_one(); }
+            void notify_all() noexcept
+                { this->m_p.notify_all(); }
+        #endif
+
+        private:
+            void begin_write() noexcept
+            {
+                this->m_lock.lock();
+                this->m_sequence.fetch_add(1, std::memory_order_seq_cst);
+                for (auto & slot: this->m_readers)
+                {
+                    for (internal::spin_backoff backoff; slot.value.load(std::memory_order_seq_cst) != 0; )
+                        backoff();
+                }
+            }
+
+            void end_write() noexcept
+            {
+                this->m_sequence.fetch_add(1, std::memory_order_release);
+                this->m_lock.unlock();
+            }
+        private:
+            std::atomic<unsigned> m_sequence{0};
+            std::atomic<T *> m_p{nullptr};
+            Lock m_lock;
+            //readers on different slots do not write to the same line
+            mutable internal::cache_line_padded<std::atomic<unsigned>> m_readers[ReaderSlots];
+        };
+    }
+
+    //MARK:- atomic_intrusive_shared_ptr
+
+    ISPTR_EXPORTED
+    template<class T, class Traits, class Policy = default_atomic_policy>
+    class atomic_intrusive_shared_ptr
+    {
+    public:
+        using value_type = intrusive_shared_ptr<T, Traits>;
+        using policy_type = Policy;
+    private:
+        using storage_type = internal::atomic_storage<T, Traits, Policy>;
+    public:
+        static constexpr bool is_always_lock_free = storage_type::is_always_lock_free;
+
+        constexpr atomic_intrusive_shared_ptr() noexcept = default;
+        atomic_intrusive_shared_ptr(value_type desired) noexcept : m_storage(publish(desired))
+            {}
+        
+        atomic_intrusive_shared_ptr(const atomic_intrusive_shared_ptr &) = delete;
+        atomic_intrusive_shared_ptr & operator=(const atomic_intrusive_shared_ptr &) = delete;
+        
+        ~atomic_intrusive_shared_ptr() noexcept = default;
+
+        value_type operator=(value_type desired) noexcept
+        { 
+            this->store(desired);
+            return desired; 
+        }
+
+        operator value_type() const noexcept
+            { return this->load(); }
+
+        value_type load(std::memory_order /*order*/ = std::memory_order_seq_cst) const noexcept
+            { return value_type::noref(this->m_storage.load()); }
+
+        void store(value_type desired, std::memory_order /*order*/ = std::memory_order_seq_cst) noexcept
+            { value_type::noref(this->m_storage.exchange(publish(desired))); }
+        
+        value_type exchange(value_type desired, std::memory_order /*order*/ = std::memory_order_seq_cst) noexcept
+            { return value_type::noref(this->m_storage.exchange(publish(desired))); }
+
+        bool compare_exchange_strong(value_type & expected, value_type desired, std::memory_order /*success*/, std::memory_order /*failure*/) noexcept
+            { return this->do_compare_exchange(expected, std::move(desired)); }
+
+        bool compare_exchange_strong(value_type & expected, value_type desired, std::memory_order /*order*/ = std::memory_order_seq_cst) noexcept
+            { return this->do_compare_exchange(expected, std::move(desired)); }
+
+        bool compare_exchange_weak(value_type & expected, value_type desired, std::memory_order /*success*/, std::memory_order /*failure*/) noexcept
+            { return this->do_compare_exchange(expected, std::move(desired)); }
+        bool compare_exchange_weak(value_type & expected, value_type desired, std::memory_order /*order*/ = std::memory_order_seq_cst) noexcept
+            { return this->do_compare_exchange(expected, std::move(desired)); }
+
+
+        bool is_lock_free() const noexcept
+            { return this->m_storage.is_lock_free(); }
+
+    #if ISPTR_USE_ATOMIC_WAIT
+        //Blocks until the stored pointer differs from old and the object is notified.
+        //Like std::atomic these do not notify automatically: call notify_one() or notify_all() after modifying.
+        void wait(value_type old, std::memory_order /*order*/ = std::memory_order_seq_cst) const noexcept
+            { this->m_storage.wait(old.get()); }
+
+        void notify_one() noexcept
+            { this->m_storage.notify_one(); }
+
+        void notify_all() noexcept
+            { this->m_storage.notify_all(); }
+    #endif
+        
+    protected:
+        //Calls func(T *) with the current value kept alive but without changing its reference count.
+        //This is meant for derived classes that need to access the pointee in place.
+        template<class Func>
+        auto borrow(Func && func) const noexcept
+            { return this->m_storage.borrow(std::forward<Func>(func)); }
+
+    private:
+        //Objects stored here become reachable from other threads
+        static T * publish(value_type & desired) noexcept
+        {
+            internal::publish<Traits>(desired.get());
+            return desired.release();
+        }
+
+        bool do_compare_exchange(value_type & expected, value_type && desired) noexcept
+        {
+            internal::publish<Traits>(desired.get());
+            T * actual;
+            if (this->m_storage.compare_exchange(expected.get(), desired.get(), actual)) {
+                desired.release();
+                return true;
+            }
+            expected = value_type::noref(actual);
+            return false;
+        }
+    private:
+        storage_type m_storage;
+    };
+}
+
+namespace std
+{
+    template<class Traits, class T>
+    class atomic<::isptr::intrusive_shared_ptr<T, Traits>> : public ::isptr::atomic_intrusive_shared_ptr<T, Traits>
+    {
+    private:
+        using base = ::isptr::atomic_intrusive_shared_ptr<T, Traits>;
+    public:
+        using typename base::value_type;
+    public:
+        constexpr atomic() noexcept = default;
+        atomic(value_type desired) noexcept : base(std::move(desired))
+            {}
+        
+        atomic(const atomic&) = delete;
+        atomic & operator=(const atomic&) = delete;
+
+        using base::operator=;
+    };
+
+#if ISPTR_SUPPORT_OUT_PTR
+
+    template<class T, class Traits>
+    class out_ptr_t<::isptr::intrusive_shared_ptr<T, Traits>, T *>
+    {
+    public:
+        constexpr out_ptr_t(::isptr::intrusive_shared_ptr<T, Traits> & owner) noexcept:
+            m_p(&owner.m_p)
+        {
+            owner.reset();
+        }
+        constexpr out_ptr_t(out_ptr_t && src) noexcept = default;
+        out_ptr_t(const out_ptr_t &) = delete;
+
+        void operator=(const out_ptr_t &) = delete;
+        void operator=(out_ptr_t &&) = delete;
+
+        constexpr operator T**() const noexcept
+            { return m_p; }
+
+        constexpr operator void**() const noexcept requires(!std::is_same_v<T *, void *>)
+            { return reinterpret_cast<void**>(m_p); }
+    private:
+        T ** m_p;
+    };
+
+    template<class T, class Traits>
+    class inout_ptr_t<::isptr::intrusive_shared_ptr<T, Traits>, T *>
+    {
+    public:
+        constexpr inout_ptr_t(::isptr::intrusive_shared_ptr<T, Traits> & owner) noexcept :
+            m_p(&owner.m_p)
+        {}
+        constexpr inout_ptr_t(inout_ptr_t && src) noexcept = default;
+        inout_ptr_t(const inout_ptr_t &) = delete;
+
+        void operator=(const inout_ptr_t &) = delete;
+        void operator=(inout_ptr_t &&) = delete;
+
+        constexpr operator T**() const noexcept
+            { return m_p; }
+
+        constexpr operator void**() const noexcept requires(!std::is_same_v<T *, void *>)
+            { return reinterpret_cast<void**>(m_p); }
+    private:
+        T ** m_p;
+    };
+
+#endif
+
+#if ISPTR_SUPPORT_STD_FORMAT
+
+    template<class T, class Traits, class CharT>
+    struct formatter<::isptr::intrusive_shared_ptr<T, Traits>, CharT> : public formatter<void *, CharT>
+    {
+        template <typename FormatContext>
+        auto format(const ::isptr::intrusive_shared_ptr<T, Traits> & ptr, FormatContext & ctx) const -> decltype(ctx.out()) 
+            { return formatter<void *, CharT>::format(ptr.get(), ctx); }
+    };
+#endif
+
+    template<class T, class Traits>
+    struct hash<::isptr::intrusive_shared_ptr<T, Traits>> 
+    {
+        constexpr size_t operator()(const ::isptr::intrusive_shared_ptr<T, Traits> & ptr) const noexcept 
+            { return hash_value(ptr); }
+    };
+}
+
+#undef ISPTR_TRIVIAL_ABI
+#undef ISPTR_CONSTEXPR_SINCE_CPP20
+#undef ISPTR_USE_SPACESHIP_OPERATOR
+#undef ISPTR_SUPPORT_OUT_PTR
+
+#endif
+
+
+#ifndef HEADER_BLOCK_POOL_H_INCLUDED
+#define HEADER_BLOCK_POOL_H_INCLUDED
+
+
+
+namespace isptr
+{
+    //MARK:- thread_block_pool
+
+    //Pool of fixed size memory blocks. Each thread allocates from its own cache which is refilled
+    //from slabs of BlocksPerSlab blocks. Blocks freed by the allocating thread go straight back to
+    //its cache. Blocks freed by other threads are pushed to a lock-free list of the cache that
+    //allocated them and picked up when its local list runs out.
+    //Memory is never returned to the system. Caches of exited threads, together with their free
+    //blocks, are reused by new threads. Blocks allocated by a thread after its cache was released,
+    //e.g. from destructors of thread_local objects, come from the heap and go back there when freed.
+    ISPTR_EXPORTED
+    template<size_t BlockSize, size_t BlockAlign = alignof(std::max_align_t), size_t BlocksPerSlab = 64>
+    class thread_block_pool
+    {
+    private:
+        struct cache;
+
+        struct free_block
+        {
+            free_block * next;
+        };
+
+        //Every block is preceded by a pointer to the cache that allocated it
+        static constexpr size_t header_size = (sizeof(cache *) + BlockAlign - 1) / BlockAlign * BlockAlign;
+        static constexpr size_t payload_size = BlockSize < sizeof(free_block) ? sizeof(free_block) : BlockSize;
+        static constexpr size_t stride = (header_size + payload_size + BlockAlign - 1) / BlockAlign * BlockAlign;
+
+        static_assert(BlockAlign >= alignof(free_block) && (BlockAlign & (BlockAlign - 1)) == 0,
+                      "BlockAlign must be a power of 2 no smaller than pointer alignment");
+        static_assert(BlockAlign <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "over-aligned blocks are not supported");
+        static_assert(BlocksPerSlab > 0, "BlocksPerSlab must be positive");
+
+        struct cache
+        {
+            free_block * local = nullptr;
+            std::atomic<free_block *> remote{nullptr};
+            std::atomic<bool> in_use{true};
+            cache * next = nullptr;
+        };
+
+        struct thread_holder
+        {
+            ~thread_holder() noexcept
+            {
+                if (this->owned)
+                {
+                    //blocks allocated from now on, including by later thread_local destructors,
+                    //do not come from the cache
+                    thread_block_pool::exited() = true;
+                    thread_block_pool::current_slot() = nullptr;
+                    this->owned->in_use.store(false, std::memory_order_release);
+                }
+            }
+
+            cache * owned = nullptr;
+        };
+
+    public:
+        static constexpr size_t block_size = BlockSize;
+        static constexpr size_t block_align = BlockAlign;
+
+        //Returns a block of block_size bytes aligned to block_align. Throws std::bad_alloc on failure.
+        static void * allocate()
+        {
+            auto owner = thread_block_pool::current_slot();
+            if (!owner)
+            {
+                if (thread_block_pool::exited())
+                    return thread_block_pool::allocate_unpooled();
+                owner = thread_block_pool::acquire_current();
+            }
+
+            auto block = owner->local;
+            if (!block)
+            {
+                block = owner->remote.exchange(nullptr, std::memory_order_acquire);
+                if (!block)
+                    block = thread_block_pool::allocate_slab(owner);
+            }
+            owner->local = block->next;
+            return block;
+        }
+
+        //Returns a block obtained from allocate(). Can be called from any thread.
+        static void deallocate(void * ptr) noexcept
+        {
+            if (!ptr)
+                return;
+            auto block = static_cast<free_block *>(ptr);
+            auto start = static_cast<char *>(ptr) - header_size;
+            auto owner = *reinterpret_cast<cache **>(start);
+            if (!owner)
+            {
+                ::operator delete(start);
+                return;
+            }
+            if (owner == thread_block_pool::current_slot())
+            {
+                block->next = owner->local;
+                owner->local = block;
+                return;
+            }
+            block->next = owner->remote.load(std::memory_order_relaxed);
+            while (!owner->remote.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed))
+            {}
+        }
+
+    private:
+        static cache *& current_slot() noexcept
+        {
+            static thread_local cache * instance = nullptr;
+            return instance;
+        }
+
+        static bool & exited() noexcept
+        {
+            static thread_local bool instance = false;
+            return instance;
+        }
+
+        static std::atomic<cache *> & head() noexcept
+        {
+            static std::atomic<cache *> instance{nullptr};
+            return instance;
+        }
+
+        static cache * acquire_current()
+        {
+            static thread_local thread_holder holder;
+
+            auto & list = thread_block_pool::head();
+            cache * ret = nullptr;
+            for (auto entry = list.load(std::memory_order_acquire); entry; entry = entry->next)
+            {
+                if (!entry->in_use.load(std::memory_order_relaxed) && !entry->in_use.exchange(true, std::memory_order_acquire))
+                {
+                    ret = entry;
+                    break;
+                }
+            }
+            if (!ret)
+            {
+                ret = new cache;
+                ret->next = list.load(std::memory_order_relaxed);
+                while (!list.compare_exchange_weak(ret->next, ret, std::memory_order_release, std::memory_order_relaxed))
+                {}
+            }
+            holder.owned = thread_block_pool::current_slot() = ret;
+            return ret;
+        }
+
+        //Returns a block that belongs to no cache
+        static void * allocate_unpooled()
+        {
+            auto start = static_cast<char *>(::operator new(stride));
+            *reinterpret_cast<cache **>(start) = nullptr;
+            return start + header_size;
+        }
+
+        //Returns a list of blocks of a new slab
+        static free_block * allocate_slab(cache * owner)
+        {
+            auto slab = static_cast<char *>(::operator new(stride * BlocksPerSlab));
+            free_block * ret = nullptr;
+            for (size_t i = BlocksPerSlab; i-- > 0; )
+            {
+                char * start = slab + i * stride;
+                *reinterpret_cast<cache **>(start) = owner;
+                auto block = reinterpret_cast<free_block *>(start + header_size);
+                block->next = ret;
+                ret = block;
+            }
+            return ret;
+        }
+    };
+
+    //Default allocator for pooled weak reference control blocks
+    ISPTR_EXPORTED
+    template<class WeakValue>
+    using weak_reference_pool = thread_block_pool<sizeof(WeakValue), alignof(WeakValue)>;
+}
+
+#endif
+
+#ifndef HEADER_DEFERRED_DESTROY_H_INCLUDED
+#define HEADER_DEFERRED_DESTROY_H_INCLUDED
+
+
+
+namespace isptr
+{
+    //MARK:- deferred_destroy_snapshot
+
+    ISPTR_EXPORTED
+    struct deferred_destroy_snapshot
+    {
+        uint64_t deferred = 0;
+        uint64_t destroyed = 0;
+        uint64_t pending = 0;
+        uint64_t max_pending = 0;
+        uint64_t drains = 0;
+        std::chrono::nanoseconds total_drain_time{0};
+        std::chrono::nanoseconds max_drain_time{0};
+    };
+
+    namespace internal
+    {
+        struct deferred_node
+        {
+            void (*destroy)(const void *) noexcept;
+            const void * object;
+            uint64_t seq;
+            deferred_node * next;
+        };
+
+        //Objects whose destruction was deferred by one thread. Only the owning thread pushes but any
+        //thread can drain. Drained nodes are returned to the queue they came from for reuse.
+        //Queues link themselves into a global list, are never freed and are reused by new threads 
+        //once their owners exit.
+        class deferred_queue
+        {
+        public:
+            //Queues destruction of object on the calling thread's queue. Destroys it immediately if
+            //that is not possible.
+            static void push(const void * object, void (*destroy)(const void *) noexcept) noexcept
+            {
+                auto queue = deferred_queue::acquire_current();
+                auto node = queue ? queue->allocate_node() : nullptr;
+                if (!node)
+                {
+                    destroy(object);
+                    return;
+                }
+                auto pushed = queue->m_pushed.load(std::memory_order_relaxed) + 1;
+                node->destroy = destroy;
+                node->object = object;
+                node->seq = pushed;
+                queue->splice(node, node);
+
+                queue->m_pushed.store(pushed, std::memory_order_relaxed);
+                auto depth = pushed - queue->m_destroyed.load(std::memory_order_relaxed);
+                if (depth > queue->m_max_depth.load(std::memory_order_relaxed))
+                    queue->m_max_depth.store(depth, std::memory_order_relaxed);
+            }
+
+            static size_t drain_current(size_t max_count) noexcept
+            {
+                auto queue = deferred_queue::current_slot();
+                if (!queue)
+                    return 0;
+                auto start = std::chrono::steady_clock::now();
+                size_t ret = 0;
+                while (ret < max_count)
+                {
+                    size_t count = queue->drain(max_count - ret);
+                    if (!count)
+                        break;
+                    ret += count;
+                }
+                deferred_queue::record_drain(start, ret);
+                return ret;
+            }
+
+            static size_t drain_all() noexcept
+            {
+                auto & list = deferred_queue::head();
+                auto start = std::chrono::steady_clock::now();
+                size_t ret = 0;
+                for (auto queue = list.load(std::memory_order_acquire); queue; queue = queue->m_next)
+                    ret += queue->drain(std::numeric_limits<size_t>::max());
+                //destructors run above could have queued more objects on this thread
+                if (auto queue = deferred_queue::current_slot())
+                {
+                    while (size_t count = queue->drain(std::numeric_limits<size_t>::max()))
+                        ret += count;
+                }
+                deferred_queue::record_drain(start, ret);
+                return ret;
+            }
+
+            static deferred_destroy_snapshot snapshot() noexcept
+            {
+                deferred_destroy_snapshot ret;
+                auto & list = deferred_queue::head();
+                for (auto queue = list.load(std::memory_order_acquire); queue; queue = queue->m_next)
+                {
+                    auto pushed = queue->m_pushed.load(std::memory_order_relaxed);
+                    auto destroyed = queue->m_destroyed.load(std::memory_order_relaxed);
+                    auto max_depth = queue->m_max_depth.load(std::memory_order_relaxed);
+                    ret.deferred += pushed;
+                    ret.destroyed += destroyed;
+                    ret.pending += pushed > destroyed ? pushed - destroyed : 0;
+                    if (max_depth > ret.max_pending)
+                        ret.max_pending = max_depth;
+                }
+                auto & stats = deferred_queue::drain_stats();
+                ret.drains = stats.drains.load(std::memory_order_relaxed);
+                ret.total_drain_time = std::chrono::nanoseconds(stats.total_time.load(std::memory_order_relaxed));
+                ret.max_drain_time = std::chrono::nanoseconds(stats.max_time.load(std::memory_order_relaxed));
+                return ret;
+            }
+
+        private:
+            struct thread_holder
+            {
+                ~thread_holder() noexcept
+                {
+                    if (this->rec)
+                    {
+                        //objects released from now on, including by the destructors run below, 
+                        //are destroyed immediately
+                        deferred_queue::exited() = true;
+                        deferred_queue::current_slot() = nullptr;
+                        this->rec->drain(std::numeric_limits<size_t>::max());
+                        this->rec->m_in_use.store(false, std::memory_order_release);
+                    }
+                }
+
+                deferred_queue * rec = nullptr;
+            };
+
+            struct drain_counters
+            {
+                std::atomic<uint64_t> drains{0};
+                std::atomic<int64_t> total_time{0};
+                std::atomic<int64_t> max_time{0};
+            };
+
+            static deferred_queue *& current_slot() noexcept
+            {
+                static thread_local deferred_queue * instance = nullptr;
+                return instance;
+            }
+
+            static bool & exited() noexcept
+            {
+                static thread_local bool instance = false;
+                return instance;
+            }
+
+            static std::atomic<deferred_queue *> & head() noexcept
+            {
+                static std::atomic<deferred_queue *> instance{nullptr};
+                return instance;
+            }
+
+            static drain_counters & drain_stats() noexcept
+            {
+                static drain_counters instance;
+                return instance;
+            }
+
+            static deferred_queue * acquire_current() noexcept
+            {
+                auto & slot = deferred_queue::current_slot();
+                if (!slot && !deferred_queue::exited())
+                {
+                    static thread_local thread_holder holder;
+                    holder.rec = slot = deferred_queue::acquire();
+                }
+                return slot;
+            }
+
+            static deferred_queue * acquire() noexcept
+            {
+                auto & list = deferred_queue::head();
+                for (auto rec = list.load(std::memory_order_acquire); rec; rec = rec->m_next)
+                {
+                    if (!rec->m_in_use.load(std::memory_order_relaxed) && !rec->m_in_use.exchange(true, std::memory_order_acquire))
+                        return rec;
+                }
+
+                auto rec = new (std::nothrow) deferred_queue;
+                if (!rec)
+                    return nullptr;
+                rec->m_next = list.load(std::memory_order_relaxed);
+                while (!list.compare_exchange_weak(rec->m_next, rec, std::memory_order_release, std::memory_order_relaxed))
+                {}
+                return rec;
+            }
+
+            //Records duration of a drain that started at start if it destroyed anything
+            static void record_drain(std::chrono::steady_clock::time_point start, size_t count) noexcept
+            {
+                if (count)
+                {
+                    int64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                    auto & stats = deferred_queue::drain_stats();
+                    stats.drains.fetch_add(1, std::memory_order_relaxed);
+                    stats.total_time.fetch_add(time, std::memory_order_relaxed);
+                    for (int64_t current = stats.max_time.load(std::memory_order_relaxed); current < time; )
+                    {
+                        if (stats.max_time.compare_exchange_weak(current, time, std::memory_order_relaxed, std::memory_order_relaxed))
+                            break;
+                    }
+                }
+            }
+
+            //Called by the owning thread
+            deferred_node * allocate_node() noexcept
+            {
+                if (!this->m_spare)
+                    this->m_spare = this->m_returned.exchange(nullptr, std::memory_order_acquire);
+                if (auto ret = this->m_spare)
+                {
+                    this->m_spare = ret->next;
+                    return ret;
+                }
+                return new (std::nothrow) deferred_node;
+            }
+
+            //Pushes a list of nodes from first to last. The list is popped in reverse order.
+            void splice(deferred_node * first, deferred_node * last) noexcept
+            {
+                last->next = this->m_head.load(std::memory_order_relaxed);
+                while (!this->m_head.compare_exchange_weak(last->next, first, std::memory_order_release, std::memory_order_relaxed))
+                {}
+            }
+
+            //Merges two lists ordered from oldest to newest
+            static deferred_node * merge(deferred_node * first, deferred_node * second) noexcept
+            {
+                deferred_node * ret = nullptr;
+                deferred_node ** tail = &ret;
+                while (first && second)
+                {
+                    auto & older = first->seq < second->seq ? first : second;
+                    *tail = older;
+                    tail = &older->next;
+                    older = older->next;
+                }
+                *tail = first ? first : second;
+                return ret;
+            }
+
+            //Keeps nodes that a drain did not get to so that the next drain destroys them before
+            //anything queued later
+            void put_back(deferred_node * oldest) noexcept
+            {
+                for ( ; ; )
+                {
+                    //another drain could have put back its own leftovers meanwhile
+                    oldest = merge(oldest, this->m_leftover.exchange(nullptr, std::memory_order_acquire));
+                    deferred_node * expected = nullptr;
+                    if (this->m_leftover.compare_exchange_strong(expected, oldest, std::memory_order_release, std::memory_order_relaxed))
+                        return;
+                }
+            }
+
+            //Destroys up to max_count objects queued so far in the order they were queued.
+            //Returns the number of destroyed objects.
+            size_t drain(size_t max_count) noexcept
+            {
+                if (!max_count || (!this->m_leftover.load(std::memory_order_relaxed) && !this->m_head.load(std::memory_order_relaxed)))
+                    return 0;
+                deferred_node * list = this->m_head.exchange(nullptr, std::memory_order_acquire);
+                deferred_node * oldest = nullptr;
+                while (list)
+                {
+                    auto next = list->next;
+                    list->next = oldest;
+                    oldest = list;
+                    list = next;
+                }
+                oldest = merge(this->m_leftover.exchange(nullptr, std::memory_order_acquire), oldest);
+
+                size_t ret = 0;
+                deferred_node * first_done = oldest;
+                deferred_node * last_done = nullptr;
+                for ( ; oldest && ret < max_count; ++ret)
+                {
+                    last_done = oldest;
+                    oldest = oldest->next;
+                    last_done->destroy(last_done->object);
+                }
+                this->m_destroyed.fetch_add(ret, std::memory_order_relaxed);
+                if (last_done)
+                {
+                    last_done->next = this->m_returned.load(std::memory_order_relaxed);
+                    while (!this->m_returned.compare_exchange_weak(last_done->next, first_done, std::memory_order_release, std::memory_order_relaxed))
+                    {}
+                }
+
+                if (oldest)
+                    this->put_back(oldest);
+                return ret;
+            }
+
+        private:
+            std::atomic<deferred_node *> m_head{nullptr};
+            //oldest first
+            std::atomic<deferred_node *> m_leftover{nullptr};
+            std::atomic<deferred_node *> m_returned{nullptr};
+            deferred_node * m_spare = nullptr;
+            std::atomic<uint64_t> m_pushed{0};
+            std::atomic<uint64_t> m_destroyed{0};
+            std::atomic<uint64_t> m_max_depth{0};
+            std::atomic<bool> m_in_use{true};
+            deferred_queue * m_next = nullptr;
+        };
+    }
+
+    //MARK:- Draining
+
+    //Destroys up to max_count objects whose destruction was deferred by the calling thread, including
+    //objects released by the destructors it runs. Suitable for idle hooks of event loops.
+    //Returns the number of destroyed objects.
+    ISPTR_EXPORTED
+    inline size_t drain_deferred_destroy(size_t max_count = std::numeric_limits<size_t>::max()) noexcept
+        { return internal::deferred_queue::drain_current(max_count); }
+
+    //Destroys all objects whose destruction was deferred by any thread.
+    //Returns the number of destroyed objects.
+    ISPTR_EXPORTED
+    inline size_t drain_all_deferred_destroy() noexcept
+        { return internal::deferred_queue::drain_all(); }
+
+    //Statistics of all deferred destruction queues
+    ISPTR_EXPORTED
+    inline deferred_destroy_snapshot deferred_destroy_stats() noexcept
+        { return internal::deferred_queue::snapshot(); }
+}
+
+#endif
+
+#ifndef HEADER_DEFERRED_DESTROY_RECLAIMER_H_INCLUDED
+#define HEADER_DEFERRED_DESTROY_RECLAIMER_H_INCLUDED
+
+
+
+namespace isptr
+{
+    //MARK:- deferred_destroy_reclaimer
+
+    //Background thread that periodically drains all deferred destruction queues.
+    //The destructor stops the thread and drains the queues once more.
+    ISPTR_EXPORTED
+    class deferred_destroy_reclaimer
+    {
+    public:
+        explicit deferred_destroy_reclaimer(std::chrono::milliseconds interval = std::chrono::milliseconds(10)):
+            m_interval(interval),
+            m_thread(&deferred_destroy_reclaimer::run, this)
+        {}
+
+        ~deferred_destroy_reclaimer() noexcept
+        {
+            {
+                std::lock_guard<std::mutex> guard(this->m_mutex);
+                this->m_stop = true;
+            }
+            this->m_cond.notify_one();
+            this->m_thread.join();
+            //the thread could have been stopped in the middle of a drain
+            drain_all_deferred_destroy();
+        }
+
+        deferred_destroy_reclaimer(const deferred_destroy_reclaimer &) = delete;
+        deferred_destroy_reclaimer & operator=(const deferred_destroy_reclaimer &) = delete;
+
+        //Makes the reclaimer drain the queues without waiting for the interval to pass
+        void wake() noexcept
+        {
+            {
+                std::lock_guard<std::mutex> guard(this->m_mutex);
+                this->m_woken = true;
+            }
+            this->m_cond.notify_one();
+        }
+
+    private:
+        void run() noexcept
+        {
+            std::unique_lock<std::mutex> lock(this->m_mutex);
+            while (!this->m_stop)
+            {
+                if (!this->m_woken)
+                    this->m_cond.wait_for(lock, this->m_interval);
+                this->m_woken = false;
+                lock.unlock();
+                drain_all_deferred_destroy();
+                lock.lock();
+            }
+        }
+
+    private:
+        const std::chrono::milliseconds m_interval;
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+        bool m_stop = false;
+        bool m_woken = false;
+        std::thread m_thread;
+    };
+}
+
+#endif
+
+#ifndef HEADER_CYCLE_COLLECTOR_H_INCLUDED
+#define HEADER_CYCLE_COLLECTOR_H_INCLUDED
+
+
+
+namespace isptr
+{
+    ISPTR_EXPORTED
+    class cycle_visitor;
+
+    namespace internal
+    {
+        class cycle_collector;
+
+        //Colors of synchronous trial deletion (Bacon and Rajan, "Concurrent Cycle Collection in
+        //Reference Counted Systems", 2001)
+        enum class cycle_color : unsigned char
+        {
+            black,      //in use
+            gray,       //possible member of a cycle
+            white,      //member of a garbage cycle
+            purple,     //possible root of a cycle
+            collecting  //garbage being destroyed
+        };
+
+        struct cycle_node;
+
+        //Type-specific operations of a cycle collectable class
+        struct cycle_ops
+        {
+            void (*traverse)(cycle_node * node, cycle_visitor & visitor) noexcept;
+            void (*release)(cycle_node * node) noexcept;
+        };
+
+        //Count of a cycle collectable object. Objects whose count drops to a non-zero value are linked
+        //into the candidate list of the releasing thread. The list is not synchronized so releasing a
+        //buffered object on another thread must not race with the buffering thread using its list.
+        struct cycle_node
+        {
+            explicit cycle_node(const cycle_ops * ops_) noexcept:
+                ops(ops_)
+            {}
+
+            void add_ref() noexcept
+            {
+                assert(this->count > 0);
+                ++this->count;
+                this->color = cycle_color::black;
+            }
+
+            //Returns whether the object needs to be destroyed
+            bool sub_ref() noexcept;
+
+            bool buffered() const noexcept
+                { return this->next != nullptr; }
+
+            void unlink() noexcept
+            {
+                this->prev->next = this->next;
+                this->next->prev = this->prev;
+                this->prev = this->next = nullptr;
+            }
+
+            cycle_node * prev = nullptr;
+            cycle_node * next = nullptr;
+            const cycle_ops * ops;
+            int count = 1;
+            cycle_color color = cycle_color::black;
+        };
+
+        template<class T, class = void>
+        struct is_cycle_collectable : std::false_type
+        {};
+
+        template<class T>
+        struct is_cycle_collectable<T, std::void_t<decltype(T::collects_cycles)>> : std::bool_constant<T::collects_cycles>
+        {};
+    }
+
+    //MARK:- cycle_visitor
+
+    //Passed to traverse() of cycle collectable classes which must call it for every pointer to
+    //a cycle collectable object they hold. Pointers to other objects are ignored.
+    ISPTR_EXPORTED
+    class cycle_visitor
+    {
+    friend internal::cycle_collector;
+    public:
+        cycle_visitor(const cycle_visitor &) = delete;
+        cycle_visitor & operator=(const cycle_visitor &) = delete;
+
+        template<class T, class Traits>
+        void operator()(intrusive_shared_ptr<T, Traits> & ptr) noexcept
+        {
+            using object_type = std::remove_const_t<T>;
+            if constexpr (internal::is_cycle_collectable<object_type>::value)
+            {
+                if (!ptr)
+                    return;
+                if (this->m_action == action::clear)
+                    ptr.reset();
+                else
+                    this->visit(object_type::ref_counted_base::cycle_node_of(ptr.get()));
+            }
+        }
+
+    private:
+        enum class action
+        {
+            mark_gray,
+            scan,
+            scan_black,
+            collect_white,
+            restore,
+            clear
+        };
+
+        cycle_visitor(internal::cycle_collector & collector, action act) noexcept:
+            m_collector(collector),
+            m_action(act)
+        {}
+
+        void visit(internal::cycle_node * node) noexcept;
+
+    private:
+        internal::cycle_collector & m_collector;
+        action m_action;
+    };
+
+    namespace internal
+    {
+        //Candidate roots of garbage cycles buffered by a thread. The list is circular with the
+        //collector as the sentinel.
+        class cycle_collector
+        {
+        friend cycle_visitor;
+        public:
+            static cycle_collector & current() noexcept
+            {
+                static thread_local cycle_collector instance;
+                return instance;
+            }
+
+            cycle_collector(const cycle_collector &) = delete;
+            cycle_collector & operator=(const cycle_collector &) = delete;
+
+            //Collects garbage left by the exiting thread
+            ~cycle_collector() noexcept
+            {
+                while (this->m_roots.next != &this->m_roots)
+                    this->collect();
+            }
+
+            void buffer(cycle_node * node) noexcept
+            {
+                node->prev = this->m_roots.prev;
+                node->next = &this->m_roots;
+                this->m_roots.prev->next = node;
+                this->m_roots.prev = node;
+            }
+
+            size_t collect() noexcept;
+
+        private:
+            cycle_collector() noexcept
+                { this->m_roots.prev = this->m_roots.next = &this->m_roots; }
+
+            void mark_gray(cycle_node * root) noexcept;
+            void scan(cycle_node * root) noexcept;
+            void scan_black(cycle_node * node) noexcept;
+            void collect_white(cycle_node * root) noexcept;
+            void drain(std::vector<cycle_node *> & stack, cycle_visitor::action act) noexcept;
+
+        private:
+            cycle_node m_roots{nullptr};
+            bool m_collecting = false;
+            //kept between collections to avoid reallocation
+            std::vector<cycle_node *> m_candidates;
+            std::vector<cycle_node *> m_stack;
+            std::vector<cycle_node *> m_black_stack;
+            std::vector<cycle_node *> m_garbage;
+        };
+
+        inline bool cycle_node::sub_ref() noexcept
+        {
+            assert(this->count > 0);
+            if (--this->count == 0)
+            {
+                if (this->buffered())
+                    this->unlink();
+                this->color = cycle_color::black;
+                return true;
+            }
+            if (this->color != cycle_color::purple && this->color != cycle_color::collecting)
+            {
+                this->color = cycle_color::purple;
+                if (!this->buffered())
+                    cycle_collector::current().buffer(this);
+            }
+            return false;
+        }
+
+        inline size_t cycle_collector::collect() noexcept
+        {
+            //destructors run by the collection can call us again
+            if (this->m_collecting)
+                return 0;
+            this->m_collecting = true;
+
+            auto & candidates = this->m_candidates;
+            for (auto node = this->m_roots.next; node != &this->m_roots; )
+            {
+                auto next = node->next;
+                node->unlink();
+                //objects used again since they were buffered are not roots anymore
+                if (node->color == cycle_color::purple)
+                    candidates.push_back(node);
+                node = next;
+            }
+
+            //trial deletion of the references inside the subgraphs reachable from the candidates
+            for (auto node: candidates)
+                this->mark_gray(node);
+            for (auto node: candidates)
+                this->scan(node);
+            for (auto node: candidates)
+                this->collect_white(node);
+            candidates.clear();
+
+            auto & garbage = this->m_garbage;
+            //undo the trial deletion of references held by garbage and add one of our own so that
+            //clearing the references does not destroy anything
+            for (auto node: garbage)
+            {
+                cycle_visitor visitor(*this, cycle_visitor::action::restore);
+                node->ops->traverse(node, visitor);
+            }
+            for (auto node: garbage)
+                ++node->count;
+            for (auto node: garbage)
+            {
+                cycle_visitor visitor(*this, cycle_visitor::action::clear);
+                node->ops->traverse(node, visitor);
+            }
+            size_t ret = garbage.size();
+            for (auto node: garbage)
+                node->ops->release(node);
+            garbage.clear();
+
+            this->m_collecting = false;
+            return ret;
+        }
+
+        inline void cycle_collector::mark_gray(cycle_node * root) noexcept
+        {
+            if (root->color == cycle_color::gray)
+                return;
+            root->color = cycle_color::gray;
+            this->m_stack.push_back(root);
+            this->drain(this->m_stack, cycle_visitor::action::mark_gray);
+        }
+
+        inline void cycle_collector::scan(cycle_node * root) noexcept
+        {
+            cycle_visitor visitor(*this, cycle_visitor::action::scan);
+            auto & stack = this->m_stack;
+            stack.push_back(root);
+            while (!stack.empty())
+            {
+                auto node = stack.back();
+                stack.pop_back();
+                if (node->color != cycle_color::gray)
+                    continue;
+                if (node->count > 0)
+                {
+                    //referenced from outside so it and everything it references is alive
+                    this->scan_black(node);
+                }
+                else
+                {
+                    node->color = cycle_color::white;
+                    node->ops->traverse(node, visitor);
+                }
+            }
+        }
+
+        inline void cycle_collector::scan_black(cycle_node * node) noexcept
+        {
+            node->color = cycle_color::black;
+            this->m_black_stack.push_back(node);
+            this->drain(this->m_black_stack, cycle_visitor::action::scan_black);
+        }
+
+        inline void cycle_collector::collect_white(cycle_node * root) noexcept
+        {
+            if (root->color != cycle_color::white)
+                return;
+            root->color = cycle_color::collecting;
+            this->m_garbage.push_back(root);
+            this->m_stack.push_back(root);
+            this->drain(this->m_stack, cycle_visitor::action::collect_white);
+        }
+
+        inline void cycle_collector::drain(std::vector<cycle_node *> & stack, cycle_visitor::action act) noexcept
+        {
+            cycle_visitor visitor(*this, act);
+            while (!stack.empty())
+            {
+                auto node = stack.back();
+                stack.pop_back();
+                node->ops->traverse(node, visitor);
+            }
+        }
+    }
+
+    inline void cycle_visitor::visit(internal::cycle_node * node) noexcept
+    {
+        using internal::cycle_color;
+
+        auto & collector = this->m_collector;
+        switch (this->m_action)
+        {
+        case action::mark_gray:
+            --node->count;
+            if (node->color != cycle_color::gray)
+            {
+                node->color = cycle_color::gray;
+                collector.m_stack.push_back(node);
+            }
+            break;
+        case action::scan:
+            collector.m_stack.push_back(node);
+            break;
+        case action::scan_black:
+            ++node->count;
+            if (node->color != cycle_color::black)
+            {
+                node->color = cycle_color::black;
+                collector.m_black_stack.push_back(node);
+            }
+            break;
+        case action::collect_white:
+            if (node->color == cycle_color::white)
+            {
+                node->color = cycle_color::collecting;
+                collector.m_garbage.push_back(node);
+                collector.m_stack.push_back(node);
+            }
+            break;
+        case action::restore:
+            ++node->count;
+            break;
+        case action::clear:
+            break;
+        }
+    }
+
+    //MARK:- collect_cycles
+
+    //Destroys garbage cycles of objects with ref_counted_flags::cycle_collectable whose count the calling
+    //thread decremented to a non-zero value since the previous collection. Returns the number of
+    //destroyed objects.
+    ISPTR_EXPORTED
+    inline size_t collect_cycles() noexcept
+        { return internal::cycle_collector::current().collect(); }
+}
+
+#endif
+
+#ifndef HEADER_REF_COUNTED_H_INCLUDED
+#define HEADER_REF_COUNTED_H_INCLUDED
+
+
+#if ISPTR_CHECK_UNPUBLISHED_USE
+#endif
+
+namespace isptr
+{
+    //Defined in rcu_ptr.h which classes with ref_counted_flags::rcu_destroy need to include
+    ISPTR_EXPORTED
+    class rcu_domain;
+    ISPTR_EXPORTED
+    class rcu_read_guard;
 
     //MARK:- ref_counted_flags
 
-    ISPTR_EXPORTED
-    enum class ref_counted_flags : unsigned
+    ISPTR_EXPORTED
+    enum class ref_counted_flags : unsigned
+    {
+        none = 0,
+        provide_weak_references = 1,
+        single_threaded = 2,
+        biased = 4,
+        allow_immortal = 8,
+        co_allocate_weak_reference = 16,
+        pool_weak_references = 32,
+        deferred_destroy = 64,
+        isolate_count = 128,
+        promote_on_share = 256,
+        weak_side_table = 512,
+        cycle_collectable = 1024,
+        rcu_destroy = 2048
+    };
+
+    ISPTR_EXPORTED constexpr ref_counted_flags operator|(ref_counted_flags lhs, ref_counted_flags rhs) noexcept
+        { return ref_counted_flags(unsigned(lhs) | unsigned(rhs)); }
+    ISPTR_EXPORTED constexpr ref_counted_flags operator&(ref_counted_flags lhs, ref_counted_flags rhs) noexcept
+        { return ref_counted_flags(unsigned(lhs) & unsigned(rhs)); }
+    ISPTR_EXPORTED constexpr ref_counted_flags operator^(ref_counted_flags lhs, ref_counted_flags rhs) noexcept
+        { return ref_counted_flags(unsigned(lhs) ^ unsigned(rhs)); }
+    ISPTR_EXPORTED constexpr ref_counted_flags operator~(ref_counted_flags arg) noexcept
+        { return ref_counted_flags(~unsigned(arg)); }
+
+    ISPTR_EXPORTED constexpr bool contains(ref_counted_flags val, ref_counted_flags flag) noexcept
+        { return (val & flag) == flag;   }
+
+    //MARK:- Weak reference allocation
+
+    namespace internal
+    {
+        //Derived::weak_reference_allocator if present, otherwise the default pool
+        template<class Derived, class WeakValue, class = void>
+        struct weak_reference_allocator_of
+        {
+            using type = weak_reference_pool<WeakValue>;
+        };
+
+        template<class Derived, class WeakValue>
+        struct weak_reference_allocator_of<Derived, WeakValue, std::void_t<typename Derived::weak_reference_allocator>>
+        {
+            using type = typename Derived::weak_reference_allocator;
+        };
+    }
+
+    //MARK:- Allocator support
+
+    namespace internal
+    {
+        //Layout of an object allocated via an allocator. The object is at the start of the block. 
+        //Allocators that cannot be recreated on demand are stored after it.
+        template<class T, class Allocator>
+        struct allocated_layout
+        {
+            static constexpr size_t align = alignof(T) > alignof(Allocator) ? alignof(T) : alignof(Allocator);
+
+            struct alignas(align) unit
+            {
+                unsigned char bytes[align];
+            };
+
+            using allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<unit>;
+            using traits = std::allocator_traits<allocator_type>;
+
+            static_assert(std::is_same_v<typename traits::pointer, unit *>, "fancy pointers are not supported");
+            static_assert(alignof(allocator_type) <= align, "rebound allocator alignment is unexpected");
+
+            static constexpr bool stores_allocator = !(traits::is_always_equal::value && 
+                                                       std::is_default_constructible_v<allocator_type>);
+            static constexpr size_t allocator_offset = (sizeof(T) + alignof(allocator_type) - 1) / alignof(allocator_type) * alignof(allocator_type);
+            static constexpr size_t size = stores_allocator ? allocator_offset + sizeof(allocator_type) : sizeof(T);
+            static constexpr size_t units = (size + align - 1) / align;
+
+            static void * allocator_address(unit * storage) noexcept
+                { return reinterpret_cast<unsigned char *>(storage) + allocator_offset; }
+            static allocator_type * stored_allocator(unit * storage) noexcept
+                { return std::launder(static_cast<allocator_type *>(allocator_address(storage))); }
+        };
+    }
+
+    //MARK:- Biased counting support
+
+    namespace internal
+    {
+        //Link of an object whose shared count went negative and which waits for its owning
+        //thread to merge the biased count into the shared one
+        struct biased_queue_node
+        {
+            void (* const merge)(biased_queue_node *) noexcept;
+            biased_queue_node * next = nullptr;
+        };
+
+        //Record of a thread that owns biased counts. Records are never freed. When a thread exits
+        //its record is released and the next thread that acquires it takes over the biased counts
+        //of all objects created under it. Queued objects of a released record are merged by the
+        //thread that queues them.
+        class biased_owner
+        {
+        public:
+            //Record of the calling thread or nullptr if it never created a biased object
+            static biased_owner * current() noexcept
+                { return biased_owner::current_slot(); }
+
+            //Record of the calling thread, acquiring one if necessary. Returns nullptr if a new
+            //record cannot be allocated
+            static biased_owner * acquire_current() noexcept
+            {
+                auto & slot = biased_owner::current_slot();
+                if (!slot)
+                {
+                    static thread_local thread_holder holder;
+                    holder.rec = slot = biased_owner::acquire();
+                }
+                return slot;
+            }
+
+            bool has_queued() const noexcept
+                { return this->m_queue.load(std::memory_order_relaxed) != nullptr; }
+
+            //Called by a non-owning thread
+            void enqueue(biased_queue_node * node) noexcept
+            {
+                node->next = this->m_queue.load(std::memory_order_relaxed);
+                while (!this->m_queue.compare_exchange_weak(node->next, node, std::memory_order_seq_cst, std::memory_order_relaxed))
+                {}
+                this->drain_if_released();
+            }
+
+            //Called by the owning thread
+            void drain() noexcept
+            {
+                for (auto node = this->m_queue.exchange(nullptr, std::memory_order_acquire); node; )
+                {
+                    auto next = node->next; //merge can destroy the object
+                    node->merge(node);
+                    node = next;
+                }
+            }
+
+        private:
+            struct thread_holder
+            {
+                ~thread_holder() noexcept
+                {
+                    if (this->rec)
+                    {
+                        biased_owner::current_slot() = nullptr;
+                        this->rec->drain();
+                        this->rec->m_in_use.store(false, std::memory_order_seq_cst);
+                        this->rec->drain_if_released();
+                    }
+                }
+
+                biased_owner * rec = nullptr;
+            };
+
+            static biased_owner *& current_slot() noexcept
+            {
+                static thread_local biased_owner * instance = nullptr;
+                return instance;
+            }
+
+            static std::atomic<biased_owner *> & head() noexcept
+            {
+                static std::atomic<biased_owner *> instance{nullptr};
+                return instance;
+            }
+
+            static biased_owner * acquire() noexcept
+            {
+                auto & list = biased_owner::head();
+                for (auto rec = list.load(std::memory_order_acquire); rec; rec = rec->m_next)
+                {
+                    if (!rec->m_in_use.load(std::memory_order_relaxed) && !rec->m_in_use.exchange(true, std::memory_order_acquire))
+                    {
+                        rec->drain();
+                        return rec;
+                    }
+                }
+
+                auto rec = new (std::nothrow) biased_owner;
+                if (!rec)
+                    return nullptr;
+                rec->m_next = list.load(std::memory_order_relaxed);
+                while (!list.compare_exchange_weak(rec->m_next, rec, std::memory_order_release, std::memory_order_relaxed))
+                {}
+                return rec;
+            }
+
+            //Nodes queued after the owner released the record would never be merged so whoever
+            //observes such nodes temporarily takes the record over and merges them
+            void drain_if_released() noexcept
+            {
+                while (this->m_queue.load(std::memory_order_seq_cst) && 
+                       !this->m_in_use.load(std::memory_order_seq_cst) &&
+                       !this->m_in_use.exchange(true, std::memory_order_seq_cst))
+                {
+                    this->drain();
+                    this->m_in_use.store(false, std::memory_order_seq_cst);
+                }
+            }
+
+        private:
+            std::atomic<biased_queue_node *> m_queue{nullptr};
+            std::atomic<bool> m_in_use{true};
+            biased_owner * m_next = nullptr;
+        };
+
+        //Count of a biased object. The owning thread updates biased without atomics. Other threads
+        //update shared which holds the count shifted left by 2 and the merged and queued flags.
+        //The node must be the first member so that ref_counted can be recovered from it.
+        template<class CountType>
+        struct biased_count
+        {
+            static constexpr CountType merged = 1;
+            static constexpr CountType queued = 2;
+            static constexpr CountType one = 4;
+
+            biased_count(CountType initial, void (*merge)(biased_queue_node *) noexcept) noexcept:
+                node{merge},
+                owner(biased_owner::acquire_current()),
+                biased(this->owner ? initial : 0),
+                shared(this->owner ? CountType(0) : CountType(initial * one | merged))
+            {}
+
+            static CountType refs(CountType value) noexcept
+                { return CountType((value - (value & (one - 1))) / one); }
+
+            biased_queue_node node;
+            biased_owner * const owner;
+            CountType biased;
+            std::atomic<CountType> shared;
+        };
+    }
+
+    //Merges the biased counts of objects owned by the calling thread that other threads have 
+    //released below zero. This happens automatically on the owning thread's sub_ref() and when 
+    //it exits. Threads that rarely release their objects can call it periodically.
+    ISPTR_EXPORTED
+    inline void merge_biased_refs() noexcept
+    {
+        if (auto owner = internal::biased_owner::current())
+            owner->drain();
+    }
+
+    //MARK:- Count storage
+
+    namespace internal
+    {
+        //Count of an object whose counts live in its co-allocated weak reference
+        struct no_count
+        {
+            constexpr explicit no_count(int) noexcept
+            {}
+        };
+
+        //Count of an object that is counted without atomic read-modify-write operations until it is
+        //published. value holds the count shifted left by 1 and the published flag.
+        template<class CountType>
+        struct promotable_count
+        {
+            static constexpr CountType published = 1;
+            static constexpr CountType one = 2;
+
+            explicit promotable_count(CountType initial) noexcept:
+                value(CountType(initial * one))
+            {}
+
+            static CountType refs(CountType value) noexcept
+                { return CountType(value / one); }
+
+            //Unpublished objects can only be used by the thread that created them
+            void check_owner() const noexcept
+            {
+            #if ISPTR_CHECK_UNPUBLISHED_USE
+                assert(this->owner == std::this_thread::get_id() && "object used by another thread before publish()");
+            #endif
+            }
+
+            std::atomic<CountType> value;
+        #if ISPTR_CHECK_UNPUBLISHED_USE
+            const std::thread::id owner = std::this_thread::get_id();
+        #endif
+        };
+
+        //Type of the count stored in ref_counted
+        template<ref_counted_flags Flags, class CountType>
+        using ref_counted_count = std::conditional_t<contains(Flags, ref_counted_flags::co_allocate_weak_reference), no_count,
+                                      std::conditional_t<contains(Flags, ref_counted_flags::cycle_collectable), cycle_node,
+                                          std::conditional_t<contains(Flags, ref_counted_flags::single_threaded), CountType, 
+                                              std::conditional_t<contains(Flags, ref_counted_flags::biased), biased_count<CountType>, 
+                                                  std::conditional_t<contains(Flags, ref_counted_flags::promote_on_share), promotable_count<CountType>,
+                                                                     std::atomic<CountType>>>>>>;
+
+        //Storage of the count of ref_counted. It is a private base so that the count stays the first member
+        //of ref_counted while optional padding follows it.
+        template<class Count, bool Isolated>
+        struct count_storage
+        {
+            explicit count_storage(Count (* make)() noexcept) noexcept:
+                m_count(make())
+            {}
+
+            mutable Count m_count;
+        };
+
+        //The padding keeps members of the derived class at least a cache line away from the count
+        template<class Count>
+        struct count_storage<Count, true>
+        {
+            static_assert(sizeof(Count) < ISPTR_CACHE_LINE_SIZE);
+
+            explicit count_storage(Count (* make)() noexcept) noexcept:
+                m_count(make())
+            {}
+
+            mutable Count m_count;
+            char m_padding[ISPTR_CACHE_LINE_SIZE - sizeof(Count)] = {};
+        };
+    }
+
+    //MARK:- Weak side table
+
+    namespace internal
+    {
+        //Weak references of objects with weak_side_table flag keyed by object address. Objects are spread 
+        //over shards with their own locks so that unrelated objects rarely contend. An object has an entry
+        //from the moment its first weak reference is created until it is destroyed.
+        class weak_side_table
+        {
+        public:
+            static void * find(const void * obj) noexcept
+            {
+                auto hash = weak_side_table::hash_of(obj);
+                auto & entry = weak_side_table::shard_for(hash);
+                entry.lock.lock();
+                auto slot = entry.find(obj, hash);
+                void * ret = slot ? slot->weak : nullptr;
+                entry.lock.unlock();
+                return ret;
+            }
+
+            //Returns the weak reference of obj. If there is none creates it via make() which is called 
+            //with the shard locked. created tells which case happened.
+            template<class Make>
+            static void * find_or_insert(const void * obj, Make && make, bool & created)
+            {
+                auto hash = weak_side_table::hash_of(obj);
+                auto & entry = weak_side_table::shard_for(hash);
+                entry.lock.lock();
+                try
+                {
+                    void * ret;
+                    if (auto slot = entry.find(obj, hash))
+                    {
+                        ret = slot->weak;
+                        created = false;
+                    }
+                    else
+                    {
+                        entry.reserve();
+                        ret = std::forward<Make>(make)();
+                        entry.insert(obj, ret, hash);
+                        created = true;
+                    }
+                    entry.lock.unlock();
+                    return ret;
+                }
+                catch(...)
+                {
+                    entry.lock.unlock();
+                    throw;
+                }
+            }
+
+            //Removes the entry of obj and returns its weak reference
+            static void * erase(const void * obj) noexcept
+            {
+                auto hash = weak_side_table::hash_of(obj);
+                auto & entry = weak_side_table::shard_for(hash);
+                entry.lock.lock();
+                void * ret = entry.erase(obj, hash);
+                entry.lock.unlock();
+                return ret;
+            }
+
+        private:
+            static constexpr unsigned shard_bits = 6;
+
+            struct slot
+            {
+                const void * obj;
+                void * weak;
+            };
+
+            //Open addressing hash table with linear probing. Top bits of the hash select the shard and 
+            //the following ones the slot.
+            struct shard
+            {
+                spin_lock<> lock;
+                slot * slots = nullptr;
+                unsigned capacity_bits = 0;
+                size_t size = 0;
+
+                size_t index_of(uint64_t hash) const noexcept
+                    { return size_t((hash << weak_side_table::shard_bits) >> (64 - this->capacity_bits)); }
+                size_t mask() const noexcept
+                    { return (size_t(1) << this->capacity_bits) - 1; }
+
+                slot * find(const void * obj, uint64_t hash) const noexcept
+                {
+                    if (!this->slots)
+                        return nullptr;
+                    for (size_t i = this->index_of(hash); this->slots[i].obj; i = (i + 1) & this->mask())
+                    {
+                        if (this->slots[i].obj == obj)
+                            return &this->slots[i];
+                    }
+                    return nullptr;
+                }
+
+                //Makes sure the next insert() does not need to allocate. Keeps the table at most half full.
+                void reserve()
+                {
+                    if (this->slots && (this->size + 1) * 2 <= this->mask() + 1)
+                        return;
+                    unsigned new_bits = this->slots ? this->capacity_bits + 1 : 4;
+                    auto old_slots = this->slots;
+                    auto old_capacity = this->slots ? this->mask() + 1 : 0;
+                    this->slots = new slot[size_t(1) << new_bits]();
+                    this->capacity_bits = new_bits;
+                    for (size_t i = 0; i < old_capacity; ++i)
+                    {
+                        if (old_slots[i].obj)
+                            this->place(old_slots[i], weak_side_table::hash_of(old_slots[i].obj));
+                    }
+                    delete[] old_slots;
+                }
+
+                void insert(const void * obj, void * weak, uint64_t hash) noexcept
+                {
+                    this->place(slot{obj, weak}, hash);
+                    ++this->size;
+                }
+
+                void * erase(const void * obj, uint64_t hash) noexcept
+                {
+                    auto found = this->find(obj, hash);
+                    if (!found)
+                        return nullptr;
+                    void * ret = found->weak;
+                    //move back following entries that would not be found across the hole otherwise
+                    size_t hole = size_t(found - this->slots);
+                    for (size_t i = (hole + 1) & this->mask(); this->slots[i].obj; i = (i + 1) & this->mask())
+                    {
+                        size_t home = this->index_of(weak_side_table::hash_of(this->slots[i].obj));
+                        if (((i - home) & this->mask()) >= ((i - hole) & this->mask()))
+                        {
+                            this->slots[hole] = this->slots[i];
+                            hole = i;
+                        }
+                    }
+                    this->slots[hole] = slot{nullptr, nullptr};
+                    --this->size;
+                    return ret;
+                }
+
+                void place(const slot & value, uint64_t hash) noexcept
+                {
+                    size_t i = this->index_of(hash);
+                    while (this->slots[i].obj)
+                        i = (i + 1) & this->mask();
+                    this->slots[i] = value;
+                }
+            };
+
+            static uint64_t hash_of(const void * obj) noexcept
+            {
+                //Fibonacci hashing spreads adjacent addresses over distant shards and slots
+                return uint64_t(reinterpret_cast<uintptr_t>(obj) / alignof(void *)) * 0x9E3779B97F4A7C15u;
+            }
+
+            static shard & shard_for(uint64_t hash) noexcept
+            {
+                //never destroyed so that objects released during static destruction can still use it
+                //each shard on its own line so that locking one does not slow down the others
+                static cache_line_padded<shard> * const shards = new cache_line_padded<shard>[size_t(1) << weak_side_table::shard_bits];
+                return shards[hash >> (64 - weak_side_table::shard_bits)].value;
+            }
+        };
+    }
+
+    //MARK:- ref_counted_layout
+
+    //Where the count of a ref_counted object is relative to the rest of it. Offsets are from the start
+    //of the object. Cache lines are counted from the one the object starts on.
+    ISPTR_EXPORTED
+    struct ref_counted_layout
+    {
+        size_t object_size = 0;
+        size_t count_offset = 0;
+        size_t count_size = 0;
+        size_t count_padding = 0;
+        size_t payload_offset = 0;
+        size_t count_line = 0;
+        size_t payload_line = 0;
+
+        //Whether the count is on the same cache line as data that follows ref_counted in the object
+        bool shares_line() const noexcept
+            { return this->payload_offset < this->object_size && this->count_line == this->payload_line; }
+    };
+
+    ISPTR_EXPORTED
+    template<class Char>
+    std::basic_ostream<Char> & operator<<(std::basic_ostream<Char> & str, const ref_counted_layout & layout)
+    {
+        str << "size: " << layout.object_size 
+            << ", count: " << layout.count_offset << '+' << layout.count_size 
+            << " (padding " << layout.count_padding << ", line " << layout.count_line << ')'
+            << ", payload: " << layout.payload_offset << " (line " << layout.payload_line << ')';
+        return str;
+    }
+
+    //MARK:- Forward Declarations
+
+    ISPTR_EXPORTED
+    template<ref_counted_flags Flags>
+    using default_count_type = std::conditional_t<contains(Flags, ref_counted_flags::provide_weak_references) && 
+                                                  !contains(Flags, ref_counted_flags::weak_side_table), intptr_t, int>;
+
+    ISPTR_EXPORTED
+    template<class Derived, ref_counted_flags Flags = ref_counted_flags::none, class CountType = default_count_type<Flags>>
+    class ref_counted;
+
+    ISPTR_EXPORTED
+    template<class T, ref_counted_flags Flags = ref_counted_flags::none, class CountType = default_count_type<Flags>>
+    class ref_counted_adapter;
+
+    ISPTR_EXPORTED
+    template<class T, ref_counted_flags Flags = ref_counted_flags::none, class CountType = default_count_type<Flags>>
+    class ref_counted_wrapper;
+
+    ISPTR_EXPORTED
+    template<class Derived>
+    using weak_ref_counted = ref_counted<Derived, ref_counted_flags::provide_weak_references>;
+
+    ISPTR_EXPORTED
+    template<class Derived>
+    using weak_ref_counted_adapter = ref_counted_adapter<Derived, ref_counted_flags::provide_weak_references>;
+
+    ISPTR_EXPORTED
+    template<class Derived>
+    using weak_ref_counted_wrapper = ref_counted_wrapper<Derived, ref_counted_flags::provide_weak_references>;
+
+    ISPTR_EXPORTED
+    template<class Derived>
+    using biased_ref_counted = ref_counted<Derived, ref_counted_flags::biased>;
+
+    ISPTR_EXPORTED
+    template<class Derived>
+    using biased_ref_counted_adapter = ref_counted_adapter<Derived, ref_counted_flags::biased>;
+
+    ISPTR_EXPORTED
+    template<class Derived>
+    using biased_ref_counted_wrapper = ref_counted_wrapper<Derived, ref_counted_flags::biased>;
+
+    ISPTR_EXPORTED
+    template<class Derived, class CountType = default_count_type<ref_counted_flags::single_threaded>>
+    using ref_counted_st = ref_counted<Derived, ref_counted_flags::single_threaded, CountType>;
+
+    ISPTR_EXPORTED
+    template<class Derived, class CountType = default_count_type<ref_counted_flags::single_threaded>>
+    using ref_counted_adapter_st = ref_counted_adapter<Derived, ref_counted_flags::single_threaded, CountType>;
+
+    ISPTR_EXPORTED
+    template<class Derived, class CountType = default_count_type<ref_counted_flags::single_threaded>>
+    using ref_counted_wrapper_st = ref_counted_wrapper<Derived, ref_counted_flags::single_threaded, CountType>;
+
+    ISPTR_EXPORTED
+    template<class Derived>
+    using weak_ref_counted_st = ref_counted<Derived, ref_counted_flags::provide_weak_references | 
+                                                     ref_counted_flags::single_threaded>;
+
+    ISPTR_EXPORTED
+    template<class Derived>
+    using weak_ref_counted_adapter_st = ref_counted_adapter<Derived, ref_counted_flags::provide_weak_references | 
+                                                                     ref_counted_flags::single_threaded>;
+
+    ISPTR_EXPORTED
+    template<class Derived>
+    using weak_ref_counted_wrapper_st = ref_counted_wrapper<Derived, ref_counted_flags::provide_weak_references |
+                                                                     ref_counted_flags::single_threaded>;
+
+    ISPTR_EXPORTED
+    template<class Owner>
+    class weak_reference;
+
+    ISPTR_EXPORTED
+    template<class T>
+    ref_counted_layout layout_of_ref_counted(const T & obj) noexcept;
+
+
+    //MARK:-
+
+    struct ref_counted_traits
+    {
+        template<class T>
+        static void add_ref(const T * obj) noexcept
+            { obj->call_add_ref(); }
+        
+        template<class T>
+        static void sub_ref(const T * obj) noexcept
+            { obj->call_sub_ref(); }
+
+        template<class T>
+        static auto add_ref_n(const T * obj, size_t n) noexcept -> decltype(obj->call_add_ref_n(n))
+            { obj->call_add_ref_n(n); }
+
+        template<class T>
+        static auto sub_ref_n(const T * obj, size_t n) noexcept -> decltype(obj->call_sub_ref_n(n))
+            { obj->call_sub_ref_n(n); }
+
+        template<class T>
+        static auto publish(const T * obj) noexcept -> decltype(obj->publish())
+            { obj->publish(); }
+
+        template<class T>
+        static auto is_referenced(const T * obj) noexcept -> decltype(obj->is_referenced())
+            { return obj->is_referenced(); }
+    };
+
+    //MARK:-
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    class ref_counted : private internal::count_storage<internal::ref_counted_count<Flags, CountType>,
+                                                        contains(Flags, ref_counted_flags::isolate_count)>
+    {
+    template<class Owner> friend class weak_reference;
+    template<class T> friend ref_counted_layout layout_of_ref_counted(const T & obj) noexcept;
+    friend ref_counted_traits;
+    friend cycle_visitor;
+    public:
+        using refcnt_ptr_traits = ref_counted_traits;
+        using ref_counted_base = ref_counted;
+        
+        static constexpr bool provides_weak_references = contains(Flags, ref_counted_flags::provide_weak_references);
+        static constexpr bool single_threaded = contains(Flags, ref_counted_flags::single_threaded);
+        static constexpr bool biased = contains(Flags, ref_counted_flags::biased);
+        static constexpr bool allows_immortal = contains(Flags, ref_counted_flags::allow_immortal);
+        static constexpr bool co_allocates_weak_reference = contains(Flags, ref_counted_flags::co_allocate_weak_reference);
+        static constexpr bool pools_weak_references = contains(Flags, ref_counted_flags::pool_weak_references);
+        static constexpr bool defers_destroy = contains(Flags, ref_counted_flags::deferred_destroy);
+        static constexpr bool isolates_count = contains(Flags, ref_counted_flags::isolate_count);
+        static constexpr bool promotes_on_share = contains(Flags, ref_counted_flags::promote_on_share);
+        static constexpr bool uses_weak_side_table = contains(Flags, ref_counted_flags::weak_side_table);
+        static constexpr bool collects_cycles = contains(Flags, ref_counted_flags::cycle_collectable);
+        static constexpr bool destroys_after_rcu = contains(Flags, ref_counted_flags::rcu_destroy);
+        
+    public:
+        using weak_value_type   = std::conditional_t<ref_counted::provides_weak_references, weak_reference<Derived>, void>;
+        using weak_ptr          = std::conditional_t<ref_counted::provides_weak_references, intrusive_shared_ptr<weak_value_type, ref_counted_traits>, void>;
+        using const_weak_ptr    = std::conditional_t<ref_counted::provides_weak_references, intrusive_shared_ptr<const weak_value_type, ref_counted_traits>, void>;
+        
+    private:
+        static_assert(!ref_counted::provides_weak_references || ref_counted::uses_weak_side_table || std::is_same_v<CountType, intptr_t>,
+                      "CountType must be intptr_t (the default) when providing weak references without weak_side_table");
+        static_assert(std::is_integral_v<CountType>, "CountType must be an integral type");
+        static_assert(ref_counted::single_threaded || std::atomic<CountType>::is_always_lock_free,
+                      "CountType must be such that std::atomic<CountType> is alwayd lock free");
+        static_assert(!ref_counted::biased || (!ref_counted::single_threaded && !ref_counted::provides_weak_references),
+                      "biased counting cannot be combined with other flags");
+        static_assert(!ref_counted::biased || std::is_signed_v<CountType>, "CountType must be signed for biased counting");
+        static_assert(!ref_counted::allows_immortal || (!ref_counted::provides_weak_references && !ref_counted::biased),
+                      "immortal objects cannot be combined with weak references or biased counting");
+        static_assert(!ref_counted::co_allocates_weak_reference || ref_counted::provides_weak_references,
+                      "co_allocate_weak_reference requires provide_weak_references");
+        static_assert(!ref_counted::pools_weak_references || 
+                      (ref_counted::provides_weak_references && !ref_counted::co_allocates_weak_reference),
+                      "pool_weak_references requires provide_weak_references and cannot be combined with co_allocate_weak_reference");
+        static_assert(!ref_counted::defers_destroy || !ref_counted::co_allocates_weak_reference,
+                      "deferred_destroy cannot be combined with co_allocate_weak_reference");
+        static_assert(!ref_counted::isolates_count || !ref_counted::co_allocates_weak_reference,
+                      "isolate_count cannot be combined with co_allocate_weak_reference");
+        static_assert(!ref_counted::promotes_on_share || 
+                      (!ref_counted::provides_weak_references && !ref_counted::single_threaded && !ref_counted::biased && 
+                       !ref_counted::allows_immortal),
+                      "promote_on_share cannot be combined with weak references, single threaded, biased or immortal objects");
+        static_assert(!ref_counted::uses_weak_side_table || 
+                      (ref_counted::provides_weak_references && !ref_counted::co_allocates_weak_reference),
+                      "weak_side_table requires provide_weak_references and cannot be combined with co_allocate_weak_reference");
+        static_assert(!ref_counted::uses_weak_side_table || std::is_signed_v<CountType>, 
+                      "CountType must be signed for weak_side_table");
+        static_assert(!ref_counted::collects_cycles || 
+                      (ref_counted::single_threaded && !ref_counted::provides_weak_references && !ref_counted::allows_immortal),
+                      "cycle_collectable requires single_threaded and cannot be combined with weak references or immortal objects");
+        static_assert(!ref_counted::collects_cycles || std::is_same_v<CountType, int>,
+                      "CountType must be int (the default) for cycle_collectable");
+        static_assert(!ref_counted::destroys_after_rcu || (!ref_counted::co_allocates_weak_reference && !ref_counted::defers_destroy),
+                      "rcu_destroy cannot be combined with co_allocate_weak_reference or deferred_destroy");
+        
+        using count_type = internal::ref_counted_count<Flags, CountType>;
+        using count_storage = internal::count_storage<count_type, ref_counted::isolates_count>;
+
+    public:
+        ref_counted(const ref_counted &) noexcept = delete;
+        ref_counted & operator=(const ref_counted &) noexcept = delete;
+        ref_counted(ref_counted &&) noexcept = delete;
+        ref_counted & operator=(ref_counted &&) noexcept = delete;
+        
+        void add_ref() const noexcept;
+        void sub_ref() const noexcept;
+
+        //Same as calling add_ref() or sub_ref() n times but with a single atomic operation where possible
+        void add_ref_n(size_t n) const noexcept;
+        void sub_ref_n(size_t n) const noexcept;
+
+        //Makes add_ref() and sub_ref() no-ops so the object is never destroyed by releasing references.
+        //Suitable for long-lived shared objects and objects with static storage.
+        template<class X = Derived, class = std::enable_if_t<internal::dependent_bool<ref_counted::allows_immortal, X>> >
+        void make_immortal() const noexcept
+        {
+            if constexpr (!ref_counted::single_threaded)
+                this->m_count.store(ref_counted::immortal_count, std::memory_order_relaxed);
+            else
+                this->m_count = ref_counted::immortal_count;
+        }
+
+        template<class X = Derived, class = std::enable_if_t<internal::dependent_bool<ref_counted::allows_immortal, X>> >
+        bool is_immortal() const noexcept
+        {
+            if constexpr (!ref_counted::single_threaded)
+                return ref_counted::is_immortal_count(this->m_count.load(std::memory_order_relaxed));
+            else
+                return ref_counted::is_immortal_count(this->m_count);
+        }
+
+        //Switches counting to atomic operations so that the object can be used by other threads. Must be
+        //called by the creating thread before the object becomes reachable from another thread. 
+        //Storing the object in std::atomic<intrusive_shared_ptr>, hazard_atomic_ptr or rcu_ptr calls it.
+        template<class X = Derived, class = std::enable_if_t<internal::dependent_bool<ref_counted::promotes_on_share, X>> >
+        void publish() const noexcept
+        {
+            auto value = this->m_count.value.load(std::memory_order_relaxed);
+            if (!(value & count_type::published))
+            {
+                this->m_count.check_owner();
+                this->m_count.value.store(value | count_type::published, std::memory_order_release);
+            }
+        }
+
+        template<class X = Derived, class = std::enable_if_t<internal::dependent_bool<ref_counted::promotes_on_share, X>> >
+        bool is_published() const noexcept
+            { return this->m_count.value.load(std::memory_order_relaxed) & count_type::published; }
+        
+        //Allocates T together with its weak reference in a single block which is freed once both the
+        //object is destroyed and all weak pointers are released. Objects of classes that co-allocate
+        //their weak references must be created via this function (make_refcnt calls it).
+        template<class T, class... Args, class X = Derived, 
+                 class = std::enable_if_t<internal::dependent_bool<ref_counted::co_allocates_weak_reference, X>> >
+        static T * co_allocate(Args &&... args)
+        {
+            static_assert(std::is_base_of_v<Derived, T>, "T must derive from Derived");
+            static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "over-aligned types cannot co-allocate weak references");
+
+            void * storage = ::operator new(ref_counted::weak_block_offset() + sizeof(T));
+            void * object_storage = static_cast<char *>(storage) + ref_counted::weak_block_offset();
+            //set before constructing T so that weak_block() can check it, including from T's constructor
+            auto block = ::new (storage) weak_value_type(1, static_cast<Derived *>(object_storage));
+            //the only weak reference is the one held by the object
+            if constexpr (!ref_counted::single_threaded)
+                block->m_count.store(1, std::memory_order_relaxed);
+            else
+                block->m_count = 1;
+            T * ret;
+            try
+            {
+                ret = ::new (object_storage) T(std::forward<Args>(args)...);
+            }
+            catch(...)
+            {
+                block->~weak_value_type();
+                ::operator delete(storage);
+                throw;
+            }
+            [[maybe_unused]] Derived * owner = ret;
+            assert(owner == block->m_owner && "Derived must be at the start of T");
+            return ret;
+        }
+
+        //Allocates T using a copy of Derived::refcnt_allocator constructed from alloc. The memory is returned
+        //through the same allocator when the object is destroyed. Only available if Derived declares a 
+        //refcnt_allocator type and T is Derived since destroy() only knows the size of Derived. Objects of 
+        //such classes must be created via this function (make_refcnt and allocate_refcnt call it).
+        template<class T, class Alloc, class... Args, class X = Derived, 
+                 class = std::enable_if_t<internal::has_refcnt_allocator<X>::value && std::is_same_v<T, X>> >
+        static T * allocate(const Alloc & alloc, Args &&... args)
+        {
+            static_assert(!ref_counted::co_allocates_weak_reference, 
+                          "refcnt_allocator cannot be combined with co_allocate_weak_reference");
+            using layout = internal::allocated_layout<T, typename X::refcnt_allocator>;
+
+            typename layout::allocator_type allocator(alloc);
+            auto storage = layout::traits::allocate(allocator, layout::units);
+            T * ret;
+            try
+            {
+                ret = ::new (static_cast<void *>(storage)) T(std::forward<Args>(args)...);
+            }
+            catch(...)
+            {
+                layout::traits::deallocate(allocator, storage, layout::units);
+                throw;
+            }
+            if constexpr (layout::stores_allocator)
+                ::new (layout::allocator_address(storage)) typename layout::allocator_type(std::move(allocator));
+            return ret;
+        }
+
+        template<class X = Derived, class = std::enable_if_t<internal::dependent_bool<ref_counted::provides_weak_references, X>> >
+        weak_ptr get_weak_ptr()
+            { return weak_ptr::noref(const_cast<weak_reference<X> *>(const_cast<const ref_counted *>(this)->call_get_weak_value())); }
+        
+        template<class X = Derived, class = std::enable_if_t<internal::dependent_bool<ref_counted::provides_weak_references, X>> >
+        const_weak_ptr get_weak_ptr() const
+            { return const_weak_ptr::noref(this->call_get_weak_value()); }
+        
+    protected:
+        ref_counted() noexcept:
+            count_storage(&ref_counted::initial_count)
+        {}
+        ~ref_counted() noexcept;
+        
+        void destroy() const noexcept
+        { 
+            //co-allocated storage is freed when the weak reference is
+            if constexpr (ref_counted::co_allocates_weak_reference)
+                static_cast<const Derived *>(this)->~Derived();
+            else if constexpr (internal::has_refcnt_allocator<Derived>::value)
+                ref_counted::deallocate(static_cast<const Derived *>(this));
+            else
+                delete static_cast<const Derived *>(this); 
+        }
+        
+        const weak_value_type * get_weak_value() const;
+        
+        weak_value_type * make_weak_reference(intptr_t count) const
+        {
+            auto non_const_derived = static_cast<Derived *>(const_cast<ref_counted *>(this));
+            if constexpr (ref_counted::pools_weak_references)
+            {
+                using allocator = typename ref_counted::weak_allocator_type<>;
+                void * storage = allocator::allocate();
+                return ::new (storage) weak_value_type(count, non_const_derived);
+            }
+            else
+            {
+                return new weak_value_type(count, non_const_derived);
+            }
+        }
+
+    private:
+        //CRTP access
+        void call_add_ref() const noexcept
+            { static_cast<const Derived *>(this)->add_ref(); }
+        void call_sub_ref() const noexcept
+            { static_cast<const Derived *>(this)->sub_ref(); }
+        void call_traverse(cycle_visitor & visitor) noexcept
+            { static_cast<Derived *>(this)->traverse(visitor); }
+
+        //Whether the count is not 0. Only meant for debug checks.
+        bool is_referenced() const noexcept;
+
+        //Classes that override add_ref() or sub_ref() see every reference individually
+        void call_add_ref_n(size_t n) const noexcept
+        {
+            if constexpr (std::is_same_v<decltype(&Derived::add_ref), void (ref_counted::*)() const noexcept>)
+                static_cast<const Derived *>(this)->add_ref_n(n);
+            else
+                for ( ; n; --n)
+                    this->call_add_ref();
+        }
+        void call_sub_ref_n(size_t n) const noexcept
+        {
+            if constexpr (std::is_same_v<decltype(&Derived::sub_ref), void (ref_counted::*)() const noexcept>)
+                static_cast<const Derived *>(this)->sub_ref_n(n);
+            else
+                for ( ; n; --n)
+                    this->call_sub_ref();
+        }
+        
+        void call_destroy() const noexcept
+        {
+            if constexpr (ref_counted::defers_destroy)
+                internal::deferred_queue::push(static_cast<const Derived *>(this), &ref_counted::destroy_deferred);
+            else if constexpr (ref_counted::destroys_after_rcu)
+                internal::dependent_t<rcu_domain, Derived>::global().call_rcu(const_cast<Derived *>(static_cast<const Derived *>(this)), 
+                                                                              &ref_counted::destroy_after_rcu);
+            else
+                static_cast<const Derived *>(this)->destroy();
+        }
+
+        static void destroy_deferred(const void * obj) noexcept
+            { static_cast<const Derived *>(obj)->destroy(); }
+        static void destroy_after_rcu(void * obj) noexcept
+            { static_cast<const Derived *>(obj)->destroy(); }
+
+        auto call_make_weak_reference(intptr_t count) const
+        {
+            if constexpr (ref_counted::provides_weak_references)
+                return static_cast<const Derived *>(this)->make_weak_reference(count);
+        }
+        
+        auto call_get_weak_value() const
+            { return static_cast<const Derived *>(this)->get_weak_value(); }
+        
+        //Weak reference pointer decoding and encoding
+    #if ISPTR_USE_FETCH_ADD_WEAK_COUNT
+        //The pointer is stored above a field that starts in the middle of its range. Updates that were meant
+        //for the count but landed on the encoded pointer change only this field and are undone afterwards.
+        static constexpr unsigned straggler_bits = 15;
+        static constexpr uintptr_t straggler_base = uintptr_t(1) << (straggler_bits - 1);
+        //Largest batched update applied at once. Leaves room in the field for 256 threads updating 
+        //the count at the same time.
+        static constexpr size_t max_straggler_update = straggler_base / 256;
+        static constexpr uintptr_t weak_pointer_mask = (uintptr_t(1) << 48) - 1;
+
+        template<class X>
+        static X * decode_pointer(intptr_t count) noexcept
+            { return (X *)((uintptr_t(count) >> ref_counted::straggler_bits) & ref_counted::weak_pointer_mask); }
+
+        template<class X>
+        static intptr_t encode_pointer(X * ptr) noexcept
+        {
+            assert((uintptr_t(ptr) & ~ref_counted::weak_pointer_mask) == 0);
+            return intptr_t((uintptr_t(ptr) << ref_counted::straggler_bits) | ref_counted::straggler_base |
+                            uintptr_t(std::numeric_limits<intptr_t>::min()));
+        }
+    #else
+        template<class X>
+        static X * decode_pointer(intptr_t count) noexcept
+            { return (X *)(uintptr_t(count) << 1); }
+
+        template<class X>
+        static intptr_t encode_pointer(X * ptr) noexcept
+            { return (uintptr_t(ptr) >> 1) | uintptr_t(std::numeric_limits<intptr_t>::min()); }
+    #endif
+
+        static bool is_encoded_pointer(intptr_t count) noexcept
+            { return count < 0; }
+
+        //With weak_side_table the count is replaced by this marker and the weak reference is looked up by 
+        //object address. The marker is in the middle of the negative range so that updates racing with 
+        //the replacement keep it negative.
+        static constexpr CountType side_table_marker = CountType(std::numeric_limits<CountType>::min() / 2);
+
+        weak_value_type * side_table_weak() const noexcept
+            { return static_cast<weak_value_type *>(internal::weak_side_table::find(this)); }
+
+        weak_value_type * make_side_table_weak() const;
+
+        //Destroys an object created by allocate() and returns its memory to the allocator
+        static void deallocate(const Derived * obj) noexcept
+        {
+            using layout = internal::allocated_layout<Derived, typename Derived::refcnt_allocator>;
+            using allocator_type = typename layout::allocator_type;
+
+            auto storage = reinterpret_cast<typename layout::unit *>(const_cast<Derived *>(obj));
+            obj->~Derived();
+            if constexpr (layout::stores_allocator)
+            {
+                auto stored = layout::stored_allocator(storage);
+                allocator_type allocator(std::move(*stored));
+                stored->~allocator_type();
+                layout::traits::deallocate(allocator, storage, layout::units);
+            }
+            else
+            {
+                allocator_type allocator;
+                layout::traits::deallocate(allocator, storage, layout::units);
+            }
+        }
+
+        //Allocator of pooled weak references
+        template<class X = Derived>
+        using weak_allocator_type = typename internal::weak_reference_allocator_of<X, weak_value_type>::type;
+
+        //Weak reference co-allocated in front of the object
+        static constexpr size_t weak_block_offset() noexcept
+        {
+            constexpr size_t align = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+            return (sizeof(weak_value_type) + align - 1) / align * align;
+        }
+
+        weak_value_type * weak_block() const noexcept
+        {
+            auto derived = reinterpret_cast<const char *>(static_cast<const Derived *>(this));
+            auto ret = reinterpret_cast<weak_value_type *>(const_cast<char *>(derived - ref_counted::weak_block_offset()));
+            //the block of a co-allocated object always points back to it
+            assert(ret->m_owner == static_cast<const Derived *>(this) && "object was not created via co_allocate()");
+            return ret;
+        }
+
+        //Immortal objects. Counts above the threshold are immortal. The sentinel is in the middle of that
+        //range so that updates racing with make_immortal() cannot bring the count back
+        static constexpr CountType immortal_threshold = std::numeric_limits<CountType>::max() / 2 + 1;
+        static constexpr CountType immortal_count = immortal_threshold + immortal_threshold / 2;
+
+        //Counts of weak_side_table objects saturate there
+        static constexpr bool saturates_count = ref_counted::allows_immortal || ref_counted::uses_weak_side_table;
+
+        static bool is_immortal_count(CountType count) noexcept
+            { return ref_counted::saturates_count && ISPTR_UNLIKELY(count >= ref_counted::immortal_threshold); }
+
+        void saturate() const noexcept
+        {
+            //move to the middle of the immortal range unless the count has been replaced meanwhile
+            CountType value = ref_counted::immortal_threshold;
+            while (!ref_counted::is_encoded_pointer(value) && 
+                   !this->m_count.compare_exchange_weak(value, ref_counted::immortal_count, std::memory_order_relaxed))
+            {}
+        }
+
+        //Biased counting
+        bool is_biased_owner() const noexcept
+            { return this->m_count.owner == internal::biased_owner::current() && this->m_count.biased != 0; }
+        void release_shared() const noexcept;
+        void merge_biased(bool from_queue) const noexcept;
+        static void merge_queued(internal::biased_queue_node * node) noexcept;
+
+        //Cycle collection
+        static void cycle_traverse(internal::cycle_node * node, cycle_visitor & visitor) noexcept;
+        static void cycle_release(internal::cycle_node * node) noexcept;
+        static internal::cycle_node * cycle_node_of(const ref_counted * obj) noexcept
+            { return &obj->m_count; }
+
+        static count_type initial_count() noexcept
+        {
+            if constexpr (ref_counted::biased)
+            {
+                return count_type(1, &ref_counted::merge_queued);
+            }
+            else if constexpr (ref_counted::collects_cycles)
+            {
+                static constexpr internal::cycle_ops ops{&ref_counted::cycle_traverse, &ref_counted::cycle_release};
+                return count_type(&ops);
+            }
+            else
+            {
+                return count_type(1);
+            }
+        }
+    };
+
+    template<class Owner>
+    class weak_reference
+    {
+    template<class T, ref_counted_flags Flags, class CountType> friend class ref_counted;
+    friend ref_counted_traits;
+    public:
+        using refcnt_ptr_traits = ref_counted_traits;
+        using strong_value_type = Owner;
+        using strong_ptr = intrusive_shared_ptr<strong_value_type, ref_counted_traits>;
+        using const_strong_ptr = intrusive_shared_ptr<const strong_value_type, ref_counted_traits>;
+
+        static constexpr bool single_threaded = Owner::single_threaded;
+
+    private:
+        using count_type = std::conditional_t<weak_reference::single_threaded, intptr_t, std::atomic<intptr_t>>;
+
+        //Strong count of a destroyed owner. With wait-free lock() failed attempts keep incrementing it 
+        //but cannot clear the sign bit.
+        static constexpr intptr_t dead_owner = (!weak_reference::single_threaded && ISPTR_USE_WAIT_FREE_WEAK_LOCK) ? 
+                                                    std::numeric_limits<intptr_t>::min() : 0;
+        static intptr_t owner_refs(intptr_t value) noexcept
+            { return value < 0 ? 0 : value; }
+        
+    public:
+        weak_reference(const weak_reference &) noexcept = delete;
+        weak_reference & operator=(const weak_reference &) noexcept = delete;
+        weak_reference(weak_reference &&) noexcept = delete;
+        weak_reference & operator=(weak_reference &&) noexcept = delete;
+
+        void add_ref() const noexcept;
+        void sub_ref() const noexcept;
+        
+        template<class X = Owner>
+        const_strong_ptr lock() const noexcept
+            { return const_strong_ptr::noref(this->call_lock_owner()); }
+        
+        template<class X = Owner>
+        strong_ptr lock() noexcept
+            { return strong_ptr::noref(this->call_lock_owner()); }
+
+        //Owners with rcu_destroy can be resolved without changing their count. The returned pointer is
+        //valid until the read section ends.
+        template<class X = Owner, class = std::enable_if_t<internal::dependent_bool<X::destroys_after_rcu, X>>>
+        const strong_value_type * peek(const internal::dependent_t<rcu_read_guard, X> & guard) const noexcept
+        {
+            assert((&guard.domain() == &internal::dependent_t<rcu_domain, X>::global()));
+            (void)guard;
+            return this->call_peek_owner();
+        }
+
+        template<class X = Owner, class = std::enable_if_t<internal::dependent_bool<X::destroys_after_rcu, X>>>
+        strong_value_type * peek(const internal::dependent_t<rcu_read_guard, X> & guard) noexcept
+        {
+            assert((&guard.domain() == &internal::dependent_t<rcu_domain, X>::global()));
+            (void)guard;
+            return this->call_peek_owner();
+        }
+
+        //Calls fn with the owner or nullptr from within a read section
+        template<class Func, class X = Owner, class = std::enable_if_t<internal::dependent_bool<X::destroys_after_rcu, X>>>
+        decltype(auto) with_locked(Func && fn) const
+        {
+            internal::dependent_t<rcu_read_guard, X> guard;
+            return std::forward<Func>(fn)(this->peek(guard));
+        }
+
+        template<class Func, class X = Owner, class = std::enable_if_t<internal::dependent_bool<X::destroys_after_rcu, X>>>
+        decltype(auto) with_locked(Func && fn)
+        {
+            internal::dependent_t<rcu_read_guard, X> guard;
+            return std::forward<Func>(fn)(this->peek(guard));
+        }
+
+    protected:
+        constexpr weak_reference(intptr_t initial_strong, Owner * owner) noexcept:
+            m_strong(initial_strong),
+            m_owner(owner)
+        {}
+
+        ~weak_reference() noexcept = default;
+        
+        void destroy() const
+        { 
+            if constexpr (Owner::co_allocates_weak_reference)
+            {
+                //we are at the start of the block that also held the owner
+                auto storage = const_cast<void *>(static_cast<const void *>(this));
+                this->~weak_reference();
+                ::operator delete(storage);
+            }
+            else if constexpr (Owner::pools_weak_references && std::is_same_v<derived_type<>, weak_reference>)
+            {
+                using allocator = typename Owner::ref_counted_base::template weak_allocator_type<Owner>;
+                auto storage = const_cast<void *>(static_cast<const void *>(this));
+                this->~weak_reference();
+                allocator::deallocate(storage);
+            }
+            else
+            {
+                delete static_cast<const derived_type<> *>(this); 
+            }
+        }
+        
+        void add_owner_ref() noexcept;
+        void sub_owner_ref() noexcept;
+        
+        strong_value_type * lock_owner() const noexcept;
+        strong_value_type * peek_owner() const noexcept;
+        
+        void on_owner_destruction() const noexcept
+        {}
+        
+    private:
+        template<class X=Owner>
+        using derived_type = std::remove_pointer_t<decltype(std::declval<X>().call_make_weak_reference(0))>;
+        
+        void call_add_ref() const noexcept
+            { static_cast<const derived_type<> *>(this)->add_ref(); }
+        void call_sub_ref() const noexcept
+            { static_cast<const derived_type<> *>(this)->sub_ref(); }
+        void call_add_owner_ref() noexcept
+            { static_cast<derived_type<> *>(this)->add_owner_ref(); }
+        void call_sub_owner_ref() noexcept
+            { static_cast<derived_type<> *>(this)->sub_owner_ref(); }
+        void call_destroy() const
+            { static_cast<const derived_type<> *>(this)->destroy(); }
+
+        //Classes that override add_owner_ref() or sub_owner_ref() see every reference individually
+        void call_add_owner_ref_n(size_t n) noexcept
+        {
+            if constexpr (std::is_same_v<decltype(&derived_type<>::add_owner_ref), void (weak_reference::*)() noexcept>)
+                this->add_owner_ref_n(n);
+            else
+                for ( ; n; --n)
+                    this->call_add_owner_ref();
+        }
+        void call_sub_owner_ref_n(size_t n) noexcept
+        {
+            if constexpr (std::is_same_v<decltype(&derived_type<>::sub_owner_ref), void (weak_reference::*)() noexcept>)
+                this->sub_owner_ref_n(n);
+            else
+                for ( ; n; --n)
+                    this->call_sub_owner_ref();
+        }
+
+        void add_owner_ref_n(size_t n) noexcept;
+        void sub_owner_ref_n(size_t n) noexcept;
+        //Called once the owner count drops to 0
+        void release_owner() noexcept;
+        strong_value_type * call_lock_owner() const noexcept
+            { return static_cast<const derived_type<> *>(this)->lock_owner(); }
+        strong_value_type * call_peek_owner() const noexcept
+            { return static_cast<const derived_type<> *>(this)->peek_owner(); }
+        void call_on_owner_destruction() const noexcept
+            { static_cast<const derived_type<> *>(this)->on_owner_destruction(); }
+
+        //A co-allocated owner cannot release its reference to us from its destructor since that could 
+        //free its memory while it is still being destroyed, so we do it here once destruction is complete
+        void release_co_allocated_owner() noexcept
+        {
+            if constexpr (Owner::co_allocates_weak_reference)
+            {
+                this->call_on_owner_destruction();
+                this->call_sub_ref(); //this can delete ourselves
+            }
+        }
+        
+    private:
+        mutable count_type m_count = 2;
+        mutable count_type m_strong = 0;
+        Owner * m_owner = nullptr;
+    };
+
+    template<class T, ref_counted_flags Flags, class CountType>
+    class ref_counted_adapter : public ref_counted<ref_counted_adapter<T, Flags, CountType>, Flags, CountType>, public T
+    {
+    friend ref_counted<ref_counted_adapter<T, Flags, CountType>, Flags, CountType>;
+    public:
+        template<class... Args, class=std::enable_if_t<std::is_constructible_v<T, Args...>>>
+        ref_counted_adapter(Args&&... args) noexcept(noexcept(T(std::forward<Args>(args)...))):
+            T(std::forward<Args>(args)...)
+        {}
+
+    protected:
+        ~ref_counted_adapter() noexcept = default;
+    };
+
+    template<class T, ref_counted_flags Flags, class CountType>
+    class ref_counted_wrapper : public ref_counted<ref_counted_wrapper<T, Flags, CountType>, Flags, CountType>
+    {
+    friend ref_counted<ref_counted_wrapper<T, Flags, CountType>, Flags, CountType>;
+    public:
+        template<class... Args, class=std::enable_if_t<std::is_constructible_v<T, Args...>>>
+        ref_counted_wrapper(Args&&... args) noexcept(noexcept(T(std::forward<Args>(args)...))):
+            wrapped(std::forward<Args>(args)...)
+        {}
+        
+        T wrapped;
+
+    protected:
+        ~ref_counted_wrapper() noexcept = default;
+    };
+
+
+    //MARK:- Implementation
+
+    template<class Owner>
+    inline void weak_reference<Owner>::add_ref() const noexcept
+    {
+        if constexpr (!weak_reference::single_threaded) 
+        {
+            [[maybe_unused]] auto oldcount = this->m_count.fetch_add(1, std::memory_order_relaxed);
+            assert(oldcount > 0);
+            assert(oldcount < std::numeric_limits<decltype(oldcount)>::max());
+        } 
+        else 
+        {
+            assert(this->m_count > 0);
+            assert(this->m_count < std::numeric_limits<decltype(this->m_count)>::max());
+            ++this->m_count;
+        }
+    }
+
+    template<class Owner>
+    inline void weak_reference<Owner>::sub_ref() const noexcept
+    {
+        if constexpr (!weak_reference::single_threaded) 
+        {
+            auto oldcount = this->m_count.fetch_sub(1, std::memory_order_release);
+            assert(oldcount > 0);
+            if (oldcount == 1)
+            {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                this->call_destroy();
+            }
+        }
+        else 
+        {
+            assert(this->m_count > 0);
+            if (--this->m_count == 0)
+                this->call_destroy();
+        }
+    }
+
+    template<class Owner>
+    inline void weak_reference<Owner>::add_owner_ref() noexcept
+    {
+        if constexpr (!weak_reference::single_threaded) 
+        {
+            [[maybe_unused]] auto oldcount = this->m_strong.fetch_add(1, std::memory_order_relaxed);
+            assert(oldcount > 0);
+            assert(oldcount < std::numeric_limits<decltype(oldcount)>::max());
+        }
+        else 
+        {
+            assert(this->m_strong > 0);
+            assert(this->m_strong < std::numeric_limits<decltype(this->m_count)>::max());
+            ++this->m_strong;
+        }
+    }
+
+    template<class Owner>
+    inline void weak_reference<Owner>::sub_owner_ref() noexcept
+    {
+        if constexpr (!weak_reference::single_threaded) 
+        {
+            auto oldcount = this->m_strong.fetch_sub(1, std::memory_order_release);
+            assert(oldcount > 0);
+            if (oldcount == 1)
+                this->release_owner();
+        } 
+        else 
+        {
+            assert(this->m_strong > 0);
+            if (--this->m_strong == 0) 
+                this->release_owner();
+        }
+    }
+
+    template<class Owner>
+    inline void weak_reference<Owner>::add_owner_ref_n(size_t n) noexcept
+    {
+        auto delta = intptr_t(n);
+        if constexpr (!weak_reference::single_threaded) 
+        {
+            [[maybe_unused]] auto oldcount = this->m_strong.fetch_add(delta, std::memory_order_relaxed);
+            assert(oldcount > 0);
+            assert(oldcount <= std::numeric_limits<decltype(oldcount)>::max() - delta);
+        }
+        else
+        {
+            assert(this->m_strong > 0);
+            assert(this->m_strong <= std::numeric_limits<decltype(this->m_strong)>::max() - delta);
+            this->m_strong += delta;
+        }
+    }
+
+    template<class Owner>
+    inline void weak_reference<Owner>::sub_owner_ref_n(size_t n) noexcept
+    {
+        auto delta = intptr_t(n);
+        if constexpr (!weak_reference::single_threaded) 
+        {
+            auto oldcount = this->m_strong.fetch_sub(delta, std::memory_order_release);
+            assert(oldcount >= delta);
+            if (oldcount == delta)
+                this->release_owner();
+        }
+        else
+        {
+            assert(this->m_strong >= delta);
+            this->m_strong -= delta;
+            if (this->m_strong == 0)
+                this->release_owner();
+        }
+    }
+
+    template<class Owner>
+    inline void weak_reference<Owner>::release_owner() noexcept
+    {
+        if constexpr (!weak_reference::single_threaded) 
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+        #if ISPTR_USE_WAIT_FREE_WEAK_LOCK
+            //lock() can revive the owner until the count is marked dead. Whoever releases the revived 
+            //reference tries again.
+            intptr_t expected = 0;
+            if (!this->m_strong.compare_exchange_strong(expected, weak_reference::dead_owner, 
+                                                        std::memory_order_acquire, std::memory_order_relaxed))
+                return;
+        #endif
+        }
+        auto owner = this->m_owner;
+        //peek_owner() can still read it and co-allocated owners check it on destruction
+        if constexpr (!Owner::co_allocates_weak_reference && (weak_reference::single_threaded || !Owner::destroys_after_rcu))
+            this->m_owner = nullptr;
+        owner->call_destroy(); //this can cascade to deleting ourselves so must be the last thing
+        this->release_co_allocated_owner();
+    }
+
+    template<class Owner>
+    inline
+    auto weak_reference<Owner>::lock_owner() const noexcept -> strong_value_type *
+    {
+        if constexpr (!weak_reference::single_threaded) 
+        {
+        #if ISPTR_USE_WAIT_FREE_WEAK_LOCK
+            //a zero count that is not yet marked dead is revived, see sub_owner_ref()
+            intptr_t value = this->m_strong.fetch_add(1, std::memory_order_acquire);
+            if (value < 0)
+                return nullptr;
+            return this->m_owner;
+        #else
+            for (intptr_t value = this->m_strong.load(std::memory_order_relaxed); ; )
+            {
+                assert(value >= 0);
+                
+                if (value == 0)
+                    return nullptr;
+
+                if (this->m_strong.compare_exchange_strong(value, value + 1, std::memory_order_release, std::memory_order_relaxed))
+                    return this->m_owner;
+            }
+        #endif
+        } 
+        else
+        {
+            if (this->m_strong == 0)
+                return nullptr;
+            ++this->m_strong;
+            return this->m_owner;
+        }
+    }
+
+    template<class Owner>
+    inline
+    auto weak_reference<Owner>::peek_owner() const noexcept -> strong_value_type *
+    {
+        //a live owner seen inside a read section is destroyed after the section ends
+        intptr_t value;
+        if constexpr (!weak_reference::single_threaded) 
+            value = this->m_strong.load(std::memory_order_acquire);
+        else
+            value = this->m_strong;
+        if (weak_reference::owner_refs(value) == 0)
+            return nullptr;
+        return this->m_owner;
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::add_ref() const noexcept
+    {
+        if constexpr(ref_counted::co_allocates_weak_reference)
+        {
+            this->weak_block()->call_add_owner_ref();
+        }
+        else if constexpr(ref_counted::promotes_on_share)
+        {
+            auto value = this->m_count.value.load(std::memory_order_relaxed);
+            assert(count_type::refs(value) > 0);
+            assert(count_type::refs(value) < std::numeric_limits<CountType>::max() / count_type::one);
+            if (value & count_type::published)
+            {
+                this->m_count.value.fetch_add(count_type::one, std::memory_order_relaxed);
+            }
+            else
+            {
+                this->m_count.check_owner();
+                this->m_count.value.store(CountType(value + count_type::one), std::memory_order_relaxed);
+            }
+        }
+        else if constexpr(ref_counted::biased)
+        {
+            if (this->is_biased_owner())
+            {
+                assert(this->m_count.biased < std::numeric_limits<CountType>::max());
+                ++this->m_count.biased;
+            }
+            else
+            {
+                [[maybe_unused]] auto oldvalue = this->m_count.shared.fetch_add(count_type::one, std::memory_order_relaxed);
+                assert(count_type::refs(oldvalue) < std::numeric_limits<CountType>::max() / count_type::one);
+            }
+        }
+        else if constexpr(ref_counted::uses_weak_side_table)
+        {
+            if constexpr(!ref_counted::single_threaded)
+            {
+                CountType value = this->m_count.load(std::memory_order_acquire);
+                if (!ref_counted::is_encoded_pointer(value))
+                {
+                    if (ref_counted::is_immortal_count(value))
+                        return;
+                    value = this->m_count.fetch_add(1, std::memory_order_relaxed);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value > 0);
+                        if (ISPTR_UNLIKELY(value == ref_counted::immortal_threshold - 1))
+                            this->saturate();
+                        return;
+                    }
+                    //the weak reference has been created since we looked so undo and go there
+                    this->m_count.fetch_sub(1, std::memory_order_acquire);
+                }
+                this->side_table_weak()->call_add_owner_ref();
+            }
+            else
+            {
+                assert(this->m_count != 0);
+                if (!ref_counted::is_encoded_pointer(this->m_count))
+                {
+                    if (!ref_counted::is_immortal_count(this->m_count))
+                        ++this->m_count;
+                }
+                else
+                {
+                    this->side_table_weak()->call_add_owner_ref();
+                }
+            }
+        }
+        else if constexpr(ref_counted::collects_cycles)
+        {
+            this->m_count.add_ref();
+        }
+        else if constexpr(!ref_counted::provides_weak_references)
+        {
+            if constexpr(!ref_counted::single_threaded)
+            {
+                if constexpr (ref_counted::allows_immortal)
+                {
+                    if (ref_counted::is_immortal_count(this->m_count.load(std::memory_order_relaxed)))
+                        return;
+                }
+                [[maybe_unused]] auto oldcount = this->m_count.fetch_add(1, std::memory_order_relaxed);
+                assert(oldcount > 0);
+                assert(oldcount < std::numeric_limits<decltype(oldcount)>::max());
+            }
+            else
+            {
+                if (ref_counted::is_immortal_count(this->m_count))
+                    return;
+                assert(this->m_count > 0);
+                assert(this->m_count < std::numeric_limits<decltype(this->m_count)>::max());
+                ++this->m_count;
+            }
+        }
+        else
+        {
+            if constexpr(!ref_counted::single_threaded)
+            {
+            #if ISPTR_USE_FETCH_ADD_WEAK_COUNT
+                intptr_t value = this->m_count.load(std::memory_order_acquire);
+                if (!ref_counted::is_encoded_pointer(value))
+                {
+                    value = this->m_count.fetch_add(1, std::memory_order_relaxed);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value > 0);
+                        assert(value < std::numeric_limits<decltype(value)>::max());
+                        return;
+                    }
+                    //the weak reference has been created since we looked so undo and go there
+                    this->m_count.fetch_sub(1, std::memory_order_acquire);
+                }
+                auto ptr = ref_counted::decode_pointer<weak_value_type>(value);
+                ptr->call_add_owner_ref();
+            #else
+                for(intptr_t value = this->m_count.load(std::memory_order_acquire); ; )
+                {
+                    assert(value != 0);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value < std::numeric_limits<decltype(value)>::max());
+                        if (this->m_count.compare_exchange_strong(value, value + 1, std::memory_order_release, std::memory_order_relaxed))
+                            return;
+                    }
+                    else
+                    {
+                        auto ptr = ref_counted::decode_pointer<weak_value_type>(value);
+                        ptr->call_add_owner_ref();
+                        return;
+                    }
+                }
+            #endif
+            }
+            else 
+            {
+                assert(this->m_count != 0);
+                if (!ref_counted::is_encoded_pointer(this->m_count))
+                {
+                    assert(this->m_count < std::numeric_limits<decltype(this->m_count)>::max());
+                    ++this->m_count;
+                }
+                else 
+                {
+                    auto ptr = ref_counted::decode_pointer<weak_value_type>(this->m_count);
+                    ptr->call_add_owner_ref();
+                }
+            }
+        }
+    }
+        
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::sub_ref() const noexcept
+    {
+        if constexpr(ref_counted::co_allocates_weak_reference)
+        {
+            this->weak_block()->call_sub_owner_ref();
+        }
+        else if constexpr(ref_counted::promotes_on_share)
+        {
+            auto value = this->m_count.value.load(std::memory_order_relaxed);
+            assert(count_type::refs(value) > 0);
+            if (value & count_type::published)
+            {
+                value = this->m_count.value.fetch_sub(count_type::one, std::memory_order_release);
+                if (value == (count_type::one | count_type::published))
+                {
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    this->call_destroy();
+                }
+            }
+            else
+            {
+                this->m_count.check_owner();
+                value = CountType(value - count_type::one);
+                this->m_count.value.store(value, std::memory_order_relaxed);
+                if (value == 0)
+                    this->call_destroy();
+            }
+        }
+        else if constexpr(ref_counted::biased)
+        {
+            if (this->is_biased_owner())
+            {
+                auto owner = this->m_count.owner;
+                if (--this->m_count.biased == 0)
+                    this->merge_biased(false);
+                if (owner->has_queued())
+                    owner->drain();
+            }
+            else
+            {
+                this->release_shared();
+            }
+        }
+        else if constexpr(ref_counted::uses_weak_side_table)
+        {
+            if constexpr(!ref_counted::single_threaded)
+            {
+                CountType value = this->m_count.load(std::memory_order_acquire);
+                if (!ref_counted::is_encoded_pointer(value))
+                {
+                    if (ref_counted::is_immortal_count(value))
+                        return;
+                    value = this->m_count.fetch_sub(1, std::memory_order_release);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value > 0);
+                        if (value == 1)
+                        {
+                            std::atomic_thread_fence(std::memory_order_acquire);
+                            this->call_destroy();
+                        }
+                        return;
+                    }
+                    //the weak reference has been created since we looked so undo and go there
+                    this->m_count.fetch_add(1, std::memory_order_acquire);
+                }
+                this->side_table_weak()->call_sub_owner_ref();
+            }
+            else
+            {
+                assert(this->m_count != 0);
+                if (!ref_counted::is_encoded_pointer(this->m_count))
+                {
+                    if (!ref_counted::is_immortal_count(this->m_count) && --this->m_count == 0)
+                        this->call_destroy();
+                }
+                else
+                {
+                    this->side_table_weak()->call_sub_owner_ref();
+                }
+            }
+        }
+        else if constexpr(ref_counted::collects_cycles)
+        {
+            if (this->m_count.sub_ref())
+                this->call_destroy();
+        }
+        else if constexpr(!ref_counted::provides_weak_references)
+        {
+            if constexpr(!ref_counted::single_threaded)
+            {
+                if constexpr (ref_counted::allows_immortal)
+                {
+                    if (ref_counted::is_immortal_count(this->m_count.load(std::memory_order_relaxed)))
+                        return;
+                }
+                auto oldcount = this->m_count.fetch_sub(1, std::memory_order_release);
+                assert(oldcount > 0);
+                if (oldcount == 1)
+                {
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    this->call_destroy();
+                }
+            }
+            else
+            {
+                if (ref_counted::is_immortal_count(this->m_count))
+                    return;
+                assert(this->m_count > 0);
+                if (--this->m_count == 0)
+                    this->call_destroy();
+            }
+        }
+        else
+        {
+            if constexpr(!ref_counted::single_threaded)
+            {
+            #if ISPTR_USE_FETCH_ADD_WEAK_COUNT
+                intptr_t value = this->m_count.load(std::memory_order_acquire);
+                if (!ref_counted::is_encoded_pointer(value))
+                {
+                    value = this->m_count.fetch_sub(1, std::memory_order_release);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value > 0);
+                        if (value == 1)
+                        {
+                            std::atomic_thread_fence(std::memory_order_acquire);
+                            this->call_destroy();
+                        }
+                        return;
+                    }
+                    //the weak reference has been created since we looked so undo and go there
+                    this->m_count.fetch_add(1, std::memory_order_acquire);
+                }
+                auto ptr = ref_counted::decode_pointer<weak_value_type>(value);
+                ptr->call_sub_owner_ref();
+            #else
+                for (intptr_t value = this->m_count.load(std::memory_order_acquire); ; )
+                {
+                    assert(value != 0);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        if (this->m_count.compare_exchange_strong(value, value - 1, std::memory_order_release, std::memory_order_relaxed))
+                        {
+                            if (value == 1)
+                            {
+                                std::atomic_thread_fence(std::memory_order_acquire);
+                                this->call_destroy();
+                            }
+                            return;
+                        }
+                    }
+                    else
+                    {
+                        auto ptr = ref_counted::decode_pointer<weak_value_type>(value);
+                        ptr->call_sub_owner_ref();
+                        return;
+                    }
+                }
+            #endif
+            }
+            else
+            {
+                assert(this->m_count != 0);
+                if (!ref_counted::is_encoded_pointer(this->m_count))
+                {
+                    if (--this->m_count == 0)
+                        this->call_destroy();
+                }
+                else
+                {
+                    auto ptr = ref_counted::decode_pointer<weak_value_type>(this->m_count);
+                    ptr->call_sub_owner_ref();
+                }
+            }
+        }
+    }
+
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::add_ref_n(size_t n) const noexcept
+    {
+        if constexpr(!ref_counted::provides_weak_references && !ref_counted::biased && !ref_counted::promotes_on_share &&
+                     !ref_counted::collects_cycles)
+        {
+            auto delta = CountType(n);
+            assert(size_t(delta) == n);
+            if constexpr(!ref_counted::single_threaded)
+            {
+                if constexpr (ref_counted::allows_immortal)
+                {
+                    if (ref_counted::is_immortal_count(this->m_count.load(std::memory_order_relaxed)))
+                        return;
+                }
+                [[maybe_unused]] auto oldcount = this->m_count.fetch_add(delta, std::memory_order_relaxed);
+                assert(oldcount > 0);
+                assert(oldcount <= std::numeric_limits<decltype(oldcount)>::max() - delta);
+            }
+            else
+            {
+                if (ref_counted::is_immortal_count(this->m_count))
+                    return;
+                assert(this->m_count > 0);
+                assert(this->m_count <= std::numeric_limits<decltype(this->m_count)>::max() - delta);
+                this->m_count = CountType(this->m_count + delta);
+            }
+        }
+        else if constexpr(ref_counted::co_allocates_weak_reference)
+        {
+            this->weak_block()->call_add_owner_ref_n(n);
+        }
+        else if constexpr(ref_counted::provides_weak_references && !ref_counted::uses_weak_side_table)
+        {
+            auto delta = intptr_t(n);
+            if constexpr(!ref_counted::single_threaded)
+            {
+            #if ISPTR_USE_FETCH_ADD_WEAK_COUNT
+                intptr_t value = this->m_count.load(std::memory_order_acquire);
+                while (n && !ref_counted::is_encoded_pointer(value))
+                {
+                    delta = intptr_t(n < ref_counted::max_straggler_update ? n : ref_counted::max_straggler_update);
+                    value = this->m_count.fetch_add(delta, std::memory_order_relaxed);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value > 0);
+                        assert(value <= std::numeric_limits<decltype(value)>::max() - delta);
+                        n -= size_t(delta);
+                        continue;
+                    }
+                    //the weak reference has been created since we looked so undo and go there
+                    this->m_count.fetch_sub(delta, std::memory_order_acquire);
+                }
+                if (n)
+                    ref_counted::decode_pointer<weak_value_type>(value)->call_add_owner_ref_n(n);
+            #else
+                for(intptr_t value = this->m_count.load(std::memory_order_acquire); ; )
+                {
+                    assert(value != 0);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value <= std::numeric_limits<decltype(value)>::max() - delta);
+                        if (this->m_count.compare_exchange_strong(value, value + delta, std::memory_order_release, std::memory_order_relaxed))
+                            return;
+                    }
+                    else
+                    {
+                        ref_counted::decode_pointer<weak_value_type>(value)->call_add_owner_ref_n(n);
+                        return;
+                    }
+                }
+            #endif
+            }
+            else 
+            {
+                assert(this->m_count != 0);
+                if (!ref_counted::is_encoded_pointer(this->m_count))
+                {
+                    assert(this->m_count <= std::numeric_limits<decltype(this->m_count)>::max() - delta);
+                    this->m_count += delta;
+                }
+                else 
+                {
+                    ref_counted::decode_pointer<weak_value_type>(this->m_count)->call_add_owner_ref_n(n);
+                }
+            }
+        }
+        else
+        {
+            for ( ; n; --n)
+                this->add_ref();
+        }
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::sub_ref_n(size_t n) const noexcept
+    {
+        if (n == 0)
+            return;
+        if constexpr(!ref_counted::provides_weak_references && !ref_counted::biased && !ref_counted::promotes_on_share &&
+                     !ref_counted::collects_cycles)
+        {
+            auto delta = CountType(n);
+            assert(size_t(delta) == n);
+            if constexpr(!ref_counted::single_threaded)
+            {
+                if constexpr (ref_counted::allows_immortal)
+                {
+                    if (ref_counted::is_immortal_count(this->m_count.load(std::memory_order_relaxed)))
+                        return;
+                }
+                auto oldcount = this->m_count.fetch_sub(delta, std::memory_order_release);
+                assert(oldcount >= delta);
+                if (oldcount == delta)
+                {
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    this->call_destroy();
+                }
+            }
+            else
+            {
+                if (ref_counted::is_immortal_count(this->m_count))
+                    return;
+                assert(this->m_count >= delta);
+                this->m_count = CountType(this->m_count - delta);
+                if (this->m_count == 0)
+                    this->call_destroy();
+            }
+        }
+        else if constexpr(ref_counted::co_allocates_weak_reference)
+        {
+            this->weak_block()->call_sub_owner_ref_n(n);
+        }
+        else if constexpr(ref_counted::provides_weak_references && !ref_counted::uses_weak_side_table)
+        {
+            auto delta = intptr_t(n);
+            if constexpr(!ref_counted::single_threaded)
+            {
+            #if ISPTR_USE_FETCH_ADD_WEAK_COUNT
+                intptr_t value = this->m_count.load(std::memory_order_acquire);
+                while (n && !ref_counted::is_encoded_pointer(value))
+                {
+                    delta = intptr_t(n < ref_counted::max_straggler_update ? n : ref_counted::max_straggler_update);
+                    value = this->m_count.fetch_sub(delta, std::memory_order_release);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value >= delta);
+                        n -= size_t(delta);
+                        if (value == delta)
+                        {
+                            assert(n == 0);
+                            std::atomic_thread_fence(std::memory_order_acquire);
+                            this->call_destroy();
+                        }
+                        continue;
+                    }
+                    //the weak reference has been created since we looked so undo and go there
+                    this->m_count.fetch_add(delta, std::memory_order_acquire);
+                }
+                if (n)
+                    ref_counted::decode_pointer<weak_value_type>(value)->call_sub_owner_ref_n(n);
+            #else
+                for (intptr_t value = this->m_count.load(std::memory_order_acquire); ; )
+                {
+                    assert(value != 0);
+                    if (!ref_counted::is_encoded_pointer(value))
+                    {
+                        assert(value >= delta);
+                        if (this->m_count.compare_exchange_strong(value, value - delta, std::memory_order_release, std::memory_order_relaxed))
+                        {
+                            if (value == delta)
+                            {
+                                std::atomic_thread_fence(std::memory_order_acquire);
+                                this->call_destroy();
+                            }
+                            return;
+                        }
+                    }
+                    else
+                    {
+                        ref_counted::decode_pointer<weak_value_type>(value)->call_sub_owner_ref_n(n);
+                        return;
+                    }
+                }
+            #endif
+            }
+            else
+            {
+                assert(this->m_count != 0);
+                if (!ref_counted::is_encoded_pointer(this->m_count))
+                {
+                    assert(this->m_count >= delta);
+                    this->m_count -= delta;
+                    if (this->m_count == 0)
+                        this->call_destroy();
+                }
+                else
+                {
+                    ref_counted::decode_pointer<weak_value_type>(this->m_count)->call_sub_owner_ref_n(n);
+                }
+            }
+        }
+        else
+        {
+            for ( ; n; --n)
+                this->sub_ref();
+        }
+    }
+
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::release_shared() const noexcept
+    {
+        auto & count = this->m_count;
+        for (CountType value = count.shared.load(std::memory_order_relaxed); ; )
+        {
+            CountType desired = CountType(value - count_type::one);
+            //Before merging the owner holds a biased reference so the object cannot die here. If the 
+            //shared count goes negative we might have released the owner's last reference and it needs 
+            //to merge the counts to find out.
+            bool enqueue = !(value & count_type::merged) && !(value & count_type::queued) && count_type::refs(desired) < 0;
+            if (enqueue)
+                desired = CountType(desired | count_type::queued);
+            if (count.shared.compare_exchange_weak(value, desired, std::memory_order_release, std::memory_order_relaxed))
+            {
+                if (enqueue)
+                {
+                    count.owner->enqueue(&count.node);
+                }
+                else if ((desired & (count_type::merged | count_type::queued)) == count_type::merged && 
+                         count_type::refs(desired) == 0)
+                {
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    this->call_destroy();
+                }
+                return;
+            }
+        }
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::merge_biased(bool from_queue) const noexcept
+    {
+        auto & count = this->m_count;
+        if (!from_queue)
+        {
+            //An object still queued is destroyed when its node is merged
+            auto oldvalue = count.shared.fetch_or(count_type::merged, std::memory_order_acq_rel);
+            if (!(oldvalue & count_type::queued) && count_type::refs(oldvalue) == 0)
+                this->call_destroy();
+            return;
+        }
+
+        CountType biased = count.biased;
+        count.biased = 0;
+        for (CountType value = count.shared.load(std::memory_order_relaxed); ; )
+        {
+            CountType desired = CountType(((value + biased * count_type::one) | count_type::merged) & ~count_type::queued);
+            if (count.shared.compare_exchange_weak(value, desired, std::memory_order_acq_rel, std::memory_order_relaxed))
+            {
+                assert(count_type::refs(desired) >= 0);
+                if (count_type::refs(desired) == 0)
+                    this->call_destroy();
+                return;
+            }
+        }
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::merge_queued(internal::biased_queue_node * node) noexcept
+    {
+        //the node is the first member of m_count which is the only member of a standard layout class
+        static_assert(std::is_standard_layout_v<ref_counted> && std::is_standard_layout_v<count_type>);
+        reinterpret_cast<const ref_counted *>(node)->merge_biased(true);
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline bool ref_counted<Derived, Flags, CountType>::is_referenced() const noexcept
+    {
+        auto value_of = [](const auto & count) {
+            if constexpr (ref_counted::single_threaded)
+                return count;
+            else
+                return count.load(std::memory_order_relaxed);
+        };
+
+        if constexpr (ref_counted::co_allocates_weak_reference)
+        {
+            return weak_value_type::owner_refs(value_of(this->weak_block()->m_strong)) > 0;
+        }
+        else if constexpr (ref_counted::provides_weak_references)
+        {
+            auto value = value_of(this->m_count);
+            if (!ref_counted::is_encoded_pointer(value))
+                return value > 0;
+            const weak_value_type * weak;
+            if constexpr (ref_counted::uses_weak_side_table)
+                weak = this->side_table_weak();
+            else
+                weak = ref_counted::decode_pointer<const weak_value_type>(value);
+            return weak_value_type::owner_refs(value_of(weak->m_strong)) > 0;
+        }
+        else if constexpr (ref_counted::biased)
+        {
+            //the owner's part of the count cannot be read from other threads
+            return true;
+        }
+        else if constexpr (ref_counted::promotes_on_share)
+        {
+            return count_type::refs(this->m_count.value.load(std::memory_order_relaxed)) > 0;
+        }
+        else if constexpr (ref_counted::collects_cycles)
+        {
+            return this->m_count.count > 0;
+        }
+        else
+        {
+            return value_of(this->m_count) > 0;
+        }
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::cycle_traverse(internal::cycle_node * node, cycle_visitor & visitor) noexcept
+    {
+        //the node is m_count which is the only member of a standard layout class
+        static_assert(std::is_standard_layout_v<ref_counted>);
+        reinterpret_cast<ref_counted *>(node)->call_traverse(visitor);
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline void ref_counted<Derived, Flags, CountType>::cycle_release(internal::cycle_node * node) noexcept
+    {
+        reinterpret_cast<const ref_counted *>(node)->call_sub_ref();
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline auto ref_counted<Derived, Flags, CountType>::get_weak_value() const -> const weak_value_type *
+    {
+        static_assert(ref_counted::provides_weak_references, "class doesn't provide weak references");
+        
+        if constexpr(ref_counted::co_allocates_weak_reference)
+        {
+            auto ptr = this->weak_block();
+            ptr->call_add_ref();
+            return ptr;
+        }
+        else if constexpr(ref_counted::uses_weak_side_table)
+        {
+            bool created;
+            auto ptr = static_cast<weak_value_type *>(
+                internal::weak_side_table::find_or_insert(this, [this]() -> void * { return this->make_side_table_weak(); }, created));
+            if (!created)
+                ptr->call_add_ref();
+            return ptr;
+        }
+        else if constexpr(!ref_counted::single_threaded)
+        {
+            weak_reference<Derived> * ret = nullptr;
+            for (intptr_t value = this->m_count.load(std::memory_order_acquire); ; )
+            {
+                if (!ref_counted::is_encoded_pointer(value))
+                {
+                    //the count keeps changing until we publish so retries only refresh the unpublished copy
+                    if (!ret)
+                        ret = this->call_make_weak_reference(value);
+                    else
+                        ret->m_strong.store(value, std::memory_order_relaxed);
+                    uintptr_t desired = ref_counted::encode_pointer(ret);
+                    if (this->m_count.compare_exchange_strong(value, desired, std::memory_order_acq_rel, std::memory_order_acquire))
+                        return ret;
+                }
+                else
+                {
+                    if (ret)
+                        ret->call_destroy();
+                    auto ptr = ref_counted::decode_pointer<weak_value_type>(value);
+                    ptr->call_add_ref();
+                    return ptr;
+                }
+            }
+        }
+        else
+        {
+            if (!ref_counted::is_encoded_pointer(this->m_count))
+            {
+                weak_reference<Derived> * ret = this->call_make_weak_reference(this->m_count);
+                this->m_count = ref_counted::encode_pointer(ret);
+                return ret;
+            }
+            else 
+            {
+                auto ptr = ref_counted::decode_pointer<weak_value_type>(this->m_count);
+                ptr->call_add_ref();
+                return ptr;
+            }
+        }
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline auto ref_counted<Derived, Flags, CountType>::make_side_table_weak() const -> weak_value_type *
+    {
+        //a saturated count stays saturated in the weak reference
+        auto strong = [](CountType value) {
+            return ref_counted::is_immortal_count(value) ? std::numeric_limits<intptr_t>::max() / 2 : intptr_t(value);
+        };
+
+        weak_value_type * ret = this->call_make_weak_reference(0);
+        if constexpr(!ref_counted::single_threaded)
+        {
+            //only add_ref() and sub_ref() can change the count while we hold the side table lock
+            for (CountType value = this->m_count.load(std::memory_order_relaxed); ; )
+            {
+                assert(value > 0);
+                ret->m_strong.store(strong(value), std::memory_order_relaxed);
+                if (this->m_count.compare_exchange_weak(value, ref_counted::side_table_marker, std::memory_order_acq_rel, std::memory_order_relaxed))
+                    return ret;
+            }
+        }
+        else
+        {
+            assert(this->m_count > 0);
+            ret->m_strong = strong(this->m_count);
+            this->m_count = ref_counted::side_table_marker;
+            return ret;
+        }
+    }
+
+    template<class Derived, ref_counted_flags Flags, class CountType>
+    inline ref_counted<Derived, Flags, CountType>::~ref_counted() noexcept
+    {
+        [[maybe_unused]] auto valid_count = [](auto val) { 
+            return val == 0 || val == 1 || (ref_counted::saturates_count && val >= ref_counted::immortal_threshold); 
+        };
+        
+        if constexpr (ref_counted::co_allocates_weak_reference)
+        {
+            //the weak reference is released by weak_reference::sub_owner_ref() after destruction completes
+            if constexpr(!ref_counted::single_threaded)
+                assert(valid_count(weak_value_type::owner_refs(this->weak_block()->m_strong.load(std::memory_order_relaxed))));
+            else
+                assert(valid_count(this->weak_block()->m_strong));
+        }
+        else if constexpr (ref_counted::uses_weak_side_table)
+        {
+            CountType value;
+            if constexpr(!ref_counted::single_threaded)
+                value = this->m_count.load(std::memory_order_relaxed);
+            else
+                value = this->m_count;
+            if (ref_counted::is_encoded_pointer(value))
+            {
+                auto ptr = static_cast<const weak_value_type *>(internal::weak_side_table::erase(this));
+                assert(ptr);
+                //a saturated object can only be destroyed directly and must not be locked after that
+                if constexpr(!ref_counted::single_threaded)
+                {
+                    assert(valid_count(weak_value_type::owner_refs(ptr->m_strong.load(std::memory_order_relaxed))));
+                    if (ptr->m_strong.load(std::memory_order_relaxed) > 1)
+                        ptr->m_strong.store(weak_value_type::dead_owner, std::memory_order_relaxed);
+                }
+                else
+                {
+                    assert(valid_count(ptr->m_strong));
+                    if (ptr->m_strong > 1)
+                        ptr->m_strong = 0;
+                }
+                ptr->call_on_owner_destruction();
+                ptr->call_sub_ref();
+            }
+            else
+            {
+                assert(valid_count(value));
+            }
+        }
+        else if constexpr (ref_counted::provides_weak_references)
+        {
+            if constexpr(!ref_counted::single_threaded)
+            {
+                intptr_t value = this->m_count.load(std::memory_order_relaxed);
+                if (ref_counted::is_encoded_pointer(value))
+                {
+                    auto ptr = ref_counted::decode_pointer<const weak_value_type>(value);
+                    assert(valid_count(weak_value_type::owner_refs(ptr->m_strong.load(std::memory_order_relaxed))));
+                    ptr->call_on_owner_destruction();
+                    ptr->call_sub_ref();
+                }
+                else
+                {
+                    assert(valid_count(value));
+                }
+            }
+            else 
+            {
+                if (ref_counted::is_encoded_pointer(this->m_count))
+                {
+                    auto ptr = ref_counted::decode_pointer<const weak_value_type>(this->m_count);
+                    assert(valid_count(ptr->m_strong));
+                    ptr->call_on_owner_destruction();
+                    ptr->call_sub_ref();
+                }
+                else
+                {
+                    assert(valid_count(this->m_count));
+                }
+            }
+        }
+        else if constexpr (ref_counted::biased)
+        {
+            assert(valid_count(this->m_count.biased + count_type::refs(this->m_count.shared.load(std::memory_order_relaxed))));
+        }
+        else if constexpr (ref_counted::promotes_on_share)
+        {
+            assert(valid_count(count_type::refs(this->m_count.value.load(std::memory_order_relaxed))));
+        }
+        else if constexpr (ref_counted::collects_cycles)
+        {
+            //objects can be destroyed directly while buffered
+            assert(valid_count(this->m_count.count));
+            if (this->m_count.buffered())
+                this->m_count.unlink();
+        }
+        else
+        {
+            if constexpr(!ref_counted::single_threaded)
+                assert(valid_count(this->m_count.load(std::memory_order_relaxed)));
+            else
+                assert(valid_count(this->m_count));
+        }
+    }
+
+    //MARK:- Layout report
+
+    //Reports where the count of obj landed. The payload is whatever follows the ref_counted base of obj, 
+    //normally the first members of T.
+    template<class T>
+    ref_counted_layout layout_of_ref_counted(const T & obj) noexcept
+    {
+        using base_type = typename T::ref_counted_base;
+
+        const base_type & base = obj;
+        auto address = [](const void * ptr) { return reinterpret_cast<uintptr_t>(ptr); };
+        auto start = address(std::addressof(obj));
+        auto count = address(std::addressof(base.m_count));
+        auto payload = address(std::addressof(base)) + sizeof(base_type);
+
+        ref_counted_layout ret;
+        ret.object_size = sizeof(T);
+        ret.count_offset = count - start;
+        ret.count_size = sizeof(base.m_count);
+        ret.count_padding = sizeof(typename base_type::count_storage) - sizeof(base.m_count);
+        ret.payload_offset = payload - start;
+        ret.count_line = count / ISPTR_CACHE_LINE_SIZE - start / ISPTR_CACHE_LINE_SIZE;
+        ret.payload_line = payload / ISPTR_CACHE_LINE_SIZE - start / ISPTR_CACHE_LINE_SIZE;
+        return ret;
+    }
+
+    //MARK:- atomic_weak_ptr
+
+    ISPTR_EXPORTED
+    template<class WeakValue, class Policy = default_atomic_policy>
+    class atomic_weak_ptr : public atomic_intrusive_shared_ptr<WeakValue, ref_counted_traits, Policy>
+    {
+    private:
+        using base = atomic_intrusive_shared_ptr<WeakValue, ref_counted_traits, Policy>;
+    public:
+        using typename base::value_type;
+        using strong_ptr = decltype(std::declval<WeakValue &>().lock());
+
+    public:
+        constexpr atomic_weak_ptr() noexcept = default;
+        atomic_weak_ptr(value_type desired) noexcept : base(std::move(desired))
+            {}
+
+        atomic_weak_ptr(const atomic_weak_ptr &) = delete;
+        atomic_weak_ptr & operator=(const atomic_weak_ptr &) = delete;
+
+        using base::operator=;
+
+        //Equivalent to load()->lock() but does not add and release a reference to the weak reference itself
+        strong_ptr lock_strong() const noexcept
+        {
+            return this->borrow([](WeakValue * weak) noexcept {
+                return weak ? weak->lock() : strong_ptr();
+            });
+        }
+    };
+}
+
+namespace std
+{
+    template<class Owner>
+    class atomic<::isptr::intrusive_shared_ptr<::isptr::weak_reference<Owner>, ::isptr::ref_counted_traits>> : 
+        public ::isptr::atomic_weak_ptr<::isptr::weak_reference<Owner>>
+    {
+    private:
+        using base = ::isptr::atomic_weak_ptr<::isptr::weak_reference<Owner>>;
+    public:
+        using typename base::value_type;
+    public:
+        constexpr atomic() noexcept = default;
+        atomic(value_type desired) noexcept : base(std::move(desired))
+            {}
+        
+        atomic(const atomic&) = delete;
+        atomic & operator=(const atomic&) = delete;
+
+        using base::operator=;
+    };
+
+    template<class Owner>
+    class atomic<::isptr::intrusive_shared_ptr<const ::isptr::weak_reference<Owner>, ::isptr::ref_counted_traits>> : 
+        public ::isptr::atomic_weak_ptr<const ::isptr::weak_reference<Owner>>
     {
-        none = 0,
-        provide_weak_references = 1,
-        single_threaded = 2
+    private:
+        using base = ::isptr::atomic_weak_ptr<const ::isptr::weak_reference<Owner>>;
+    public:
+        using typename base::value_type;
+    public:
+        constexpr atomic() noexcept = default;
+        atomic(value_type desired) noexcept : base(std::move(desired))
+            {}
+        
+        atomic(const atomic&) = delete;
+        atomic & operator=(const atomic&) = delete;
+
+        using base::operator=;
     };
+}
 
-    ISPTR_EXPORTED constexpr ref_counted_flags operator|(ref_counted_flags lhs, ref_counted_flags rhs) noexcept
-        { return ref_counted_flags(unsigned(lhs) | unsigned(rhs)); }
-    ISPTR_EXPORTED constexpr ref_counted_flags operator&(ref_counted_flags lhs, ref_counted_flags rhs) noexcept
-        { return ref_counted_flags(unsigned(lhs) & unsigned(rhs)); }
-    ISPTR_EXPORTED constexpr ref_counted_flags operator^(ref_counted_flags lhs, ref_counted_flags rhs) noexcept
-        { return ref_counted_flags(unsigned(lhs) ^ unsigned(rhs)); }
-    ISPTR_EXPORTED constexpr ref_counted_flags operator~(ref_counted_flags arg) noexcept
-        { return ref_counted_flags(~unsigned(arg)); }
+#endif
 
-    ISPTR_EXPORTED constexpr bool contains(ref_counted_flags val, ref_counted_flags flag) noexcept
-        { return (val & flag) == flag;   }
+#ifndef HEADER_APPLE_CF_PTR_H_INCLUDED
+#define HEADER_APPLE_CF_PTR_H_INCLUDED
 
-    //MARK:- Forward Declarations
+#if (defined(__APPLE__) && defined(__MACH__))
+
+
+
+namespace isptr
+{
+    struct cf_traits
+    {
+        static void add_ref(CFTypeRef ptr) noexcept
+            { CFRetain(ptr); }
+        static void sub_ref(CFTypeRef ptr) noexcept
+            { CFRelease(ptr); }
+    };
 
     ISPTR_EXPORTED
-    template<ref_counted_flags Flags>
-    using default_count_type = std::conditional_t<contains(Flags, ref_counted_flags::provide_weak_references), intptr_t, int>;
+    template<class T>
+    using cf_ptr = intrusive_shared_ptr<std::remove_pointer_t<T>, cf_traits>;
 
     ISPTR_EXPORTED
-    template<class Derived, ref_counted_flags Flags = ref_counted_flags::none, class CountType = default_count_type<Flags>>
-    class ref_counted;
+    template<class T>
+    cf_ptr<T *> cf_retain(T * ptr) {
+        return cf_ptr<T *>::ref(ptr);
+    }
+    ISPTR_EXPORTED
+    template<class T>
+    cf_ptr<T *> cf_attach(T * ptr) {
+        return cf_ptr<T *>::noref(ptr);
+    }
+}
+
+#endif
+
+#endif
+
+#ifndef HEADER_COM_PTR_H_INCLUDED
+#define HEADER_COM_PTR_H_INCLUDED
+
+#if defined(_WIN32)
+
+
+
+namespace isptr
+{
+    struct com_traits
+    {
+        template<class T>
+        static std::enable_if_t<std::is_base_of_v<IUnknown, T>, void> add_ref(T * ptr) noexcept
+            { ptr->AddRef(); }
+        template<class T>
+        static std::enable_if_t<std::is_base_of_v<IUnknown, T>, void> sub_ref(T * ptr) noexcept
+            { ptr->Release(); }
+    };
 
     ISPTR_EXPORTED
-    template<class T, ref_counted_flags Flags = ref_counted_flags::none, class CountType = default_count_type<Flags>>
-    class ref_counted_adapter;
+    template<class T>
+    using com_shared_ptr = intrusive_shared_ptr<T, com_traits>;
 
     ISPTR_EXPORTED
-    template<class T, ref_counted_flags Flags = ref_counted_flags::none, class CountType = default_count_type<Flags>>
-    class ref_counted_wrapper;
+    template<class T>
+    com_shared_ptr<T> com_retain(T * ptr) {
+        return com_shared_ptr<T>::ref(ptr);
+    }
+    ISPTR_EXPORTED
+    template<class T>
+    com_shared_ptr<T> com_attach(T * ptr) {
+        return com_shared_ptr<T>::noref(ptr);
+    }
+}
+
+#endif
+
+#endif
+#if __has_include(<Python.h>)
+
+#ifndef HEADER_PYTHON_PTR_H_INCLUDED
+#define HEADER_PYTHON_PTR_H_INCLUDED
+
+
+
+namespace isptr
+{
+    struct py_traits {
+        static void add_ref(PyObject * ptr) noexcept
+            { Py_INCREF(ptr); }
+        static void sub_ref(PyObject * ptr) noexcept
+            { Py_DECREF(ptr); }
+
+        static void add_ref(PyTypeObject * ptr) noexcept
+            { Py_INCREF(ptr); }
+        static void sub_ref(PyTypeObject * ptr) noexcept
+            { Py_DECREF(ptr); }
+    };
+
+    template<class T>
+    using py_ptr = intrusive_shared_ptr<T, py_traits>;
 
     ISPTR_EXPORTED
-    template<class Derived>
-    using weak_ref_counted = ref_counted<Derived, ref_counted_flags::provide_weak_references>;
+    template<class T>
+    py_ptr<T> py_retain(T * ptr) {
+        return py_ptr<T>::ref(ptr);
+    }
+    ISPTR_EXPORTED
+    template<class T>
+    py_ptr<T> py_attach(T * ptr) {
+        return py_ptr<T>::noref(ptr);
+    }
+}
+
+#endif
+#endif
+
+#ifndef HEADER_REFCNT_PTR_H_INCLUDED
+#define HEADER_REFCNT_PTR_H_INCLUDED
+
+
+namespace isptr
+{
 
     ISPTR_EXPORTED
-    template<class Derived>
-    using weak_ref_counted_adapter = ref_counted_adapter<Derived, ref_counted_flags::provide_weak_references>;
+    template<class T>
+    using refcnt_ptr = intrusive_shared_ptr<T, typename T::refcnt_ptr_traits>;
 
     ISPTR_EXPORTED
-    template<class Derived>
-    using weak_ref_counted_wrapper = ref_counted_wrapper<Derived, ref_counted_flags::provide_weak_references>;
+    template<class T>
+    using borrowed_refcnt_ptr = borrowed_ptr<T, typename T::refcnt_ptr_traits>;
 
     ISPTR_EXPORTED
-    template<class Derived, class CountType = default_count_type<ref_counted_flags::single_threaded>>
-    using ref_counted_st = ref_counted<Derived, ref_counted_flags::single_threaded, CountType>;
+    template<class T>
+    constexpr refcnt_ptr<T> refcnt_retain(T * ptr) noexcept {
+        return refcnt_ptr<T>::ref(ptr);
+    }
 
     ISPTR_EXPORTED
-    template<class Derived, class CountType = default_count_type<ref_counted_flags::single_threaded>>
-    using ref_counted_adapter_st = ref_counted_adapter<Derived, ref_counted_flags::single_threaded, CountType>;
+    template<class T>
+    constexpr refcnt_ptr<T> refcnt_attach(T * ptr) noexcept {
+        return refcnt_ptr<T>::noref(ptr);
+    }
+
+    namespace internal
+    {
+        template<class Void, class T, class... Args>
+        struct has_co_allocate : std::false_type {};
+
+        template<class T, class... Args>
+        struct has_co_allocate<std::void_t<decltype(T::template co_allocate<T>(std::declval<Args>()...))>, T, Args...> : std::true_type {};
+
+        template<class Void, class T, class... Args>
+        struct has_allocate : std::false_type {};
+
+        template<class T, class... Args>
+        struct has_allocate<std::void_t<decltype(T::template allocate<T>(std::declval<const typename T::refcnt_allocator &>(), 
+                                                                          std::declval<Args>()...))>, T, Args...> : std::true_type {};
+    }
 
     ISPTR_EXPORTED
-    template<class Derived, class CountType = default_count_type<ref_counted_flags::single_threaded>>
-    using ref_counted_wrapper_st = ref_counted_wrapper<Derived, ref_counted_flags::single_threaded, CountType>;
+    template<class T, class... Args>
+    inline refcnt_ptr<T> make_refcnt(Args &&... args) {
+        //classes that co-allocate their weak references need to allocate themselves
+        if constexpr (internal::has_co_allocate<void, T, Args &&...>::value)
+            return refcnt_ptr<T>::noref(T::template co_allocate<T>(std::forward<Args>(args)...));
+        //and so do classes that use an allocator
+        else if constexpr (internal::has_allocate<void, T, Args &&...>::value)
+            return refcnt_ptr<T>::noref(T::template allocate<T>(typename T::refcnt_allocator(), std::forward<Args>(args)...));
+        else if constexpr (internal::has_refcnt_allocator<T>::value)
+            static_assert(internal::dependent_bool<false, T>, 
+                          "classes with refcnt_allocator can only be created as the Derived type of their ref_counted base");
+        else
+            return refcnt_ptr<T>::noref(new T( std::forward<Args>(args)... ));
+    }
 
+    //Creates T using an allocator. T must declare a refcnt_allocator type constructible from alloc.
     ISPTR_EXPORTED
-    template<class Derived>
-    using weak_ref_counted_st = ref_counted<Derived, ref_counted_flags::provide_weak_references | 
-                                                     ref_counted_flags::single_threaded>;
+    template<class T, class Alloc, class... Args>
+    inline refcnt_ptr<T> allocate_refcnt(const Alloc & alloc, Args &&... args) {
+        static_assert(internal::has_allocate<void, T, Args &&...>::value, 
+                      "T must declare refcnt_allocator and be the Derived type of its ref_counted base");
+        return refcnt_ptr<T>::noref(T::template allocate<T>(alloc, std::forward<Args>(args)...));
+    }
 
     ISPTR_EXPORTED
-    template<class Derived>
-    using weak_ref_counted_adapter_st = ref_counted_adapter<Derived, ref_counted_flags::provide_weak_references | 
-                                                                     ref_counted_flags::single_threaded>;
+    template<class T>
+    inline
+    refcnt_ptr<typename T::weak_value_type> weak_cast(const refcnt_ptr<T> & src) {
+        return src ? src->get_weak_ptr() : refcnt_ptr<typename T::weak_value_type>{};
+    }
 
     ISPTR_EXPORTED
-    template<class Derived>
-    using weak_ref_counted_wrapper_st = ref_counted_wrapper<Derived, ref_counted_flags::provide_weak_references |
-                                                                     ref_counted_flags::single_threaded>;
+    template<class T>
+    inline
+    refcnt_ptr<const typename T::weak_value_type> weak_cast(const refcnt_ptr<const T> & src) {
+        return src ? src->get_weak_ptr() : refcnt_ptr<const typename T::weak_value_type>{};
+    }
 
     ISPTR_EXPORTED
-    template<class Owner>
-    class weak_reference;
+    template<class T>
+    inline
+    refcnt_ptr<typename T::strong_value_type> strong_cast(const refcnt_ptr<T> & src) noexcept {
+        return src ? src->lock() : refcnt_ptr<typename T::strong_value_type>{};
+    }
 
+    ISPTR_EXPORTED
+    template<class T>
+    inline
+    refcnt_ptr<const typename T::strong_value_type> strong_cast(const refcnt_ptr<const T> & src) noexcept {
+        return src ? src->lock() : refcnt_ptr<const typename T::strong_value_type>{};
+    }
+}
 
-    //MARK:-
+#endif
 
-    struct ref_counted_traits
-    {
-        template<class T>
-        static void add_ref(const T * obj) noexcept
-            { obj->call_add_ref(); }
-        
-        template<class T>
-        static void sub_ref(const T * obj) noexcept
-            { obj->call_sub_ref(); }
-    };
+#ifndef HEADER_HAZARD_POINTER_H_INCLUDED
+#define HEADER_HAZARD_POINTER_H_INCLUDED
 
-    //MARK:-
 
-    template<class Derived, ref_counted_flags Flags, class CountType>
-    class ref_counted
+
+namespace isptr
+{
+    ISPTR_EXPORTED
+    template<class T>
+    class hazard_guard;
+
+    //MARK:- hazard_domain
+
+    ISPTR_EXPORTED
+    class hazard_domain
     {
-    template<class Owner> friend class weak_reference;
-    friend ref_counted_traits;
-    public:
-        using refcnt_ptr_traits = ref_counted_traits;
-        using ref_counted_base = ref_counted;
-        
-        static constexpr bool provides_weak_references = contains(Flags, ref_counted_flags::provide_weak_references);
-        static constexpr bool single_threaded = contains(Flags, ref_counted_flags::single_threaded);
-        
+    template<class T> friend class hazard_guard;
     public:
-        using weak_value_type   = std::conditional_t<ref_counted::provides_weak_references, weak_reference<Derived>, void>;
-        using weak_ptr          = std::conditional_t<ref_counted::provides_weak_references, intrusive_shared_ptr<weak_value_type, ref_counted_traits>, void>;
-        using const_weak_ptr    = std::conditional_t<ref_counted::provides_weak_references, intrusive_shared_ptr<const weak_value_type, ref_counted_traits>, void>;
-        
-    private:
-        static_assert(!ref_counted::provides_weak_references || (ref_counted::provides_weak_references && std::is_same_v<CountType, intptr_t>),
-                      "CountType must be intptr_t (the default) when providing weak references");
-        static_assert(std::is_integral_v<CountType>, "CountType must be an integral type");
-        static_assert(ref_counted::single_threaded || std::atomic<CountType>::is_always_lock_free,
-                      "CountType must be such that std::atomic<CountType> is alwayd lock free");
-        
-        using count_type = std::conditional_t<ref_counted::single_threaded, CountType, std::atomic<CountType>>;
+        using reclaimer = void (*)(void *) noexcept;
+
+        static constexpr size_t default_reclaim_threshold = 16;
+
+    private:
+        struct record
+        {
+            std::atomic<const void *> hazard{nullptr};
+            std::atomic<bool> active{true};
+            record * next = nullptr;
+        };
+
+        struct retired
+        {
+            void * ptr;
+            reclaimer reclaim;
+            retired * next;
+        };
+
+        //Free records of the global domain cached by each thread. Other domains can be
+        //destroyed while threads still run so their records are not cached.
+        struct thread_cache
+        {
+            static constexpr unsigned capacity = 4;
+
+            ~thread_cache() noexcept
+            {
+                for (unsigned i = 0; i < this->count; ++i)
+                    this->records[i]->active.store(false, std::memory_order_release);
+            }
+
+            record * records[capacity];
+            unsigned count = 0;
+        };
 
     public:
-        ref_counted(const ref_counted &) noexcept = delete;
-        ref_counted & operator=(const ref_counted &) noexcept = delete;
-        ref_counted(ref_counted &&) noexcept = delete;
-        ref_counted & operator=(ref_counted &&) noexcept = delete;
-        
-        void add_ref() const noexcept;
-        void sub_ref() const noexcept;
-        
-        template<class X = Derived, class = std::enable_if_t<internal::dependent_bool<ref_counted::provides_weak_references, X>> >
-        weak_ptr get_weak_ptr()
-            { return weak_ptr::noref(const_cast<weak_reference<X> *>(const_cast<const ref_counted *>(this)->call_get_weak_value())); }
-        
-        template<class X = Derived, class = std::enable_if_t<internal::dependent_bool<ref_counted::provides_weak_references, X>> >
-        const_weak_ptr get_weak_ptr() const
-            { return const_weak_ptr::noref(this->call_get_weak_value()); }
-        
-    protected:
-        ref_counted() noexcept = default;
-        ~ref_counted() noexcept;
-        
-        void destroy() const noexcept
-            { delete static_cast<const Derived *>(this); }
-        
-        const weak_value_type * get_weak_value() const;
-        
-        weak_value_type * make_weak_reference(intptr_t count) const
+        explicit hazard_domain(size_t reclaim_threshold = default_reclaim_threshold) noexcept:
+            m_reclaim_threshold(reclaim_threshold)
+        {}
+        hazard_domain(const hazard_domain &) = delete;
+        hazard_domain & operator=(const hazard_domain &) = delete;
+        ~hazard_domain() noexcept;
+
+        //The default domain. It is never destroyed.
+        static hazard_domain & global() noexcept
         {
-            auto non_const_derived = static_cast<Derived *>(const_cast<ref_counted *>(this));
-            return new weak_value_type(count, non_const_derived);
+            static hazard_domain * instance = new hazard_domain();
+            return *instance;
         }
 
-    private:
-        //CRTP access
-        void call_add_ref() const noexcept
-            { static_cast<const Derived *>(this)->add_ref(); }
-        void call_sub_ref() const noexcept
-            { static_cast<const Derived *>(this)->sub_ref(); }
-        
-        void call_destroy() const noexcept
-            { static_cast<const Derived *>(this)->destroy(); }
+        //Calls reclaim(ptr) once no hazard guard protects ptr
+        void retire(void * ptr, reclaimer reclaim) noexcept;
 
-        auto call_make_weak_reference(intptr_t count) const
+        //Calls Traits::sub_ref(ptr) once no hazard guard protects ptr
+        template<class Traits, class T>
+        void retire_ref(T * ptr) noexcept
         {
-            if constexpr (ref_counted::provides_weak_references)
-                return static_cast<const Derived *>(this)->make_weak_reference(count);
+            using mutable_type = std::remove_cv_t<T>;
+            this->retire(const_cast<mutable_type *>(ptr), [](void * p) noexcept {
+                Traits::sub_ref(static_cast<T *>(static_cast<mutable_type *>(p)));
+            });
         }
-        
-        auto call_get_weak_value() const
-            { return static_cast<const Derived *>(this)->get_weak_value(); }
-        
-        //Weak reference pointer decoding and encoding
-        template<class X>
-        static X * decode_pointer(intptr_t count) noexcept
-            { return (X *)(uintptr_t(count) << 1); }
 
-        template<class X>
-        static intptr_t encode_pointer(X * ptr) noexcept
-            { return (uintptr_t(ptr) >> 1) | uintptr_t(std::numeric_limits<intptr_t>::min()); }
+        //Reclaims all retired pointers that are not currently protected
+        void reclaim() noexcept;
 
-        static bool is_encoded_pointer(intptr_t count) noexcept
-            { return count < 0; }
     private:
-        mutable count_type m_count = 1;
-    };
-
-    template<class Owner>
-    class weak_reference
-    {
-    template<class T, ref_counted_flags Flags, class CountType> friend class ref_counted;
-    friend ref_counted_traits;
-    public:
-        using refcnt_ptr_traits = ref_counted_traits;
-        using strong_value_type = Owner;
-        using strong_ptr = intrusive_shared_ptr<strong_value_type, ref_counted_traits>;
-        using const_strong_ptr = intrusive_shared_ptr<const strong_value_type, ref_counted_traits>;
+        record * acquire_record();
+        void release_record(record * rec) noexcept;
+        bool is_protected(const void * ptr) const noexcept;
 
-        static constexpr bool single_threaded = Owner::single_threaded;
+        static thread_cache & this_thread_cache() noexcept
+        {
+            static thread_local thread_cache cache;
+            return cache;
+        }
 
     private:
-        using count_type = std::conditional_t<weak_reference::single_threaded, intptr_t, std::atomic<intptr_t>>;
-        
+        std::atomic<record *> m_records{nullptr};
+        std::atomic<retired *> m_retired{nullptr};
+        std::atomic<size_t> m_retired_count{0};
+        const size_t m_reclaim_threshold;
+    };
+
+    //MARK:- hazard_guard
+
+    ISPTR_EXPORTED
+    template<class T>
+    class hazard_guard
+    {
+    template<class X, class Traits> friend class hazard_atomic_ptr;
     public:
-        weak_reference(const weak_reference &) noexcept = delete;
-        weak_reference & operator=(const weak_reference &) noexcept = delete;
-        weak_reference(weak_reference &&) noexcept = delete;
-        weak_reference & operator=(weak_reference &&) noexcept = delete;
+        constexpr hazard_guard() noexcept = default;
+        hazard_guard(hazard_guard && src) noexcept:
+            m_domain(src.m_domain),
+            m_record(src.m_record),
+            m_p(src.m_p)
+        {
+            src.m_record = nullptr;
+            src.m_p = nullptr;
+        }
+        hazard_guard & operator=(hazard_guard && src) noexcept
+        {
+            if (this != &src)
+            {
+                this->reset();
+                this->m_domain = src.m_domain;
+                this->m_record = src.m_record;
+                this->m_p = src.m_p;
+                src.m_record = nullptr;
+                src.m_p = nullptr;
+            }
+            return *this;
+        }
+        ~hazard_guard() noexcept
+            { this->reset(); }
 
-        void add_ref() const noexcept;
-        void sub_ref() const noexcept;
-        
-        template<class X = Owner>
-        const_strong_ptr lock() const noexcept
-            { return const_strong_ptr::noref(this->call_lock_owner()); }
-        
-        template<class X = Owner>
-        strong_ptr lock() noexcept
-            { return strong_ptr::noref(this->call_lock_owner()); }
+        T * get() const noexcept
+            { return this->m_p; }
+        T * operator->() const noexcept
+            { return this->m_p; }
+        template<class X=T>
+        std::enable_if_t<std::is_same_v<X, T>,
+        X &> operator*() const noexcept
+            { return *this->m_p; }
+        explicit operator bool() const noexcept
+            { return this->m_p; }
 
-    protected:
-        constexpr weak_reference(intptr_t initial_strong, Owner * owner) noexcept:
-            m_strong(initial_strong),
-            m_owner(owner)
-        {}
+        void reset() noexcept
+        {
+            if (this->m_record)
+            {
+                this->m_record->hazard.store(nullptr, std::memory_order_release);
+                this->m_domain->release_record(this->m_record);
+                this->m_record = nullptr;
+            }
+            this->m_p = nullptr;
+        }
 
-        ~weak_reference() noexcept = default;
-        
-        void destroy() const
-            { delete static_cast<const derived_type<> *>(this); }
-        
-        void add_owner_ref() noexcept;
-        void sub_owner_ref() noexcept;
-        
-        strong_value_type * lock_owner() const noexcept;
-        
-        void on_owner_destruction() const noexcept
-        {}
-        
     private:
-        template<class X=Owner>
-        using derived_type = std::remove_pointer_t<decltype(std::declval<X>().call_make_weak_reference(0))>;
-        
-        void call_add_ref() const noexcept
-            { static_cast<const derived_type<> *>(this)->add_ref(); }
-        void call_sub_ref() const noexcept
-            { static_cast<const derived_type<> *>(this)->sub_ref(); }
-        void call_add_owner_ref() noexcept
-            { static_cast<derived_type<> *>(this)->add_owner_ref(); }
-        void call_sub_owner_ref() noexcept
-            { static_cast<derived_type<> *>(this)->sub_owner_ref(); }
-        void call_destroy() const
-            { static_cast<const derived_type<> *>(this)->destroy(); }
-        strong_value_type * call_lock_owner() const noexcept
-            { return static_cast<const derived_type<> *>(this)->lock_owner(); }
-        void call_on_owner_destruction() const noexcept
-            { static_cast<const derived_type<> *>(this)->on_owner_destruction(); }
-        
+        //Publishes the value of source in a hazard record, retrying until it is stable
+        hazard_guard(hazard_domain & domain, const std::atomic<T *> & source):
+            m_domain(&domain),
+            m_record(domain.acquire_record())
+        {
+            T * p = source.load(std::memory_order_relaxed);
+            for ( ; ; )
+            {
+                this->m_record->hazard.store(p, std::memory_order_seq_cst);
+                T * current = source.load(std::memory_order_seq_cst);
+                if (current == p)
+                    break;
+                p = current;
+            }
+            this->m_p = p;
+        }
+
     private:
-        mutable count_type m_count = 2;
-        mutable count_type m_strong = 0;
-        Owner * m_owner = nullptr;
+        hazard_domain * m_domain = nullptr;
+        hazard_domain::record * m_record = nullptr;
+        T * m_p = nullptr;
     };
 
-    template<class T, ref_counted_flags Flags, class CountType>
-    class ref_counted_adapter : public ref_counted<ref_counted_adapter<T, Flags, CountType>, Flags, CountType>, public T
+    //MARK:- hazard_atomic_ptr
+
+    ISPTR_EXPORTED
+    template<class T, class Traits>
+    class hazard_atomic_ptr
     {
-    friend ref_counted<ref_counted_adapter<T, Flags, CountType>, Flags, CountType>;
     public:
-        template<class... Args, class=std::enable_if_t<std::is_constructible_v<T, Args...>>>
-        ref_counted_adapter(Args&&... args) noexcept(noexcept(T(std::forward<Args>(args)...))):
-            T(std::forward<Args>(args)...)
-        {}
-
-    protected:
-        ~ref_counted_adapter() noexcept = default;
-    };
+        using value_type = intrusive_shared_ptr<T, Traits>;
+        using guard_type = hazard_guard<T>;
 
-    template<class T, ref_counted_flags Flags, class CountType>
-    class ref_counted_wrapper : public ref_counted<ref_counted_wrapper<T, Flags, CountType>, Flags, CountType>
-    {
-    friend ref_counted<ref_counted_wrapper<T, Flags, CountType>, Flags, CountType>;
     public:
-        template<class... Args, class=std::enable_if_t<std::is_constructible_v<T, Args...>>>
-        ref_counted_wrapper(Args&&... args) noexcept(noexcept(T(std::forward<Args>(args)...))):
-            wrapped(std::forward<Args>(args)...)
+        hazard_atomic_ptr() noexcept:
+            m_domain(&hazard_domain::global())
+        {}
+        explicit hazard_atomic_ptr(hazard_domain & domain) noexcept:
+            m_domain(&domain)
+        {}
+        hazard_atomic_ptr(value_type desired, hazard_domain & domain = hazard_domain::global()) noexcept:
+            m_p(publish(desired)),
+            m_domain(&domain)
         {}
-        
-        T wrapped;
 
-    protected:
-        ~ref_counted_wrapper() noexcept = default;
-    };
+        hazard_atomic_ptr(const hazard_atomic_ptr &) = delete;
+        hazard_atomic_ptr & operator=(const hazard_atomic_ptr &) = delete;
 
+        ~hazard_atomic_ptr() noexcept
+        {
+            if (T * p = this->m_p.load(std::memory_order_relaxed))
+                this->m_domain->template retire_ref<Traits>(p);
+        }
 
-    //MARK:- Implementation
+        value_type operator=(value_type desired) noexcept
+        {
+            this->store(desired);
+            return desired;
+        }
 
-    template<class Owner>
-    inline void weak_reference<Owner>::add_ref() const noexcept
-    {
-        if constexpr (!weak_reference::single_threaded) 
+        //Borrows the current value without changing its reference count.
+        //The value stays alive at least until the guard is destroyed or reset.
+        guard_type protect() const
+            { return guard_type(*this->m_domain, this->m_p); }
+
+        value_type load() const
         {
-            [[maybe_unused]] auto oldcount = this->m_count.fetch_add(1, std::memory_order_relaxed);
-            assert(oldcount > 0);
-            assert(oldcount < std::numeric_limits<decltype(oldcount)>::max());
-        } 
-        else 
+            auto guard = this->protect();
+            return value_type::ref(guard.get());
+        }
+
+        operator value_type() const
+            { return this->load(); }
+
+        void store(value_type desired) noexcept
         {
-            assert(this->m_count > 0);
-            assert(this->m_count < std::numeric_limits<decltype(this->m_count)>::max());
-            ++this->m_count;
+            T * old = this->m_p.exchange(publish(desired), std::memory_order_acq_rel);
+            if (old)
+                this->m_domain->template retire_ref<Traits>(old);
         }
-    }
 
-    template<class Owner>
-    inline void weak_reference<Owner>::sub_ref() const noexcept
+        value_type exchange(value_type desired) noexcept
+        {
+            T * old = this->m_p.exchange(publish(desired), std::memory_order_acq_rel);
+            //readers may still use the old value so our reference is retired and the caller gets a new one
+            auto ret = value_type::ref(old);
+            if (old)
+                this->m_domain->template retire_ref<Traits>(old);
+            return ret;
+        }
+
+        bool compare_exchange_strong(value_type & expected, value_type desired)
+        {
+            internal::publish<Traits>(desired.get());
+            for ( ; ; )
+            {
+                T * current = expected.get();
+                if (this->m_p.compare_exchange_strong(current, desired.get(), std::memory_order_acq_rel, std::memory_order_relaxed))
+                {
+                    desired.release();
+                    if (current)
+                        this->m_domain->template retire_ref<Traits>(current);
+                    return true;
+                }
+                //current cannot be dereferenced so reload safely. If the value changed back to
+                //expected meanwhile, failing would be spurious.
+                auto loaded = this->load();
+                if (loaded != expected)
+                {
+                    expected = std::move(loaded);
+                    return false;
+                }
+            }
+        }
+
+        hazard_domain & domain() const noexcept
+            { return *this->m_domain; }
+
+    private:
+        //Objects stored here become reachable from other threads
+        static T * publish(value_type & desired) noexcept
+        {
+            internal::publish<Traits>(desired.get());
+            return desired.release();
+        }
+
+    private:
+        std::atomic<T *> m_p{nullptr};
+        hazard_domain * m_domain;
+    };
+
+    //MARK:- Implementation
+
+    inline hazard_domain::~hazard_domain() noexcept
     {
-        if constexpr (!weak_reference::single_threaded) 
+        //reclaimers can retire more pointers which looks at the records so those are freed last
+        while (auto node = this->m_retired.exchange(nullptr, std::memory_order_acquire))
         {
-            auto oldcount = this->m_count.fetch_sub(1, std::memory_order_release);
-            assert(oldcount > 0);
-            if (oldcount == 1)
+            while (node)
             {
-                std::atomic_thread_fence(std::memory_order_acquire);
-                this->call_destroy();
+                auto next = node->next;
+                node->reclaim(node->ptr);
+                delete node;
+                node = next;
             }
         }
-        else 
+        for (auto rec = this->m_records.exchange(nullptr, std::memory_order_acquire); rec; )
         {
-            assert(this->m_count > 0);
-            if (--this->m_count == 0)
-                this->call_destroy();
+            assert(!rec->active.load(std::memory_order_relaxed) || rec->hazard.load(std::memory_order_relaxed) == nullptr);
+            auto next = rec->next;
+            delete rec;
+            rec = next;
         }
     }
 
-    template<class Owner>
-    inline void weak_reference<Owner>::add_owner_ref() noexcept
+    inline auto hazard_domain::acquire_record() -> record *
     {
-        if constexpr (!weak_reference::single_threaded) 
+        if (this == &hazard_domain::global())
         {
-            [[maybe_unused]] auto oldcount = this->m_strong.fetch_add(1, std::memory_order_relaxed);
-            assert(oldcount > 0);
-            assert(oldcount < std::numeric_limits<decltype(oldcount)>::max());
+            auto & cache = hazard_domain::this_thread_cache();
+            if (cache.count)
+                return cache.records[--cache.count];
         }
-        else 
+
+        for (auto rec = this->m_records.load(std::memory_order_acquire); rec; rec = rec->next)
         {
-            assert(this->m_strong > 0);
-            assert(this->m_strong < std::numeric_limits<decltype(this->m_count)>::max());
-            ++this->m_strong;
+            if (!rec->active.load(std::memory_order_relaxed) && !rec->active.exchange(true, std::memory_order_acquire))
+                return rec;
         }
+
+        auto rec = new record;
+        rec->next = this->m_records.load(std::memory_order_relaxed);
+        while (!this->m_records.compare_exchange_weak(rec->next, rec, std::memory_order_release, std::memory_order_relaxed))
+        {}
+        return rec;
     }
 
-    template<class Owner>
-    inline void weak_reference<Owner>::sub_owner_ref() noexcept
+    inline void hazard_domain::release_record(record * rec) noexcept
     {
-        if constexpr (!weak_reference::single_threaded) 
-        {
-            auto oldcount = this->m_strong.fetch_sub(1, std::memory_order_release);
-            assert(oldcount > 0);
-            if (oldcount == 1)
-            {
-                std::atomic_thread_fence(std::memory_order_acquire);
-                auto owner = this->m_owner;
-                this->m_owner = nullptr;
-                owner->call_destroy(); //this can cascade to deleting ourselves so must be the last thing
-            }
-        } 
-        else 
+        if (this == &hazard_domain::global())
         {
-            assert(this->m_strong > 0);
-            if (--this->m_strong == 0) 
+            auto & cache = hazard_domain::this_thread_cache();
+            if (cache.count < thread_cache::capacity)
             {
-                auto owner = this->m_owner;
-                this->m_owner = nullptr;
-                owner->call_destroy(); //this can cascade to deleting ourselves so must be the last thing
+                cache.records[cache.count++] = rec;
+                return;
             }
         }
+        rec->active.store(false, std::memory_order_release);
     }
 
-    template<class Owner>
-    inline
-    auto weak_reference<Owner>::lock_owner() const noexcept -> strong_value_type *
+    inline bool hazard_domain::is_protected(const void * ptr) const noexcept
     {
-        if constexpr (!weak_reference::single_threaded) 
+        for (auto rec = this->m_records.load(std::memory_order_acquire); rec; rec = rec->next)
         {
-            for (intptr_t value = this->m_strong.load(std::memory_order_relaxed); ; )
-            {
-                assert(value >= 0);
-                
-                if (value == 0)
-                    return nullptr;
+            if (rec->hazard.load(std::memory_order_seq_cst) == ptr)
+                return true;
+        }
+        return false;
+    }
 
-                if (this->m_strong.compare_exchange_strong(value, value + 1, std::memory_order_release, std::memory_order_relaxed))
-                    return this->m_owner;
-            }
-        } 
-        else
+    inline void hazard_domain::retire(void * ptr, reclaimer reclaim) noexcept
+    {
+        auto node = new (std::nothrow) retired{ptr, reclaim, nullptr};
+        if (!node)
         {
-            if (this->m_strong == 0)
-                return nullptr;
-            ++this->m_strong;
-            return this->m_owner;
+            //out of memory: wait for the readers instead
+            for (internal::spin_backoff backoff; this->is_protected(ptr); )
+                backoff();
+            reclaim(ptr);
+            return;
         }
+        node->next = this->m_retired.load(std::memory_order_relaxed);
+        while (!this->m_retired.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+        {}
+        if (this->m_retired_count.fetch_add(1, std::memory_order_relaxed) + 1 >= this->m_reclaim_threshold)
+            this->reclaim();
     }
 
-    template<class Derived, ref_counted_flags Flags, class CountType>
-    inline void ref_counted<Derived, Flags, CountType>::add_ref() const noexcept
+    inline void hazard_domain::reclaim() noexcept
     {
-        if constexpr(!ref_counted::provides_weak_references)
+        //Take the whole list so reclaimers can safely retire more pointers
+        auto node = this->m_retired.exchange(nullptr, std::memory_order_acquire);
+        if (!node)
+            return;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        retired * keep = nullptr;
+        retired * keep_tail = nullptr;
+        size_t kept = 0;
+        size_t taken = 0;
+        while (node)
         {
-            if constexpr(!ref_counted::single_threaded)
+            auto next = node->next;
+            ++taken;
+            if (this->is_protected(node->ptr))
             {
-                [[maybe_unused]] auto oldcount = this->m_count.fetch_add(1, std::memory_order_relaxed);
-                assert(oldcount > 0);
-                assert(oldcount < std::numeric_limits<decltype(oldcount)>::max());
+                node->next = keep;
+                keep = node;
+                if (!keep_tail)
+                    keep_tail = node;
+                ++kept;
             }
             else
             {
-                assert(this->m_count > 0);
-                assert(this->m_count < std::numeric_limits<decltype(this->m_count)>::max());
-                ++this->m_count;
+                node->reclaim(node->ptr);
+                delete node;
             }
+            node = next;
         }
-        else
+        this->m_retired_count.fetch_sub(taken - kept, std::memory_order_relaxed);
+        if (keep)
         {
-            if constexpr(!ref_counted::single_threaded)
-            {
-                for(intptr_t value = this->m_count.load(std::memory_order_relaxed); ; )
-                {
-                    assert(value != 0);
-                    if (!ref_counted::is_encoded_pointer(value))
-                    {
-                        assert(value < std::numeric_limits<decltype(value)>::max());
-                        if (this->m_count.compare_exchange_strong(value, value + 1, std::memory_order_release, std::memory_order_relaxed))
-                            return;
-                    }
-                    else
-                    {
-                        auto ptr = ref_counted::decode_pointer<weak_value_type>(value);
-                        ptr->call_add_owner_ref();
-                        return;
-                    }
-                }
-            }
-            else 
-            {
-                assert(this->m_count != 0);
-                if (!ref_counted::is_encoded_pointer(this->m_count))
-                {
-                    assert(this->m_count < std::numeric_limits<decltype(this->m_count)>::max());
-                    ++this->m_count;
-                }
-                else 
-                {
-                    auto ptr = ref_counted::decode_pointer<weak_value_type>(this->m_count);
-                    ptr->call_add_owner_ref();
-                }
-            }
+            keep_tail->next = this->m_retired.load(std::memory_order_relaxed);
+            while (!this->m_retired.compare_exchange_weak(keep_tail->next, keep, std::memory_order_release, std::memory_order_relaxed))
+            {}
         }
     }
-        
-    template<class Derived, ref_counted_flags Flags, class CountType>
-    inline void ref_counted<Derived, Flags, CountType>::sub_ref() const noexcept
+}
+
+#endif
+
+#ifndef HEADER_RCU_PTR_H_INCLUDED
+#define HEADER_RCU_PTR_H_INCLUDED
+
+
+
+namespace isptr
+{
+    ISPTR_EXPORTED
+    class rcu_read_guard;
+
+    //MARK:- rcu_domain
+
+    ISPTR_EXPORTED
+    class rcu_domain
     {
-        if constexpr(!ref_counted::provides_weak_references)
+    friend rcu_read_guard;
+    public:
+        using callback = void (*)(void *) noexcept;
+
+        static constexpr size_t default_poll_interval = 1;
+
+    private:
+        //Epoch of the read section the owning thread is in or 0 if none
+        struct record
         {
-            if constexpr(!ref_counted::single_threaded)
-            {
-                auto oldcount = this->m_count.fetch_sub(1, std::memory_order_release);
-                assert(oldcount > 0);
-                if (oldcount == 1)
-                {
-                    std::atomic_thread_fence(std::memory_order_acquire);
-                    this->call_destroy();
-                }
-            }
-            else
+            std::atomic<uint64_t> epoch{0};
+            std::atomic<bool> active{true};
+            record * next = nullptr;
+        };
+
+        struct pending
+        {
+            void * arg;
+            callback func;
+            uint64_t epoch;
+            pending * next;
+        };
+
+        //Each thread keeps its record of the global domain. Other domains can be destroyed
+        //while threads still run so their records are acquired by each guard.
+        struct thread_cache
+        {
+            ~thread_cache() noexcept
             {
-                assert(this->m_count > 0);
-                if (--this->m_count == 0)
-                    this->call_destroy();
+                if (this->rec)
+                    this->rec->active.store(false, std::memory_order_release);
             }
+
+            record * rec = nullptr;
+            unsigned nesting = 0;
+        };
+
+    public:
+        explicit rcu_domain(size_t poll_interval = default_poll_interval) noexcept:
+            m_poll_interval(poll_interval),
+            m_next_poll(poll_interval)
+        {}
+        rcu_domain(const rcu_domain &) = delete;
+        rcu_domain & operator=(const rcu_domain &) = delete;
+        ~rcu_domain() noexcept;
+
+        //The default domain. It is never destroyed.
+        static rcu_domain & global() noexcept
+        {
+            static rcu_domain * instance = new rcu_domain();
+            return *instance;
         }
-        else
+
+        //Waits until all read sections that started before the call have finished.
+        //Must not be called from within a read section of this domain.
+        void synchronize() noexcept;
+
+        //Calls func(arg) once all read sections that started before the call have finished.
+        //Never waits. Callbacks run from within later call_rcu(), poll() or barrier() calls.
+        void call_rcu(void * arg, callback func) noexcept;
+
+        //Calls Traits::sub_ref(ptr) once all current read sections have finished
+        template<class Traits, class T>
+        void retire_ref(T * ptr) noexcept
         {
-            if constexpr(!ref_counted::single_threaded)
-            {
-                for (intptr_t value = this->m_count.load(std::memory_order_relaxed); ; )
-                {
-                    assert(value != 0);
-                    if (!ref_counted::is_encoded_pointer(value))
-                    {
-                        if (this->m_count.compare_exchange_strong(value, value - 1, std::memory_order_release, std::memory_order_relaxed))
-                        {
-                            if (value == 1)
-                            {
-                                std::atomic_thread_fence(std::memory_order_acquire);
-                                this->call_destroy();
-                            }
-                            return;
-                        }
-                    }
-                    else
-                    {
-                        auto ptr = ref_counted::decode_pointer<weak_value_type>(value);
-                        ptr->call_sub_owner_ref();
-                        return;
-                    }
-                }
-            }
-            else
-            {
-                assert(this->m_count != 0);
-                if (!ref_counted::is_encoded_pointer(this->m_count))
-                {
-                    if (--this->m_count == 0)
-                        this->call_destroy();
-                }
-                else
-                {
-                    auto ptr = ref_counted::decode_pointer<weak_value_type>(this->m_count);
-                    ptr->call_sub_owner_ref();
-                }
-            }
+            using mutable_type = std::remove_cv_t<T>;
+            this->call_rcu(const_cast<mutable_type *>(ptr), [](void * p) noexcept {
+                Traits::sub_ref(static_cast<T *>(static_cast<mutable_type *>(p)));
+            });
+        }
+
+        //Deletes ptr once all current read sections have finished. Suitable for use in
+        //an overridden ref_counted::destroy()
+        template<class T>
+        void defer_delete(const T * ptr) noexcept
+        {
+            this->call_rcu(const_cast<T *>(ptr), [](void * p) noexcept {
+                delete static_cast<const T *>(p);
+            });
         }
-    }
 
+        //Runs the callbacks whose grace period has already elapsed without waiting
+        void poll() noexcept;
 
-    template<class Derived, ref_counted_flags Flags, class CountType>
-    inline auto ref_counted<Derived, Flags, CountType>::get_weak_value() const -> const weak_value_type *
+        //Waits for a grace period and runs all callbacks scheduled before the call
+        void barrier() noexcept;
+
+    private:
+        record * acquire_record();
+        void release_record(record * rec) noexcept;
+        uint64_t oldest_reader() const noexcept;
+        void run_callbacks(uint64_t before) noexcept;
+
+        static thread_cache & this_thread_cache() noexcept
+        {
+            static thread_local thread_cache cache;
+            return cache;
+        }
+
+    private:
+        std::atomic<uint64_t> m_epoch{1};
+        std::atomic<record *> m_records{nullptr};
+        std::atomic<pending *> m_pending{nullptr};
+        std::atomic<size_t> m_pending_count{0};
+        const size_t m_poll_interval;
+        std::atomic<size_t> m_next_poll;
+    };
+
+    //MARK:- rcu_read_guard
+
+    ISPTR_EXPORTED
+    class rcu_read_guard
     {
-        static_assert(ref_counted::provides_weak_references, "class doesn't provide weak references");
-        
-        if constexpr(!ref_counted::single_threaded)
+    public:
+        //Enters a read section. For the global domain this stores the current epoch into a thread-local 
+        //record (allocated on the first use by a thread) followed by a full fence so that writers 
+        //see it before the reader loads any pointer. Nested sections do neither.
+        explicit rcu_read_guard(rcu_domain & domain = rcu_domain::global());
+        rcu_read_guard(const rcu_read_guard &) = delete;
+        rcu_read_guard & operator=(const rcu_read_guard &) = delete;
+        ~rcu_read_guard() noexcept;
+
+        rcu_domain & domain() const noexcept
+            { return *this->m_domain; }
+
+    private:
+        rcu_domain * m_domain;
+        rcu_domain::record * m_record;
+    };
+
+    //MARK:- rcu_ptr
+
+    ISPTR_EXPORTED
+    template<class T, class Traits>
+    class rcu_ptr
+    {
+    public:
+        using value_type = intrusive_shared_ptr<T, Traits>;
+
+    public:
+        rcu_ptr() noexcept:
+            m_domain(&rcu_domain::global())
+        {}
+        explicit rcu_ptr(rcu_domain & domain) noexcept:
+            m_domain(&domain)
+        {}
+        rcu_ptr(value_type desired, rcu_domain & domain = rcu_domain::global()) noexcept:
+            m_p(publish(desired)),
+            m_domain(&domain)
+        {}
+
+        rcu_ptr(const rcu_ptr &) = delete;
+        rcu_ptr & operator=(const rcu_ptr &) = delete;
+
+        ~rcu_ptr() noexcept
         {
-            for (intptr_t value = this->m_count.load(std::memory_order_acquire); ; )
-            {
-                if (!ref_counted::is_encoded_pointer(value))
-                {
-                    weak_reference<Derived> * ret = this->call_make_weak_reference(value);
-                    uintptr_t desired = ref_counted::encode_pointer(ret);
-                    if (this->m_count.compare_exchange_strong(value, desired, std::memory_order_release, std::memory_order_relaxed))
-                        return ret;
+            if (T * p = this->m_p.load(std::memory_order_relaxed))
+                this->m_domain->template retire_ref<Traits>(p);
+        }
 
-                    ret->call_destroy();
-                }
-                else
-                {
-                    auto ptr = ref_counted::decode_pointer<weak_value_type>(value);
-                    ptr->call_add_ref();
-                    return ptr;
-                }
-            }
+        value_type operator=(value_type desired) noexcept
+        {
+            this->store(desired);
+            return desired;
         }
-        else
+
+        //Reads the current value without changing its reference count.
+        //The result is valid until the guard is destroyed.
+        T * read([[maybe_unused]] const rcu_read_guard & guard) const noexcept
         {
-            if (!ref_counted::is_encoded_pointer(this->m_count))
-            {
-                weak_reference<Derived> * ret = this->call_make_weak_reference(this->m_count);
-                this->m_count = ref_counted::encode_pointer(ret);
-                return ret;
-            }
-            else 
-            {
-                auto ptr = ref_counted::decode_pointer<weak_value_type>(this->m_count);
-                ptr->call_add_ref();
-                return ptr;
-            }
+            assert(&guard.domain() == this->m_domain);
+            return this->m_p.load(std::memory_order_acquire);
+        }
+
+        value_type load() const
+        {
+            rcu_read_guard guard(*this->m_domain);
+            return value_type::ref(this->read(guard));
         }
-    }
 
-    template<class Derived, ref_counted_flags Flags, class CountType>
-    inline ref_counted<Derived, Flags, CountType>::~ref_counted() noexcept
-    {
-        [[maybe_unused]] auto valid_count = [](auto val) { return val == 0 || val == 1;};
-        
-        if constexpr (ref_counted::provides_weak_references)
+        operator value_type() const
+            { return this->load(); }
+
+        void store(value_type desired) noexcept
         {
-            if constexpr(!ref_counted::single_threaded)
-            {
-                intptr_t value = this->m_count.load(std::memory_order_relaxed);
-                if (ref_counted::is_encoded_pointer(value))
-                {
-                    auto ptr = ref_counted::decode_pointer<const weak_value_type>(value);
-                    assert(valid_count(ptr->m_strong.load(std::memory_order_relaxed)));
-                    ptr->call_on_owner_destruction();
-                    ptr->call_sub_ref();
-                }
-                else
-                {
-                    assert(valid_count(value));
-                }
-            }
-            else 
+            T * old = this->m_p.exchange(publish(desired), std::memory_order_seq_cst);
+            if (old)
+                this->m_domain->template retire_ref<Traits>(old);
+        }
+
+        value_type exchange(value_type desired) noexcept
+        {
+            T * old = this->m_p.exchange(publish(desired), std::memory_order_seq_cst);
+            //readers may still use the old value so our reference is retired and the caller gets a new one
+            auto ret = value_type::ref(old);
+            if (old)
+                this->m_domain->template retire_ref<Traits>(old);
+            return ret;
+        }
+
+        bool compare_exchange_strong(value_type & expected, value_type desired)
+        {
+            internal::publish<Traits>(desired.get());
+            for ( ; ; )
             {
-                if (ref_counted::is_encoded_pointer(this->m_count))
+                T * current = expected.get();
+                if (this->m_p.compare_exchange_strong(current, desired.get(), std::memory_order_seq_cst, std::memory_order_relaxed))
                 {
-                    auto ptr = ref_counted::decode_pointer<const weak_value_type>(this->m_count);
-                    assert(valid_count(ptr->m_strong));
-                    ptr->call_on_owner_destruction();
-                    ptr->call_sub_ref();
+                    desired.release();
+                    if (current)
+                        this->m_domain->template retire_ref<Traits>(current);
+                    return true;
                 }
-                else
+                //current cannot be dereferenced so reload safely. If the value changed back to
+                //expected meanwhile, failing would be spurious.
+                auto loaded = this->load();
+                if (loaded != expected)
                 {
-                    assert(valid_count(this->m_count));
+                    expected = std::move(loaded);
+                    return false;
                 }
             }
         }
-        else
+
+        rcu_domain & domain() const noexcept
+            { return *this->m_domain; }
+
+    private:
+        //Objects stored here become reachable from other threads
+        static T * publish(value_type & desired) noexcept
         {
-            if constexpr(!ref_counted::single_threaded)
-                assert(valid_count(this->m_count.load(std::memory_order_relaxed)));
-            else
-                assert(valid_count(this->m_count));
+            internal::publish<Traits>(desired.get());
+            return desired.release();
         }
-    }
-}
-
-#endif
 
-#ifndef HEADER_APPLE_CF_PTR_H_INCLUDED
-#define HEADER_APPLE_CF_PTR_H_INCLUDED
+    private:
+        std::atomic<T *> m_p{nullptr};
+        rcu_domain * m_domain;
+    };
 
-#if (defined(__APPLE__) && defined(__MACH__))
+    //MARK:- Implementation
 
+    inline rcu_read_guard::rcu_read_guard(rcu_domain & domain):
+        m_domain(&domain)
+    {
+        if (&domain == &rcu_domain::global())
+        {
+            auto & cache = rcu_domain::this_thread_cache();
+            if (!cache.rec)
+                cache.rec = domain.acquire_record();
+            this->m_record = cache.rec;
+            if (cache.nesting++ != 0)
+                return;
+        }
+        else
+        {
+            this->m_record = domain.acquire_record();
+        }
+        this->m_record->epoch.store(domain.m_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
 
+    inline rcu_read_guard::~rcu_read_guard() noexcept
+    {
+        if (this->m_domain == &rcu_domain::global())
+        {
+            auto & cache = rcu_domain::this_thread_cache();
+            if (--cache.nesting != 0)
+                return;
+            this->m_record->epoch.store(0, std::memory_order_release);
+        }
+        else
+        {
+            this->m_record->epoch.store(0, std::memory_order_release);
+            this->m_domain->release_record(this->m_record);
+        }
+    }
 
-namespace isptr
-{
-    struct cf_traits
+    inline rcu_domain::~rcu_domain() noexcept
     {
-        static void add_ref(CFTypeRef ptr) noexcept
-            { CFRetain(ptr); }
-        static void sub_ref(CFTypeRef ptr) noexcept
-            { CFRelease(ptr); }
-    };
+        //callbacks can schedule more callbacks which look at the records so those are freed last
+        while (auto node = this->m_pending.exchange(nullptr, std::memory_order_acquire))
+        {
+            while (node)
+            {
+                auto next = node->next;
+                node->func(node->arg);
+                delete node;
+                node = next;
+            }
+        }
+        for (auto rec = this->m_records.exchange(nullptr, std::memory_order_acquire); rec; )
+        {
+            assert(rec->epoch.load(std::memory_order_relaxed) == 0);
+            auto next = rec->next;
+            delete rec;
+            rec = next;
+        }
+    }
 
-    ISPTR_EXPORTED
-    template<class T>
-    using cf_ptr = intrusive_shared_ptr<std::remove_pointer_t<T>, cf_traits>;
+    inline auto rcu_domain::acquire_record() -> record *
+    {
+        for (auto rec = this->m_records.load(std::memory_order_acquire); rec; rec = rec->next)
+        {
+            if (!rec->active.load(std::memory_order_relaxed) && !rec->active.exchange(true, std::memory_order_acquire))
+                return rec;
+        }
 
-    ISPTR_EXPORTED
-    template<class T>
-    cf_ptr<T *> cf_retain(T * ptr) {
-        return cf_ptr<T *>::ref(ptr);
-    }
-    ISPTR_EXPORTED
-    template<class T>
-    cf_ptr<T *> cf_attach(T * ptr) {
-        return cf_ptr<T *>::noref(ptr);
+        auto rec = new record;
+        rec->next = this->m_records.load(std::memory_order_relaxed);
+        while (!this->m_records.compare_exchange_weak(rec->next, rec, std::memory_order_release, std::memory_order_relaxed))
+        {}
+        return rec;
     }
-}
 
-#endif
-
-#endif
+    inline void rcu_domain::release_record(record * rec) noexcept
+    {
+        rec->active.store(false, std::memory_order_release);
+    }
 
-#ifndef HEADER_COM_PTR_H_INCLUDED
-#define HEADER_COM_PTR_H_INCLUDED
+    inline uint64_t rcu_domain::oldest_reader() const noexcept
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t ret = UINT64_MAX;
+        for (auto rec = this->m_records.load(std::memory_order_acquire); rec; rec = rec->next)
+        {
+            uint64_t epoch = rec->epoch.load(std::memory_order_acquire);
+            if (epoch != 0 && epoch < ret)
+                ret = epoch;
+        }
+        return ret;
+    }
 
-#if defined(_WIN32)
+    inline void rcu_domain::synchronize() noexcept
+    {
+        uint64_t epoch = this->m_epoch.fetch_add(1, std::memory_order_seq_cst);
+        for (internal::spin_backoff backoff; this->oldest_reader() <= epoch; )
+            backoff();
+    }
 
+    inline void rcu_domain::call_rcu(void * arg, callback func) noexcept
+    {
+        uint64_t epoch = this->m_epoch.fetch_add(1, std::memory_order_seq_cst);
+        //There is nowhere to keep the callback if allocation fails and waiting for the readers
+        //instead could deadlock, so running out of memory terminates
+        auto node = new pending{arg, func, epoch, nullptr};
+        node->next = this->m_pending.load(std::memory_order_relaxed);
+        while (!this->m_pending.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+        {}
 
+        if (this->m_pending_count.fetch_add(1, std::memory_order_relaxed) + 1 >= this->m_next_poll.load(std::memory_order_relaxed))
+            this->poll();
+    }
 
-namespace isptr
-{
-    struct com_traits
+    inline void rcu_domain::poll() noexcept
     {
-        template<class T>
-        static std::enable_if_t<std::is_base_of_v<IUnknown, T>, void> add_ref(T * ptr) noexcept
-            { ptr->AddRef(); }
-        template<class T>
-        static std::enable_if_t<std::is_base_of_v<IUnknown, T>, void> sub_ref(T * ptr) noexcept
-            { ptr->Release(); }
-    };
-
-    ISPTR_EXPORTED
-    template<class T>
-    using com_shared_ptr = intrusive_shared_ptr<T, com_traits>;
+        this->run_callbacks(this->oldest_reader());
+    }
 
-    ISPTR_EXPORTED
-    template<class T>
-    com_shared_ptr<T> com_retain(T * ptr) {
-        return com_shared_ptr<T>::ref(ptr);
+    inline void rcu_domain::barrier() noexcept
+    {
+        uint64_t epoch = this->m_epoch.load(std::memory_order_seq_cst);
+        this->synchronize();
+        this->run_callbacks(epoch + 1);
     }
-    ISPTR_EXPORTED
-    template<class T>
-    com_shared_ptr<T> com_attach(T * ptr) {
-        return com_shared_ptr<T>::noref(ptr);
+
+    inline void rcu_domain::run_callbacks(uint64_t before) noexcept
+    {
+        //Take the whole list so callbacks can safely schedule more
+        auto node = this->m_pending.exchange(nullptr, std::memory_order_acquire);
+        if (!node)
+            return;
+
+        pending * keep = nullptr;
+        pending * keep_tail = nullptr;
+        size_t ran = 0;
+        while (node)
+        {
+            auto next = node->next;
+            if (node->epoch < before)
+            {
+                node->func(node->arg);
+                delete node;
+                ++ran;
+            }
+            else
+            {
+                node->next = keep;
+                keep = node;
+                if (!keep_tail)
+                    keep_tail = node;
+            }
+            node = next;
+        }
+        //callbacks kept for long read sections make each poll longer so poll less often as they accumulate
+        size_t left = this->m_pending_count.fetch_sub(ran, std::memory_order_relaxed) - ran;
+        this->m_next_poll.store(left + (left > this->m_poll_interval ? left : this->m_poll_interval), std::memory_order_relaxed);
+        if (keep)
+        {
+            keep_tail->next = this->m_pending.load(std::memory_order_relaxed);
+            while (!this->m_pending.compare_exchange_weak(keep_tail->next, keep, std::memory_order_release, std::memory_order_relaxed))
+            {}
+        }
     }
 }
 
 #endif
 
-#endif
-#if __has_include(<Python.h>)
-
-#ifndef HEADER_PYTHON_PTR_H_INCLUDED
-#define HEADER_PYTHON_PTR_H_INCLUDED
+#ifndef HEADER_LOCK_CONTENTION_H_INCLUDED
+#define HEADER_LOCK_CONTENTION_H_INCLUDED
 
 
 
 namespace isptr
 {
-    struct py_traits {
-        static void add_ref(PyObject * ptr) noexcept
-            { Py_INCREF(ptr); }
-        static void sub_ref(PyObject * ptr) noexcept
-            { Py_DECREF(ptr); }
+    //MARK:- lock_contention_snapshot
 
-        static void add_ref(PyTypeObject * ptr) noexcept
-            { Py_INCREF(ptr); }
-        static void sub_ref(PyTypeObject * ptr) noexcept
-            { Py_DECREF(ptr); }
+    ISPTR_EXPORTED
+    struct lock_contention_snapshot
+    {
+        const char * name = nullptr;
+        uint64_t acquisitions = 0;
+        uint64_t contended = 0;
+        uint64_t spins = 0;
+        uint64_t parks = 0;
+        std::chrono::nanoseconds total_wait{0};
+        std::chrono::nanoseconds max_wait{0};
     };
 
-    template<class T>
-    using py_ptr = intrusive_shared_ptr<T, py_traits>;
+    namespace internal
+    {
+        //Counters shared by all locks with the same tag. Entries link themselves into a global
+        //list on first use and are never removed.
+        struct lock_contention_entry
+        {
+            const char * const name;
+            std::atomic<uint64_t> acquisitions{0};
+            std::atomic<uint64_t> contended{0};
+            std::atomic<uint64_t> spins{0};
+            std::atomic<uint64_t> parks{0};
+            std::atomic<int64_t> total_wait{0};
+            std::atomic<int64_t> max_wait{0};
+            std::atomic<bool> registered{false};
+            lock_contention_entry * next = nullptr;
+
+            static std::atomic<lock_contention_entry *> & head() noexcept
+            {
+                static std::atomic<lock_contention_entry *> instance{nullptr};
+                return instance;
+            }
 
-    ISPTR_EXPORTED
-    template<class T>
-    py_ptr<T> py_retain(T * ptr) {
-        return py_ptr<T>::ref(ptr);
-    }
-    ISPTR_EXPORTED
-    template<class T>
-    py_ptr<T> py_attach(T * ptr) {
-        return py_ptr<T>::noref(ptr);
-    }
-}
+            void ensure_registered() noexcept
+            {
+                if (this->registered.load(std::memory_order_acquire) || this->registered.exchange(true, std::memory_order_acq_rel))
+                    return;
+                auto & list = lock_contention_entry::head();
+                this->next = list.load(std::memory_order_relaxed);
+                while (!list.compare_exchange_weak(this->next, this, std::memory_order_release, std::memory_order_relaxed))
+                {}
+            }
 
-#endif
-#endif
+            lock_contention_snapshot snapshot() const noexcept
+            {
+                lock_contention_snapshot ret;
+                ret.name = this->name;
+                ret.acquisitions = this->acquisitions.load(std::memory_order_relaxed);
+                ret.contended = this->contended.load(std::memory_order_relaxed);
+                ret.spins = this->spins.load(std::memory_order_relaxed);
+                ret.parks = this->parks.load(std::memory_order_relaxed);
+                ret.total_wait = std::chrono::nanoseconds(this->total_wait.load(std::memory_order_relaxed));
+                ret.max_wait = std::chrono::nanoseconds(this->max_wait.load(std::memory_order_relaxed));
+                return ret;
+            }
 
-#ifndef HEADER_REFCNT_PTR_H_INCLUDED
-#define HEADER_REFCNT_PTR_H_INCLUDED
+            void reset() noexcept
+            {
+                this->acquisitions.store(0, std::memory_order_relaxed);
+                this->contended.store(0, std::memory_order_relaxed);
+                this->spins.store(0, std::memory_order_relaxed);
+                this->parks.store(0, std::memory_order_relaxed);
+                this->total_wait.store(0, std::memory_order_relaxed);
+                this->max_wait.store(0, std::memory_order_relaxed);
+            }
+        };
 
+        template<class Tag, class = void>
+        struct lock_tag_name
+        {
+            static constexpr const char * value = nullptr;
+        };
 
-namespace isptr
-{
+        template<class Tag>
+        struct lock_tag_name<Tag, std::void_t<decltype(Tag::name)>>
+        {
+            static constexpr const char * value = Tag::name;
+        };
+    }
 
-    ISPTR_EXPORTED
-    template<class T>
-    using refcnt_ptr = intrusive_shared_ptr<T, typename T::refcnt_ptr_traits>;
+    //MARK:- lock_contention_counter
 
+    //Stats hook for spin_lock that aggregates contention of all locks using the same Tag.
+    //If Tag has a static `name` member convertible to const char * it is reported in snapshots.
     ISPTR_EXPORTED
-    template<class T>
-    constexpr refcnt_ptr<T> refcnt_retain(T * ptr) noexcept {
-        return refcnt_ptr<T>::ref(ptr);
-    }
+    template<class Tag>
+    class lock_contention_counter
+    {
+    public:
+        using clock = std::chrono::steady_clock;
 
-    ISPTR_EXPORTED
-    template<class T>
-    constexpr refcnt_ptr<T> refcnt_attach(T * ptr) noexcept {
-        return refcnt_ptr<T>::noref(ptr);
-    }
+        static void record_acquisition() noexcept
+        {
+            auto & entry = lock_contention_counter::s_entry;
+            entry.ensure_registered();
+            entry.acquisitions.fetch_add(1, std::memory_order_relaxed);
+        }
 
-    ISPTR_EXPORTED
-    template<class T, class... Args>
-    inline refcnt_ptr<T> make_refcnt(Args &&... args) {
-        return refcnt_ptr<T>::noref(new T( std::forward<Args>(args)... ));
-    }
+        static clock::time_point begin_contention() noexcept
+            { return clock::now(); }
 
-    ISPTR_EXPORTED
-    template<class T>
-    inline
-    refcnt_ptr<typename T::weak_value_type> weak_cast(const refcnt_ptr<T> & src) {
-        return src ? src->get_weak_ptr() : refcnt_ptr<typename T::weak_value_type>{};
-    }
+        static void end_contention(clock::time_point start, unsigned spins, unsigned parks) noexcept
+        {
+            int64_t wait = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+            auto & entry = lock_contention_counter::s_entry;
+            entry.ensure_registered();
+            entry.acquisitions.fetch_add(1, std::memory_order_relaxed);
+            entry.contended.fetch_add(1, std::memory_order_relaxed);
+            entry.spins.fetch_add(spins, std::memory_order_relaxed);
+            entry.parks.fetch_add(parks, std::memory_order_relaxed);
+            entry.total_wait.fetch_add(wait, std::memory_order_relaxed);
+            for (int64_t current = entry.max_wait.load(std::memory_order_relaxed); current < wait; )
+            {
+                if (entry.max_wait.compare_exchange_weak(current, wait, std::memory_order_relaxed, std::memory_order_relaxed))
+                    break;
+            }
+        }
 
-    ISPTR_EXPORTED
-    template<class T>
-    inline
-    refcnt_ptr<const typename T::weak_value_type> weak_cast(const refcnt_ptr<const T> & src) {
-        return src ? src->get_weak_ptr() : refcnt_ptr<const typename T::weak_value_type>{};
-    }
+        static lock_contention_snapshot snapshot() noexcept
+            { return lock_contention_counter::s_entry.snapshot(); }
+
+        static void reset() noexcept
+            { lock_contention_counter::s_entry.reset(); }
+
+    private:
+        static inline internal::lock_contention_entry s_entry{internal::lock_tag_name<Tag>::value};
+    };
 
+    //Convenience lock type: spin_lock with default spin budget that records contention under Tag
     ISPTR_EXPORTED
-    template<class T>
-    inline
-    refcnt_ptr<typename T::strong_value_type> strong_cast(const refcnt_ptr<T> & src) noexcept {
-        return src ? src->lock() : refcnt_ptr<typename T::strong_value_type>{};
-    }
+    template<class Tag>
+    using counted_spin_lock = spin_lock<spin_lock<>::spin_budget, lock_contention_counter<Tag>>;
 
+    //Calls func(const lock_contention_snapshot &) for every tag whose locks were acquired at least once
     ISPTR_EXPORTED
-    template<class T>
-    inline
-    refcnt_ptr<const typename T::strong_value_type> strong_cast(const refcnt_ptr<const T> & src) noexcept {
-        return src ? src->lock() : refcnt_ptr<const typename T::strong_value_type>{};
+    template<class Func>
+    void for_each_lock_contention(Func && func)
+    {
+        auto & list = internal::lock_contention_entry::head();
+        for (auto entry = list.load(std::memory_order_acquire); entry; entry = entry->next)
+            func(entry->snapshot());
     }
 }
 
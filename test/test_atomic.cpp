@@ -5,7 +5,15 @@
 #include <doctest/doctest.h>
 
 #include <atomic>
+#include <chrono>
+#include <thread>
 #include <type_traits>
+#include <tuple>
+#include <vector>
+
+#if defined(__linux__) || defined(__APPLE__)
+    #include <time.h>
+#endif
 
 #if ISPTR_USE_MODULES
     import isptr;
@@ -55,6 +63,24 @@ TEST_CASE( "Atomic type traits are correct" ) {
         CHECK( std::is_convertible_v<ptr, mock_ptr<instrumented_counted<1>>> );
         //CHECK( std::is_nothrow_convertible_v<ptr, intrusive_shared_ptr<instrumented_counted<>>> );
     }
+
+    SUBCASE("Lock freedom") {
+
+        using locked_ptr = atomic_intrusive_shared_ptr<instrumented_counted<1>, mock_traits<>, locked_atomic_policy<>>;
+
+        CHECK( ptr::is_always_lock_free == std::is_same_v<default_atomic_policy, lock_free_atomic_policy> );
+        CHECK( ptr().is_lock_free() == ptr::is_always_lock_free );
+        CHECK( !locked_ptr::is_always_lock_free );
+        CHECK( !locked_ptr().is_lock_free() );
+
+        if constexpr (ptr::is_always_lock_free) {
+            CHECK( sizeof(ptr) == sizeof(instrumented_counted<> *) );
+        }
+
+        using striped_ptr = atomic_intrusive_shared_ptr<instrumented_counted<1>, mock_traits<>, striped_atomic_policy<>>;
+        CHECK( sizeof(striped_ptr) == sizeof(instrumented_counted<> *) );
+        CHECK( !striped_ptr::is_always_lock_free );
+    }
 }
 
 TEST_CASE( "Atomic load" ) {
@@ -224,4 +250,202 @@ TEST_CASE( "Atomic comapre and exchange" ) {
     }
 }
 
+using AtomicPolicies = std::tuple<locked_atomic_policy<>, default_atomic_policy, read_mostly_atomic_policy<>, read_mostly_atomic_policy<1>,
+                                  striped_atomic_policy<>, striped_atomic_policy<1>, locked_atomic_policy<spin_lock<0>>,
+                                  locked_atomic_policy<pure_spin_lock>>;
+
+TEST_CASE_TEMPLATE_DEFINE( "Atomic operations with policy", TestType, atomic_policy_ops ) {
+
+    using ptr = atomic_intrusive_shared_ptr<instrumented_counted<>, mock_traits<>, TestType>;
+
+    SUBCASE( "Default constructed" ) {
+        ptr p;
+        CHECK( p.load() == nullptr );
+        CHECK( p.exchange(nullptr) == nullptr );
+    }
+
+    SUBCASE( "Load and store" ) {
+        instrumented_counted<> object1, object2;
+        {
+            ptr p = mock_noref(&object1);
+            auto p1 = p.load();
+            CHECK( p1.get() == &object1 );
+            CHECK( object1.count == 2 );
+
+            p.store(mock_noref(&object2));
+            CHECK( object1.count == 1 );
+            CHECK( p.load().get() == &object2 );
+            CHECK( object2.count == 1 );
+        }
+        CHECK( object1.count == -1 );
+        CHECK( object2.count == -1 );
+    }
+
+    SUBCASE( "Exchange" ) {
+        instrumented_counted<> object1, object2;
+        ptr p = mock_noref(&object1);
+        auto old = p.exchange(mock_noref(&object2));
+        CHECK( old.get() == &object1 );
+        CHECK( object1.count == 1 );
+        CHECK( object2.count == 1 );
+        old = p.exchange(nullptr);
+        CHECK( old.get() == &object2 );
+        CHECK( object1.count == -1 );
+        CHECK( object2.count == 1 );
+        old.reset();
+        CHECK( object2.count == -1 );
+    }
+
+    SUBCASE( "Compare and exchange" ) {
+        instrumented_counted<> object1, object2, object3;
+        ptr p = mock_noref(&object1);
+        auto expected = mock_noref(&object2);
+        auto desired = mock_noref(&object3);
+
+        CHECK( !p.compare_exchange_strong(expected, desired) );
+        CHECK( expected.get() == &object1 );
+        CHECK( object1.count == 2 );
+        CHECK( object2.count == -1 );
+
+        CHECK( p.compare_exchange_strong(expected, desired) );
+        CHECK( object1.count == 1 );
+        CHECK( object3.count == 2 );
+
+        mock_ptr<instrumented_counted<>> null;
+        CHECK( !p.compare_exchange_strong(null, nullptr) );
+        CHECK( null.get() == &object3 );
+        CHECK( p.compare_exchange_strong(null, nullptr) );
+        CHECK( p.load() == nullptr );
+        CHECK( object3.count == 2 );
+    }
+
+#if __cpp_lib_atomic_wait >= 201907L
+    SUBCASE( "Wait and notify" ) {
+        instrumented_counted<> object1, object2, object3;
+        ptr p = mock_noref(&object1);
+
+        p.wait(nullptr);
+        p.wait(mock_noref(&object3));
+        CHECK( object3.count == -1 );
+
+        std::atomic<bool> woken{false};
+        std::thread waiter([&, old = p.load()]{
+            p.wait(old);
+            woken = true;
+        });
+        //spurious wake ups without a change must not end the wait
+        p.notify_all();
+        p.store(mock_noref(&object2));
+        p.notify_one();
+        waiter.join();
+        CHECK( woken );
+        CHECK( object1.count == -1 );
+
+        p.store(nullptr);
+        p.notify_all();
+        CHECK( object2.count == -1 );
+    }
+#endif
+}
+TEST_CASE_TEMPLATE_APPLY(atomic_policy_ops, AtomicPolicies);
+
+#if __cpp_lib_atomic_wait >= 201907L && (defined(__linux__) || defined(__APPLE__))
+
+namespace {
+    struct shared_counted {
+        mutable std::atomic<int> count{1};
+    };
+
+    struct shared_counted_traits {
+        static void add_ref(const shared_counted * c) noexcept
+            { c->count.fetch_add(1, std::memory_order_relaxed); }
+        static void sub_ref(const shared_counted * c) noexcept
+            { c->count.fetch_sub(1, std::memory_order_acq_rel); }
+    };
+
+    std::chrono::nanoseconds thread_cpu_time() {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+    }
+}
+
+TEST_CASE_TEMPLATE_DEFINE( "Atomic wait with concurrent loads", TestType, atomic_wait_load_ops ) {
+
+    using ptr = atomic_intrusive_shared_ptr<shared_counted, shared_counted_traits, TestType>;
+    using value_ptr = intrusive_shared_ptr<shared_counted, shared_counted_traits>;
+
+    shared_counted object1, object2;
+    ptr p = value_ptr::noref(&object1);
+
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> loaders;
+    for (int i = 0; i < 2; ++i) {
+        loaders.emplace_back([&]{
+            while (!stop.load(std::memory_order_relaxed))
+                p.load();
+        });
+    }
+
+    std::chrono::nanoseconds waiter_time{0};
+    std::thread waiter([&, old = p.load()]{
+        auto start = thread_cpu_time();
+        p.wait(old);
+        waiter_time = thread_cpu_time() - start;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    p.store(value_ptr::noref(&object2));
+    p.notify_all();
+    waiter.join();
+    stop = true;
+    for (auto & t: loaders) t.join();
+
+    //the waiter must sleep rather than wake up on every load
+    CHECK( waiter_time < std::chrono::milliseconds(100) );
+    CHECK( object1.count == 0 );
+    p.store(nullptr);
+    CHECK( object2.count == 0 );
+}
+TEST_CASE_TEMPLATE_APPLY(atomic_wait_load_ops, AtomicPolicies);
+
+#endif
+
+using SpinLocks = std::tuple<spin_lock<>, spin_lock<0>, spin_lock<1>, pure_spin_lock>;
+
+TEST_CASE_TEMPLATE_DEFINE( "Spin lock", TestType, spin_lock_ops ) {
+
+    SUBCASE( "Single thread" ) {
+        TestType lock;
+        CHECK( lock.try_lock() );
+        CHECK( !lock.try_lock() );
+        lock.unlock();
+        lock.lock();
+        CHECK( !lock.try_lock() );
+        lock.unlock();
+        CHECK( lock.try_lock() );
+        lock.unlock();
+    }
+
+    SUBCASE( "Threads" ) {
+        static constexpr int N_THREADS = 8;
+        static constexpr int N_OPS = 20000;
+
+        TestType lock;
+        int counter = 0;
+        std::vector<std::thread> threads;
+        for (int i = 0; i < N_THREADS; ++i) {
+            threads.emplace_back([&]{
+                for (int j = 0; j < N_OPS; ++j) {
+                    lock.lock();
+                    ++counter;
+                    lock.unlock();
+                }
+            });
+        }
+        for (auto & t: threads) t.join();
+        CHECK( counter == N_THREADS * N_OPS );
+    }
+}
+TEST_CASE_TEMPLATE_APPLY(spin_lock_ops, SpinLocks);
+
 }
@@ -0,0 +1,256 @@
+#if !ISPTR_USE_MODULES
+    #include <intrusive_shared_ptr/ref_counted.h>
+    #include <intrusive_shared_ptr/refcnt_ptr.h>
+#endif
+
+#include <doctest/doctest.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if ISPTR_USE_MODULES
+    import isptr;
+#endif
+
+using namespace isptr;
+
+namespace
+{
+    struct biased_counted : biased_ref_counted<biased_counted>
+    {
+        friend ref_counted;
+
+        static inline std::atomic<int> instance_count{0};
+
+        biased_counted() noexcept
+        { ++instance_count; }
+
+        biased_counted(int)
+        { throw std::runtime_error("x"); }
+
+        int value = 5;
+    private:
+        ~biased_counted() noexcept
+        { --instance_count; }
+    };
+
+    static_assert( !std::is_copy_constructible_v<biased_counted> );
+    static_assert( !std::is_move_constructible_v<biased_counted> );
+    static_assert( !std::is_destructible_v<biased_counted> );
+
+    struct hooked_counted : biased_ref_counted<hooked_counted>
+    {
+        friend ref_counted;
+
+        static inline std::atomic<int> instance_count{0};
+
+        hooked_counted() noexcept
+        { ++instance_count; }
+
+        void add_ref() const noexcept
+        {
+            ++adds;
+            ref_counted::add_ref();
+        }
+
+        void sub_ref() const noexcept
+        {
+            ++subs;
+            ref_counted::sub_ref();
+        }
+
+        mutable std::atomic<int> adds{0};
+        mutable std::atomic<int> subs{0};
+    private:
+        ~hooked_counted() noexcept
+        { --instance_count; }
+    };
+
+    struct isolated_biased_counted : ref_counted<isolated_biased_counted, ref_counted_flags::biased | 
+                                                                          ref_counted_flags::isolate_count>
+    {
+        friend ref_counted;
+
+        static inline std::atomic<int> instance_count{0};
+
+        isolated_biased_counted() noexcept
+        { ++instance_count; }
+    private:
+        ~isolated_biased_counted() noexcept
+        { --instance_count; }
+    };
+
+    template<class Func>
+    void run_on_thread(Func func)
+    {
+        std::thread thread(func);
+        thread.join();
+    }
+}
+
+TEST_SUITE("biased_ref_counted") {
+
+TEST_CASE( "Owner thread" ) {
+
+    auto p1 = make_refcnt<biased_counted>();
+    CHECK(biased_counted::instance_count == 1);
+    auto p2 = p1;
+    CHECK(biased_counted::instance_count == 1);
+    p1.reset();
+    CHECK(biased_counted::instance_count == 1);
+    p2.reset();
+    CHECK(biased_counted::instance_count == 0);
+}
+
+TEST_CASE( "Ctor exception" ) {
+
+    try
+    {
+        auto p1 = make_refcnt<biased_counted>(2);
+    }
+    catch(std::exception &)
+    {
+        CHECK(biased_counted::instance_count == 0);
+    }
+}
+
+TEST_CASE( "Other thread" ) {
+
+    SUBCASE("copies released on other thread") {
+        auto p1 = make_refcnt<biased_counted>();
+        run_on_thread([&]() {
+            auto p2 = p1;
+            auto p3 = p2;
+            CHECK(p3->value == 5);
+        });
+        CHECK(biased_counted::instance_count == 1);
+        p1.reset();
+        CHECK(biased_counted::instance_count == 0);
+    }
+
+    SUBCASE("owner releases first") {
+        auto p1 = make_refcnt<biased_counted>();
+        refcnt_ptr<biased_counted> p2;
+        run_on_thread([&]() {
+            p2 = p1;
+        });
+        p1.reset();
+        CHECK(biased_counted::instance_count == 1);
+        run_on_thread([&]() {
+            CHECK(p2->value == 5);
+            p2.reset();
+        });
+        CHECK(biased_counted::instance_count == 0);
+    }
+
+    SUBCASE("last reference released on other thread") {
+        auto p1 = make_refcnt<biased_counted>();
+        run_on_thread([&]() {
+            p1.reset();
+        });
+        //the owner still has the biased count until it merges it
+        CHECK(biased_counted::instance_count == 1);
+        merge_biased_refs();
+        CHECK(biased_counted::instance_count == 0);
+    }
+
+    SUBCASE("isolated count") {
+        auto p1 = make_refcnt<isolated_biased_counted>();
+        CHECK(!layout_of_ref_counted(*p1).shares_line());
+        run_on_thread([&]() {
+            p1.reset();
+        });
+        CHECK(isolated_biased_counted::instance_count == 1);
+        merge_biased_refs();
+        CHECK(isolated_biased_counted::instance_count == 0);
+    }
+
+    SUBCASE("merged on owner release") {
+        auto p1 = make_refcnt<biased_counted>();
+        auto p2 = make_refcnt<biased_counted>();
+        run_on_thread([&]() {
+            p1.reset();
+        });
+        CHECK(biased_counted::instance_count == 2);
+        p2.reset();
+        CHECK(biased_counted::instance_count == 0);
+    }
+
+    SUBCASE("owner exited") {
+        refcnt_ptr<biased_counted> p1;
+        run_on_thread([&]() {
+            p1 = make_refcnt<biased_counted>();
+        });
+        auto p2 = p1;
+        p1.reset();
+        CHECK(biased_counted::instance_count == 1);
+        p2.reset();
+        CHECK(biased_counted::instance_count == 0);
+    }
+
+    SUBCASE("record reused") {
+        refcnt_ptr<biased_counted> p1;
+        run_on_thread([&]() {
+            p1 = make_refcnt<biased_counted>();
+            auto p2 = make_refcnt<biased_counted>();
+            run_on_thread([&]() {
+                p2.reset();
+            });
+            CHECK(biased_counted::instance_count == 2);
+        });
+        CHECK(biased_counted::instance_count == 1);
+        run_on_thread([&]() {
+            auto p2 = make_refcnt<biased_counted>();
+            auto p3 = p1;
+            p3.reset();
+            p2.reset();
+        });
+        CHECK(biased_counted::instance_count == 1);
+        p1.reset();
+        CHECK(biased_counted::instance_count == 0);
+    }
+}
+
+TEST_CASE( "Overridden hooks" ) {
+
+    auto p1 = make_refcnt<hooked_counted>();
+    run_on_thread([&]() {
+        auto p2 = p1;
+        p1.reset();
+        CHECK(p2->adds == 1);
+        CHECK(p2->subs == 1);
+    });
+    CHECK(hooked_counted::instance_count == 1);
+    merge_biased_refs();
+    CHECK(hooked_counted::instance_count == 0);
+}
+
+TEST_CASE( "Threads" ) {
+
+    static constexpr int N_THREADS = 8;
+    static constexpr int N_OPS = 20000;
+
+    auto common = make_refcnt<biased_counted>();
+    std::vector<std::thread> threads;
+    std::atomic<int> errors{0};
+    for (int i = 0; i < N_THREADS; ++i) {
+        //each thread gets the only reference to an object owned by this thread
+        threads.emplace_back([ptr = make_refcnt<biased_counted>(), &common, &errors]() mutable {
+            for (int j = 0; j < N_OPS; ++j) {
+                auto copy = ptr;
+                auto other = common;
+                if (copy->value != other->value) errors.fetch_add(1);
+            }
+            ptr.reset();
+        });
+    }
+    for (auto & t : threads) t.join();
+    CHECK(errors.load() == 0);
+    CHECK(biased_counted::instance_count == N_THREADS + 1);
+    common.reset();
+    CHECK(biased_counted::instance_count == 0);
+}
+
+}
@@ -0,0 +1,149 @@
+#if !ISPTR_USE_MODULES
+    #include <intrusive_shared_ptr/intrusive_shared_ptr.h>
+    #include <intrusive_shared_ptr/ref_counted.h>
+    #include <intrusive_shared_ptr/refcnt_ptr.h>
+#endif
+
+#include <doctest/doctest.h>
+
+#include <type_traits>
+
+#if ISPTR_USE_MODULES
+    import isptr;
+#endif
+
+#include "mocks.h"
+
+using namespace isptr;
+
+namespace
+{
+    struct checking_traits : mock_traits<>
+    {
+        static inline int checks = 0;
+
+        template<int Tag>
+        static bool is_referenced(const instrumented_counted<Tag> * c) noexcept
+        {
+            ++checks;
+            return c->count > 0;
+        }
+    };
+
+    struct counted : ref_counted<counted>
+    {
+        int value = 3;
+    };
+
+    struct derived_counted : counted
+    {};
+
+    struct weak_counted : weak_ref_counted<weak_counted>
+    {};
+
+    int count_of(const instrumented_counted<> * c)
+        { return c->count; }
+
+    int read(borrowed_ptr<instrumented_counted<>, mock_traits<>> p)
+        { return count_of(p.get()); }
+
+    int read_value(borrowed_refcnt_ptr<const counted> p)
+        { return p->value; }
+}
+
+TEST_SUITE("borrowed_ptr") {
+
+TEST_CASE( "Borrowed ptr type traits are correct" ) {
+
+    using borrowed = borrowed_ptr<instrumented_counted<>, mock_traits<>>;
+    CHECK(std::is_trivially_copyable_v<borrowed>);
+    CHECK(std::is_trivially_destructible_v<borrowed>);
+    CHECK(sizeof(borrowed) == sizeof(void *));
+    CHECK(std::is_nothrow_constructible_v<borrowed, const mock_ptr<instrumented_counted<>> &>);
+    CHECK(std::is_convertible_v<const mock_ptr<instrumented_counted<>> &, borrowed>);
+    static_assert(!std::is_constructible_v<borrowed, mock_ptr<instrumented_counted<>> &&>);
+    static_assert(!std::is_constructible_v<borrowed, mock_ptr<derived_instrumented_counted<>> &&>);
+    CHECK(!std::is_convertible_v<mock_ptr<instrumented_counted<>>, borrowed>);
+    CHECK(std::is_convertible_v<const mock_ptr<derived_instrumented_counted<>> &, borrowed>);
+    CHECK(!std::is_convertible_v<instrumented_counted<> *, borrowed>);
+    CHECK(!std::is_convertible_v<const mock_ptr_different_traits<instrumented_counted<>> &, borrowed>);
+    CHECK(!std::is_convertible_v<borrowed, mock_ptr<instrumented_counted<>>>);
+    CHECK(std::is_convertible_v<borrowed_ptr<derived_instrumented_counted<>, mock_traits<>>, borrowed>);
+    CHECK(!std::is_convertible_v<borrowed, borrowed_ptr<derived_instrumented_counted<>, mock_traits<>>>);
+}
+
+TEST_CASE( "Borrowed ptr does not count" ) {
+
+    instrumented_counted<> object;
+    {
+        auto owner = mock_noref(&object);
+
+        CHECK(read(owner) == 1);
+
+        borrowed_ptr<instrumented_counted<>, mock_traits<>> borrowed = owner;
+        auto copy = borrowed;
+        CHECK(copy.get() == &object);
+        CHECK(&*copy == &object);
+        CHECK(copy->count == 1);
+        CHECK(copy == owner);
+        CHECK(owner == copy);
+        CHECK(copy == borrowed);
+        CHECK(copy != nullptr);
+        CHECK(bool(copy));
+
+        auto promoted = copy.ref();
+        CHECK(object.count == 2);
+        CHECK(promoted == owner);
+        promoted.reset();
+        CHECK(object.count == 1);
+    }
+    CHECK(object.count == -1);
+}
+
+TEST_CASE( "Null borrowed ptr" ) {
+
+    borrowed_ptr<instrumented_counted<>, mock_traits<>> empty;
+    CHECK(!empty);
+    CHECK(empty == nullptr);
+    CHECK(nullptr == empty);
+    CHECK(empty.get() == nullptr);
+    CHECK(!empty.ref());
+
+    mock_ptr<instrumented_counted<>> null_owner;
+    borrowed_ptr<instrumented_counted<>, mock_traits<>> from_null = null_owner;
+    CHECK(from_null == empty);
+    CHECK(from_null == null_owner);
+}
+
+TEST_CASE( "Borrowed ptr checks the count" ) {
+
+    instrumented_counted<> object;
+    auto owner = intrusive_shared_ptr<instrumented_counted<>, checking_traits>::noref(&object);
+    borrowed_ptr<instrumented_counted<>, checking_traits> borrowed = owner;
+    checking_traits::checks = 0;
+    CHECK(borrowed->count == 1);
+#ifndef NDEBUG
+    CHECK(checking_traits::checks == 1);
+#else
+    CHECK(checking_traits::checks == 0);
+#endif
+}
+
+TEST_CASE( "Borrowed refcnt_ptr" ) {
+
+    auto owner = make_refcnt<derived_counted>();
+    CHECK(read_value(owner) == 3);
+
+    borrowed_refcnt_ptr<counted> borrowed = owner;
+    refcnt_ptr<counted> promoted = borrowed.ref();
+    CHECK(promoted == owner);
+
+    auto weak_owner = make_refcnt<weak_counted>();
+    auto weak = weak_owner->get_weak_ptr();
+    borrowed_refcnt_ptr<weak_counted> borrowed_weak_owner = weak_owner;
+    CHECK(borrowed_weak_owner.get() == weak_owner.get());
+    borrowed_refcnt_ptr<weak_counted::weak_value_type> borrowed_weak = weak;
+    CHECK(borrowed_weak->lock() == weak_owner);
+}
+
+}
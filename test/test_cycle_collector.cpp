@@ -0,0 +1,188 @@
+#if !ISPTR_USE_MODULES
+    #include <intrusive_shared_ptr/ref_counted.h>
+    #include <intrusive_shared_ptr/refcnt_ptr.h>
+    #include <intrusive_shared_ptr/cycle_collector.h>
+#endif
+
+#include <doctest/doctest.h>
+
+#include <thread>
+#include <vector>
+
+#if ISPTR_USE_MODULES
+    import isptr;
+#endif
+
+using namespace isptr;
+
+namespace
+{
+    struct plain : ref_counted<plain, ref_counted_flags::single_threaded>
+    {
+        friend ref_counted;
+
+        static inline int instance_count = 0;
+
+        plain() noexcept
+            { ++instance_count; }
+    private:
+        ~plain() noexcept
+            { --instance_count; }
+    };
+
+    struct graph_node : ref_counted<graph_node, ref_counted_flags::single_threaded | ref_counted_flags::cycle_collectable>
+    {
+        friend ref_counted;
+
+        static inline int instance_count = 0;
+
+        graph_node() noexcept
+            { ++instance_count; }
+
+        void link(const refcnt_ptr<graph_node> & to)
+            { children.push_back(to); }
+
+        std::vector<refcnt_ptr<graph_node>> children;
+        refcnt_ptr<plain> payload;
+    private:
+        ~graph_node() noexcept
+            { --instance_count; }
+
+        void traverse(cycle_visitor & visitor) noexcept
+        {
+            for (auto & child: children)
+                visitor(child);
+            //not collectable so ignored
+            visitor(payload);
+        }
+    };
+}
+
+TEST_SUITE("cycle_collector") {
+
+TEST_CASE( "Cycle collection" ) {
+
+    REQUIRE(collect_cycles() == 0);
+
+    SUBCASE( "Acyclic" ) {
+        auto a = make_refcnt<graph_node>();
+        auto b = make_refcnt<graph_node>();
+        a->link(b);
+        b.reset();
+        a.reset();
+        CHECK(graph_node::instance_count == 0);
+        CHECK(collect_cycles() == 0);
+    }
+
+    SUBCASE( "Self cycle" ) {
+        auto a = make_refcnt<graph_node>();
+        a->link(a);
+        a.reset();
+        CHECK(graph_node::instance_count == 1);
+        CHECK(collect_cycles() == 1);
+        CHECK(graph_node::instance_count == 0);
+    }
+
+    SUBCASE( "Two node cycle" ) {
+        auto a = make_refcnt<graph_node>();
+        auto b = make_refcnt<graph_node>();
+        a->link(b);
+        b->link(a);
+        a->payload = make_refcnt<plain>();
+        a.reset();
+        b.reset();
+        CHECK(graph_node::instance_count == 2);
+        CHECK(collect_cycles() == 2);
+        CHECK(graph_node::instance_count == 0);
+        CHECK(plain::instance_count == 0);
+        CHECK(collect_cycles() == 0);
+    }
+
+    SUBCASE( "Externally referenced cycle" ) {
+        auto a = make_refcnt<graph_node>();
+        auto b = make_refcnt<graph_node>();
+        a->link(b);
+        b->link(a);
+        b.reset();
+        CHECK(collect_cycles() == 0);
+        CHECK(graph_node::instance_count == 2);
+        CHECK(a->children[0]->children[0] == a);
+
+        a.reset();
+        CHECK(collect_cycles() == 2);
+        CHECK(graph_node::instance_count == 0);
+    }
+
+    SUBCASE( "Garbage referencing live objects" ) {
+        auto live = make_refcnt<graph_node>();
+        auto a = make_refcnt<graph_node>();
+        auto b = make_refcnt<graph_node>();
+        a->link(b);
+        b->link(a);
+        a->link(live);
+        a.reset();
+        b.reset();
+        CHECK(collect_cycles() == 2);
+        CHECK(graph_node::instance_count == 1);
+        live.reset();
+        CHECK(graph_node::instance_count == 0);
+    }
+
+    SUBCASE( "Live objects referencing garbage candidates" ) {
+        auto root = make_refcnt<graph_node>();
+        auto a = make_refcnt<graph_node>();
+        auto b = make_refcnt<graph_node>();
+        root->link(a);
+        a->link(b);
+        b->link(a);
+        a.reset();
+        b.reset();
+        CHECK(collect_cycles() == 0);
+        CHECK(graph_node::instance_count == 3);
+        root.reset();
+        CHECK(collect_cycles() == 2);
+        CHECK(graph_node::instance_count == 0);
+    }
+
+    SUBCASE( "Long ring" ) {
+        constexpr int length = 100'000;
+        auto first = make_refcnt<graph_node>();
+        auto last = first;
+        for (int i = 1; i < length; ++i)
+        {
+            auto next = make_refcnt<graph_node>();
+            last->link(next);
+            last = std::move(next);
+        }
+        last->link(first);
+        last.reset();
+        first.reset();
+        CHECK(graph_node::instance_count == length);
+        CHECK(collect_cycles() == size_t(length));
+        CHECK(graph_node::instance_count == 0);
+    }
+
+    SUBCASE( "Candidate destroyed before collection" ) {
+        auto a = make_refcnt<graph_node>();
+        auto copy = a;
+        copy.reset();
+        a.reset();
+        CHECK(graph_node::instance_count == 0);
+        CHECK(collect_cycles() == 0);
+    }
+
+    SUBCASE( "Thread exit" ) {
+        std::thread([]() {
+            auto a = make_refcnt<graph_node>();
+            auto b = make_refcnt<graph_node>();
+            a->link(b);
+            b->link(a);
+        }).join();
+        CHECK(graph_node::instance_count == 0);
+    }
+
+    CHECK(graph_node::instance_count == 0);
+    CHECK(plain::instance_count == 0);
+}
+
+}
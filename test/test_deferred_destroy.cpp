@@ -0,0 +1,210 @@
+#if !ISPTR_USE_MODULES
+    #include <intrusive_shared_ptr/ref_counted.h>
+    #include <intrusive_shared_ptr/refcnt_ptr.h>
+    #include <intrusive_shared_ptr/deferred_destroy.h>
+    #include <intrusive_shared_ptr/deferred_destroy_reclaimer.h>
+#endif
+
+#include <doctest/doctest.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if ISPTR_USE_MODULES
+    import isptr;
+#endif
+
+using namespace isptr;
+
+namespace
+{
+    std::mutex destroyed_mutex;
+    std::vector<int> destroyed_ids;
+
+    struct deferred_counted : ref_counted<deferred_counted, ref_counted_flags::deferred_destroy>
+    {
+        friend ref_counted;
+
+        static inline std::atomic<int> instance_count{0};
+
+        deferred_counted(int i = 0, refcnt_ptr<deferred_counted> c = nullptr) noexcept :
+            id(i),
+            child(std::move(c))
+        { ++instance_count; }
+
+        int id;
+        refcnt_ptr<deferred_counted> child;
+    private:
+        ~deferred_counted() noexcept
+        {
+            std::lock_guard<std::mutex> guard(destroyed_mutex);
+            destroyed_ids.push_back(this->id);
+            --instance_count;
+        }
+    };
+
+    struct weak_deferred_counted : ref_counted<weak_deferred_counted, ref_counted_flags::provide_weak_references |
+                                                                      ref_counted_flags::deferred_destroy>
+    {
+        friend ref_counted;
+
+        static inline std::atomic<int> instance_count{0};
+
+        weak_deferred_counted() noexcept
+        { ++instance_count; }
+    private:
+        ~weak_deferred_counted() noexcept
+        { --instance_count; }
+    };
+
+    void clear_destroyed()
+    {
+        std::lock_guard<std::mutex> guard(destroyed_mutex);
+        destroyed_ids.clear();
+    }
+}
+
+TEST_SUITE("deferred_destroy") {
+
+TEST_CASE( "Drain" ) {
+
+    clear_destroyed();
+    auto before = deferred_destroy_stats();
+
+    auto p1 = make_refcnt<deferred_counted>(1);
+    auto p2 = p1;
+    p1.reset();
+    p2.reset();
+    CHECK(deferred_counted::instance_count == 1);
+
+    auto stats = deferred_destroy_stats();
+    CHECK(stats.deferred - before.deferred == 1);
+    CHECK(stats.pending >= 1);
+
+    CHECK(drain_deferred_destroy() == 1);
+    CHECK(deferred_counted::instance_count == 0);
+    CHECK(drain_deferred_destroy() == 0);
+
+    stats = deferred_destroy_stats();
+    CHECK(stats.destroyed - before.destroyed == 1);
+    CHECK(stats.drains - before.drains == 1);
+    CHECK(stats.max_pending >= 1);
+    CHECK(stats.max_drain_time <= stats.total_drain_time);
+}
+
+TEST_CASE( "Budget and order" ) {
+
+    clear_destroyed();
+    for (int i = 0; i < 10; ++i)
+        make_refcnt<deferred_counted>(i);
+    CHECK(deferred_counted::instance_count == 10);
+
+    CHECK(drain_deferred_destroy(3) == 3);
+    CHECK(deferred_counted::instance_count == 7);
+    make_refcnt<deferred_counted>(10);
+    CHECK(drain_deferred_destroy() == 8);
+    CHECK(deferred_counted::instance_count == 0);
+    CHECK(destroyed_ids == std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10});
+}
+
+TEST_CASE( "Budget with pushes in between" ) {
+
+    clear_destroyed();
+    for (int i = 0; i < 4; ++i)
+        make_refcnt<deferred_counted>(i, make_refcnt<deferred_counted>(100 + i));
+    make_refcnt<deferred_counted>(4);
+    //destroying 0 and 1 queues 100 and 101 after everything else
+    CHECK(drain_deferred_destroy(2) == 2);
+    make_refcnt<deferred_counted>(5);
+    CHECK(drain_deferred_destroy(2) == 2);
+    make_refcnt<deferred_counted>(6);
+    CHECK(drain_deferred_destroy(2) == 2);
+    CHECK(destroyed_ids == std::vector<int>{0, 1, 2, 3, 4, 100});
+    CHECK(drain_deferred_destroy() == 5);
+    CHECK(deferred_counted::instance_count == 0);
+    CHECK(destroyed_ids == std::vector<int>{0, 1, 2, 3, 4, 100, 101, 5, 102, 103, 6});
+}
+
+TEST_CASE( "Cascade" ) {
+
+    clear_destroyed();
+    {
+        auto leaf = make_refcnt<deferred_counted>(3);
+        auto middle = make_refcnt<deferred_counted>(2, leaf);
+        make_refcnt<deferred_counted>(1, middle);
+    }
+    CHECK(deferred_counted::instance_count == 3);
+    CHECK(drain_deferred_destroy() == 3);
+    CHECK(deferred_counted::instance_count == 0);
+    CHECK(destroyed_ids == std::vector<int>{1, 2, 3});
+}
+
+TEST_CASE( "Other threads" ) {
+
+    SUBCASE("drain all") {
+        std::atomic<bool> released{false};
+        std::atomic<bool> done{false};
+        auto p1 = make_refcnt<deferred_counted>();
+        std::thread thread([&]() {
+            p1.reset();
+            released = true;
+            while (!done)
+                std::this_thread::yield();
+        });
+        while (!released)
+            std::this_thread::yield();
+        CHECK(deferred_counted::instance_count == 1);
+        CHECK(drain_deferred_destroy() == 0);
+        CHECK(drain_all_deferred_destroy() == 1);
+        CHECK(deferred_counted::instance_count == 0);
+        done = true;
+        thread.join();
+    }
+
+    SUBCASE("thread exit") {
+        auto p1 = make_refcnt<deferred_counted>();
+        std::thread([&]() {
+            p1.reset();
+        }).join();
+        CHECK(deferred_counted::instance_count == 0);
+    }
+}
+
+TEST_CASE( "Reclaimer" ) {
+
+    {
+        deferred_destroy_reclaimer reclaimer(std::chrono::milliseconds(1));
+        for (int i = 0; i < 100; ++i)
+            make_refcnt<deferred_counted>(i);
+        reclaimer.wake();
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (deferred_counted::instance_count != 0 && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        CHECK(deferred_counted::instance_count == 0);
+    }
+    CHECK(drain_deferred_destroy() == 0);
+
+    {
+        deferred_destroy_reclaimer reclaimer(std::chrono::hours(1));
+        for (int i = 0; i < 10; ++i)
+            make_refcnt<deferred_counted>(i);
+    }
+    CHECK(deferred_counted::instance_count == 0);
+}
+
+TEST_CASE( "Weak references" ) {
+
+    auto p1 = make_refcnt<weak_deferred_counted>();
+    auto w1 = p1->get_weak_ptr();
+    p1.reset();
+    CHECK(weak_deferred_counted::instance_count == 1);
+    CHECK(!w1->lock());
+    CHECK(drain_deferred_destroy() == 1);
+    CHECK(weak_deferred_counted::instance_count == 0);
+    CHECK(!w1->lock());
+}
+
+}
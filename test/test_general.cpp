@@ -4,9 +4,11 @@
 
 #include <doctest/doctest.h>
 
+#include <array>
 #include <sstream>
 #include <type_traits>
 #include <cstdint>
+#include <vector>
 
 #if ISPTR_USE_MODULES
     import isptr;
@@ -16,6 +18,35 @@
 
 using namespace isptr;
 
+namespace
+{
+    struct batching_traits : mock_traits<>
+    {
+        static inline int batched_adds = 0;
+        static inline int batched_subs = 0;
+
+        template<int Tag>
+        static void add_ref_n(const instrumented_counted<Tag> * c, size_t n) noexcept
+        {
+            REQUIRE(c->count > 0);
+            ++batched_adds;
+            c->count += int(n);
+        }
+
+        template<int Tag>
+        static void sub_ref_n(const instrumented_counted<Tag> * c, size_t n) noexcept
+        {
+            CHECK(c->count >= int(n));
+            ++batched_subs;
+            if ((c->count -= int(n)) == 0)
+                c->count = -1;
+        }
+    };
+
+    template<class T>
+    using batching_ptr = intrusive_shared_ptr<T, batching_traits>;
+}
+
 TEST_SUITE("traits") {
 
 TEST_CASE( "Type traits are correct" ) {
@@ -565,6 +596,65 @@ TEST_CASE( "Member pointer" ) {
     CHECK(x == 1);
 }
 
+TEST_CASE( "Batched operations" ) {
+
+    SUBCASE("Fallback") {
+        instrumented_counted<> object, object1;
+        auto ptr = mock_noref(&object);
+        auto ptr1 = mock_noref(&object1);
+        std::vector<mock_ptr<instrumented_counted<>>> ptrs{ptr, ptr, nullptr, ptr1, ptr};
+        CHECK(object.count == 4);
+
+        release_all(ptrs);
+        for (auto & p: ptrs)
+            CHECK(!p);
+        CHECK(object.count == 1);
+        CHECK(object1.count == 1);
+
+        std::vector<mock_ptr<instrumented_counted<>>> src{ptr, ptr1, ptr1};
+        ref_all(src.data(), ptrs.data(), src.size());
+        CHECK(ptrs[0] == ptr);
+        CHECK(ptrs[2] == ptr1);
+        CHECK(ptrs[3] == nullptr);
+        CHECK(object.count == 3);
+        CHECK(object1.count == 5);
+        release_all(ptrs);
+        release_all(src);
+        CHECK(object.count == 1);
+        CHECK(object1.count == 1);
+    }
+
+    SUBCASE("Batched") {
+        batching_traits::batched_adds = 0;
+        batching_traits::batched_subs = 0;
+
+        instrumented_counted<> object, object1;
+        auto ptr = batching_ptr<instrumented_counted<>>::noref(&object);
+        auto ptr1 = batching_ptr<instrumented_counted<>>::noref(&object1);
+
+        std::array<batching_ptr<instrumented_counted<>>, 7> src{ptr, ptr, ptr, ptr1, ptr1, nullptr, ptr};
+        std::array<batching_ptr<instrumented_counted<>>, 7> dest;
+        dest.fill(ptr1);
+        CHECK(object.count == 5);
+        CHECK(object1.count == 10);
+
+        ref_all(src, dest);
+        CHECK(dest == src);
+        CHECK(object.count == 9);
+        CHECK(object1.count == 5);
+        CHECK(batching_traits::batched_subs == 1);
+        CHECK(batching_traits::batched_adds == 3);
+
+        release_all(dest);
+        release_all(src.data(), src.size());
+        for (size_t i = 0; i < src.size(); ++i)
+            CHECK((!src[i] && !dest[i]));
+        CHECK(batching_traits::batched_subs == 7);
+        CHECK(object.count == 1);
+        CHECK(object1.count == 1);
+    }
+}
+
 TEST_CASE( "Hash code" ) {
 
     instrumented_counted<> object;
@@ -0,0 +1,185 @@
+#if !ISPTR_USE_MODULES
+    #include <intrusive_shared_ptr/hazard_pointer.h>
+    #include <intrusive_shared_ptr/ref_counted.h>
+    #include <intrusive_shared_ptr/refcnt_ptr.h>
+#endif
+
+#include <doctest/doctest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#if ISPTR_USE_MODULES
+    import isptr;
+#endif
+
+#include "mocks.h"
+
+using namespace isptr;
+
+namespace
+{
+    struct hazard_counted : ref_counted<hazard_counted>
+    {
+        hazard_counted(int v) : value(v) 
+            { ++alive; }
+        ~hazard_counted() noexcept
+            { value = -1; --alive; }
+
+        int value;
+        static inline std::atomic<int> alive{0};
+    };
+
+    struct hazard_node : ref_counted<hazard_node>
+    {
+        hazard_node(hazard_domain & domain) : child(domain)
+            { ++alive; }
+        ~hazard_node() noexcept
+            { --alive; }
+
+        hazard_atomic_ptr<hazard_node, refcnt_ptr_traits> child;
+        static inline int alive = 0;
+    };
+}
+
+TEST_SUITE("hazard_pointer") {
+
+TEST_CASE( "Hazard protected access" ) {
+
+    hazard_domain domain(1);
+
+    SUBCASE( "Protect does not change the count" ) {
+        instrumented_counted<> object;
+        {
+            hazard_atomic_ptr<instrumented_counted<>, mock_traits<>> ptr(mock_noref(&object), domain);
+            {
+                auto guard = ptr.protect();
+                CHECK( guard.get() == &object );
+                CHECK( object.count == 1 );
+                auto guard1 = ptr.protect();
+                CHECK( guard1.get() == &object );
+                CHECK( object.count == 1 );
+            }
+            auto loaded = ptr.load();
+            CHECK( loaded.get() == &object );
+            CHECK( object.count == 2 );
+        }
+        CHECK( object.count == -1 );
+    }
+
+    SUBCASE( "Null" ) {
+        hazard_atomic_ptr<instrumented_counted<>, mock_traits<>> ptr(domain);
+        auto guard = ptr.protect();
+        CHECK( !guard );
+        CHECK( ptr.load() == nullptr );
+    }
+
+    SUBCASE( "Release is deferred while protected" ) {
+        instrumented_counted<> object1, object2;
+        hazard_atomic_ptr<instrumented_counted<>, mock_traits<>> ptr(mock_noref(&object1), domain);
+        {
+            auto guard = ptr.protect();
+            ptr.store(mock_noref(&object2));
+            domain.reclaim();
+            CHECK( object1.count == 1 );
+            CHECK( guard->count == 1 );
+        }
+        domain.reclaim();
+        CHECK( object1.count == -1 );
+        
+        auto old = ptr.exchange(nullptr);
+        CHECK( old.get() == &object2 );
+        //the retired reference is reclaimed immediately since the threshold is 1
+        CHECK( object2.count == 1 );
+        old.reset();
+        CHECK( object2.count == -1 );
+    }
+
+    SUBCASE( "Compare and exchange" ) {
+        instrumented_counted<> object1, object2, object3;
+        hazard_atomic_ptr<instrumented_counted<>, mock_traits<>> ptr(mock_noref(&object1), domain);
+        auto expected = mock_noref(&object2);
+        auto desired = mock_noref(&object3);
+
+        CHECK( !ptr.compare_exchange_strong(expected, desired) );
+        CHECK( expected.get() == &object1 );
+        CHECK( object2.count == -1 );
+        CHECK( object1.count == 2 );
+
+        CHECK( ptr.compare_exchange_strong(expected, desired) );
+        CHECK( object3.count == 2 );
+        domain.reclaim();
+        CHECK( object1.count == 1 );
+        expected.reset();
+        desired.reset();
+        ptr.store(nullptr);
+        domain.reclaim();
+        CHECK( object1.count == -1 );
+        CHECK( object3.count == -1 );
+    }
+
+    SUBCASE( "Guard move" ) {
+        instrumented_counted<> object;
+        hazard_atomic_ptr<instrumented_counted<>, mock_traits<>> ptr(mock_noref(&object), domain);
+        hazard_guard<instrumented_counted<>> guard;
+        CHECK( !guard );
+        guard = ptr.protect();
+        auto guard1 = std::move(guard);
+        CHECK( !guard );
+        CHECK( guard1.get() == &object );
+        ptr.store(nullptr);
+        domain.reclaim();
+        CHECK( object.count == 1 );
+        guard1.reset();
+        domain.reclaim();
+        CHECK( object.count == -1 );
+    }
+}
+
+TEST_CASE( "Hazard domain destruction" ) {
+
+    auto domain = new hazard_domain(1);
+    {
+        hazard_atomic_ptr<hazard_node, hazard_node::refcnt_ptr_traits> root(make_refcnt<hazard_node>(*domain), *domain);
+        root.protect()->child.store(make_refcnt<hazard_node>(*domain));
+        auto guard = root.protect();
+        root.store(nullptr);
+        CHECK( hazard_node::alive == 2 );
+    }
+    CHECK( hazard_node::alive == 2 );
+    //reclaiming the root retires its child
+    delete domain;
+    CHECK( hazard_node::alive == 0 );
+}
+
+TEST_CASE( "Hazard threads" ) {
+
+    static constexpr int N_THREADS = 8;
+    static constexpr int N_OPS = 50000;
+
+    {
+        hazard_atomic_ptr<hazard_counted, hazard_counted::refcnt_ptr_traits> shared(make_refcnt<hazard_counted>(0));
+        std::vector<std::thread> threads;
+        std::atomic<int> errors{0};
+
+        for (int i = 0; i < N_THREADS; ++i) {
+            threads.emplace_back([&shared, i, &errors]{
+                for (int j = 0; j < N_OPS; ++j) {
+                    if (j % 8 != 0) {
+                        auto guard = shared.protect();
+                        if (!guard || guard->value < 0) errors.fetch_add(1);
+                    } else {
+                        shared.store(make_refcnt<hazard_counted>(i * N_OPS + j));
+                    }
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+        CHECK(errors.load() == 0);
+    }
+    hazard_domain::global().reclaim();
+    CHECK( hazard_counted::alive.load() == 0 );
+}
+
+}
@@ -0,0 +1,121 @@
+#if !ISPTR_USE_MODULES
+    #include <intrusive_shared_ptr/lock_contention.h>
+#endif
+
+#include <doctest/doctest.h>
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+#if ISPTR_USE_MODULES
+    import isptr;
+#endif
+
+#include "mocks.h"
+
+using namespace isptr;
+
+namespace
+{
+    struct named_tag
+    {
+        static constexpr const char name[] = "named_tag";
+    };
+
+    struct unnamed_tag
+    {};
+
+    struct slot_tag
+    {
+        static constexpr const char name[] = "slot_tag";
+    };
+}
+
+TEST_SUITE("lock_contention") {
+
+TEST_CASE( "Disabled stats do not change the lock" ) {
+    static_assert( std::is_void_v<spin_lock<>::stats_type> );
+    CHECK( sizeof(spin_lock<>) == sizeof(counted_spin_lock<named_tag>) );
+}
+
+TEST_CASE( "Lock contention counting" ) {
+
+    using lock_type = counted_spin_lock<named_tag>;
+    lock_contention_counter<named_tag>::reset();
+
+    SUBCASE( "Uncontended" ) {
+        lock_type lock;
+        lock.lock();
+        lock.unlock();
+        CHECK( lock.try_lock() );
+        CHECK( !lock.try_lock() );
+        lock.unlock();
+
+        auto stats = lock_contention_counter<named_tag>::snapshot();
+        CHECK( std::strcmp(stats.name, "named_tag") == 0 );
+        CHECK( stats.acquisitions == 2 );
+        CHECK( stats.contended == 0 );
+        CHECK( stats.spins == 0 );
+        CHECK( stats.max_wait.count() == 0 );
+    }
+
+    SUBCASE( "Contended" ) {
+        lock_type lock;
+        lock.lock();
+        std::atomic<bool> started{false};
+        std::thread other([&]{
+            started = true;
+            lock.lock();
+            lock.unlock();
+        });
+        while (!started)
+            std::this_thread::yield();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        lock.unlock();
+        other.join();
+
+        auto stats = lock_contention_counter<named_tag>::snapshot();
+        CHECK( stats.acquisitions == 2 );
+        CHECK( stats.contended == 1 );
+        CHECK( stats.spins > 0 );
+        CHECK( stats.max_wait.count() > 0 );
+        CHECK( stats.total_wait == stats.max_wait );
+    }
+
+    SUBCASE( "Enumeration" ) {
+        counted_spin_lock<unnamed_tag> lock;
+        lock.lock();
+        lock.unlock();
+        bool found_unnamed = false;
+        for_each_lock_contention([&](const lock_contention_snapshot & stats) {
+            if (stats.name == nullptr && stats.acquisitions == 1)
+                found_unnamed = true;
+        });
+        CHECK( found_unnamed );
+    }
+}
+
+TEST_CASE( "Atomic slot contention" ) {
+
+    using ptr = atomic_intrusive_shared_ptr<instrumented_counted<>, mock_traits<>, locked_atomic_policy<counted_spin_lock<slot_tag>>>;
+    lock_contention_counter<slot_tag>::reset();
+
+    instrumented_counted<> object;
+    {
+        ptr p = mock_noref(&object);
+        CHECK( p.load().get() == &object );
+        p.store(nullptr);
+    }
+    CHECK( lock_contention_counter<slot_tag>::snapshot().acquisitions == 2 );
+
+    bool found = false;
+    for_each_lock_contention([&](const lock_contention_snapshot & stats) {
+        if (stats.name && std::strcmp(stats.name, "slot_tag") == 0)
+            found = true;
+    });
+    CHECK( found );
+}
+
+}
@@ -0,0 +1,275 @@
+#if !ISPTR_USE_MODULES
+    #include <intrusive_shared_ptr/rcu_ptr.h>
+    #include <intrusive_shared_ptr/ref_counted.h>
+    #include <intrusive_shared_ptr/refcnt_ptr.h>
+#endif
+
+#include <doctest/doctest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#if ISPTR_USE_MODULES
+    import isptr;
+#endif
+
+#include "mocks.h"
+
+using namespace isptr;
+
+namespace
+{
+    struct rcu_counted : ref_counted<rcu_counted>
+    {
+        rcu_counted(int v) : value(v)
+            { ++alive; }
+        ~rcu_counted() noexcept
+            { value = -1; --alive; }
+
+        int value;
+        static inline std::atomic<int> alive{0};
+    };
+
+    //Object whose memory outlives its last reference until readers are done
+    class rcu_destroyed : public ref_counted<rcu_destroyed>
+    {
+        friend ref_counted;
+        friend rcu_domain;
+    public:
+        rcu_destroyed(rcu_domain & domain) : m_domain(domain)
+            { ++alive; }
+
+        static inline std::atomic<int> alive{0};
+    private:
+        ~rcu_destroyed() noexcept
+            { --alive; }
+
+        void destroy() const noexcept
+            { m_domain.defer_delete(this); }
+
+        rcu_domain & m_domain;
+    };
+}
+
+TEST_SUITE("rcu_ptr") {
+
+TEST_CASE( "RCU read sections" ) {
+
+    rcu_domain domain;
+
+    SUBCASE( "Read does not change the count" ) {
+        instrumented_counted<> object;
+        {
+            rcu_ptr<instrumented_counted<>, mock_traits<>> ptr(mock_noref(&object), domain);
+            {
+                rcu_read_guard guard(domain);
+                CHECK( ptr.read(guard) == &object );
+                CHECK( object.count == 1 );
+            }
+            auto loaded = ptr.load();
+            CHECK( loaded.get() == &object );
+            CHECK( object.count == 2 );
+        }
+        domain.barrier();
+        CHECK( object.count == -1 );
+    }
+
+    SUBCASE( "Null" ) {
+        rcu_ptr<instrumented_counted<>, mock_traits<>> ptr(domain);
+        rcu_read_guard guard(domain);
+        CHECK( ptr.read(guard) == nullptr );
+        CHECK( ptr.load() == nullptr );
+    }
+
+    SUBCASE( "Release is deferred while reading" ) {
+        instrumented_counted<> object1, object2;
+        rcu_ptr<instrumented_counted<>, mock_traits<>> ptr(mock_noref(&object1), domain);
+        {
+            rcu_read_guard guard(domain);
+            auto p = ptr.read(guard);
+            ptr.store(mock_noref(&object2));
+            domain.poll();
+            CHECK( object1.count == 1 );
+            CHECK( p->count == 1 );
+        }
+        domain.poll();
+        CHECK( object1.count == -1 );
+
+        auto old = ptr.exchange(nullptr);
+        CHECK( old.get() == &object2 );
+        CHECK( object2.count == 1 );
+        old.reset();
+        CHECK( object2.count == -1 );
+    }
+
+    SUBCASE( "Readers that start later do not delay release" ) {
+        instrumented_counted<> object1, object2;
+        rcu_ptr<instrumented_counted<>, mock_traits<>> ptr(mock_noref(&object1), domain);
+        ptr.store(mock_noref(&object2));
+        {
+            rcu_read_guard guard(domain);
+            CHECK( ptr.read(guard) == &object2 );
+            domain.poll();
+            CHECK( object1.count == -1 );
+            ptr.store(nullptr);
+            domain.poll();
+            CHECK( object2.count == 1 );
+        }
+        domain.poll();
+        CHECK( object2.count == -1 );
+    }
+
+    SUBCASE( "Compare and exchange" ) {
+        instrumented_counted<> object1, object2, object3;
+        rcu_ptr<instrumented_counted<>, mock_traits<>> ptr(mock_noref(&object1), domain);
+        auto expected = mock_noref(&object2);
+        auto desired = mock_noref(&object3);
+
+        CHECK( !ptr.compare_exchange_strong(expected, desired) );
+        CHECK( expected.get() == &object1 );
+        CHECK( object2.count == -1 );
+        CHECK( object1.count == 2 );
+
+        CHECK( ptr.compare_exchange_strong(expected, desired) );
+        CHECK( object3.count == 2 );
+        domain.poll();
+        CHECK( object1.count == 1 );
+        expected.reset();
+        desired.reset();
+        ptr.store(nullptr);
+        domain.poll();
+        CHECK( object1.count == -1 );
+        CHECK( object3.count == -1 );
+    }
+
+    SUBCASE( "Call rcu" ) {
+        int called = 0;
+        {
+            rcu_read_guard guard(domain);
+            domain.call_rcu(&called, [](void * p) noexcept { ++*static_cast<int *>(p); });
+            domain.poll();
+            CHECK( called == 0 );
+        }
+        domain.synchronize();
+        CHECK( called == 0 );
+        domain.barrier();
+        CHECK( called == 1 );
+    }
+
+    SUBCASE( "Call rcu does not wait" ) {
+        rcu_domain eager(1);
+        int called = 0;
+        {
+            rcu_read_guard guard(eager);
+            for (int i = 0; i < 3; ++i)
+                eager.call_rcu(&called, [](void * p) noexcept { ++*static_cast<int *>(p); });
+            CHECK( called == 0 );
+        }
+        eager.poll();
+        CHECK( called == 3 );
+    }
+
+    SUBCASE( "Poll interval" ) {
+        rcu_domain batched(4);
+        int called = 0;
+        for (int i = 0; i < 3; ++i)
+            batched.call_rcu(&called, [](void * p) noexcept { ++*static_cast<int *>(p); });
+        CHECK( called == 0 );
+        batched.call_rcu(&called, [](void * p) noexcept { ++*static_cast<int *>(p); });
+        CHECK( called == 4 );
+    }
+
+    SUBCASE( "Deferred destroy" ) {
+        auto obj = refcnt_attach(new rcu_destroyed(domain));
+        CHECK( rcu_destroyed::alive == 1 );
+        {
+            rcu_read_guard guard(domain);
+            obj.reset();
+            domain.poll();
+            CHECK( rcu_destroyed::alive == 1 );
+        }
+        domain.poll();
+        CHECK( rcu_destroyed::alive == 0 );
+    }
+}
+
+TEST_CASE( "RCU domain destruction" ) {
+
+    struct state
+    {
+        rcu_domain * domain;
+        int called = 0;
+    };
+
+    auto domain = new rcu_domain();
+    state st{domain};
+    {
+        rcu_read_guard guard(*domain);
+        domain->call_rcu(&st, [](void * p) noexcept {
+            auto st = static_cast<state *>(p);
+            ++st->called;
+            //the domain is being destroyed but must still accept callbacks
+            st->domain->call_rcu(p, [](void * p) noexcept { ++static_cast<state *>(p)->called; });
+        });
+    }
+    delete domain;
+    CHECK( st.called == 2 );
+}
+
+TEST_CASE( "RCU global domain" ) {
+
+    instrumented_counted<> object1, object2;
+    rcu_ptr<instrumented_counted<>, mock_traits<>> ptr(mock_noref(&object1));
+    {
+        rcu_read_guard outer;
+        {
+            rcu_read_guard inner;
+            CHECK( ptr.read(inner) == &object1 );
+        }
+        ptr.store(mock_noref(&object2));
+        rcu_domain::global().poll();
+        //still inside the outer section
+        CHECK( object1.count == 1 );
+    }
+    rcu_domain::global().barrier();
+    CHECK( object1.count == -1 );
+    ptr.store(nullptr);
+    rcu_domain::global().barrier();
+    CHECK( object2.count == -1 );
+}
+
+TEST_CASE( "RCU threads" ) {
+
+    static constexpr int N_THREADS = 8;
+    static constexpr int N_OPS = 50000;
+
+    {
+        rcu_ptr<rcu_counted, rcu_counted::refcnt_ptr_traits> shared(make_refcnt<rcu_counted>(0));
+        std::vector<std::thread> threads;
+        std::atomic<int> errors{0};
+
+        for (int i = 0; i < N_THREADS; ++i) {
+            threads.emplace_back([&shared, i, &errors]{
+                for (int j = 0; j < N_OPS; ++j) {
+                    if (j % 8 != 0) {
+                        rcu_read_guard guard;
+                        auto p = shared.read(guard);
+                        if (!p || p->value < 0) errors.fetch_add(1);
+                    } else if (j % 64 == 0) {
+                        rcu_read_guard guard;
+                        shared.store(make_refcnt<rcu_counted>(i * N_OPS + j));
+                    } else {
+                        shared.store(make_refcnt<rcu_counted>(i * N_OPS + j));
+                    }
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+        CHECK(errors.load() == 0);
+    }
+    rcu_domain::global().barrier();
+    CHECK( rcu_counted::alive.load() == 0 );
+}
+
+}
@@ -5,9 +5,16 @@
 
 #include <doctest/doctest.h>
 
+#include <cstddef>
 #include <vector>
+#include <memory>
+#include <sstream>
+#if __has_include(<memory_resource>)
+    #include <memory_resource>
+#endif
 #include <stdexcept>
 #include <thread>
+#include <tuple>
 
 #if ISPTR_USE_MODULES
     import isptr;
@@ -89,6 +96,143 @@ namespace
     static_assert( !std::is_move_assignable_v<simple_counted> );
     static_assert( !std::is_destructible_v<simple_counted> );
 
+    struct allocation_stats
+    {
+        int allocations = 0;
+        int deallocations = 0;
+        size_t bytes = 0;
+    };
+
+    inline allocation_stats global_stats;
+
+    //Stateless allocator that records into global_stats
+    template<class T>
+    struct global_counting_allocator
+    {
+        using value_type = T;
+
+        global_counting_allocator() noexcept = default;
+        template<class U>
+        global_counting_allocator(const global_counting_allocator<U> &) noexcept {}
+
+        T * allocate(size_t n)
+        {
+            ++global_stats.allocations;
+            global_stats.bytes += n * sizeof(T);
+            return std::allocator<T>().allocate(n);
+        }
+        void deallocate(T * ptr, size_t n) noexcept
+        {
+            ++global_stats.deallocations;
+            global_stats.bytes -= n * sizeof(T);
+            std::allocator<T>().deallocate(ptr, n);
+        }
+
+        friend bool operator==(const global_counting_allocator &, const global_counting_allocator &) noexcept
+            { return true; }
+        friend bool operator!=(const global_counting_allocator &, const global_counting_allocator &) noexcept
+            { return false; }
+    };
+
+    //Stateful allocator that records into the stats it points to
+    template<class T>
+    struct counting_allocator
+    {
+        using value_type = T;
+
+        allocation_stats * stats;
+
+        counting_allocator(allocation_stats * s) noexcept : stats(s) {}
+        template<class U>
+        counting_allocator(const counting_allocator<U> & other) noexcept : stats(other.stats) {}
+
+        T * allocate(size_t n)
+        {
+            ++stats->allocations;
+            stats->bytes += n * sizeof(T);
+            return std::allocator<T>().allocate(n);
+        }
+        void deallocate(T * ptr, size_t n) noexcept
+        {
+            ++stats->deallocations;
+            stats->bytes -= n * sizeof(T);
+            std::allocator<T>().deallocate(ptr, n);
+        }
+
+        friend bool operator==(const counting_allocator & lhs, const counting_allocator & rhs) noexcept
+            { return lhs.stats == rhs.stats; }
+        friend bool operator!=(const counting_allocator & lhs, const counting_allocator & rhs) noexcept
+            { return lhs.stats != rhs.stats; }
+    };
+
+    struct stateless_allocated : ref_counted<stateless_allocated>
+    {
+        friend ref_counted;
+        using refcnt_allocator = global_counting_allocator<stateless_allocated>;
+
+        static inline int instance_count = 0;
+
+        stateless_allocated(int v = 0) noexcept : value(v)
+        { ++instance_count; }
+
+        stateless_allocated(const char *)
+        { throw std::runtime_error("x"); }
+
+        int value;
+    private:
+        ~stateless_allocated() noexcept
+        { --instance_count; }
+    };
+
+    struct stateful_allocated : ref_counted<stateful_allocated, ref_counted_flags::single_threaded>
+    {
+        friend ref_counted;
+        using refcnt_allocator = counting_allocator<char>;
+
+        stateful_allocated(int v) noexcept : value(v)
+        {}
+
+        int value;
+    private:
+        ~stateful_allocated() noexcept = default;
+    };
+
+#if __cpp_lib_memory_resource >= 201603L
+    struct pmr_allocated : ref_counted<pmr_allocated>
+    {
+        using refcnt_allocator = std::pmr::polymorphic_allocator<std::byte>;
+
+        pmr_allocated(int v) noexcept : value(v)
+        {}
+        ~pmr_allocated() noexcept = default;
+
+        int value;
+    };
+#endif
+
+    struct isolated_counted : ref_counted<isolated_counted, ref_counted_flags::isolate_count>
+    {
+        int value = 7;
+    };
+
+    struct weak_isolated_counted : ref_counted<weak_isolated_counted, ref_counted_flags::provide_weak_references | 
+                                                                      ref_counted_flags::isolate_count>
+    {
+        int value = 8;
+    };
+
+    struct promoted_counted : ref_counted<promoted_counted, ref_counted_flags::promote_on_share>
+    {
+        promoted_counted(int v) noexcept : value(v)
+        { ++instance_count; }
+
+        int value;
+        static inline int instance_count = 0;
+    private:
+        friend ref_counted;
+        ~promoted_counted() noexcept
+        { --instance_count; }
+    };
 }
 
 TEST_SUITE("ref_counted") {
@@ -180,16 +324,355 @@ TEST_CASE( "Ref counted wrapper" ) {
     }
 }
 
-TEST_CASE( "Atomic") {
+TEST_CASE( "Immortal" ) {
 
-    struct Foo : public ref_counted<Foo> {
-        int x;
-        Foo(int v) : x(v) {}
+    struct immortal_counted : ref_counted<immortal_counted, ref_counted_flags::allow_immortal>
+    {
+        ~immortal_counted() noexcept = default;
+        int value = 3;
     };
 
+    //Immortal objects that are not allocated on the heap override destroy() so that compilers do not 
+    //warn about a delete of them which they cannot prove unreachable
+    struct static_immortal_counted : ref_counted<static_immortal_counted, ref_counted_flags::allow_immortal>
+    {
+        friend ref_counted;
+    private:
+        void destroy() const noexcept
+            { CHECK(false); }
+    };
+
+    SUBCASE("static storage") {
+        static static_immortal_counted instance;
+        instance.make_immortal();
+        CHECK(instance.is_immortal());
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([]{
+                for (int j = 0; j < 10000; ++j) {
+                    auto p = refcnt_retain(&instance);
+                    auto p1 = p;
+                }
+            });
+        }
+        for (auto & t : threads) t.join();
+        CHECK(instance.is_immortal());
+    }
+
+    SUBCASE("made immortal while referenced") {
+        auto object = new immortal_counted;
+        auto p1 = refcnt_attach(object);
+        auto p2 = p1;
+        CHECK(!p1->is_immortal());
+        p1->make_immortal();
+        CHECK(p1->is_immortal());
+        p1.reset();
+        p2.reset();
+        CHECK(object->is_immortal());
+        CHECK(object->value == 3);
+        delete object;
+    }
+
+    SUBCASE("single threaded") {
+        struct immortal_counted_st : ref_counted<immortal_counted_st, ref_counted_flags::allow_immortal | ref_counted_flags::single_threaded, char>
+        {
+            friend ref_counted;
+            ~immortal_counted_st() noexcept = default;
+        private:
+            void destroy() const noexcept
+                { CHECK(false); }
+        };
+
+        immortal_counted_st instance;
+        instance.make_immortal();
+        {
+            std::vector<refcnt_ptr<immortal_counted_st>> refs(200, refcnt_retain(&instance));
+            CHECK(instance.is_immortal());
+        }
+        CHECK(instance.is_immortal());
+    }
+}
+
+TEST_CASE( "Batched references" ) {
+
+    SUBCASE("Atomic") {
+        auto original = make_refcnt<simple_counted>();
+        std::vector<refcnt_ptr<simple_counted>> src(64, original), dest(64);
+        ref_all(src, dest);
+        CHECK(dest == src);
+        release_all(src);
+        original.reset();
+        CHECK(simple_counted::instance_count == 1);
+        release_all(dest);
+        CHECK(simple_counted::instance_count == 0);
+    }
+
+    SUBCASE("Small count") {
+        auto original = refcnt_attach(new minimal_counted);
+        std::vector<refcnt_ptr<minimal_counted>> copies(50);
+        ref_all(std::vector<refcnt_ptr<minimal_counted>>(50, original), copies);
+        release_all(copies);
+        original.reset();
+    }
+
+    SUBCASE("Hooked") {
+        struct hooked_counted : ref_counted<hooked_counted>
+        {
+            void add_ref() const noexcept
+            {
+                ++adds;
+                ref_counted::add_ref();
+            }
+
+            mutable int adds = 0;
+            ~hooked_counted() noexcept = default;
+        };
+
+        auto original = refcnt_attach(new hooked_counted);
+        std::vector<refcnt_ptr<hooked_counted>> copies(10);
+        ref_all(std::vector<refcnt_ptr<hooked_counted>>(10, original), copies);
+        CHECK(original->adds == 20);
+        release_all(copies);
+    }
+}
+
+TEST_CASE( "Allocator" ) {
+
+    SUBCASE("stateless") {
+        auto & stats = global_stats;
+        stats = {};
+        auto p1 = make_refcnt<stateless_allocated>(5);
+        CHECK(p1->value == 5);
+        CHECK(stats.allocations == 1);
+        //no space for the allocator
+        CHECK(stats.bytes == sizeof(stateless_allocated));
+        auto p2 = allocate_refcnt<stateless_allocated>(global_counting_allocator<int>(), 7);
+        CHECK(p2->value == 7);
+        CHECK(stats.allocations == 2);
+        CHECK(stateless_allocated::instance_count == 2);
+        p1.reset();
+        p2.reset();
+        CHECK(stateless_allocated::instance_count == 0);
+        CHECK(stats.deallocations == 2);
+        CHECK(stats.bytes == 0);
+    }
+
+    SUBCASE("ctor exception") {
+        auto & stats = global_stats;
+        stats = {};
+        try
+        {
+            auto p1 = make_refcnt<stateless_allocated>("x");
+            CHECK(false);
+        }
+        catch(std::runtime_error &)
+        {
+        }
+        CHECK(stateless_allocated::instance_count == 0);
+        CHECK(stats.allocations == 1);
+        CHECK(stats.deallocations == 1);
+    }
+
+    SUBCASE("stateful") {
+        allocation_stats stats1, stats2;
+        auto p1 = allocate_refcnt<stateful_allocated>(counting_allocator<char>(&stats1), 1);
+        auto p2 = allocate_refcnt<stateful_allocated>(counting_allocator<int>(&stats2), 2);
+        CHECK(p1->value == 1);
+        CHECK(p2->value == 2);
+        CHECK(stats1.allocations == 1);
+        CHECK(stats2.allocations == 1);
+        CHECK(stats1.bytes >= sizeof(stateful_allocated) + sizeof(counting_allocator<char>));
+        auto p3 = p2;
+        p2.reset();
+        CHECK(stats2.deallocations == 0);
+        p3.reset();
+        CHECK(stats2.deallocations == 1);
+        CHECK(stats2.bytes == 0);
+        p1.reset();
+        CHECK(stats1.deallocations == 1);
+        CHECK(stats1.bytes == 0);
+    }
+
+#if __cpp_lib_memory_resource >= 201603L
+    SUBCASE("pmr") {
+        struct counting_resource : std::pmr::memory_resource
+        {
+            int allocations = 0;
+            int deallocations = 0;
+
+            void * do_allocate(size_t bytes, size_t align) override
+            {
+                ++allocations;
+                return std::pmr::new_delete_resource()->allocate(bytes, align);
+            }
+            void do_deallocate(void * ptr, size_t bytes, size_t align) override
+            {
+                ++deallocations;
+                std::pmr::new_delete_resource()->deallocate(ptr, bytes, align);
+            }
+            bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override
+                { return this == &other; }
+        };
+
+        counting_resource resource;
+        {
+            std::pmr::monotonic_buffer_resource arena(&resource);
+            auto p1 = allocate_refcnt<pmr_allocated>(&arena, 1);
+            auto p2 = allocate_refcnt<pmr_allocated>(std::pmr::polymorphic_allocator<int>(&arena), 2);
+            CHECK(p1->value + p2->value == 3);
+            CHECK(resource.allocations == 1);
+        }
+        CHECK(resource.deallocations == 1);
+
+        auto p3 = allocate_refcnt<pmr_allocated>(&resource, 3);
+        CHECK(resource.allocations == 2);
+        p3.reset();
+        CHECK(resource.deallocations == 2);
+    }
+#endif
+}
+
+TEST_CASE( "Isolated count" ) {
+
+    SUBCASE("Default") {
+        auto p = make_refcnt<simple_counted>();
+        auto layout = layout_of_ref_counted(*p);
+        CHECK(layout.object_size == sizeof(simple_counted));
+        CHECK(layout.count_offset == 0);
+        CHECK(layout.count_size == sizeof(int));
+        CHECK(layout.count_padding == 0);
+        CHECK(layout.payload_offset == sizeof(int));
+        CHECK(!layout.shares_line());
+    }
+
+    SUBCASE("Isolated") {
+        auto p = make_refcnt<isolated_counted>();
+        auto layout = layout_of_ref_counted(*p);
+        CHECK(layout.count_offset == 0);
+        CHECK(layout.count_size == sizeof(int));
+        CHECK(layout.payload_offset == layout.count_size + layout.count_padding);
+        CHECK(layout.payload_offset >= 64);
+        CHECK(layout.payload_line > layout.count_line);
+        CHECK(!layout.shares_line());
+        CHECK(size_t(reinterpret_cast<const char *>(&p->value) - reinterpret_cast<const char *>(p.get())) >= layout.payload_offset);
+
+        auto copy = p;
+        p.reset();
+        CHECK(copy->value == 7);
+    }
+
+    SUBCASE("Weak") {
+        auto p = make_refcnt<weak_isolated_counted>();
+        auto weak = p->get_weak_ptr();
+        auto layout = layout_of_ref_counted(*p);
+        CHECK(layout.count_size == sizeof(intptr_t));
+        CHECK(layout.payload_offset >= 64);
+        CHECK(!layout.shares_line());
+        CHECK(weak->lock() == p);
+        p.reset();
+        CHECK(!weak->lock());
+    }
+
+    SUBCASE("Report") {
+        ref_counted_layout layout;
+        layout.object_size = 72;
+        layout.count_size = 8;
+        layout.count_padding = 56;
+        layout.payload_offset = 64;
+        layout.payload_line = 1;
+        std::ostringstream str;
+        str << layout;
+        CHECK(str.str() == "size: 72, count: 0+8 (padding 56, line 0), payload: 64 (line 1)");
+    }
+}
+
+TEST_CASE( "Promote on share" ) {
+
+    SUBCASE("Local") {
+        auto p = make_refcnt<promoted_counted>(1);
+        CHECK(!p->is_published());
+        {
+            auto copy = p;
+            std::vector<refcnt_ptr<promoted_counted>> copies(4, p);
+            release_all(copies);
+        }
+        CHECK(!p->is_published());
+        CHECK(promoted_counted::instance_count == 1);
+        p.reset();
+        CHECK(promoted_counted::instance_count == 0);
+    }
+
+    SUBCASE("Publish") {
+        auto p = make_refcnt<promoted_counted>(2);
+        auto copy = p;
+        p->publish();
+        CHECK(p->is_published());
+        p->publish();
+        CHECK(p->is_published());
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([p]{
+                for (int j = 0; j < 10000; ++j) {
+                    auto local = p;
+                    CHECK(local->value == 2);
+                }
+            });
+        }
+        for (auto & t: threads) t.join();
+        p.reset();
+        CHECK(promoted_counted::instance_count == 1);
+        copy.reset();
+        CHECK(promoted_counted::instance_count == 0);
+    }
+
+    SUBCASE("Atomic handoff") {
+        std::atomic<refcnt_ptr<promoted_counted>> shared;
+        auto p = make_refcnt<promoted_counted>(3);
+        shared.store(p);
+        CHECK(p->is_published());
+
+        auto q = make_refcnt<promoted_counted>(4);
+        auto expected = p;
+        CHECK(shared.compare_exchange_strong(expected, q));
+        CHECK(q->is_published());
+        p.reset();
+        expected.reset();
+        CHECK(promoted_counted::instance_count == 1);
+
+        std::thread producer([&]{
+            auto local = shared.exchange(make_refcnt<promoted_counted>(5));
+            CHECK(local->value == 4);
+        });
+        producer.join();
+        auto r = shared.load();
+        CHECK(r->value == 5);
+        CHECK(r->is_published());
+        q.reset();
+        r.reset();
+        CHECK(promoted_counted::instance_count == 1);
+        shared.store(nullptr);
+        CHECK(promoted_counted::instance_count == 0);
+    }
+}
+
+struct atomic_foo : public ref_counted<atomic_foo> {
+    int x;
+    atomic_foo(int v) : x(v) {}
+};
+
+using AtomicTypes = std::tuple<std::atomic<refcnt_ptr<atomic_foo>>, 
+                               atomic_intrusive_shared_ptr<atomic_foo, atomic_foo::refcnt_ptr_traits, locked_atomic_policy<>>,
+                               atomic_intrusive_shared_ptr<atomic_foo, atomic_foo::refcnt_ptr_traits, default_atomic_policy>,
+                               atomic_intrusive_shared_ptr<atomic_foo, atomic_foo::refcnt_ptr_traits, read_mostly_atomic_policy<>>,
+                               atomic_intrusive_shared_ptr<atomic_foo, atomic_foo::refcnt_ptr_traits, striped_atomic_policy<>>>;
+
+TEST_CASE_TEMPLATE_DEFINE( "Atomic", TestType, atomic_threads ) {
+
     static constexpr int N_THREADS = 8;
     static constexpr int N_OPS = 100000;
-    std::atomic<refcnt_ptr<Foo>> shared(make_refcnt<Foo>(0));
+    TestType shared(make_refcnt<atomic_foo>(0));
  
     std::vector<std::thread> threads;
     std::atomic<int> errors{0};
@@ -201,7 +684,7 @@ TEST_CASE( "Atomic") {
                     auto v = shared.load();
                     if (v && v->x < 0) errors.fetch_add(1);
                 } else {
-                    shared.store(make_refcnt<Foo>(i * N_OPS + j));
+                    shared.store(make_refcnt<atomic_foo>(i * N_OPS + j));
                 }
             }
         });
@@ -217,5 +700,6 @@ TEST_CASE( "Atomic") {
     CHECK(j >= 0);
     CHECK(j < N_OPS);
 }
+TEST_CASE_TEMPLATE_APPLY(atomic_threads, AtomicTypes);
 
 }
@@ -1,11 +1,21 @@
 #if !ISPTR_USE_MODULES
     #include <intrusive_shared_ptr/ref_counted.h>
     #include <intrusive_shared_ptr/refcnt_ptr.h>
+    #include <intrusive_shared_ptr/rcu_ptr.h>
 #endif
 
 #include <doctest/doctest.h>
-#include <type_traits>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 
 #if ISPTR_USE_MODULES
     import isptr;
@@ -52,6 +62,56 @@ namespace
 
     using wrapped_counted = weak_ref_counted_adapter<wrapped>;
 
+    struct contended_counted : weak_ref_counted<contended_counted>
+    {
+        friend ref_counted;
+
+        static inline std::atomic<int> instance_count{0};
+
+        contended_counted() noexcept
+        { ++instance_count; }
+    private:
+        ~contended_counted() noexcept
+        { --instance_count; }
+    };
+
+    struct lock_target : weak_ref_counted<lock_target>
+    {
+        friend ref_counted;
+
+        static constexpr int alive = 0x5a5a;
+        static inline std::atomic<int> destroyed_count{0};
+
+        std::atomic<int> state{alive};
+    private:
+        ~lock_target() noexcept
+        {
+            CHECK(state.exchange(0) == alive);
+            ++destroyed_count;
+        }
+    };
+
+    struct rcu_target : ref_counted<rcu_target, ref_counted_flags::provide_weak_references | 
+                                                ref_counted_flags::rcu_destroy>
+    {
+        friend ref_counted;
+
+        static constexpr int alive = 0x5a5a;
+        static inline std::atomic<int> instance_count{0};
+
+        rcu_target() noexcept
+            { ++instance_count; }
+
+        std::atomic<int> state{alive};
+        int value = 7;
+    private:
+        ~rcu_target() noexcept
+        {
+            state = 0;
+            --instance_count;
+        }
+    };
+
     int with_custom_weak_reference_count = 0;
 
     struct custom_weak_reference;
@@ -99,6 +159,91 @@ namespace
 
     inline custom_weak_reference * with_custom_weak_reference::make_weak_reference(intptr_t count) const
         { return new custom_weak_reference(count, const_cast<with_custom_weak_reference *>(this)); }
+
+    struct pooled_counted : ref_counted<pooled_counted, ref_counted_flags::provide_weak_references | 
+                                                        ref_counted_flags::pool_weak_references>
+    {
+        int value = 4;
+    };
+
+    struct counting_weak_allocator
+    {
+        static inline int allocated = 0;
+
+        static void * allocate()
+        {
+            ++allocated;
+            return ::operator new(64);
+        }
+        static void deallocate(void * ptr) noexcept
+        {
+            --allocated;
+            ::operator delete(ptr);
+        }
+    };
+
+    struct custom_pooled_counted : ref_counted<custom_pooled_counted, ref_counted_flags::provide_weak_references | 
+                                                                      ref_counted_flags::pool_weak_references>
+    {
+        using weak_reference_allocator = counting_weak_allocator;
+    };
+
+    int co_allocated_count = 0;
+
+    struct co_allocated_counted : ref_counted<co_allocated_counted, ref_counted_flags::provide_weak_references | 
+                                                                    ref_counted_flags::co_allocate_weak_reference>
+    {
+        friend ref_counted;
+    public:
+        co_allocated_counted(int v) : value(v)
+        {
+            if (v < 0)
+                throw std::runtime_error("x");
+            ++co_allocated_count;
+        }
+
+        int value;
+    private:
+        ~co_allocated_counted() noexcept
+        {
+            auto weak = get_weak_ptr();
+            CHECK(weak);
+            CHECK(!weak->lock());
+            --co_allocated_count;
+        }
+    };
+
+    struct side_table_counted : ref_counted<side_table_counted, ref_counted_flags::provide_weak_references | 
+                                                                ref_counted_flags::weak_side_table>
+    {
+        static inline std::atomic<int> instance_count{0};
+
+        side_table_counted(int v = 0) noexcept : value(v)
+        { ++instance_count; }
+        ~side_table_counted() noexcept
+        { --instance_count; }
+
+        int value;
+    };
+
+    struct short_side_table_counted : ref_counted<short_side_table_counted, ref_counted_flags::provide_weak_references | 
+                                                                            ref_counted_flags::weak_side_table, int16_t>
+    {
+        int16_t value = 6;
+    };
+
+    static_assert(sizeof(side_table_counted) == 2 * sizeof(int));
+    static_assert(sizeof(short_side_table_counted) == 2 * sizeof(int16_t));
+
+    struct atomic_weak_counted : weak_ref_counted<atomic_weak_counted>
+    {
+        atomic_weak_counted(int v) : value(v)
+            {}
+        ~atomic_weak_counted() noexcept
+            { value = -1; }
+
+        int value;
+    };
 }
 
 TEST_SUITE("traits") {
@@ -232,4 +377,578 @@ TEST_CASE( "Weak ref counted works" ) {
     }
 }
 
+TEST_CASE( "Batched references" ) {
+
+    auto original = make_refcnt<derived_counted>();
+    std::vector<refcnt_ptr<derived_counted>> copies(64);
+
+    SUBCASE("Without weak reference") {
+        ref_all(std::vector<refcnt_ptr<derived_counted>>(64, original), copies);
+        release_all(copies);
+        CHECK(derived_count == 1);
+    }
+
+    SUBCASE("With weak reference") {
+        auto weak = original->get_weak_ptr();
+        std::fill(copies.begin(), copies.end(), original);
+        release_all(copies);
+        CHECK(derived_count == 1);
+        copies.assign(64, original);
+        original.reset();
+        release_all(copies);
+        CHECK(derived_count == 0);
+        CHECK(!weak->lock());
+    }
+
+    release_all(copies);
+    original.reset();
+    CHECK(derived_count == 0);
+}
+
+TEST_CASE( "Weak reference created under contention" ) {
+
+    static constexpr int N_THREADS = 4;
+    static constexpr int N_OPS = 20000;
+
+    for (int round = 0; round < 20; ++round) {
+        auto original = make_refcnt<contended_counted>();
+        std::atomic<int> started{0};
+        std::vector<std::thread> threads;
+        for (int i = 0; i < N_THREADS; ++i) {
+            threads.emplace_back([&original, &started]() {
+                started.fetch_add(1);
+                std::vector<refcnt_ptr<contended_counted>> held;
+                for (int j = 0; j < N_OPS; ++j) {
+                    refcnt_ptr<contended_counted> copy = original;
+                    if (j % 7 == 0)
+                        held.push_back(std::move(copy));
+                    if (held.size() > 16)
+                        held.clear();
+                }
+            });
+        }
+        while (started.load() != N_THREADS)
+            std::this_thread::yield();
+        auto weak = original->get_weak_ptr();
+        CHECK(weak->lock() == original);
+        for (auto & t: threads) t.join();
+        CHECK(contended_counted::instance_count == 1);
+        original.reset();
+        CHECK(contended_counted::instance_count == 0);
+        CHECK(!weak->lock());
+    }
+}
+
+TEST_CASE( "Batched references racing with weak reference creation" ) {
+
+    static constexpr int N_THREADS = 4;
+    static constexpr int N_OPS = 200;
+
+    for (int round = 0; round < 20; ++round) {
+        auto original = make_refcnt<contended_counted>();
+        std::atomic<int> started{0};
+        std::vector<std::thread> threads;
+        for (int i = 0; i < N_THREADS; ++i) {
+            threads.emplace_back([&original, &started]() {
+                started.fetch_add(1);
+                //larger than a single update of the count is allowed to be
+                std::vector<refcnt_ptr<contended_counted>> src(300, original), copies(300);
+                for (int j = 0; j < N_OPS; ++j) {
+                    ref_all(src, copies);
+                    release_all(copies);
+                }
+                release_all(src);
+            });
+        }
+        while (started.load() != N_THREADS)
+            std::this_thread::yield();
+        auto weak = original->get_weak_ptr();
+        CHECK(weak->lock() == original);
+        for (auto & t: threads) t.join();
+        CHECK(contended_counted::instance_count == 1);
+        std::vector<refcnt_ptr<contended_counted>> copies(100, original);
+        original.reset();
+        release_all(copies);
+        CHECK(contended_counted::instance_count == 0);
+        CHECK(!weak->lock());
+    }
+}
+
+TEST_CASE( "Weak lock racing with the last release" ) {
+
+    static constexpr int N_THREADS = 8;
+    static constexpr int N_ROUNDS = 200;
+    static constexpr int N_OPS = 2000;
+
+    lock_target::destroyed_count = 0;
+    for (int round = 0; round < N_ROUNDS; ++round) {
+        auto original = make_refcnt<lock_target>();
+        auto weak = original->get_weak_ptr();
+        std::atomic<int> started{0};
+        std::atomic<bool> bad{false};
+        std::vector<std::thread> threads;
+        for (int i = 0; i < N_THREADS; ++i) {
+            threads.emplace_back([&weak, &started, &bad, i]() {
+                started.fetch_add(1);
+                std::vector<refcnt_ptr<lock_target>> held;
+                for (int j = 0; j < N_OPS; ++j) {
+                    auto strong = weak->lock();
+                    if (!strong)
+                        break;
+                    if (strong->state.load() != lock_target::alive)
+                        bad = true;
+                    //some threads keep what they locked for a while so the last release happens on them
+                    if (i % 2)
+                        held.push_back(std::move(strong));
+                    if (held.size() > 4)
+                        held.clear();
+                }
+            });
+        }
+        while (started.load() != N_THREADS)
+            std::this_thread::yield();
+        original.reset();
+        for (auto & t: threads) t.join();
+        CHECK(!bad);
+        CHECK(!weak->lock());
+        CHECK(lock_target::destroyed_count == round + 1);
+    }
+}
+
+TEST_CASE( "Borrowed weak resolution" ) {
+
+    auto & domain = rcu_domain::global();
+
+    SUBCASE( "Basics" ) {
+        auto strong = make_refcnt<rcu_target>();
+        auto weak = strong->get_weak_ptr();
+        CHECK(weak->with_locked([](const rcu_target * p) { return p ? p->value : -1; }) == 7);
+        {
+            rcu_read_guard guard;
+            CHECK(weak->peek(guard) == strong.get());
+        }
+        strong.reset();
+        CHECK(!weak->with_locked([](rcu_target * p) { return p != nullptr; }));
+        domain.barrier();
+        CHECK(rcu_target::instance_count == 0);
+    }
+
+    SUBCASE( "Const" ) {
+        auto strong = make_refcnt<rcu_target>();
+        const rcu_target & ref = *strong;
+        rcu_target::const_weak_ptr weak = ref.get_weak_ptr();
+        rcu_read_guard guard;
+        const rcu_target * p = weak->peek(guard);
+        CHECK(p == strong.get());
+    }
+
+    SUBCASE( "Owner outlives the read section" ) {
+        auto strong = make_refcnt<rcu_target>();
+        auto weak = strong->get_weak_ptr();
+        weak->with_locked([&](rcu_target * p) {
+            REQUIRE(p);
+            strong.reset();
+            domain.poll();
+            CHECK(p->state == rcu_target::alive);
+            CHECK(rcu_target::instance_count == 1);
+        });
+        CHECK(!weak->lock());
+        domain.barrier();
+        CHECK(rcu_target::instance_count == 0);
+    }
+
+    SUBCASE( "Threads" ) {
+        static constexpr int N_THREADS = 4;
+        static constexpr int N_ROUNDS = 50;
+        static constexpr int N_OPS = 2000;
+
+        for (int round = 0; round < N_ROUNDS; ++round) {
+            auto strong = make_refcnt<rcu_target>();
+            auto weak = strong->get_weak_ptr();
+            std::atomic<int> started{0};
+            std::atomic<bool> bad{false};
+            std::vector<std::thread> threads;
+            for (int i = 0; i < N_THREADS; ++i) {
+                threads.emplace_back([&weak, &started, &bad]() {
+                    started.fetch_add(1);
+                    for (int j = 0; j < N_OPS; ++j) {
+                        bool ok = weak->with_locked([](const rcu_target * p) {
+                            return !p || p->state.load() == rcu_target::alive;
+                        });
+                        if (!ok)
+                            bad = true;
+                    }
+                });
+            }
+            while (started.load() != N_THREADS)
+                std::this_thread::yield();
+            strong.reset();
+            for (auto & t: threads) t.join();
+            CHECK(!bad);
+        }
+        domain.barrier();
+        CHECK(rcu_target::instance_count == 0);
+    }
+}
+
+TEST_CASE( "Weak side table" ) {
+
+    SUBCASE( "Basics" ) {
+        auto original = make_refcnt<side_table_counted>(2);
+        auto copy = original;
+        auto weak1 = original->get_weak_ptr();
+        auto weak2 = copy->get_weak_ptr();
+        CHECK(weak1 == weak2);
+        CHECK(weak1->lock() == original);
+        auto copies = std::vector<refcnt_ptr<side_table_counted>>(8, original);
+        release_all(copies);
+        original.reset();
+        CHECK(side_table_counted::instance_count == 1);
+        copy.reset();
+        CHECK(side_table_counted::instance_count == 0);
+        CHECK(!weak1->lock());
+
+        //the same address can be reused by an object that is not weak yet
+        auto other = make_refcnt<side_table_counted>(3);
+        auto other_weak = other->get_weak_ptr();
+        CHECK(other_weak != weak1);
+        CHECK(other_weak->lock()->value == 3);
+    }
+
+    SUBCASE( "Many objects" ) {
+        std::vector<refcnt_ptr<side_table_counted>> objects;
+        std::vector<refcnt_ptr<weak_reference<side_table_counted>>> weak;
+        for (int i = 0; i < 5000; ++i) {
+            objects.push_back(make_refcnt<side_table_counted>(i));
+            weak.push_back(objects.back()->get_weak_ptr());
+        }
+        for (size_t i = 0; i < objects.size(); i += 3)
+            objects[i].reset();
+        for (size_t i = 0; i < objects.size(); ++i) {
+            auto strong = weak[i]->lock();
+            CHECK(bool(strong) == (i % 3 != 0));
+            if (strong) {
+                CHECK(strong->value == int(i));
+                CHECK(strong->get_weak_ptr() == weak[i]);
+            }
+        }
+        objects.clear();
+        CHECK(side_table_counted::instance_count == 0);
+    }
+
+    SUBCASE( "Saturation" ) {
+        auto original = make_refcnt<short_side_table_counted>();
+        std::vector<refcnt_ptr<short_side_table_counted>> copies(std::numeric_limits<int16_t>::max() / 2 + 10, original);
+        auto weak = original->get_weak_ptr();
+        copies.clear();
+        CHECK(weak->lock() == original);
+        auto raw = original.release();
+        CHECK(weak->lock().get() == raw);
+        //saturated objects are never released so they can only be destroyed directly
+        delete raw;
+        CHECK(!weak->lock());
+    }
+
+    SUBCASE( "Threads" ) {
+        static constexpr int N_THREADS = 4;
+        static constexpr int N_OPS = 20000;
+
+        for (int round = 0; round < 10; ++round) {
+            auto original = make_refcnt<side_table_counted>(round);
+            std::atomic<int> started{0};
+            std::atomic<int> errors{0};
+            std::vector<std::thread> threads;
+            for (int i = 0; i < N_THREADS; ++i) {
+                threads.emplace_back([&original, &started, &errors, round]() {
+                    started.fetch_add(1);
+                    std::vector<refcnt_ptr<side_table_counted>> held;
+                    for (int j = 0; j < N_OPS; ++j) {
+                        refcnt_ptr<side_table_counted> copy = original;
+                        if (j % 7 == 0)
+                            held.push_back(std::move(copy));
+                        if (held.size() > 16)
+                            held.clear();
+                        if (j % 1000 == 0 && original->get_weak_ptr()->lock()->value != round)
+                            errors.fetch_add(1);
+                    }
+                });
+            }
+            while (started.load() != N_THREADS)
+                std::this_thread::yield();
+            auto weak = original->get_weak_ptr();
+            CHECK(weak->lock() == original);
+            for (auto & t: threads) t.join();
+            CHECK(errors.load() == 0);
+            CHECK(side_table_counted::instance_count == 1);
+            original.reset();
+            CHECK(side_table_counted::instance_count == 0);
+            CHECK(!weak->lock());
+        }
+    }
+}
+
+TEST_CASE( "Co-allocated weak reference" ) {
+
+    SUBCASE( "Basics" ) {
+        auto original = make_refcnt<co_allocated_counted>(3);
+        CHECK(co_allocated_count == 1);
+        auto weak1 = original->get_weak_ptr();
+        //the weak reference is in the same allocation, right before the object
+        auto distance = reinterpret_cast<const char *>(original.get()) - reinterpret_cast<const char *>(weak1.get());
+        CHECK(distance > 0);
+        CHECK(size_t(distance) < 2 * sizeof(*weak1) + alignof(std::max_align_t));
+        auto strong1 = weak1->lock();
+        CHECK(original == strong1);
+        auto weak2 = weak_cast(strong1);
+        CHECK(weak1 == weak2);
+        original.reset();
+        CHECK(co_allocated_count == 1);
+        strong1.reset();
+        CHECK(co_allocated_count == 0);
+        CHECK(!weak1->lock());
+        CHECK(!strong_cast(weak2));
+    }
+
+    SUBCASE( "No weak pointers" ) {
+        auto original = make_refcnt<co_allocated_counted>(3);
+        auto copy = original;
+        CHECK(copy->value == 3);
+        original.reset();
+        copy.reset();
+        CHECK(co_allocated_count == 0);
+    }
+
+    SUBCASE( "Ctor exception" ) {
+        try
+        {
+            auto original = make_refcnt<co_allocated_counted>(-1);
+        }
+        catch(std::exception &)
+        {
+            CHECK(co_allocated_count == 0);
+        }
+    }
+
+    SUBCASE( "Threads" ) {
+        static constexpr int N_THREADS = 4;
+        static constexpr int N_OPS = 10000;
+
+        std::atomic<int> errors{0};
+        for (int round = 0; round < 20; ++round) {
+            auto original = make_refcnt<co_allocated_counted>(round);
+            auto weak = original->get_weak_ptr();
+            std::vector<std::thread> threads;
+            for (int i = 0; i < N_THREADS; ++i) {
+                threads.emplace_back([weak, round, &errors]() {
+                    for (int j = 0; j < N_OPS; ++j) {
+                        auto strong = weak->lock();
+                        if (!strong)
+                            break;
+                        if (strong->value != round)
+                            errors.fetch_add(1);
+                    }
+                });
+            }
+            original.reset();
+            for (auto & t: threads) t.join();
+        }
+        CHECK( errors.load() == 0 );
+        CHECK(co_allocated_count == 0);
+    }
+}
+
+TEST_CASE( "Pooled weak references" ) {
+
+    SUBCASE( "Basics" ) {
+        auto original = make_refcnt<pooled_counted>();
+        auto weak = original->get_weak_ptr();
+        CHECK(weak->lock() == original);
+        original.reset();
+        CHECK(!weak->lock());
+    }
+
+    SUBCASE( "Blocks are reused" ) {
+        const void * first;
+        {
+            auto original = make_refcnt<pooled_counted>();
+            auto weak = original->get_weak_ptr();
+            first = weak.get();
+        }
+        auto original = make_refcnt<pooled_counted>();
+        auto weak = original->get_weak_ptr();
+        CHECK(weak.get() == first);
+    }
+
+    SUBCASE( "Freed on other threads" ) {
+        static constexpr int N_OBJECTS = 1000;
+
+        std::vector<pooled_counted::weak_ptr> weaks;
+        std::vector<refcnt_ptr<pooled_counted>> strongs;
+        for (int i = 0; i < N_OBJECTS; ++i) {
+            strongs.push_back(make_refcnt<pooled_counted>());
+            weaks.push_back(strongs.back()->get_weak_ptr());
+        }
+        std::thread([&]() {
+            strongs.clear();
+            weaks.clear();
+            //allocations on this thread come from its own cache
+            auto original = make_refcnt<pooled_counted>();
+            auto weak = original->get_weak_ptr();
+            CHECK(weak->lock() == original);
+        }).join();
+
+        //blocks freed by the other thread come back to us
+        for (int i = 0; i < N_OBJECTS; ++i) {
+            strongs.push_back(make_refcnt<pooled_counted>());
+            weaks.push_back(strongs.back()->get_weak_ptr());
+        }
+        for (auto & weak: weaks)
+            CHECK(weak->lock()->value == 4);
+    }
+
+    SUBCASE( "Custom allocator" ) {
+        auto original = make_refcnt<custom_pooled_counted>();
+        auto weak = original->get_weak_ptr();
+        CHECK(counting_weak_allocator::allocated == 1);
+        original.reset();
+        CHECK(counting_weak_allocator::allocated == 1);
+        weak.reset();
+        CHECK(counting_weak_allocator::allocated == 0);
+    }
+}
+
+TEST_CASE( "thread_block_pool" ) {
+
+    using pool = thread_block_pool<24, 8, 4>;
+
+    //exhaust whole slabs so that the next allocation has to pick up remotely freed blocks
+    std::vector<void *> blocks;
+    for (int i = 0; i < 8; ++i) {
+        auto block = pool::allocate();
+        CHECK(reinterpret_cast<uintptr_t>(block) % 8 == 0);
+        std::memset(block, i, 24);
+        blocks.push_back(block);
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        for (size_t j = 0; j < 24; ++j)
+            CHECK(static_cast<unsigned char *>(blocks[i])[j] == i);
+    }
+    std::thread([&]() {
+        for (auto block: blocks)
+            pool::deallocate(block);
+    }).join();
+    auto block = pool::allocate();
+    CHECK(std::find(blocks.begin(), blocks.end(), block) != blocks.end());
+    pool::deallocate(block);
+    pool::deallocate(nullptr);
+}
+
+TEST_CASE( "thread_block_pool after thread exit" ) {
+
+    using pool = thread_block_pool<24, 8, 2>;
+
+    struct late_allocator {
+        bool armed = false;
+        ~late_allocator() {
+            if (!armed)
+                return;
+            //runs after the pool released this thread's cache
+            auto block = pool::allocate();
+            std::memset(block, 1, 24);
+            pool::deallocate(block);
+        }
+    };
+
+    void * first = nullptr;
+    std::thread([&]() {
+        //constructed before the pool's thread_local so destroyed after it
+        static thread_local late_allocator late;
+        late.armed = true;
+        first = pool::allocate();
+        pool::deallocate(first);
+    }).join();
+
+    //the cache released by the exited thread is reused
+    std::thread([&]() {
+        auto block = pool::allocate();
+        CHECK(block == first);
+        pool::deallocate(block);
+    }).join();
+}
+
+using AtomicWeakPolicies = std::tuple<locked_atomic_policy<>, default_atomic_policy, read_mostly_atomic_policy<>, striped_atomic_policy<>>;
+
+TEST_CASE_TEMPLATE_DEFINE( "Atomic weak", TestType, atomic_weak ) {
+
+    using weak_slot = atomic_weak_ptr<atomic_weak_counted::weak_value_type, TestType>;
+
+    SUBCASE( "Lock strong" ) {
+        auto strong = refcnt_attach(new atomic_weak_counted(3));
+        weak_slot slot(strong->get_weak_ptr());
+        auto locked = slot.lock_strong();
+        CHECK( locked == strong );
+        CHECK( slot.load() == strong->get_weak_ptr() );
+        locked.reset();
+        strong.reset();
+        CHECK( !slot.lock_strong() );
+        CHECK( slot.load() );
+    }
+
+    SUBCASE( "Null" ) {
+        weak_slot slot;
+        CHECK( !slot.lock_strong() );
+        auto strong = refcnt_attach(new atomic_weak_counted(3));
+        slot = strong->get_weak_ptr();
+        CHECK( slot.lock_strong() == strong );
+        slot.store(nullptr);
+        CHECK( !slot.lock_strong() );
+    }
+
+    SUBCASE( "Threads" ) {
+        static constexpr int N_THREADS = 8;
+        static constexpr int N_OPS = 20000;
+
+        auto initial = refcnt_attach(new atomic_weak_counted(0));
+        weak_slot slot(initial->get_weak_ptr());
+        std::atomic<int> errors{0};
+        std::vector<std::thread> threads;
+        for (int i = 0; i < N_THREADS; ++i) {
+            threads.emplace_back([&, i]{
+                refcnt_ptr<atomic_weak_counted> keep;
+                for (int j = 0; j < N_OPS; ++j) {
+                    if (j % 16 == 0) {
+                        //the previous object dies as soon as it is replaced here
+                        keep = refcnt_attach(new atomic_weak_counted(i + 1));
+                        slot.store(keep->get_weak_ptr());
+                    } else if (auto strong = slot.lock_strong()) {
+                        if (strong->value < 0) errors.fetch_add(1);
+                    }
+                }
+            });
+        }
+        for (auto & t: threads) t.join();
+        CHECK( errors.load() == 0 );
+    }
+}
+TEST_CASE_TEMPLATE_APPLY(atomic_weak, AtomicWeakPolicies);
+
+TEST_CASE( "std::atomic of weak pointers" ) {
+
+    auto strong = refcnt_attach(new atomic_weak_counted(7));
+    std::atomic<atomic_weak_counted::weak_ptr> slot(strong->get_weak_ptr());
+    CHECK( slot.lock_strong() == strong );
+
+    refcnt_ptr<const atomic_weak_counted> const_strong = strong;
+    std::atomic<atomic_weak_counted::const_weak_ptr> const_slot(const_strong->get_weak_ptr());
+    auto locked = const_slot.lock_strong();
+    static_assert( std::is_same_v<decltype(locked), refcnt_ptr<const atomic_weak_counted>> );
+    CHECK( locked == const_strong );
+    
+    locked.reset();
+    const_strong.reset();
+    strong.reset();
+    CHECK( !slot.lock_strong() );
+    CHECK( !const_slot.lock_strong() );
+}
+
 }
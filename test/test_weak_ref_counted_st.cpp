@@ -101,6 +101,13 @@ namespace
 
     inline custom_weak_reference * with_custom_weak_reference::make_weak_reference(intptr_t count) const
         { return new custom_weak_reference(count, const_cast<with_custom_weak_reference *>(this)); }
+
+    struct side_table_counted : ref_counted<side_table_counted, ref_counted_flags::provide_weak_references | 
+                                                                ref_counted_flags::single_threaded |
+                                                                ref_counted_flags::weak_side_table, int16_t>
+    {
+        int16_t value = 7;
+    };
 }
 
 TEST_SUITE("traits") {
@@ -229,6 +236,23 @@ TEST_CASE( "Weak ref counted st works" ) {
         strong1 = weak->lock();
         CHECK(!strong1);
     }
+
+    SUBCASE( "Side table" ) {
+        static_assert(sizeof(side_table_counted) == 2 * sizeof(int16_t));
+
+        auto original = make_refcnt<side_table_counted>();
+        auto copy = original;
+        auto weak1 = original->get_weak_ptr();
+        auto weak2 = copy->get_weak_ptr();
+        CHECK(weak1 == weak2);
+        auto strong1 = weak1->lock();
+        CHECK(strong1 == original);
+        original.reset();
+        copy.reset();
+        CHECK(strong1->value == 7);
+        strong1.reset();
+        CHECK(!weak1->lock());
+    }
 }
 
 }